@@ -22,17 +22,32 @@ public:
 	// returns signed volume
 	float signedVolume() const;
 
+	// refits child aggregates; the baseline aggregate itself stores no bounding volumes
+	void refit();
+
 	// intersects with ray, starting the traversal at the specified node in an aggregate
 	// NOTE: interactions are invalid when checkForOcclusion is enabled
 	int intersectFromNode(Ray<DIM>& r, std::vector<Interaction<DIM>>& is,
 						  int nodeStartIndex, int aggregateIndex, int& nodesVisited,
 						  bool checkForOcclusion=false, bool recordAllHits=false) const;
 
+	// intersects with ray, starting the traversal at the specified node in an aggregate;
+	// returns the closest interaction in i without allocating
+	// NOTE: interaction is invalid when checkForOcclusion is enabled
+	bool intersectFromNode(Ray<DIM>& r, Interaction<DIM>& i, int nodeStartIndex,
+						   int aggregateIndex, int& nodesVisited,
+						   bool checkForOcclusion=false) const;
+
 	// finds closest point to sphere center, starting the traversal at the specified node in an aggregate
 	bool findClosestPointFromNode(BoundingSphere<DIM>& s, Interaction<DIM>& i,
 								  int nodeStartIndex, int aggregateIndex,
 								  const Vector<DIM>& boundaryHint, int& nodesVisited) const;
 
+	// finds the k closest primitives to sphere center, starting the traversal at the specified node in an aggregate
+	bool findKClosestPointsFromNode(BoundingSphere<DIM>& s, std::vector<Interaction<DIM>>& is,
+									int k, int nodeStartIndex, int aggregateIndex,
+									int& nodesVisited) const;
+
 protected:
 	// members
 	const std::vector<PrimitiveType *>& primitives;
@@ -55,20 +55,39 @@ inline float Baseline<DIM, PrimitiveType>::signedVolume() const
 	return volume;
 }
 
+template<size_t DIM, typename PrimitiveType>
+inline void Baseline<DIM, PrimitiveType>::refit()
+{
+	if (primitiveTypeIsAggregate) {
+		for (int p = 0; p < (int)primitives.size(); p++) {
+			reinterpret_cast<Aggregate<DIM> *>(primitives[p])->refit();
+		}
+	}
+}
+
 template<size_t DIM, typename PrimitiveType>
 inline int Baseline<DIM, PrimitiveType>::intersectFromNode(Ray<DIM>& r, std::vector<Interaction<DIM>>& is,
 														   int nodeStartIndex, int aggregateIndex, int& nodesVisited,
 														   bool checkForOcclusion, bool recordAllHits) const
 {
-	int hits = 0;
-	if (!recordAllHits) is.resize(1);
+	if (!recordAllHits) {
+		// find the closest intersection without allocating
+		is.resize(1);
+		bool hit = intersectFromNode(r, is[0], nodeStartIndex, aggregateIndex,
+									 nodesVisited, checkForOcclusion);
+		if (hit && checkForOcclusion) is.clear();
 
-	// find closest hit
+		return hit ? 1 : 0;
+	}
+
+	// find all hits
+	int hits = 0;
 	for (int p = 0; p < (int)primitives.size(); p++) {
 		nodesVisited++;
 
 		int hit = 0;
-		std::vector<Interaction<DIM>> cs;
+		QueryBuffer<DIM> buffer;
+		std::vector<Interaction<DIM>>& cs = buffer.interactions;
 		if (primitiveTypeIsAggregate) {
 			const Aggregate<DIM> *aggregate = reinterpret_cast<const Aggregate<DIM> *>(primitives[p]);
 			hit = aggregate->intersectFromNode(r, cs, nodeStartIndex, aggregateIndex,
@@ -89,26 +108,15 @@ inline int Baseline<DIM, PrimitiveType>::intersectFromNode(Ray<DIM>& r, std::vec
 			}
 
 			hits += hit;
-			if (recordAllHits) {
-				is.insert(is.end(), cs.begin(), cs.end());
-
-			} else {
-				r.tMax = std::min(r.tMax, cs[0].d);
-				is[0] = cs[0];
-			}
+			is.insert(is.end(), cs.begin(), cs.end());
 		}
 	}
 
 	if (hits > 0) {
 		// sort by distance and remove duplicates
-		if (recordAllHits) {
-			std::sort(is.begin(), is.end(), compareInteractions<DIM>);
-			is = removeDuplicates<DIM>(is);
-			hits = (int)is.size();
-
-		} else {
-			hits = 1;
-		}
+		std::sort(is.begin(), is.end(), compareInteractions<DIM>);
+		removeDuplicates<DIM>(is);
+		hits = (int)is.size();
 
 		// compute normals
 		if (this->computeNormals && !primitiveTypeIsAggregate) {
@@ -123,6 +131,54 @@ inline int Baseline<DIM, PrimitiveType>::intersectFromNode(Ray<DIM>& r, std::vec
 	return 0;
 }
 
+template<size_t DIM, typename PrimitiveType>
+inline bool Baseline<DIM, PrimitiveType>::intersectFromNode(Ray<DIM>& r, Interaction<DIM>& i,
+															int nodeStartIndex, int aggregateIndex,
+															int& nodesVisited, bool checkForOcclusion) const
+{
+	bool hit = false;
+
+	// find closest hit
+	for (int p = 0; p < (int)primitives.size(); p++) {
+		nodesVisited++;
+
+		bool found = false;
+		Interaction<DIM> c;
+		if (primitiveTypeIsAggregate) {
+			const Aggregate<DIM> *aggregate = reinterpret_cast<const Aggregate<DIM> *>(primitives[p]);
+			found = aggregate->intersectFromNode(r, c, nodeStartIndex, aggregateIndex,
+												 nodesVisited, checkForOcclusion);
+
+		} else {
+			// call through the base class, since primitives that only override the vector version
+			// of intersect hide this overload
+			const Primitive<DIM> *primitive = primitives[p];
+			found = primitive->intersect(r, c, checkForOcclusion);
+			c.referenceIndex = p;
+			c.objectIndex = this->index;
+		}
+
+		if (found) {
+			if (checkForOcclusion) return true;
+
+			hit = true;
+			r.tMax = std::min(r.tMax, c.d);
+			i = c;
+		}
+	}
+
+	if (hit) {
+		// compute normal
+		if (this->computeNormals && !primitiveTypeIsAggregate) {
+			i.computeNormal(primitives[i.referenceIndex]);
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
 template<size_t DIM, typename PrimitiveType>
 inline bool Baseline<DIM, PrimitiveType>::findClosestPointFromNode(BoundingSphere<DIM>& s, Interaction<DIM>& i,
 																   int nodeStartIndex, int aggregateIndex,
@@ -166,4 +222,36 @@ inline bool Baseline<DIM, PrimitiveType>::findClosestPointFromNode(BoundingSpher
 	return false;
 }
 
+template<size_t DIM, typename PrimitiveType>
+inline bool Baseline<DIM, PrimitiveType>::findKClosestPointsFromNode(BoundingSphere<DIM>& s,
+																	 std::vector<Interaction<DIM>>& is,
+																	 int k, int nodeStartIndex, int aggregateIndex,
+																	 int& nodesVisited) const
+{
+	// find k closest points
+	bool found = false;
+	for (int p = 0; p < (int)primitives.size(); p++) {
+		nodesVisited++;
+
+		if (primitiveTypeIsAggregate) {
+			const Aggregate<DIM> *aggregate = reinterpret_cast<const Aggregate<DIM> *>(primitives[p]);
+			if (aggregate->findKClosestPointsFromNode(s, is, k, nodeStartIndex,
+													  aggregateIndex, nodesVisited)) {
+				found = true;
+			}
+
+		} else {
+			Interaction<DIM> c;
+			if (primitives[p]->findClosestPoint(s, c)) {
+				c.referenceIndex = p;
+				c.objectIndex = this->index;
+				if (this->computeNormals) c.computeNormal(primitives[p]);
+				if (addKClosestInteraction<DIM>(s, is, c, k)) found = true;
+			}
+		}
+	}
+
+	return found;
+}
+
 } // namespace fcpw
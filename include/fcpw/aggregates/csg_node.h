@@ -31,6 +31,9 @@ public:
 	// returns signed volume
 	float signedVolume() const;
 
+	// refits the children and recomputes the bounding box
+	void refit();
+
 	// intersects with ray, starting the traversal at the specified node in an aggregate
 	// NOTE: interactions are invalid when checkForOcclusion is enabled
 	int intersectFromNode(Ray<DIM>& r, std::vector<Interaction<DIM>>& is,
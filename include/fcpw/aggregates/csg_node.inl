@@ -20,6 +20,8 @@ rightPrimitiveTypeIsAggregate(std::is_base_of<Aggregate<DIM>, PrimitiveTypeRight
 template<size_t DIM, typename PrimitiveTypeLeft, typename PrimitiveTypeRight>
 inline void CsgNode<DIM, PrimitiveTypeLeft, PrimitiveTypeRight>::computeBoundingBox()
 {
+	box = BoundingBox<DIM>();
+
 	if (operation == BooleanOperation::Intersection) {
 		// use the child bounding box with the smaller extent; this is not the tightest fit box
 		BoundingBox<DIM> boxLeft = left->boundingBox();
@@ -42,6 +44,20 @@ inline void CsgNode<DIM, PrimitiveTypeLeft, PrimitiveTypeRight>::computeBounding
 	}
 }
 
+template<size_t DIM, typename PrimitiveTypeLeft, typename PrimitiveTypeRight>
+inline void CsgNode<DIM, PrimitiveTypeLeft, PrimitiveTypeRight>::refit()
+{
+	if (leftPrimitiveTypeIsAggregate) {
+		reinterpret_cast<Aggregate<DIM> *>(left.get())->refit();
+	}
+
+	if (rightPrimitiveTypeIsAggregate) {
+		reinterpret_cast<Aggregate<DIM> *>(right.get())->refit();
+	}
+
+	computeBoundingBox();
+}
+
 template<size_t DIM, typename PrimitiveTypeLeft, typename PrimitiveTypeRight>
 inline BoundingBox<DIM> CsgNode<DIM, PrimitiveTypeLeft, PrimitiveTypeRight>::boundingBox() const
 {
@@ -143,7 +159,8 @@ inline int CsgNode<DIM, PrimitiveTypeLeft, PrimitiveTypeRight>::intersectFromNod
 		// perform intersection query for left child
 		int hitsLeft = 0;
 		Ray<DIM> rLeft = r;
-		std::vector<Interaction<DIM>> isLeft;
+		QueryBuffer<DIM> bufferLeft;
+		std::vector<Interaction<DIM>>& isLeft = bufferLeft.interactions;
 		if (leftPrimitiveTypeIsAggregate) {
 			const Aggregate<DIM> *aggregate = reinterpret_cast<const Aggregate<DIM> *>(left.get());
 			hitsLeft = aggregate->intersectFromNode(rLeft, isLeft, nodeStartIndex, aggregateIndex,
@@ -168,7 +185,8 @@ inline int CsgNode<DIM, PrimitiveTypeLeft, PrimitiveTypeRight>::intersectFromNod
 		// perform intersection query for right child
 		int hitsRight = 0;
 		Ray<DIM> rRight = r;
-		std::vector<Interaction<DIM>> isRight;
+		QueryBuffer<DIM> bufferRight;
+		std::vector<Interaction<DIM>>& isRight = bufferRight.interactions;
 		if (rightPrimitiveTypeIsAggregate) {
 			const Aggregate<DIM> *aggregate = reinterpret_cast<const Aggregate<DIM> *>(right.get());
 			hitsRight = aggregate->intersectFromNode(rRight, isRight, nodeStartIndex, aggregateIndex,
@@ -8,9 +8,34 @@
 	#define FCPW_MBVH_BRANCHING_FACTOR 4
 	#define FCPW_MBVH_MAX_DEPTH 96
 #endif
+#ifndef FCPW_MBVH_SHORT_STACK_SIZE
+	#define FCPW_MBVH_SHORT_STACK_SIZE 8 // used with FCPW_USE_SHORT_STACK_TRAVERSAL
+#endif
+#ifndef FCPW_MBVH_PACKET_SIZE
+	#define FCPW_MBVH_PACKET_SIZE 8 // used with FCPW_USE_RAY_PACKET_TRAVERSAL, at most 32
+#endif
 
 namespace fcpw {
 
+#ifdef FCPW_USE_QUANTIZED_MBVH_NODES
+// child boxes are stored with 8 bits per coordinate, which makes a node about half the
+// size of a full precision node at the cost of slightly larger (conservative) boxes
+template<size_t DIM>
+struct MbvhNode {
+	// constructor
+	MbvhNode(): child(maxInt) {
+		std::fill(boxOrigin, boxOrigin + DIM, 0.0f);
+		std::fill(boxScale, boxScale + DIM, 0.0f);
+		std::fill(&qBoxMin[0][0], &qBoxMin[0][0] + DIM*FCPW_MBVH_BRANCHING_FACTOR, 0);
+		std::fill(&qBoxMax[0][0], &qBoxMax[0][0] + DIM*FCPW_MBVH_BRANCHING_FACTOR, 0);
+	}
+
+	// members
+	float boxOrigin[DIM], boxScale[DIM]; // child boxes are quantized relative to this frame
+	uint8_t qBoxMin[DIM][FCPW_MBVH_BRANCHING_FACTOR], qBoxMax[DIM][FCPW_MBVH_BRANCHING_FACTOR];
+	IntP<FCPW_MBVH_BRANCHING_FACTOR> child; // use sign to differentiate between inner and leaf nodes
+};
+#else
 template<size_t DIM>
 struct MbvhNode {
 	// constructor
@@ -22,6 +47,7 @@ struct MbvhNode {
 	VectorP<FCPW_MBVH_BRANCHING_FACTOR, DIM> boxMin, boxMax;
 	IntP<FCPW_MBVH_BRANCHING_FACTOR> child; // use sign to differentiate between inner and leaf nodes
 };
+#endif
 
 template<size_t WIDTH, size_t DIM, typename PrimitiveType>
 struct MbvhLeafNode {
@@ -44,12 +70,46 @@ struct MbvhLeafNode<WIDTH, DIM, Triangle> {
 	IntP<WIDTH> primitiveIndex;
 };
 
+// leaf node of an object with mixed primitive types; each leaf node contains either line
+// segments or triangles, so that it can be queried with the same wide operations as the
+// leaf nodes of objects with a single primitive type
+template<size_t WIDTH, size_t DIM>
+struct MbvhLeafNode<WIDTH, DIM, GeometricPrimitive<DIM>> {
+	// members
+	VectorP<WIDTH, DIM> positions[3]; // positions[2] is unused by line segments
+	IntP<WIDTH> primitiveIndex;
+	IntP<WIDTH> referenceIndex;
+	ObjectType type; // LineSegments or Triangles
+	int nReferences;
+};
+
+// leaf node of an aggregate of aggregates (e.g., object instances); the bounding boxes of the
+// aggregates are stored side by side, so that a query can cull WIDTH of them at a time before
+// descending into any of them
+template<size_t WIDTH, size_t DIM>
+struct MbvhLeafNode<WIDTH, DIM, Aggregate<DIM>> {
+	// members
+	VectorP<WIDTH, DIM> boxMin, boxMax;
+};
+
 template<size_t WIDTH, size_t DIM, typename PrimitiveType=Primitive<DIM>>
 class Mbvh: public Aggregate<DIM> {
 public:
 	// constructor
 	Mbvh(const Sbvh<DIM, PrimitiveType> *sbvh_, bool printStats_=false);
 
+	// constructor; views a tree serialized with write (e.g., in a memory mapped file) in place
+	// instead of collapsing an sbvh; primitives_ must be in the reference order of the serialized tree.
+	// Set copyReferences_ to keep a copy of primitives_ in the tree, e.g., when it contains the
+	// references of a tree built with spatial splits
+	Mbvh(const std::vector<PrimitiveType *>& primitives_, BinaryReader& reader, bool copyReferences_=false);
+
+	// serializes the tree without its primitives
+	void write(BinaryWriter& writer) const;
+
+	// returns the primitives in the reference order of the tree
+	const std::vector<PrimitiveType *>& getReferences() const;
+
 	// returns bounding box
 	BoundingBox<DIM> boundingBox() const;
 
@@ -62,17 +122,87 @@ public:
 	// returns signed volume
 	float signedVolume() const;
 
+	// recomputes the node bounding boxes bottom-up and rewrites the vectorized leaf nodes
+	// in place after the primitives have moved; the tree topology is left unchanged
+	void refit();
+
+	// stops referencing the primitives when the vectorized leaves store the line segments or
+	// triangles, so that they can be freed; normals are then computed from primitives rebuilt
+	// from their indices in the polygon soup. Returns false if the primitives are still needed.
+	// NOTE: the tree cannot be refit afterwards
+	bool releasePrimitives();
+
 	// intersects with ray, starting the traversal at the specified node in an aggregate
 	// NOTE: interactions are invalid when checkForOcclusion is enabled
 	int intersectFromNode(Ray<DIM>& r, std::vector<Interaction<DIM>>& is,
 						  int nodeStartIndex, int aggregateIndex, int& nodesVisited,
 						  bool checkForOcclusion=false, bool recordAllHits=false) const;
 
+	// intersects with ray, starting the traversal at the specified node in an aggregate;
+	// returns the closest interaction in i without allocating
+	// NOTE: interaction is invalid when checkForOcclusion is enabled
+	bool intersectFromNode(Ray<DIM>& r, Interaction<DIM>& i, int nodeStartIndex,
+						   int aggregateIndex, int& nodesVisited,
+						   bool checkForOcclusion=false) const;
+
+	// intersects with ray, starting the traversal at the specified node in an aggregate;
+	// returns the closest interaction accepted by filter in i
+	// NOTE: interaction is invalid when checkForOcclusion is enabled
+	bool intersectFromNode(Ray<DIM>& r, Interaction<DIM>& i, const HitFilter<DIM>& filter,
+						   int nodeStartIndex, int aggregateIndex, int& nodesVisited,
+						   bool checkForOcclusion=false) const;
+
+	// intersects with ray like the overload above, with a filter(c) that is inlined into the
+	// traversal and returns a HitFilterResult for each candidate hit c
+	template<typename FilterFunc>
+	bool intersectFromNodeWithFilter(Ray<DIM>& r, Interaction<DIM>& i, FilterFunc&& filter,
+									 int nodeStartIndex, int aggregateIndex, int& nodesVisited,
+									 bool checkForOcclusion=false) const;
+
 	// finds closest point to sphere center, starting the traversal at the specified node in an aggregate
 	bool findClosestPointFromNode(BoundingSphere<DIM>& s, Interaction<DIM>& i,
 								  int nodeStartIndex, int aggregateIndex,
 								  const Vector<DIM>& boundaryHint, int& nodesVisited) const;
 
+	// finds closest point to sphere center, searching the subtree of the specified node first and
+	// then the sibling subtrees that overlap the sphere on the way up to the root
+	bool findClosestPointBottomUp(BoundingSphere<DIM>& s, Interaction<DIM>& i, int nodeStartIndex,
+								  int aggregateIndex, int& nodesVisited) const;
+
+	// intersects a packet of nRays <= FCPW_MBVH_PACKET_SIZE rays with a single traversal that
+	// fetches each node once for all the rays that overlap it, and returns the closest interaction
+	// of each ray in is; subtrees overlapped by only one ray of the packet are traversed with the
+	// single ray traversal. Returns a bit mask of the rays with a hit
+	// NOTE: interactions are invalid when checkForOcclusion is enabled
+	uint32_t intersectPacket(Ray<DIM> *rays, Interaction<DIM> *is, int nRays,
+							 int& nodesVisited, bool checkForOcclusion=false) const;
+
+	// finds the k closest primitives to sphere center, starting the traversal at the specified node in an aggregate
+	bool findKClosestPointsFromNode(BoundingSphere<DIM>& s, std::vector<Interaction<DIM>>& is,
+									int k, int nodeStartIndex, int aggregateIndex,
+									int& nodesVisited) const;
+
+	// finds closest points to the query points in the range [begin, end) of a batch;
+	// see findClosestPointsInRange for the layout of the input and output buffers
+	void findClosestPoints(const float *xyz, const float *squaredRadii, size_t nQueries,
+						   size_t begin, size_t end, float *distances, float *points,
+						   int *primitiveIndices, float *uvs) const;
+
+	// finds closest points to the query points in the range [begin, end) of a batch by traversing
+	// the tree once per cluster of clusterSize consecutive query points, with distance bounds from
+	// the box enclosing the cluster; each query point then only visits the leaves that survive
+	// this traversal. See findClosestPointsInRange for the layout of the input and output buffers
+	void findClosestPointsInClusters(const float *xyz, const float *squaredRadii, size_t nQueries,
+									 size_t begin, size_t end, size_t clusterSize, float *distances,
+									 float *points, int *primitiveIndices, float *uvs) const;
+
+	// intersects the rays in the range [begin, end) of a batch, returns the number of rays with a hit;
+	// see intersectRaysInRange for the layout of the input and output buffers. If
+	// FCPW_USE_RAY_PACKET_TRAVERSAL is defined, consecutive rays are intersected as packets
+	int intersectRays(const float *origins, const float *directions, const float *tMax,
+					  size_t nRays, size_t begin, size_t end, float *distances, float *points,
+					  int *primitiveIndices, float *uvs, bool checkForOcclusion=false) const;
+
 protected:
 	// collapses sbvh into a mbvh
 	int collapseSbvh(const Sbvh<DIM, PrimitiveType> *sbvh, int sbvhNodeIndex, int parent, int depth);
@@ -80,18 +210,63 @@ protected:
 	// determines whether mbvh node is a leaf node
 	bool isLeafNode(const MbvhNode<DIM>& node) const;
 
+	// computes the bounding box of a node from its child boxes, or from its primitives if it is a leaf
+	BoundingBox<DIM> computeNodeBox(int nodeIndex) const;
+
 	// populates leaf nodes
 	void populateLeafNodes();
 
+	// records the parent of each node in parents
+	void computeParents();
+
+	// checks that the child indices, leaf node ranges and reference ranges of a serialized tree lie within it
+	bool hasValidNodes(size_t nLeafNodes) const;
+
+	// computes the normal at an interaction with a primitive in the tree
+	void computePrimitiveNormal(Interaction<DIM>& i) const;
+
+	// computes surface area, signed volume and centroid, counting primitives
+	// with references duplicated by spatial splits once
+	void computeAggregateProperties();
+
+	// processes subtree for intersection; records the closest hit accepted by filter in i or all
+	// hits in is, and returns true if the query was terminated by an occluding or terminating hit
+	template<typename FilterFunc>
+	bool processSubtreeForIntersection(Ray<DIM>& r, Interaction<DIM>& i, std::vector<Interaction<DIM>>& is,
+									   FilterFunc&& filter, int nodeStartIndex, int aggregateIndex,
+									   bool checkForOcclusion, bool recordAllHits, int rootIndex,
+									   int& hits, int& nodesVisited) const;
+
+	// finds closest point to sphere center among the primitives in a leaf node
+	bool findClosestPointInLeaf(const MbvhNode<DIM>& node, int nodeIndex, BoundingSphere<DIM>& s,
+								const enokiVector<DIM>& sc, Interaction<DIM>& i, int nodeStartIndex,
+								int aggregateIndex, const Vector<DIM>& boundaryHint, int& nodesVisited) const;
+
+	// traverses the subtree rooted at rootIndex in front to back order; overlapChildren(node, tMin)
+	// returns the mask of children to visit and their distances, processLeaf(node, nodeIndex)
+	// returns true to terminate the traversal, and nodes further than pruneDistance() are skipped.
+	// Returns whether the traversal was terminated
+	template<typename OverlapFunc, typename LeafFunc, typename PruneFunc>
+	bool traverse(int rootIndex, OverlapFunc&& overlapChildren,
+				  LeafFunc&& processLeaf, PruneFunc&& pruneDistance) const;
+
 	// members
-	int nNodes, nLeafs, maxDepth;
+	int nNodes, nLeafs, maxDepth, nPrimitives;
 	float area, volume;
 	Vector<DIM> aggregateCentroid;
-	const std::vector<PrimitiveType *>& primitives;
+	std::vector<PrimitiveType *> ownedReferences; // references owned by the tree, e.g., when built with spatial splits
+	const std::vector<PrimitiveType *>& primitives; // refers to ownedReferences or to the primitives passed to the tree
+	std::vector<bool> isDuplicateReference;
 	std::vector<MbvhNode<DIM>> flatTree;
 	std::vector<MbvhLeafNode<WIDTH, DIM, PrimitiveType>> leafNodes;
-	ObjectType vectorizedLeafType;
+	MbvhNode<DIM> *nodes; // points to flatTree, or to a serialized tree viewed in place
+	std::vector<int> parents; // indexed by node, -1 for the root
+	MbvhLeafNode<WIDTH, DIM, PrimitiveType> *leaves; // points to leafNodes, or to serialized leaf nodes
+	bool vectorizedLeaves; // set if the line segments and triangles in the leaves are queried through leafNodes
+	bool aggregateLeaves; // set if leafNodes store the bounding boxes of the aggregates in the leaves
 	bool primitiveTypeIsAggregate;
+	bool releasedPrimitives; // set if primitives must not be accessed, see releasePrimitives
+	const PolygonSoup<DIM> *soup; // soup of the released primitives
 	enoki::Array<int, DIM> range;
 };
 
@@ -2,11 +2,129 @@
 
 namespace fcpw {
 
+#ifdef FCPW_USE_QUANTIZED_MBVH_NODES
+inline uint8_t quantizeBoxMin(float pMin, float origin, float scale)
+{
+	// round down, and step down further if the dequantized value is not strictly below pMin,
+	// since the traversal may evaluate origin + q*scale with a fused multiply add
+	if (scale == 0.0f) return 0;
+	int q = clamp((int)std::floor((pMin - origin)/scale), 0, 255);
+	while (q > 0 && origin + (float)q*scale >= pMin) q--;
+
+	return (uint8_t)q;
+}
+
+inline uint8_t quantizeBoxMax(float pMax, float origin, float scale)
+{
+	// round up, and step up further if the dequantized value is not strictly above pMax
+	if (scale == 0.0f) return 0;
+	int q = clamp((int)std::ceil((pMax - origin)/scale), 0, 255);
+	while (q < 255 && origin + (float)q*scale <= pMax) q++;
+
+	return (uint8_t)q;
+}
+#endif
+
+template<size_t DIM>
+inline void setChildBoxes(MbvhNode<DIM>& node, const BoundingBox<DIM> *boxes, int nBoxes)
+{
+#ifdef FCPW_USE_QUANTIZED_MBVH_NODES
+	// quantize the child boxes relative to the box enclosing them; the scale is enlarged until
+	// the largest quantized value lies strictly above the enclosing box so that the
+	// dequantized child boxes are conservative
+	BoundingBox<DIM> box;
+	for (int w = 0; w < nBoxes; w++) box.expandToInclude(boxes[w]);
+
+	for (size_t j = 0; j < DIM; j++) {
+		float origin = nBoxes > 0 ? box.pMin[j] : 0.0f;
+		float extent = nBoxes > 0 ? box.pMax[j] - origin : 0.0f;
+		float scale = extent > 0.0f ? std::max(extent/255.0f, std::numeric_limits<float>::min()) : 0.0f;
+		while (extent > 0.0f && origin + 255.0f*scale <= box.pMax[j]) scale *= 1.0f + 1.0f/256.0f;
+		node.boxOrigin[j] = origin;
+		node.boxScale[j] = scale;
+
+		for (int w = 0; w < FCPW_MBVH_BRANCHING_FACTOR; w++) {
+			node.qBoxMin[j][w] = w < nBoxes ? quantizeBoxMin(boxes[w].pMin[j], origin, scale) : 0;
+			node.qBoxMax[j][w] = w < nBoxes ? quantizeBoxMax(boxes[w].pMax[j], origin, scale) : 0;
+		}
+	}
+#else
+	for (size_t j = 0; j < DIM; j++) {
+		for (int w = 0; w < FCPW_MBVH_BRANCHING_FACTOR; w++) {
+			node.boxMin[j][w] = w < nBoxes ? boxes[w].pMin[j] : maxFloat;
+			node.boxMax[j][w] = w < nBoxes ? boxes[w].pMax[j] : minFloat;
+		}
+	}
+#endif
+}
+
+template<size_t DIM>
+inline BoundingBox<DIM> getChildBox(const MbvhNode<DIM>& node, int w)
+{
+	BoundingBox<DIM> box;
+	for (size_t j = 0; j < DIM; j++) {
+#ifdef FCPW_USE_QUANTIZED_MBVH_NODES
+		box.pMin[j] = node.boxOrigin[j] + (float)node.qBoxMin[j][w]*node.boxScale[j];
+		box.pMax[j] = node.boxOrigin[j] + (float)node.qBoxMax[j][w]*node.boxScale[j];
+#else
+		box.pMin[j] = node.boxMin[j][w];
+		box.pMax[j] = node.boxMax[j][w];
+#endif
+	}
+
+	return box;
+}
+
+template<typename PrimitiveType>
+inline bool hasVectorizedLeafNodes(const std::vector<PrimitiveType *>& primitives)
+{
+	return std::is_same<PrimitiveType, LineSegment>::value ||
+		   std::is_same<PrimitiveType, Triangle>::value;
+}
+
+inline bool hasVectorizedLeafNodes(const std::vector<GeometricPrimitive<3> *>& primitives)
+{
+	// objects with mixed primitive types are vectorized if they only contain line segments and triangles
+	for (int p = 0; p < (int)primitives.size(); p++) {
+		const GeometricPrimitive<3> *primitive = primitives[p];
+		if (dynamic_cast<const LineSegment *>(primitive) == nullptr &&
+			dynamic_cast<const Triangle *>(primitive) == nullptr) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+template<size_t WIDTH, typename PrimitiveType>
+inline int countLeafNodes(const std::vector<PrimitiveType *>& primitives, int referenceOffset, int nReferences)
+{
+	int nLeafNodes = nReferences/WIDTH;
+	if (nReferences%WIDTH != 0) nLeafNodes += 1;
+
+	return nLeafNodes;
+}
+
+template<size_t WIDTH>
+inline int countLeafNodes(const std::vector<GeometricPrimitive<3> *>& primitives, int referenceOffset, int nReferences)
+{
+	// the line segments and triangles of an object with mixed primitive types are placed in separate leaf nodes
+	int nTriangles = 0;
+	for (int p = 0; p < nReferences; p++) {
+		if (dynamic_cast<const Triangle *>(primitives[referenceOffset + p]) != nullptr) nTriangles++;
+	}
+
+	int nLineSegments = nReferences - nTriangles;
+	int W = (int)WIDTH;
+
+	return (nLineSegments + W - 1)/W + (nTriangles + W - 1)/W;
+}
+
 template<size_t WIDTH, size_t DIM, typename PrimitiveType>
 inline int Mbvh<WIDTH, DIM, PrimitiveType>::collapseSbvh(const Sbvh<DIM, PrimitiveType> *sbvh,
 														 int sbvhNodeIndex, int parent, int depth)
 {
-	const SbvhNode<DIM>& sbvhNode = sbvh->flatTree[sbvhNodeIndex];
+	const SbvhNode<DIM>& sbvhNode = sbvh->nodes[sbvhNodeIndex];
 	maxDepth = std::max(depth, maxDepth);
 
 	// create mbvh node
@@ -20,8 +138,7 @@ inline int Mbvh<WIDTH, DIM, PrimitiveType>::collapseSbvh(const Sbvh<DIM, Primiti
 		// sbvh node is a leaf node; assign mbvh node its reference indices
 		MbvhNode<DIM>& mbvhNode = flatTree[mbvhNodeIndex];
 		mbvhNode.child[0] = -(nLeafs + 1); // negative value indicates that node is a leaf
-		mbvhNode.child[1] = sbvhNode.nReferences/WIDTH;
-		if (sbvhNode.nReferences%WIDTH != 0) mbvhNode.child[1] += 1;
+		mbvhNode.child[1] = countLeafNodes<WIDTH>(primitives, sbvhNode.referenceOffset, sbvhNode.nReferences);
 		mbvhNode.child[2] = sbvhNode.referenceOffset;
 		mbvhNode.child[3] = sbvhNode.nReferences;
 		nLeafs += mbvhNode.child[1];
@@ -41,7 +158,7 @@ inline int Mbvh<WIDTH, DIM, PrimitiveType>::collapseSbvh(const Sbvh<DIM, Primiti
 
 			for (int i = 0; i < nNodesToCollapse; i++) {
 				int sbvhNodeIndex = nodesToCollapse[i];
-				const SbvhNode<DIM>& sbvhNode = sbvh->flatTree[sbvhNodeIndex];
+				const SbvhNode<DIM>& sbvhNode = sbvh->nodes[sbvhNodeIndex];
 
 				if (sbvhNode.nReferences == 0) {
 					float surfaceArea = sbvhNode.box.surfaceArea();
@@ -60,7 +177,7 @@ inline int Mbvh<WIDTH, DIM, PrimitiveType>::collapseSbvh(const Sbvh<DIM, Primiti
 			} else {
 				// remove the selected node from the list, and add its two children
 				int sbvhNodeIndex = nodesToCollapse[maxIndex];
-				const SbvhNode<DIM>& sbvhNode = sbvh->flatTree[sbvhNodeIndex];
+				const SbvhNode<DIM>& sbvhNode = sbvh->nodes[sbvhNodeIndex];
 
 				nodesToCollapse[maxIndex] = sbvhNodeIndex + sbvhNode.secondChildOffset;
 				nodesToCollapse[nNodesToCollapse] = sbvhNodeIndex + 1;
@@ -68,19 +185,18 @@ inline int Mbvh<WIDTH, DIM, PrimitiveType>::collapseSbvh(const Sbvh<DIM, Primiti
 			}
 		}
 
-		// collapse the nodes
+		// assign mbvh node the bounding boxes of the sbvh nodes it collapses
 		std::sort(nodesToCollapse, nodesToCollapse + nNodesToCollapse);
+		BoundingBox<DIM> boxes[FCPW_MBVH_BRANCHING_FACTOR];
 		for (int i = 0; i < nNodesToCollapse; i++) {
-			int sbvhNodeIndex = nodesToCollapse[i];
-			const SbvhNode<DIM>& sbvhNode = sbvh->flatTree[sbvhNodeIndex];
+			boxes[i] = sbvh->nodes[nodesToCollapse[i]].box;
+		}
 
-			// assign mbvh node this sbvh node's bounding box and index
-			for (size_t j = 0; j < DIM; j++) {
-				flatTree[mbvhNodeIndex].boxMin[j][i] = sbvhNode.box.pMin[j];
-				flatTree[mbvhNodeIndex].boxMax[j][i] = sbvhNode.box.pMax[j];
-			}
+		setChildBoxes(flatTree[mbvhNodeIndex], boxes, nNodesToCollapse);
 
-			flatTree[mbvhNodeIndex].child[i] = collapseSbvh(sbvh, sbvhNodeIndex, mbvhNodeIndex, depth + 1);
+		// collapse the nodes
+		for (int i = 0; i < nNodesToCollapse; i++) {
+			flatTree[mbvhNodeIndex].child[i] = collapseSbvh(sbvh, nodesToCollapse[i], mbvhNodeIndex, depth + 1);
 		}
 	}
 
@@ -93,9 +209,29 @@ inline bool Mbvh<WIDTH, DIM, PrimitiveType>::isLeafNode(const MbvhNode<DIM>& nod
 	return node.child[0] < 0;
 }
 
+template<size_t WIDTH, size_t DIM, typename PrimitiveType>
+inline BoundingBox<DIM> Mbvh<WIDTH, DIM, PrimitiveType>::computeNodeBox(int nodeIndex) const
+{
+	const MbvhNode<DIM>& node = nodes[nodeIndex];
+	BoundingBox<DIM> box;
+
+	if (isLeafNode(node)) {
+		for (int p = 0; p < node.child[3]; p++) {
+			box.expandToInclude(primitives[node.child[2] + p]->boundingBox());
+		}
+
+	} else {
+		for (int w = 0; w < FCPW_MBVH_BRANCHING_FACTOR; w++) {
+			if (node.child[w] != maxInt) box.expandToInclude(getChildBox(node, w));
+		}
+	}
+
+	return box;
+}
+
 template<size_t WIDTH, size_t DIM, typename PrimitiveType>
 inline void populateLeafNode(const MbvhNode<DIM>& node, const std::vector<PrimitiveType *>& primitives,
-							 std::vector<MbvhLeafNode<WIDTH, DIM, PrimitiveType>>& leafNodes)
+							 MbvhLeafNode<WIDTH, DIM, PrimitiveType> *leafNodes)
 {
 	std::cerr << "populateLeafNode(): WIDTH: " << WIDTH << ", DIM: " << DIM << " not supported" << std::endl;
 	exit(EXIT_FAILURE);
@@ -103,7 +239,7 @@ inline void populateLeafNode(const MbvhNode<DIM>& node, const std::vector<Primit
 
 template<size_t WIDTH>
 inline void populateLeafNode(const MbvhNode<3>& node, const std::vector<LineSegment *>& primitives,
-							 std::vector<MbvhLeafNode<WIDTH, 3, LineSegment>>& leafNodes)
+							 MbvhLeafNode<WIDTH, 3, LineSegment> *leafNodes)
 {
 	int leafOffset = -node.child[0] - 1;
 	int referenceOffset = node.child[2];
@@ -129,7 +265,7 @@ inline void populateLeafNode(const MbvhNode<3>& node, const std::vector<LineSegm
 
 template<size_t WIDTH>
 inline void populateLeafNode(const MbvhNode<3>& node, const std::vector<Triangle *>& primitives,
-							 std::vector<MbvhLeafNode<WIDTH, 3, Triangle>>& leafNodes)
+							 MbvhLeafNode<WIDTH, 3, Triangle> *leafNodes)
 {
 	int leafOffset = -node.child[0] - 1;
 	int referenceOffset = node.child[2];
@@ -155,18 +291,165 @@ inline void populateLeafNode(const MbvhNode<3>& node, const std::vector<Triangle
 	}
 }
 
+template<size_t WIDTH>
+inline void populateLeafNode(const MbvhNode<3>& node, const std::vector<GeometricPrimitive<3> *>& primitives,
+							 MbvhLeafNode<WIDTH, 3, GeometricPrimitive<3>> *leafNodes)
+{
+	int leafOffset = -node.child[0] - 1;
+	int referenceOffset = node.child[2];
+	int nReferences = node.child[3];
+
+	// the line segments fill the first leaf nodes, and the triangles the remaining ones
+	int nTriangles = 0;
+	for (int p = 0; p < nReferences; p++) {
+		if (dynamic_cast<const Triangle *>(primitives[referenceOffset + p]) != nullptr) nTriangles++;
+	}
+
+	int nLineSegments = nReferences - nTriangles;
+	int triangleLeafOffset = leafOffset + nLineSegments/WIDTH + (nLineSegments%WIDTH != 0 ? 1 : 0);
+	int lineSegmentIndex = 0;
+	int triangleIndex = 0;
+
+	// populate leaf nodes with line segments and triangles
+	for (int p = 0; p < nReferences; p++) {
+		int referenceIndex = referenceOffset + p;
+		const GeometricPrimitive<3> *primitive = primitives[referenceIndex];
+		const Triangle *triangle = dynamic_cast<const Triangle *>(primitive);
+
+		if (triangle != nullptr) {
+			int leafIndex = triangleLeafOffset + triangleIndex/WIDTH;
+			int w = triangleIndex%WIDTH;
+			triangleIndex++;
+
+			const Vector3& pa = triangle->soup->positions[triangle->indices[0]];
+			const Vector3& pb = triangle->soup->positions[triangle->indices[1]];
+			const Vector3& pc = triangle->soup->positions[triangle->indices[2]];
+
+			leafNodes[leafIndex].type = ObjectType::Triangles;
+			leafNodes[leafIndex].nReferences = w + 1;
+			leafNodes[leafIndex].primitiveIndex[w] = triangle->pIndex;
+			leafNodes[leafIndex].referenceIndex[w] = referenceIndex;
+			for (int i = 0; i < 3; i++) {
+				leafNodes[leafIndex].positions[0][i][w] = pa[i];
+				leafNodes[leafIndex].positions[1][i][w] = pb[i];
+				leafNodes[leafIndex].positions[2][i][w] = pc[i];
+			}
+
+		} else {
+			int leafIndex = leafOffset + lineSegmentIndex/WIDTH;
+			int w = lineSegmentIndex%WIDTH;
+			lineSegmentIndex++;
+
+			const LineSegment *lineSegment = static_cast<const LineSegment *>(primitive);
+			const Vector3& pa = lineSegment->soup->positions[lineSegment->indices[0]];
+			const Vector3& pb = lineSegment->soup->positions[lineSegment->indices[1]];
+
+			leafNodes[leafIndex].type = ObjectType::LineSegments;
+			leafNodes[leafIndex].nReferences = w + 1;
+			leafNodes[leafIndex].primitiveIndex[w] = lineSegment->pIndex;
+			leafNodes[leafIndex].referenceIndex[w] = referenceIndex;
+			for (int i = 0; i < 3; i++) {
+				leafNodes[leafIndex].positions[0][i][w] = pa[i];
+				leafNodes[leafIndex].positions[1][i][w] = pb[i];
+			}
+		}
+	}
+}
+
+template<size_t WIDTH, size_t DIM>
+inline void populateLeafNode(const MbvhNode<DIM>& node, const std::vector<Aggregate<DIM> *>& primitives,
+							 MbvhLeafNode<WIDTH, DIM, Aggregate<DIM>> *leafNodes)
+{
+	int leafOffset = -node.child[0] - 1;
+	int referenceOffset = node.child[2];
+	int nReferences = node.child[3];
+
+	// populate leaf nodes with the bounding boxes of the aggregates
+	for (int p = 0; p < nReferences; p++) {
+		int referenceIndex = referenceOffset + p;
+		int leafIndex = leafOffset + p/WIDTH;
+		int w = p%WIDTH;
+
+		BoundingBox<DIM> box = primitives[referenceIndex]->boundingBox();
+		for (size_t i = 0; i < DIM; i++) {
+			leafNodes[leafIndex].boxMin[i][w] = box.pMin[i];
+			leafNodes[leafIndex].boxMax[i][w] = box.pMax[i];
+		}
+	}
+}
+
 template<size_t WIDTH, size_t DIM, typename PrimitiveType>
 inline void Mbvh<WIDTH, DIM, PrimitiveType>::populateLeafNodes()
 {
-	if (vectorizedLeafType == ObjectType::LineSegments ||
-		vectorizedLeafType == ObjectType::Triangles) {
-		leafNodes.resize(nLeafs);
-
+	if (vectorizedLeaves || aggregateLeaves) {
 		for (int i = 0; i < nNodes; i++) {
-			MbvhNode<DIM>& node = flatTree[i];
-			if (isLeafNode(node)) populateLeafNode(node, primitives, leafNodes);
+			const MbvhNode<DIM>& node = nodes[i];
+			if (isLeafNode(node)) populateLeafNode(node, primitives, leaves);
+		}
+	}
+}
+
+template<size_t WIDTH, size_t DIM, typename PrimitiveType>
+inline void Mbvh<WIDTH, DIM, PrimitiveType>::computeParents()
+{
+	parents.resize(nNodes);
+	if (nNodes > 0) parents[0] = -1;
+
+	for (int i = 0; i < nNodes; i++) {
+		const MbvhNode<DIM>& node = nodes[i];
+		if (isLeafNode(node)) continue;
+
+		for (int w = 0; w < FCPW_MBVH_BRANCHING_FACTOR; w++) {
+			if (node.child[w] != maxInt) parents[node.child[w]] = i;
+		}
+	}
+}
+
+template<size_t WIDTH, size_t DIM, typename PrimitiveType>
+inline bool Mbvh<WIDTH, DIM, PrimitiveType>::hasValidNodes(size_t nLeafNodes) const
+{
+	int nReferences = (int)primitives.size();
+	if (nNodes <= 0) return false;
+	if (isDuplicateReference.size() > 0 && (int)isDuplicateReference.size() != nReferences) return false;
+
+	for (int i = 0; i < nNodes; i++) {
+		const MbvhNode<DIM>& node = nodes[i];
+		if (isLeafNode(node)) {
+			// leaf node; its references must fill exactly the leaf nodes it spans
+			int leafOffset = -(node.child[0] + 1);
+			int referenceOffset = node.child[2];
+			int nReferencesInLeaf = node.child[3];
+			if (referenceOffset < 0 || nReferencesInLeaf < 0 ||
+				nReferencesInLeaf > nReferences - referenceOffset) return false;
+			if (node.child[1] != countLeafNodes<WIDTH>(primitives, referenceOffset, nReferencesInLeaf) ||
+				(size_t)leafOffset + (size_t)node.child[1] > nLeafNodes) return false;
+
+		} else {
+			// inner node; children are stored after their parent, so that traversals terminate
+			for (int w = 0; w < FCPW_MBVH_BRANCHING_FACTOR; w++) {
+				int child = node.child[w];
+				if (child != maxInt && (child <= i || child >= nNodes)) return false;
+			}
 		}
 	}
+
+	return true;
+}
+
+template<size_t WIDTH, size_t DIM, typename PrimitiveType>
+inline void Mbvh<WIDTH, DIM, PrimitiveType>::computeAggregateProperties()
+{
+	area = 0.0f;
+	volume = 0.0f;
+	aggregateCentroid = Vector<DIM>::Zero();
+
+	forEachUniquePrimitive(primitives, isDuplicateReference, [this](const PrimitiveType *primitive) {
+		aggregateCentroid += primitive->centroid();
+		area += primitive->surfaceArea();
+		volume += primitive->signedVolume();
+	});
+
+	aggregateCentroid /= nPrimitives;
 }
 
 template<size_t WIDTH, size_t DIM, typename PrimitiveType>
@@ -174,10 +457,19 @@ inline Mbvh<WIDTH, DIM, PrimitiveType>::Mbvh(const Sbvh<DIM, PrimitiveType> *sbv
 nNodes(0),
 nLeafs(0),
 maxDepth(0),
+nPrimitives(sbvh_->nPrimitives),
 area(0.0f),
 volume(0.0f),
-primitives(sbvh_->primitives),
+ownedReferences(sbvh_->ownedReferences),
+primitives(&sbvh_->primitives == &sbvh_->ownedReferences ? ownedReferences : sbvh_->primitives),
+isDuplicateReference(sbvh_->isDuplicateReference),
+nodes(nullptr),
+leaves(nullptr),
+vectorizedLeaves(false),
+aggregateLeaves(std::is_same<PrimitiveType, Aggregate<DIM>>::value),
 primitiveTypeIsAggregate(std::is_base_of<Aggregate<DIM>, PrimitiveType>::value),
+releasedPrimitives(false),
+soup(nullptr),
 range(enoki::arange<enoki::Array<int, DIM>>())
 {
 	static_assert(FCPW_MBVH_BRANCHING_FACTOR == 4 || FCPW_MBVH_BRANCHING_FACTOR == 8,
@@ -189,25 +481,19 @@ range(enoki::arange<enoki::Array<int, DIM>>())
 	// collapse sbvh
 	collapseSbvh(sbvh_, 0, 0xfffffffc, 0);
 
-	// determine object type
-	vectorizedLeafType = std::is_same<PrimitiveType, LineSegment>::value ? ObjectType::LineSegments :
-						 std::is_same<PrimitiveType, Triangle>::value ? ObjectType::Triangles :
-						 ObjectType::Mixed;
-
 	// populate leaf nodes if primitive type is supported
-	populateLeafNodes();
-
-	// precompute surface area and signed volume
-	int nPrimitives = (int)primitives.size();
-	aggregateCentroid = Vector<DIM>::Zero();
-
-	for (int p = 0; p < nPrimitives; p++) {
-		aggregateCentroid += primitives[p]->centroid();
-		area += primitives[p]->surfaceArea();
-		volume += primitives[p]->signedVolume();
+	vectorizedLeaves = hasVectorizedLeafNodes(primitives);
+	if (vectorizedLeaves || aggregateLeaves) {
+		leafNodes.resize(nLeafs);
 	}
 
-	aggregateCentroid /= nPrimitives;
+	nodes = flatTree.data();
+	leaves = leafNodes.data();
+	populateLeafNodes();
+	computeParents();
+
+	// precompute surface area, signed volume and centroid
+	computeAggregateProperties();
 
 	// don't compute normals by default
 	this->computeNormals = false;
@@ -246,21 +532,198 @@ range(enoki::arange<enoki::Array<int, DIM>>())
 				  << (nNodesNotFull*100/nInnerNodes) << "% nodes & "
 				  << (nLeafsNotFull*100/nLeafs) << "% leaves not full, "
 				  << maxDepth << " max depth, "
-				  << primitives.size() << " primitives in "
-				  << timeSpan.count() << " seconds" << std::endl;
+				  << nPrimitives << " primitives";
+		if (sbvh_->useSpatialSplits) std::cout << ", " << primitives.size() << " references";
+		std::cout << " in " << timeSpan.count() << " seconds" << std::endl;
 	}
 }
 
 template<size_t WIDTH, size_t DIM, typename PrimitiveType>
-inline BoundingBox<DIM> Mbvh<WIDTH, DIM, PrimitiveType>::boundingBox() const
+inline void Mbvh<WIDTH, DIM, PrimitiveType>::refit()
 {
-	BoundingBox<DIM> box;
-	if (flatTree.size() == 0) return box;
+	if (releasedPrimitives) {
+		std::cerr << "Mbvh::refit(): Not supported after the primitives have been released" << std::endl;
+		exit(EXIT_FAILURE);
+	}
 
-	enoki::scatter(box.pMin.data(), enoki::hmin_inner(flatTree[0].boxMin), range);
-	enoki::scatter(box.pMax.data(), enoki::hmax_inner(flatTree[0].boxMax), range);
+	// refit child aggregates before their bounding boxes are read
+	if (primitiveTypeIsAggregate) {
+		forEachUniquePrimitive(primitives, isDuplicateReference, [](PrimitiveType *primitive) {
+			reinterpret_cast<Aggregate<DIM> *>(primitive)->refit();
+		});
+	}
 
-	return box;
+	// rewrite the vectorized leaf positions and aggregate bounding boxes in place
+	populateLeafNodes();
+
+	// children are created after their parent, so a reverse sweep visits them first
+	for (int i = nNodes - 1; i >= 0; i--) {
+		MbvhNode<DIM>& node = nodes[i];
+		if (isLeafNode(node)) continue;
+
+		BoundingBox<DIM> boxes[FCPW_MBVH_BRANCHING_FACTOR];
+		int nBoxes = 0;
+		while (nBoxes < FCPW_MBVH_BRANCHING_FACTOR && node.child[nBoxes] != maxInt) {
+			boxes[nBoxes] = computeNodeBox(node.child[nBoxes]);
+			nBoxes++;
+		}
+
+		setChildBoxes(node, boxes, nBoxes);
+	}
+
+	// update surface area, signed volume and centroid
+	computeAggregateProperties();
+}
+
+template<size_t WIDTH, size_t DIM, typename PrimitiveType>
+inline Mbvh<WIDTH, DIM, PrimitiveType>::Mbvh(const std::vector<PrimitiveType *>& primitives_,
+											 BinaryReader& reader, bool copyReferences_):
+nNodes(0),
+nLeafs(0),
+maxDepth(0),
+nPrimitives(0),
+area(0.0f),
+volume(0.0f),
+ownedReferences(copyReferences_ ? primitives_ : std::vector<PrimitiveType *>()),
+primitives(copyReferences_ ? ownedReferences : primitives_),
+nodes(nullptr),
+leaves(nullptr),
+vectorizedLeaves(false),
+aggregateLeaves(std::is_same<PrimitiveType, Aggregate<DIM>>::value),
+primitiveTypeIsAggregate(std::is_base_of<Aggregate<DIM>, PrimitiveType>::value),
+releasedPrimitives(false),
+soup(nullptr),
+range(enoki::arange<enoki::Array<int, DIM>>())
+{
+	// determine whether the leaves are vectorized
+	vectorizedLeaves = hasVectorizedLeafNodes(primitives);
+
+	// read the precomputed properties and the tree, which is viewed in place
+	nLeafs = reader.read<int>();
+	maxDepth = reader.read<int>();
+	nPrimitives = reader.read<int>();
+	area = reader.read<float>();
+	volume = reader.read<float>();
+	aggregateCentroid = reader.read<Vector<DIM>>();
+
+	size_t nFlatTreeNodes = 0, nLeafNodes = 0;
+	nodes = reader.readArray<MbvhNode<DIM>>(nFlatTreeNodes);
+	leaves = reader.readArray<MbvhLeafNode<WIDTH, DIM, PrimitiveType>>(nLeafNodes);
+	nNodes = (int)nFlatTreeNodes;
+	reader.readArray(isDuplicateReference);
+
+	// reject trees whose nodes index outside of them, e.g., in a corrupted file
+	if (!reader.good() || !hasValidNodes(nLeafNodes)) {
+		reader.fail();
+		nodes = nullptr;
+		leaves = nullptr;
+		nNodes = 0;
+		isDuplicateReference.clear();
+		return;
+	}
+
+	// the parents are not serialized, since they can be recovered from the tree
+	computeParents();
+
+	// don't compute normals by default
+	this->computeNormals = false;
+}
+
+template<size_t DIM, typename PrimitiveType>
+inline bool getPrimitiveSoup(const std::vector<PrimitiveType *>& primitives, const PolygonSoup<DIM> *& soup)
+{
+	// only line segments and triangles can be rebuilt from their indices in the soup
+	return false;
+}
+
+template<>
+inline bool getPrimitiveSoup<3, LineSegment>(const std::vector<LineSegment *>& primitives,
+											 const PolygonSoup<3> *& soup)
+{
+	soup = primitives.size() > 0 ? primitives[0]->soup : nullptr;
+	return true;
+}
+
+template<>
+inline bool getPrimitiveSoup<3, Triangle>(const std::vector<Triangle *>& primitives,
+										  const PolygonSoup<3> *& soup)
+{
+	soup = primitives.size() > 0 ? primitives[0]->soup : nullptr;
+	return true;
+}
+
+template<size_t DIM, typename PrimitiveType>
+inline void computeNormalFromSoup(const PolygonSoup<DIM> *soup, Interaction<DIM>& i)
+{
+	std::cerr << "computeNormalFromSoup<DIM, PrimitiveType>(): Not supported" << std::endl;
+	exit(EXIT_FAILURE);
+}
+
+template<>
+inline void computeNormalFromSoup<3, LineSegment>(const PolygonSoup<3> *soup, Interaction<3>& i)
+{
+	LineSegment lineSegment;
+	lineSegment.soup = soup;
+	lineSegment.indices[0] = soup->indices[2*i.primitiveIndex];
+	lineSegment.indices[1] = soup->indices[2*i.primitiveIndex + 1];
+	lineSegment.pIndex = i.primitiveIndex;
+	i.computeNormal(&lineSegment);
+}
+
+template<>
+inline void computeNormalFromSoup<3, Triangle>(const PolygonSoup<3> *soup, Interaction<3>& i)
+{
+	Triangle triangle;
+	triangle.soup = soup;
+	triangle.indices[0] = soup->indices[3*i.primitiveIndex];
+	triangle.indices[1] = soup->indices[3*i.primitiveIndex + 1];
+	triangle.indices[2] = soup->indices[3*i.primitiveIndex + 2];
+	triangle.pIndex = i.primitiveIndex;
+	i.computeNormal(&triangle);
+}
+
+template<size_t WIDTH, size_t DIM, typename PrimitiveType>
+inline bool Mbvh<WIDTH, DIM, PrimitiveType>::releasePrimitives()
+{
+	if (!vectorizedLeaves || !getPrimitiveSoup<DIM, PrimitiveType>(primitives, soup)) return false;
+
+	std::vector<PrimitiveType *>().swap(ownedReferences);
+	releasedPrimitives = true;
+	return true;
+}
+
+template<size_t WIDTH, size_t DIM, typename PrimitiveType>
+inline void Mbvh<WIDTH, DIM, PrimitiveType>::computePrimitiveNormal(Interaction<DIM>& i) const
+{
+	if (releasedPrimitives) computeNormalFromSoup<DIM, PrimitiveType>(soup, i);
+	else i.computeNormal(primitives[i.referenceIndex]);
+}
+
+template<size_t WIDTH, size_t DIM, typename PrimitiveType>
+inline const std::vector<PrimitiveType *>& Mbvh<WIDTH, DIM, PrimitiveType>::getReferences() const
+{
+	return primitives;
+}
+
+template<size_t WIDTH, size_t DIM, typename PrimitiveType>
+inline void Mbvh<WIDTH, DIM, PrimitiveType>::write(BinaryWriter& writer) const
+{
+	writer.write<int>(nLeafs);
+	writer.write<int>(maxDepth);
+	writer.write<int>(nPrimitives);
+	writer.write<float>(area);
+	writer.write<float>(volume);
+	writer.write<Vector<DIM>>(aggregateCentroid);
+	writer.writeArray(nodes, nNodes);
+	writer.writeArray(leaves, vectorizedLeaves || aggregateLeaves ? nLeafs : 0);
+	writer.writeArray(isDuplicateReference);
+}
+
+template<size_t WIDTH, size_t DIM, typename PrimitiveType>
+inline BoundingBox<DIM> Mbvh<WIDTH, DIM, PrimitiveType>::boundingBox() const
+{
+	if (nNodes == 0) return BoundingBox<DIM>();
+	return computeNodeBox(0);
 }
 
 template<size_t WIDTH, size_t DIM, typename PrimitiveType>
@@ -283,17 +746,16 @@ inline float Mbvh<WIDTH, DIM, PrimitiveType>::signedVolume() const
 
 template<size_t WIDTH, size_t DIM>
 inline void enqueueNodes(const MbvhNode<DIM>& node, const FloatP<WIDTH>& tMin,
-						 const FloatP<WIDTH>& tMax, const MaskP<WIDTH>& mask,
-						 float minDist, float& tMaxMin, int& stackPtr, BvhTraversal *subtree)
+						 const MaskP<WIDTH>& mask, int& stackPtr, BvhTraversal *subtree)
 {
 	// enqueue nodes
 	int closestIndex = -1;
+	float minDist = maxFloat;
 	for (int w = 0; w < WIDTH; w++) {
 		if (mask[w]) {
 			stackPtr++;
 			subtree[stackPtr].node = node.child[w];
 			subtree[stackPtr].distance = tMin[w];
-			tMaxMin = std::min(tMaxMin, tMax[w]);
 
 			if (tMin[w] < minDist) {
 				closestIndex = stackPtr;
@@ -321,8 +783,7 @@ inline void sortOrder4(const FloatP<4>& t, int& a, int& b, int& c, int& d)
 
 template<size_t DIM>
 inline void enqueueNodes(const MbvhNode<DIM>& node, const FloatP<4>& tMin,
-						 const FloatP<4>& tMax, const MaskP<4>& mask,
-						 float minDist, float& tMaxMin, int& stackPtr, BvhTraversal *subtree)
+						 const MaskP<4>& mask, int& stackPtr, BvhTraversal *subtree)
 {
 	// sort nodes
 	int order[4] = {0, 1, 2, 3};
@@ -336,96 +797,248 @@ inline void enqueueNodes(const MbvhNode<DIM>& node, const FloatP<4>& tMin,
 			stackPtr++;
 			subtree[stackPtr].node = node.child[W];
 			subtree[stackPtr].distance = tMin[W];
-			tMaxMin = std::min(tMaxMin, tMax[W]);
 		}
 	}
 }
 
-template<size_t WIDTH, size_t DIM, typename PrimitiveType>
-inline int intersectPrimitives(const MbvhNode<DIM>& node,
-							   const std::vector<MbvhLeafNode<WIDTH, DIM, PrimitiveType>>& leafNodes,
-							   int nodeIndex, int aggregateIndex, const enokiVector<DIM>& ro, const enokiVector<DIM>& rd,
-							   float& rtMax, std::vector<Interaction<DIM>>& is, bool recordAllHits)
+#ifdef FCPW_USE_SHORT_STACK_TRAVERSAL
+template<size_t WIDTH>
+inline int sortChildren(const FloatP<WIDTH>& tMin, const MaskP<WIDTH>& mask, int *order)
 {
-	std::cerr << "intersectPrimitives(): WIDTH: " << WIDTH << ", DIM: " << DIM << " not supported" << std::endl;
-	exit(EXIT_FAILURE);
+	// insertion sort of the overlapping children by distance; ties keep their lane order,
+	// so that the order is reproduced exactly when the traversal restarts
+	int nChildren = 0;
+	for (int w = 0; w < (int)WIDTH; w++) {
+		if (!mask[w]) continue;
+
+		int k = nChildren++;
+		while (k > 0 && tMin[order[k - 1]] > tMin[w]) {
+			order[k] = order[k - 1];
+			k--;
+		}
 
-	return 0;
+		order[k] = w;
+	}
+
+	return nChildren;
 }
+#endif
 
-template<size_t WIDTH>
-inline int intersectPrimitives(const MbvhNode<3>& node,
-							   const std::vector<MbvhLeafNode<WIDTH, 3, LineSegment>>& leafNodes,
-							   int nodeIndex, int aggregateIndex, const enokiVector3& ro, const enokiVector3& rd,
-							   float& rtMax, std::vector<Interaction<3>>& is, bool recordAllHits)
+template<size_t WIDTH, size_t DIM, typename PrimitiveType>
+template<typename OverlapFunc, typename LeafFunc, typename PruneFunc>
+inline bool Mbvh<WIDTH, DIM, PrimitiveType>::traverse(int rootIndex, OverlapFunc&& overlapChildren,
+													  LeafFunc&& processLeaf, PruneFunc&& pruneDistance) const
 {
-	int leafOffset = -node.child[0] - 1;
-	int nLeafs = node.child[1];
-	int referenceOffset = node.child[2];
-	int nReferences = node.child[3];
-	int startReference = 0;
-	int hits = 0;
-
-	for (int l = 0; l < nLeafs; l++) {
-		// perform vectorized intersection query
-		FloatP<WIDTH> d;
-		Vector3P<WIDTH> pt;
-		FloatP<WIDTH> t;
-		int leafIndex = leafOffset + l;
-		const Vector3P<WIDTH>& pa = leafNodes[leafIndex].positions[0];
-		const Vector3P<WIDTH>& pb = leafNodes[leafIndex].positions[1];
-		const IntP<WIDTH>& primitiveIndex = leafNodes[leafIndex].primitiveIndex;
-		MaskP<WIDTH> mask = intersectWideLineSegment<WIDTH>(pa, pb, ro, rd, rtMax, d, pt, t);
+	FloatP<FCPW_MBVH_BRANCHING_FACTOR> tMin;
+
+#ifdef FCPW_USE_SHORT_STACK_TRAVERSAL
+	// the short stack holds the next siblings to visit along with their level and rank in the
+	// sorted order of their parent's children; when it overflows, its oldest entries are dropped.
+	// The trail records the rank of the child being visited at each level of the current path
+	// (or that it is the last one), so that once the stack runs empty, the traversal can restart
+	// from the root and descend to the next subtree that has not been visited yet. This is valid
+	// since the children skipped by a restart are culled by the same distances they are sorted by,
+	// so that a shrinking ray or sphere only ever removes children from the end of the sorted order
+	struct StackEntry {
+		int node;
+		float distance;
+		uint8_t level, rank;
+	};
+
+	const uint8_t lastChild = 0xff;
+	StackEntry stack[FCPW_MBVH_SHORT_STACK_SIZE];
+	uint8_t trail[FCPW_MBVH_MAX_DEPTH];
+	std::fill(trail, trail + FCPW_MBVH_MAX_DEPTH, 0);
+	int stackBegin = 0, stackSize = 0;
+	int nodeIndex = rootIndex, level = 0;
+	int order[FCPW_MBVH_BRANCHING_FACTOR];
+
+	while (true) {
+		const MbvhNode<DIM>& node(nodes[nodeIndex]);
 
-		if (recordAllHits) {
-			// record interactions
-			int endReference = startReference + WIDTH;
-			if (endReference > nReferences) endReference = nReferences;
-
-			for (int p = startReference; p < endReference; p++) {
-				int w = p - startReference;
+		if (isLeafNode(node)) {
+			if (processLeaf(node, nodeIndex)) return true;
 
-				if (mask[w]) {
-					hits++;
-					auto it = is.emplace(is.end(), Interaction<3>());
-					it->d = d[w];
-					it->p[0] = pt[0][w];
-					it->p[1] = pt[1][w];
-					it->p[2] = pt[2][w];
-					it->uv[0] = t[w];
-					it->uv[1] = -1;
-					it->primitiveIndex = primitiveIndex[w];
-					it->nodeIndex = nodeIndex;
-					it->referenceIndex = referenceOffset + p;
-					it->objectIndex = aggregateIndex;
+		} else {
+			// sort the overlapping children, and descend into the child recorded in the trail
+			MaskP<FCPW_MBVH_BRANCHING_FACTOR> mask = overlapChildren(node, tMin);
+			int nChildren = sortChildren<FCPW_MBVH_BRANCHING_FACTOR>(tMin, mask, order);
+			int rank = trail[level] == lastChild ? nChildren - 1 : trail[level];
+
+			if (rank >= 0 && rank < nChildren) {
+				// push the siblings that follow, the furthest first
+				for (int k = nChildren - 1; k > rank; k--) {
+					StackEntry& entry = stack[(stackBegin + stackSize)%FCPW_MBVH_SHORT_STACK_SIZE];
+					entry.node = node.child[order[k]];
+					entry.distance = tMin[order[k]];
+					entry.level = (uint8_t)level;
+					entry.rank = k == nChildren - 1 ? lastChild : (uint8_t)k;
+
+					if (stackSize < FCPW_MBVH_SHORT_STACK_SIZE) stackSize++;
+					else stackBegin = (stackBegin + 1)%FCPW_MBVH_SHORT_STACK_SIZE;
 				}
+
+				trail[level] = rank == nChildren - 1 ? lastChild : (uint8_t)rank;
+				nodeIndex = node.child[order[rank]];
+				level++;
+				continue;
 			}
+		}
 
-		} else {
-			// determine closest index
-			int closestIndex = -1;
+		// the subtree rooted at this node is done, find the next one to visit
+		while (true) {
+			if (stackSize > 0) {
+				// pop off the next sibling
+				stackSize--;
+				const StackEntry& entry = stack[(stackBegin + stackSize)%FCPW_MBVH_SHORT_STACK_SIZE];
+				std::fill(trail + entry.level + 1, trail + level + 1, 0);
+				trail[entry.level] = entry.rank;
+				nodeIndex = entry.node;
+				level = entry.level + 1;
+
+				// if this node is further than the closest found primitive, it is done as well
+				if (entry.distance <= pruneDistance()) break;
+
+			} else {
+				// restart from the root after advancing the trail at the deepest level with
+				// siblings left to visit; the traversal is complete if there is no such level
+				int parentLevel = level - 1;
+				while (parentLevel >= 0 && trail[parentLevel] == lastChild) parentLevel--;
+				if (parentLevel < 0) return false;
+
+				std::fill(trail + parentLevel + 1, trail + level + 1, 0);
+				trail[parentLevel]++;
+				nodeIndex = rootIndex;
+				level = 0;
+				break;
+			}
+		}
+	}
+#else
+	BvhTraversal subtree[FCPW_MBVH_MAX_DEPTH];
+	subtree[0].node = rootIndex;
+	subtree[0].distance = minFloat;
+	int stackPtr = 0;
+
+	while (stackPtr >= 0) {
+		// pop off the next node to work on
+		int nodeIndex = subtree[stackPtr].node;
+		float near = subtree[stackPtr].distance;
+		stackPtr--;
+
+		// if this node is further than the closest found primitive, continue
+		if (near > pruneDistance()) continue;
+		const MbvhNode<DIM>& node(nodes[nodeIndex]);
+
+		if (isLeafNode(node)) {
+			if (processLeaf(node, nodeIndex)) return true;
+
+		} else {
+			// enqueue overlapping children in sorted order
+			MaskP<FCPW_MBVH_BRANCHING_FACTOR> mask = overlapChildren(node, tMin);
+			if (enoki::any(mask)) {
+				enqueueNodes(node, tMin, mask, stackPtr, subtree);
+			}
+		}
+	}
+
+	return false;
+#endif
+}
+
+template<size_t WIDTH, size_t DIM, typename PrimitiveType, typename FilterFunc>
+inline int intersectPrimitives(const MbvhNode<DIM>& node,
+							   const MbvhLeafNode<WIDTH, DIM, PrimitiveType> *leafNodes,
+							   int nodeIndex, int aggregateIndex, const enokiVector<DIM>& ro, const enokiVector<DIM>& rd,
+							   float& rtMax, Interaction<DIM>& i, std::vector<Interaction<DIM>>& is,
+							   bool recordAllHits, FilterFunc&& filter, bool& terminated)
+{
+	std::cerr << "intersectPrimitives(): WIDTH: " << WIDTH << ", DIM: " << DIM << " not supported" << std::endl;
+	exit(EXIT_FAILURE);
+
+	return 0;
+}
+
+template<size_t WIDTH, typename FilterFunc>
+inline int intersectPrimitives(const MbvhNode<3>& node,
+							   const MbvhLeafNode<WIDTH, 3, LineSegment> *leafNodes,
+							   int nodeIndex, int aggregateIndex, const enokiVector3& ro, const enokiVector3& rd,
+							   float& rtMax, Interaction<3>& i, std::vector<Interaction<3>>& is,
+							   bool recordAllHits, FilterFunc&& filter, bool& terminated)
+{
+	constexpr bool filterHits = !std::is_same<typename std::decay<FilterFunc>::type, AcceptAllHits>::value;
+	int leafOffset = -node.child[0] - 1;
+	int nLeafs = node.child[1];
+	int referenceOffset = node.child[2];
+	int nReferences = node.child[3];
+	int startReference = 0;
+	int hits = 0;
+
+	for (int l = 0; l < nLeafs; l++) {
+		// perform vectorized intersection query
+		FloatP<WIDTH> d;
+		Vector3P<WIDTH> pt;
+		FloatP<WIDTH> t;
+		int leafIndex = leafOffset + l;
+		const Vector3P<WIDTH>& pa = leafNodes[leafIndex].positions[0];
+		const Vector3P<WIDTH>& pb = leafNodes[leafIndex].positions[1];
+		const IntP<WIDTH>& primitiveIndex = leafNodes[leafIndex].primitiveIndex;
+		MaskP<WIDTH> mask = intersectWideLineSegment<WIDTH>(pa, pb, ro, rd, rtMax, d, pt, t);
+
+		auto setInteraction = [&](Interaction<3>& c, int w) {
+			c.d = d[w];
+			c.p[0] = pt[0][w];
+			c.p[1] = pt[1][w];
+			c.p[2] = pt[2][w];
+			c.uv[0] = t[w];
+			c.uv[1] = -1;
+			c.primitiveIndex = primitiveIndex[w];
+			c.nodeIndex = nodeIndex;
+			c.referenceIndex = referenceOffset + startReference + w;
+			c.objectIndex = aggregateIndex;
+		};
+
+		if (recordAllHits) {
+			// record interactions
+			int endReference = startReference + WIDTH;
+			if (endReference > nReferences) endReference = nReferences;
+
+			for (int p = startReference; p < endReference; p++) {
+				int w = p - startReference;
+
+				if (mask[w]) {
+					hits++;
+					auto it = is.emplace(is.end(), Interaction<3>());
+					setInteraction(*it, w);
+				}
+			}
+
+		} else {
+			// determine closest index, skipping the hits rejected by the filter
+			int closestIndex = -1;
 			int W = std::min((int)WIDTH, nReferences - startReference);
 
 			for (int w = 0; w < W; w++) {
 				if (mask[w] && d[w] <= rtMax) {
+					if (filterHits) {
+						Interaction<3> c;
+						setInteraction(c, w);
+						HitFilterResult result = filter(c);
+						if (result == HitFilterResult::Reject) continue;
+						if (result == HitFilterResult::Terminate) terminated = true;
+					}
+
 					closestIndex = w;
 					rtMax = d[w];
+					if (filterHits && terminated) break;
 				}
 			}
 
 			// update interaction
 			if (closestIndex != -1) {
 				hits = 1;
-				is[0].d = d[closestIndex];
-				is[0].p[0] = pt[0][closestIndex];
-				is[0].p[1] = pt[1][closestIndex];
-				is[0].p[2] = pt[2][closestIndex];
-				is[0].uv[0] = t[closestIndex];
-				is[0].uv[1] = -1;
-				is[0].primitiveIndex = primitiveIndex[closestIndex];
-				is[0].nodeIndex = nodeIndex;
-				is[0].referenceIndex = referenceOffset + startReference + closestIndex;
-				is[0].objectIndex = aggregateIndex;
+				setInteraction(i, closestIndex);
+				if (filterHits && terminated) break;
 			}
 		}
 
@@ -435,12 +1048,14 @@ inline int intersectPrimitives(const MbvhNode<3>& node,
 	return hits;
 }
 
-template<size_t WIDTH>
+template<size_t WIDTH, typename FilterFunc>
 inline int intersectPrimitives(const MbvhNode<3>& node,
-							   const std::vector<MbvhLeafNode<WIDTH, 3, Triangle>>& leafNodes,
+							   const MbvhLeafNode<WIDTH, 3, Triangle> *leafNodes,
 							   int nodeIndex, int aggregateIndex, const enokiVector3& ro, const enokiVector3& rd,
-							   float& rtMax, std::vector<Interaction<3>>& is, bool recordAllHits)
+							   float& rtMax, Interaction<3>& i, std::vector<Interaction<3>>& is,
+							   bool recordAllHits, FilterFunc&& filter, bool& terminated)
 {
+	constexpr bool filterHits = !std::is_same<typename std::decay<FilterFunc>::type, AcceptAllHits>::value;
 	int leafOffset = -node.child[0] - 1;
 	int nLeafs = node.child[1];
 	int referenceOffset = node.child[2];
@@ -460,6 +1075,19 @@ inline int intersectPrimitives(const MbvhNode<3>& node,
 		const IntP<WIDTH>& primitiveIndex = leafNodes[leafIndex].primitiveIndex;
 		MaskP<WIDTH> mask = intersectWideTriangle<WIDTH>(pa, pb, pc, ro, rd, rtMax, d, pt, t);
 
+		auto setInteraction = [&](Interaction<3>& c, int w) {
+			c.d = d[w];
+			c.p[0] = pt[0][w];
+			c.p[1] = pt[1][w];
+			c.p[2] = pt[2][w];
+			c.uv[0] = t[0][w];
+			c.uv[1] = t[1][w];
+			c.primitiveIndex = primitiveIndex[w];
+			c.nodeIndex = nodeIndex;
+			c.referenceIndex = referenceOffset + startReference + w;
+			c.objectIndex = aggregateIndex;
+		};
+
 		if (recordAllHits) {
 			// record interactions
 			int endReference = startReference + WIDTH;
@@ -471,44 +1099,36 @@ inline int intersectPrimitives(const MbvhNode<3>& node,
 				if (mask[w]) {
 					hits++;
 					auto it = is.emplace(is.end(), Interaction<3>());
-					it->d = d[w];
-					it->p[0] = pt[0][w];
-					it->p[1] = pt[1][w];
-					it->p[2] = pt[2][w];
-					it->uv[0] = t[0][w];
-					it->uv[1] = t[1][w];
-					it->primitiveIndex = primitiveIndex[w];
-					it->nodeIndex = nodeIndex;
-					it->referenceIndex = referenceOffset + p;
-					it->objectIndex = aggregateIndex;
+					setInteraction(*it, w);
 				}
 			}
 
 		} else {
-			// determine closest index
+			// determine closest index, skipping the hits rejected by the filter
 			int closestIndex = -1;
 			int W = std::min((int)WIDTH, nReferences - startReference);
 
 			for (int w = 0; w < W; w++) {
 				if (mask[w] && d[w] <= rtMax) {
+					if (filterHits) {
+						Interaction<3> c;
+						setInteraction(c, w);
+						HitFilterResult result = filter(c);
+						if (result == HitFilterResult::Reject) continue;
+						if (result == HitFilterResult::Terminate) terminated = true;
+					}
+
 					closestIndex = w;
 					rtMax = d[w];
+					if (filterHits && terminated) break;
 				}
 			}
 
 			// update interaction
 			if (closestIndex != -1) {
 				hits = 1;
-				is[0].d = d[closestIndex];
-				is[0].p[0] = pt[0][closestIndex];
-				is[0].p[1] = pt[1][closestIndex];
-				is[0].p[2] = pt[2][closestIndex];
-				is[0].uv[0] = t[0][closestIndex];
-				is[0].uv[1] = t[1][closestIndex];
-				is[0].primitiveIndex = primitiveIndex[closestIndex];
-				is[0].nodeIndex = nodeIndex;
-				is[0].referenceIndex = referenceOffset + startReference + closestIndex;
-				is[0].objectIndex = aggregateIndex;
+				setInteraction(i, closestIndex);
+				if (filterHits && terminated) break;
 			}
 		}
 
@@ -518,60 +1138,188 @@ inline int intersectPrimitives(const MbvhNode<3>& node,
 	return hits;
 }
 
-template<size_t WIDTH, size_t DIM, typename PrimitiveType>
-inline int Mbvh<WIDTH, DIM, PrimitiveType>::intersectFromNode(Ray<DIM>& r, std::vector<Interaction<DIM>>& is,
-															  int nodeStartIndex, int aggregateIndex, int& nodesVisited,
-															  bool checkForOcclusion, bool recordAllHits) const
+template<size_t WIDTH, typename FilterFunc>
+inline int intersectPrimitives(const MbvhNode<3>& node,
+							   const MbvhLeafNode<WIDTH, 3, GeometricPrimitive<3>> *leafNodes,
+							   int nodeIndex, int aggregateIndex, const enokiVector3& ro, const enokiVector3& rd,
+							   float& rtMax, Interaction<3>& i, std::vector<Interaction<3>>& is,
+							   bool recordAllHits, FilterFunc&& filter, bool& terminated)
 {
+	constexpr bool filterHits = !std::is_same<typename std::decay<FilterFunc>::type, AcceptAllHits>::value;
+	int leafOffset = -node.child[0] - 1;
+	int nLeafs = node.child[1];
 	int hits = 0;
-	if (!recordAllHits) is.resize(1);
-	BvhTraversal subtree[FCPW_MBVH_MAX_DEPTH];
-	FloatP<FCPW_MBVH_BRANCHING_FACTOR> tMin, tMax;
+
+	for (int l = 0; l < nLeafs; l++) {
+		// perform vectorized intersection query to the line segments or triangles in the leaf node
+		FloatP<WIDTH> d;
+		Vector3P<WIDTH> pt;
+		Vector2P<WIDTH> t;
+		const MbvhLeafNode<WIDTH, 3, GeometricPrimitive<3>>& leafNode = leafNodes[leafOffset + l];
+		bool isTriangleLeaf = leafNode.type == ObjectType::Triangles;
+		MaskP<WIDTH> mask = isTriangleLeaf ?
+			intersectWideTriangle<WIDTH>(leafNode.positions[0], leafNode.positions[1], leafNode.positions[2],
+										 ro, rd, rtMax, d, pt, t) :
+			intersectWideLineSegment<WIDTH>(leafNode.positions[0], leafNode.positions[1],
+											ro, rd, rtMax, d, pt, t[0]);
+
+		auto setInteraction = [&](Interaction<3>& c, int w) {
+			c.d = d[w];
+			c.p[0] = pt[0][w];
+			c.p[1] = pt[1][w];
+			c.p[2] = pt[2][w];
+			c.uv[0] = t[0][w];
+			c.uv[1] = isTriangleLeaf ? t[1][w] : -1;
+			c.primitiveIndex = leafNode.primitiveIndex[w];
+			c.nodeIndex = nodeIndex;
+			c.referenceIndex = leafNode.referenceIndex[w];
+			c.objectIndex = aggregateIndex;
+		};
+
+		if (recordAllHits) {
+			// record interactions
+			for (int w = 0; w < leafNode.nReferences; w++) {
+				if (mask[w]) {
+					hits++;
+					auto it = is.emplace(is.end(), Interaction<3>());
+					setInteraction(*it, w);
+				}
+			}
+
+		} else {
+			// determine closest index, skipping the hits rejected by the filter
+			int closestIndex = -1;
+
+			for (int w = 0; w < leafNode.nReferences; w++) {
+				if (mask[w] && d[w] <= rtMax) {
+					if (filterHits) {
+						Interaction<3> c;
+						setInteraction(c, w);
+						HitFilterResult result = filter(c);
+						if (result == HitFilterResult::Reject) continue;
+						if (result == HitFilterResult::Terminate) terminated = true;
+					}
+
+					closestIndex = w;
+					rtMax = d[w];
+					if (filterHits && terminated) break;
+				}
+			}
+
+			// update interaction
+			if (closestIndex != -1) {
+				hits = 1;
+				setInteraction(i, closestIndex);
+				if (filterHits && terminated) break;
+			}
+		}
+	}
+
+	return hits;
+}
+
+template<size_t WIDTH, size_t DIM, typename PrimitiveType>
+inline MaskP<WIDTH> intersectLeafNodeBoxes(const MbvhLeafNode<WIDTH, DIM, PrimitiveType>& leafNode,
+										   const enokiVector<DIM>& ro, const enokiVector<DIM>& rinvD,
+										   float rtMax, FloatP<WIDTH>& tMin)
+{
+	std::cerr << "intersectLeafNodeBoxes(): WIDTH: " << WIDTH << ", DIM: " << DIM << " not supported" << std::endl;
+	exit(EXIT_FAILURE);
+
+	return MaskP<WIDTH>(false);
+}
+
+template<size_t WIDTH, size_t DIM>
+inline MaskP<WIDTH> intersectLeafNodeBoxes(const MbvhLeafNode<WIDTH, DIM, Aggregate<DIM>>& leafNode,
+										   const enokiVector<DIM>& ro, const enokiVector<DIM>& rinvD,
+										   float rtMax, FloatP<WIDTH>& tMin)
+{
+	FloatP<WIDTH> tMax;
+	return intersectWideBox<WIDTH, DIM>(leafNode.boxMin, leafNode.boxMax, ro, rinvD, rtMax, tMin, tMax);
+}
+
+template<size_t WIDTH, size_t DIM, typename PrimitiveType>
+template<typename FilterFunc>
+inline bool Mbvh<WIDTH, DIM, PrimitiveType>::processSubtreeForIntersection(Ray<DIM>& r, Interaction<DIM>& i,
+																		   std::vector<Interaction<DIM>>& is,
+																		   FilterFunc&& filter, int nodeStartIndex,
+																		   int aggregateIndex, bool checkForOcclusion,
+																		   bool recordAllHits, int rootIndex, int& hits,
+																		   int& nodesVisited) const
+{
+	// nested aggregates filter their own hits, and report whether the filter terminated the query
+	constexpr bool filterHits = !std::is_same<typename std::decay<FilterFunc>::type, AcceptAllHits>::value;
+	bool terminated = false;
+	auto filterNested = [&](const Interaction<DIM>& c) -> HitFilterResult {
+		HitFilterResult result = filter(c);
+		if (result == HitFilterResult::Terminate) terminated = true;
+
+		return result;
+	};
+
 	enokiVector<DIM> ro = enoki::gather<enokiVector<DIM>>(r.o.data(), range);
 	enokiVector<DIM> rd = enoki::gather<enokiVector<DIM>>(r.d.data(), range);
 	enokiVector<DIM> rinvD = enoki::gather<enokiVector<DIM>>(r.invD.data(), range);
 
-	// push root node
-	int rootIndex = aggregateIndex == this->index ? nodeStartIndex : 0;
-	subtree[0].node = rootIndex;
-	subtree[0].distance = minFloat;
-	int stackPtr = 0;
+	auto intersectChildren = [&](const MbvhNode<DIM>& node, FloatP<FCPW_MBVH_BRANCHING_FACTOR>& tMin) {
+		// intersect ray with boxes
+		FloatP<FCPW_MBVH_BRANCHING_FACTOR> tMax;
+		MaskP<FCPW_MBVH_BRANCHING_FACTOR> mask = intersectWideBox<FCPW_MBVH_BRANCHING_FACTOR, DIM>(
+#ifdef FCPW_USE_QUANTIZED_MBVH_NODES
+													node.boxOrigin, node.boxScale, node.qBoxMin, node.qBoxMax,
+#else
+													node.boxMin, node.boxMax,
+#endif
+													ro, rinvD, r.tMax, tMin, tMax);
+		nodesVisited++;
+
+		return mask & enoki::neq(node.child, maxInt);
+	};
+
+	auto processLeaf = [&](const MbvhNode<DIM>& node, int nodeIndex) -> bool {
+		if (vectorizedLeaves) {
+			// perform vectorized intersection query
+			hits += intersectPrimitives(node, leaves, nodeIndex, this->index, ro, rd, r.tMax, i, is,
+										recordAllHits, filter, terminated);
+			nodesVisited++;
 
-	while (stackPtr >= 0) {
-		// pop off the next node to work on
-		int nodeIndex = subtree[stackPtr].node;
-		float near = subtree[stackPtr].distance;
-		stackPtr--;
+			if (hits > 0 && checkForOcclusion) {
+				is.clear();
+				return true;
+			}
 
-		// if this node is further than the closest found intersection, continue
-		if (!recordAllHits && near > r.tMax) continue;
-		const MbvhNode<DIM>& node(flatTree[nodeIndex]);
+			if (filterHits && terminated) return true;
 
-		if (isLeafNode(node)) {
-			if (vectorizedLeafType == ObjectType::LineSegments ||
-				vectorizedLeafType == ObjectType::Triangles) {
-				// perform vectorized intersection query
-				hits += intersectPrimitives(node, leafNodes, nodeIndex, this->index, ro, rd, r.tMax, is, recordAllHits);
-				nodesVisited++;
+		} else {
+			// primitive type does not support vectorized intersection query,
+			// perform query to each primitive one by one
+			int leafOffset = -node.child[0] - 1;
+			int referenceOffset = node.child[2];
+			int nReferences = node.child[3];
+			MaskP<WIDTH> mask;
+			FloatP<WIDTH> tMin;
+
+			for (int p = 0; p < nReferences; p++) {
+				int w = p%WIDTH;
+				if (aggregateLeaves) {
+					// intersect ray with the bounding boxes of the next WIDTH aggregates,
+					// and skip the aggregates that are missed or further than the closest hit
+					if (w == 0) {
+						mask = intersectLeafNodeBoxes(leaves[leafOffset + p/WIDTH], ro, rinvD, r.tMax, tMin);
+						nodesVisited++;
+					}
 
-				if (hits > 0 && checkForOcclusion) {
-					is.clear();
-					return 1;
+					if (!mask[w] || (!recordAllHits && tMin[w] > r.tMax)) continue;
 				}
 
-			} else {
-				// primitive type does not support vectorized intersection query,
-				// perform query to each primitive one by one
-				int referenceOffset = node.child[2];
-				int nReferences = node.child[3];
-
-				for (int p = 0; p < nReferences; p++) {
-					int referenceIndex = referenceOffset + p;
-					const PrimitiveType *prim = primitives[referenceIndex];
-					nodesVisited++;
+				int referenceIndex = referenceOffset + p;
+				const PrimitiveType *prim = primitives[referenceIndex];
+				nodesVisited++;
 
+				if (recordAllHits) {
 					int hit = 0;
-					std::vector<Interaction<DIM>> cs;
+					QueryBuffer<DIM> buffer;
+					std::vector<Interaction<DIM>>& cs = buffer.interactions;
 					if (primitiveTypeIsAggregate) {
 						const Aggregate<DIM> *aggregate = reinterpret_cast<const Aggregate<DIM> *>(prim);
 						hit = aggregate->intersectFromNode(r, cs, nodeStartIndex, aggregateIndex,
@@ -579,62 +1327,108 @@ inline int Mbvh<WIDTH, DIM, PrimitiveType>::intersectFromNode(Ray<DIM>& r, std::
 
 					} else {
 						hit = prim->intersect(r, cs, checkForOcclusion, recordAllHits);
-						for (int i = 0; i < (int)cs.size(); i++) {
-							cs[i].nodeIndex = nodeIndex;
-							cs[i].referenceIndex = referenceIndex;
-							cs[i].objectIndex = this->index;
+						for (int j = 0; j < (int)cs.size(); j++) {
+							cs[j].nodeIndex = nodeIndex;
+							cs[j].referenceIndex = referenceIndex;
+							cs[j].objectIndex = this->index;
 						}
 					}
 
-					// keep the closest intersection only
+					// record all intersections
 					if (hit > 0) {
 						if (checkForOcclusion) {
 							is.clear();
-							return 1;
+							return true;
 						}
 
 						hits += hit;
-						if (recordAllHits) {
-							is.insert(is.end(), cs.begin(), cs.end());
+						is.insert(is.end(), cs.begin(), cs.end());
+					}
+
+				} else {
+					bool hit = false;
+					Interaction<DIM> c;
+					HitFilterResult result = HitFilterResult::Accept;
+					if (primitiveTypeIsAggregate) {
+						const Aggregate<DIM> *aggregate = reinterpret_cast<const Aggregate<DIM> *>(prim);
+						if (filterHits) {
+							// the type erased filter wraps a reference to the lambda, which avoids allocating
+							hit = aggregate->intersectFromNode(r, c, HitFilter<DIM>(std::ref(filterNested)),
+															   nodeStartIndex, aggregateIndex,
+															   nodesVisited, checkForOcclusion);
+							if (terminated) result = HitFilterResult::Terminate;
 
 						} else {
-							r.tMax = std::min(r.tMax, cs[0].d);
-							is[0] = cs[0];
+							hit = aggregate->intersectFromNode(r, c, nodeStartIndex, aggregateIndex,
+															   nodesVisited, checkForOcclusion);
 						}
+
+					} else {
+						// the filter requires a complete interaction, even for occlusion queries; call through
+						// the base class, since primitives that only override the vector version of intersect
+						// hide this overload
+						const Primitive<DIM> *primitive = prim;
+						hit = primitive->intersect(r, c, checkForOcclusion && !filterHits);
+						c.nodeIndex = nodeIndex;
+						c.referenceIndex = referenceIndex;
+						c.objectIndex = this->index;
+						if (filterHits && hit) result = filter(c);
 					}
-				}
-			}
 
-		} else {
-			// intersect ray with boxes
-			MaskP<FCPW_MBVH_BRANCHING_FACTOR> mask = intersectWideBox<FCPW_MBVH_BRANCHING_FACTOR, DIM>(
-														node.boxMin, node.boxMax, ro, rinvD, r.tMax, tMin, tMax);
+					// keep the closest intersection only
+					if (hit && result != HitFilterResult::Reject) {
+						if (checkForOcclusion) return true;
 
-			// enqueue intersecting boxes in sorted order
-			nodesVisited++;
-			mask &= enoki::neq(node.child, maxInt);
-			if (enoki::any(mask)) {
-				float t = 0.0f;
-				enqueueNodes(node, tMin, tMax, mask, r.tMax, t, stackPtr, subtree);
+						hits++;
+						r.tMax = std::min(r.tMax, c.d);
+						i = c;
+						if (result == HitFilterResult::Terminate) return true;
+					}
+				}
 			}
 		}
+
+		return false;
+	};
+
+	// if a node is further than the closest found intersection, it is skipped
+	return traverse(rootIndex, intersectChildren, processLeaf, [&]() {
+		return recordAllHits ? maxFloat : r.tMax;
+	});
+}
+
+template<size_t WIDTH, size_t DIM, typename PrimitiveType>
+inline int Mbvh<WIDTH, DIM, PrimitiveType>::intersectFromNode(Ray<DIM>& r, std::vector<Interaction<DIM>>& is,
+															  int nodeStartIndex, int aggregateIndex, int& nodesVisited,
+															  bool checkForOcclusion, bool recordAllHits) const
+{
+	if (!recordAllHits) {
+		// find the closest intersection without allocating
+		is.resize(1);
+		bool hit = intersectFromNode(r, is[0], nodeStartIndex, aggregateIndex,
+									 nodesVisited, checkForOcclusion);
+		if (hit && checkForOcclusion) is.clear();
+
+		return hit ? 1 : 0;
 	}
 
+	int hits = 0;
+	Interaction<DIM> c; // unused since all hits are recorded
+	int rootIndex = aggregateIndex == this->index ? nodeStartIndex : 0;
+	bool occluded = processSubtreeForIntersection(r, c, is, AcceptAllHits(), nodeStartIndex, aggregateIndex,
+												  checkForOcclusion, recordAllHits, rootIndex, hits, nodesVisited);
+	if (occluded) return 1;
+
 	if (hits > 0) {
 		// sort by distance and remove duplicates
-		if (recordAllHits) {
-			std::sort(is.begin(), is.end(), compareInteractions<DIM>);
-			is = removeDuplicates<DIM>(is);
-			hits = (int)is.size();
-
-		} else {
-			hits = 1;
-		}
+		std::sort(is.begin(), is.end(), compareInteractions<DIM>);
+		removeDuplicates<DIM>(is);
+		hits = (int)is.size();
 
 		// compute normals
 		if (this->computeNormals && !primitiveTypeIsAggregate) {
 			for (int i = 0; i < (int)is.size(); i++) {
-				is[i].computeNormal(primitives[is[i].referenceIndex]);
+				computePrimitiveNormal(is[i]);
 			}
 		}
 
@@ -645,55 +1439,224 @@ inline int Mbvh<WIDTH, DIM, PrimitiveType>::intersectFromNode(Ray<DIM>& r, std::
 }
 
 template<size_t WIDTH, size_t DIM, typename PrimitiveType>
-inline bool findClosestPointPrimitives(const MbvhNode<DIM>& node,
-									   const std::vector<MbvhLeafNode<WIDTH, DIM, PrimitiveType>>& leafNodes,
-									   int nodeIndex, int aggregateIndex, const enokiVector<DIM>& sc, float& sr2,
-									   Interaction<DIM>& i)
+inline bool Mbvh<WIDTH, DIM, PrimitiveType>::intersectFromNode(Ray<DIM>& r, Interaction<DIM>& i,
+															   int nodeStartIndex, int aggregateIndex,
+															   int& nodesVisited, bool checkForOcclusion) const
 {
-	std::cerr << "findClosestPointPrimitives(): WIDTH: " << WIDTH << ", DIM: " << DIM << " not supported" << std::endl;
-	exit(EXIT_FAILURE);
+	return intersectFromNodeWithFilter(r, i, AcceptAllHits(), nodeStartIndex, aggregateIndex,
+									   nodesVisited, checkForOcclusion);
+}
+
+template<size_t WIDTH, size_t DIM, typename PrimitiveType>
+inline bool Mbvh<WIDTH, DIM, PrimitiveType>::intersectFromNode(Ray<DIM>& r, Interaction<DIM>& i,
+															   const HitFilter<DIM>& filter,
+															   int nodeStartIndex, int aggregateIndex,
+															   int& nodesVisited, bool checkForOcclusion) const
+{
+	return intersectFromNodeWithFilter(r, i, filter, nodeStartIndex, aggregateIndex,
+									   nodesVisited, checkForOcclusion);
+}
+
+template<size_t WIDTH, size_t DIM, typename PrimitiveType>
+template<typename FilterFunc>
+inline bool Mbvh<WIDTH, DIM, PrimitiveType>::intersectFromNodeWithFilter(Ray<DIM>& r, Interaction<DIM>& i,
+																		 FilterFunc&& filter, int nodeStartIndex,
+																		 int aggregateIndex, int& nodesVisited,
+																		 bool checkForOcclusion) const
+{
+	int hits = 0;
+	std::vector<Interaction<DIM>> is; // remains empty since all hits are not recorded
+	int rootIndex = aggregateIndex == this->index ? nodeStartIndex : 0;
+	bool terminated = processSubtreeForIntersection(r, i, is, filter, nodeStartIndex, aggregateIndex,
+													checkForOcclusion, false, rootIndex, hits, nodesVisited);
+	if (terminated && checkForOcclusion) return true;
+
+	if (hits > 0) {
+		// compute normal
+		if (this->computeNormals && !primitiveTypeIsAggregate) {
+			computePrimitiveNormal(i);
+		}
+
+		return true;
+	}
 
 	return false;
 }
 
-template<size_t WIDTH>
-inline bool findClosestPointPrimitives(const MbvhNode<3>& node,
-									   const std::vector<MbvhLeafNode<WIDTH, 3, LineSegment>>& leafNodes,
-									   int nodeIndex, int aggregateIndex, const enokiVector3& sc, float& sr2,
-									   Interaction<3>& i)
+template<size_t WIDTH, size_t DIM, typename PrimitiveType>
+inline uint32_t Mbvh<WIDTH, DIM, PrimitiveType>::intersectPacket(Ray<DIM> *rays, Interaction<DIM> *is, int nRays,
+																 int& nodesVisited, bool checkForOcclusion) const
 {
-	int leafOffset = -node.child[0] - 1;
-	int nLeafs = node.child[1];
-	int referenceOffset = node.child[2];
-	int nReferences = node.child[3];
-	int startReference = 0;
-	bool found = false;
+	static_assert(FCPW_MBVH_PACKET_SIZE <= 32, "FCPW_MBVH_PACKET_SIZE must be at most 32");
+
+	// the stack entries record the rays of the packet that overlap each node,
+	// along with the closest distance to the node over these rays
+	struct PacketTraversal {
+		int node;
+		float distance;
+		uint32_t rayMask;
+	};
+
+	enokiVector<DIM> ro[FCPW_MBVH_PACKET_SIZE], rinvD[FCPW_MBVH_PACKET_SIZE];
+	for (int j = 0; j < nRays; j++) {
+		ro[j] = enoki::gather<enokiVector<DIM>>(rays[j].o.data(), range);
+		rinvD[j] = enoki::gather<enokiVector<DIM>>(rays[j].invD.data(), range);
+	}
 
-	for (int l = 0; l < nLeafs; l++) {
-		// perform vectorized closest point query
-		Vector3P<WIDTH> pt;
-		FloatP<WIDTH> t;
-		int leafIndex = leafOffset + l;
-		const Vector3P<WIDTH>& pa = leafNodes[leafIndex].positions[0];
-		const Vector3P<WIDTH>& pb = leafNodes[leafIndex].positions[1];
-		const IntP<WIDTH>& primitiveIndex = leafNodes[leafIndex].primitiveIndex;
-		FloatP<WIDTH> d = findClosestPointWideLineSegment<WIDTH>(pa, pb, sc, pt, t);
-		FloatP<WIDTH> d2 = d*d;
+	uint32_t activeMask = nRays == 32 ? 0xffffffffu : (1u << nRays) - 1u;
+	uint32_t hitMask = 0;
+	std::vector<Interaction<DIM>> cs; // remains empty since all hits are not recorded
 
-		// determine closest index
-		int closestIndex = -1;
-		int W = std::min((int)WIDTH, nReferences - startReference);
+	auto intersectSubtree = [&](int j, int rootIndex) {
+		int hits = 0;
+		bool occluded = processSubtreeForIntersection(rays[j], is[j], cs, AcceptAllHits(), 0, this->index,
+													  checkForOcclusion, false, rootIndex, hits, nodesVisited);
+		if (occluded || hits > 0) hitMask |= 1u << j;
+		if (occluded) activeMask &= ~(1u << j);
+	};
 
-		for (int w = 0; w < W; w++) {
-			if (d2[w] <= sr2) {
-				closestIndex = w;
-				sr2 = d2[w];
-			}
-		}
+	PacketTraversal subtree[FCPW_MBVH_MAX_DEPTH];
+	subtree[0].node = 0;
+	subtree[0].distance = minFloat;
+	subtree[0].rayMask = activeMask;
+	int stackPtr = 0;
 
-		// update interaction
-		if (closestIndex != -1) {
-			i.d = d[closestIndex];
+	while (stackPtr >= 0) {
+		// pop off the next node to work on, along with its rays that have not been terminated
+		int nodeIndex = subtree[stackPtr].node;
+		float near = subtree[stackPtr].distance;
+		uint32_t rayMask = subtree[stackPtr].rayMask & activeMask;
+		stackPtr--;
+
+		// drop the rays whose closest found intersection is closer than the node
+		for (int j = 0; j < nRays; j++) {
+			if (((rayMask >> j) & 1u) && near > rays[j].tMax) rayMask &= ~(1u << j);
+		}
+
+		if (rayMask == 0) continue;
+		const MbvhNode<DIM>& node(nodes[nodeIndex]);
+
+		if (isLeafNode(node) || (rayMask & (rayMask - 1u)) == 0) {
+			// intersect each ray with the primitives in the leaf, or traverse the subtree with a
+			// single ray traversal once the packet has diverged to one ray
+			for (int j = 0; j < nRays; j++) {
+				if ((rayMask >> j) & 1u) intersectSubtree(j, nodeIndex);
+			}
+
+			continue;
+		}
+
+		// intersect the rays with the child boxes, fetching the node once for all of them
+		float childDistance[FCPW_MBVH_BRANCHING_FACTOR];
+		uint32_t childRayMask[FCPW_MBVH_BRANCHING_FACTOR];
+		std::fill(childDistance, childDistance + FCPW_MBVH_BRANCHING_FACTOR, maxFloat);
+		std::fill(childRayMask, childRayMask + FCPW_MBVH_BRANCHING_FACTOR, 0u);
+		nodesVisited++;
+
+		for (int j = 0; j < nRays; j++) {
+			if (((rayMask >> j) & 1u) == 0) continue;
+
+			FloatP<FCPW_MBVH_BRANCHING_FACTOR> tMin, tMax;
+			MaskP<FCPW_MBVH_BRANCHING_FACTOR> mask = intersectWideBox<FCPW_MBVH_BRANCHING_FACTOR, DIM>(
+#ifdef FCPW_USE_QUANTIZED_MBVH_NODES
+														node.boxOrigin, node.boxScale, node.qBoxMin, node.qBoxMax,
+#else
+														node.boxMin, node.boxMax,
+#endif
+														ro[j], rinvD[j], rays[j].tMax, tMin, tMax);
+			mask &= enoki::neq(node.child, maxInt);
+
+			for (int w = 0; w < FCPW_MBVH_BRANCHING_FACTOR; w++) {
+				if (mask[w]) {
+					childRayMask[w] |= 1u << j;
+					childDistance[w] = std::min(childDistance[w], (float)tMin[w]);
+				}
+			}
+		}
+
+		// sort the overlapped children by distance, and push the furthest first
+		int order[FCPW_MBVH_BRANCHING_FACTOR];
+		int nChildren = 0;
+		for (int w = 0; w < FCPW_MBVH_BRANCHING_FACTOR; w++) {
+			if (childRayMask[w] == 0) continue;
+
+			int k = nChildren++;
+			while (k > 0 && childDistance[order[k - 1]] < childDistance[w]) {
+				order[k] = order[k - 1];
+				k--;
+			}
+
+			order[k] = w;
+		}
+
+		for (int k = 0; k < nChildren; k++) {
+			stackPtr++;
+			subtree[stackPtr].node = node.child[order[k]];
+			subtree[stackPtr].distance = childDistance[order[k]];
+			subtree[stackPtr].rayMask = childRayMask[order[k]];
+		}
+	}
+
+	if (this->computeNormals && !primitiveTypeIsAggregate && !checkForOcclusion) {
+		// compute normals
+		for (int j = 0; j < nRays; j++) {
+			if ((hitMask >> j) & 1u) computePrimitiveNormal(is[j]);
+		}
+	}
+
+	return hitMask;
+}
+
+template<size_t WIDTH, size_t DIM, typename PrimitiveType>
+inline bool findClosestPointPrimitives(const MbvhNode<DIM>& node,
+									   const MbvhLeafNode<WIDTH, DIM, PrimitiveType> *leafNodes,
+									   int nodeIndex, int aggregateIndex, const enokiVector<DIM>& sc, float& sr2,
+									   Interaction<DIM>& i)
+{
+	std::cerr << "findClosestPointPrimitives(): WIDTH: " << WIDTH << ", DIM: " << DIM << " not supported" << std::endl;
+	exit(EXIT_FAILURE);
+
+	return false;
+}
+
+template<size_t WIDTH>
+inline bool findClosestPointPrimitives(const MbvhNode<3>& node,
+									   const MbvhLeafNode<WIDTH, 3, LineSegment> *leafNodes,
+									   int nodeIndex, int aggregateIndex, const enokiVector3& sc, float& sr2,
+									   Interaction<3>& i)
+{
+	int leafOffset = -node.child[0] - 1;
+	int nLeafs = node.child[1];
+	int referenceOffset = node.child[2];
+	int nReferences = node.child[3];
+	int startReference = 0;
+	bool found = false;
+
+	for (int l = 0; l < nLeafs; l++) {
+		// perform vectorized closest point query
+		Vector3P<WIDTH> pt;
+		FloatP<WIDTH> t;
+		int leafIndex = leafOffset + l;
+		const Vector3P<WIDTH>& pa = leafNodes[leafIndex].positions[0];
+		const Vector3P<WIDTH>& pb = leafNodes[leafIndex].positions[1];
+		const IntP<WIDTH>& primitiveIndex = leafNodes[leafIndex].primitiveIndex;
+		FloatP<WIDTH> d = findClosestPointWideLineSegment<WIDTH>(pa, pb, sc, pt, t);
+		FloatP<WIDTH> d2 = d*d;
+
+		// determine closest index
+		int closestIndex = -1;
+		int W = std::min((int)WIDTH, nReferences - startReference);
+
+		for (int w = 0; w < W; w++) {
+			if (d2[w] <= sr2) {
+				closestIndex = w;
+				sr2 = d2[w];
+			}
+		}
+
+		// update interaction
+		if (closestIndex != -1) {
+			i.d = d[closestIndex];
 			i.p[0] = pt[0][closestIndex];
 			i.p[1] = pt[1][closestIndex];
 			i.p[2] = pt[2][closestIndex];
@@ -714,7 +1677,7 @@ inline bool findClosestPointPrimitives(const MbvhNode<3>& node,
 
 template<size_t WIDTH>
 inline bool findClosestPointPrimitives(const MbvhNode<3>& node,
-									   const std::vector<MbvhLeafNode<WIDTH, 3, Triangle>>& leafNodes,
+									   const MbvhLeafNode<WIDTH, 3, Triangle> *leafNodes,
 									   int nodeIndex, int aggregateIndex, const enokiVector3& sc, float& sr2,
 									   Interaction<3>& i)
 {
@@ -769,93 +1732,440 @@ inline bool findClosestPointPrimitives(const MbvhNode<3>& node,
 	return found;
 }
 
+template<size_t WIDTH>
+inline bool findClosestPointPrimitives(const MbvhNode<3>& node,
+									   const MbvhLeafNode<WIDTH, 3, GeometricPrimitive<3>> *leafNodes,
+									   int nodeIndex, int aggregateIndex, const enokiVector3& sc, float& sr2,
+									   Interaction<3>& i)
+{
+	int leafOffset = -node.child[0] - 1;
+	int nLeafs = node.child[1];
+	bool found = false;
+
+	for (int l = 0; l < nLeafs; l++) {
+		// perform vectorized closest point query to the line segments or triangles in the leaf node
+		Vector3P<WIDTH> pt;
+		Vector2P<WIDTH> t;
+		const MbvhLeafNode<WIDTH, 3, GeometricPrimitive<3>>& leafNode = leafNodes[leafOffset + l];
+		bool isTriangleLeaf = leafNode.type == ObjectType::Triangles;
+		FloatP<WIDTH> d = isTriangleLeaf ?
+			findClosestPointWideTriangle<WIDTH>(leafNode.positions[0], leafNode.positions[1],
+												leafNode.positions[2], sc, pt, t) :
+			findClosestPointWideLineSegment<WIDTH>(leafNode.positions[0], leafNode.positions[1],
+												   sc, pt, t[0]);
+		FloatP<WIDTH> d2 = d*d;
+
+		// determine closest index
+		int closestIndex = -1;
+
+		for (int w = 0; w < leafNode.nReferences; w++) {
+			if (d2[w] <= sr2) {
+				closestIndex = w;
+				sr2 = d2[w];
+			}
+		}
+
+		// update interaction
+		if (closestIndex != -1) {
+			i.d = d[closestIndex];
+			i.p[0] = pt[0][closestIndex];
+			i.p[1] = pt[1][closestIndex];
+			i.p[2] = pt[2][closestIndex];
+			i.uv[0] = t[0][closestIndex];
+			i.uv[1] = isTriangleLeaf ? t[1][closestIndex] : -1;
+			i.primitiveIndex = leafNode.primitiveIndex[closestIndex];
+			i.nodeIndex = nodeIndex;
+			i.referenceIndex = leafNode.referenceIndex[closestIndex];
+			i.objectIndex = aggregateIndex;
+			found = true;
+		}
+	}
+
+	return found;
+}
+
+template<size_t WIDTH, size_t DIM, typename PrimitiveType, typename AddFunc>
+inline bool findKClosestPointsPrimitives(const MbvhNode<DIM>& node,
+										 const MbvhLeafNode<WIDTH, DIM, PrimitiveType> *leafNodes,
+										 int nodeIndex, int aggregateIndex, const enokiVector<DIM>& sc,
+										 const float& sr2, AddFunc&& addInteraction)
+{
+	std::cerr << "findKClosestPointsPrimitives(): WIDTH: " << WIDTH << ", DIM: " << DIM << " not supported" << std::endl;
+	exit(EXIT_FAILURE);
+
+	return false;
+}
+
+template<size_t WIDTH, typename AddFunc>
+inline bool findKClosestPointsPrimitives(const MbvhNode<3>& node,
+										 const MbvhLeafNode<WIDTH, 3, LineSegment> *leafNodes,
+										 int nodeIndex, int aggregateIndex, const enokiVector3& sc,
+										 const float& sr2, AddFunc&& addInteraction)
+{
+	int leafOffset = -node.child[0] - 1;
+	int nLeafs = node.child[1];
+	int referenceOffset = node.child[2];
+	int nReferences = node.child[3];
+	int startReference = 0;
+	bool found = false;
+
+	for (int l = 0; l < nLeafs; l++) {
+		// perform vectorized closest point query
+		Vector3P<WIDTH> pt;
+		FloatP<WIDTH> t;
+		int leafIndex = leafOffset + l;
+		const Vector3P<WIDTH>& pa = leafNodes[leafIndex].positions[0];
+		const Vector3P<WIDTH>& pb = leafNodes[leafIndex].positions[1];
+		const IntP<WIDTH>& primitiveIndex = leafNodes[leafIndex].primitiveIndex;
+		FloatP<WIDTH> d = findClosestPointWideLineSegment<WIDTH>(pa, pb, sc, pt, t);
+		FloatP<WIDTH> d2 = d*d;
+
+		// add the line segments inside the sphere, which shrinks as the heap fills up
+		int W = std::min((int)WIDTH, nReferences - startReference);
+
+		for (int w = 0; w < W; w++) {
+			if (d2[w] <= sr2) {
+				Interaction<3> c;
+				c.d = d[w];
+				c.p[0] = pt[0][w];
+				c.p[1] = pt[1][w];
+				c.p[2] = pt[2][w];
+				c.uv[0] = t[w];
+				c.uv[1] = -1;
+				c.primitiveIndex = primitiveIndex[w];
+				c.nodeIndex = nodeIndex;
+				c.referenceIndex = referenceOffset + startReference + w;
+				c.objectIndex = aggregateIndex;
+				if (addInteraction(c)) found = true;
+			}
+		}
+
+		startReference += WIDTH;
+	}
+
+	return found;
+}
+
+template<size_t WIDTH, typename AddFunc>
+inline bool findKClosestPointsPrimitives(const MbvhNode<3>& node,
+										 const MbvhLeafNode<WIDTH, 3, Triangle> *leafNodes,
+										 int nodeIndex, int aggregateIndex, const enokiVector3& sc,
+										 const float& sr2, AddFunc&& addInteraction)
+{
+	int leafOffset = -node.child[0] - 1;
+	int nLeafs = node.child[1];
+	int referenceOffset = node.child[2];
+	int nReferences = node.child[3];
+	int startReference = 0;
+	bool found = false;
+
+	for (int l = 0; l < nLeafs; l++) {
+		// perform vectorized closest point query
+		Vector3P<WIDTH> pt;
+		Vector2P<WIDTH> t;
+		int leafIndex = leafOffset + l;
+		const Vector3P<WIDTH>& pa = leafNodes[leafIndex].positions[0];
+		const Vector3P<WIDTH>& pb = leafNodes[leafIndex].positions[1];
+		const Vector3P<WIDTH>& pc = leafNodes[leafIndex].positions[2];
+		const IntP<WIDTH>& primitiveIndex = leafNodes[leafIndex].primitiveIndex;
+		FloatP<WIDTH> d = findClosestPointWideTriangle<WIDTH>(pa, pb, pc, sc, pt, t);
+		FloatP<WIDTH> d2 = d*d;
+
+		// add the triangles inside the sphere, which shrinks as the heap fills up
+		int W = std::min((int)WIDTH, nReferences - startReference);
+
+		for (int w = 0; w < W; w++) {
+			if (d2[w] <= sr2) {
+				Interaction<3> c;
+				c.d = d[w];
+				c.p[0] = pt[0][w];
+				c.p[1] = pt[1][w];
+				c.p[2] = pt[2][w];
+				c.uv[0] = t[0][w];
+				c.uv[1] = t[1][w];
+				c.primitiveIndex = primitiveIndex[w];
+				c.nodeIndex = nodeIndex;
+				c.referenceIndex = referenceOffset + startReference + w;
+				c.objectIndex = aggregateIndex;
+				if (addInteraction(c)) found = true;
+			}
+		}
+
+		startReference += WIDTH;
+	}
+
+	return found;
+}
+
+template<size_t WIDTH, typename AddFunc>
+inline bool findKClosestPointsPrimitives(const MbvhNode<3>& node,
+										 const MbvhLeafNode<WIDTH, 3, GeometricPrimitive<3>> *leafNodes,
+										 int nodeIndex, int aggregateIndex, const enokiVector3& sc,
+										 const float& sr2, AddFunc&& addInteraction)
+{
+	int leafOffset = -node.child[0] - 1;
+	int nLeafs = node.child[1];
+	bool found = false;
+
+	for (int l = 0; l < nLeafs; l++) {
+		// perform vectorized closest point query to the line segments or triangles in the leaf node
+		Vector3P<WIDTH> pt;
+		Vector2P<WIDTH> t;
+		const MbvhLeafNode<WIDTH, 3, GeometricPrimitive<3>>& leafNode = leafNodes[leafOffset + l];
+		bool isTriangleLeaf = leafNode.type == ObjectType::Triangles;
+		FloatP<WIDTH> d = isTriangleLeaf ?
+			findClosestPointWideTriangle<WIDTH>(leafNode.positions[0], leafNode.positions[1],
+												leafNode.positions[2], sc, pt, t) :
+			findClosestPointWideLineSegment<WIDTH>(leafNode.positions[0], leafNode.positions[1],
+												   sc, pt, t[0]);
+		FloatP<WIDTH> d2 = d*d;
+
+		// add the primitives inside the sphere, which shrinks as the heap fills up
+		for (int w = 0; w < leafNode.nReferences; w++) {
+			if (d2[w] <= sr2) {
+				Interaction<3> c;
+				c.d = d[w];
+				c.p[0] = pt[0][w];
+				c.p[1] = pt[1][w];
+				c.p[2] = pt[2][w];
+				c.uv[0] = t[0][w];
+				c.uv[1] = isTriangleLeaf ? t[1][w] : -1;
+				c.primitiveIndex = leafNode.primitiveIndex[w];
+				c.nodeIndex = nodeIndex;
+				c.referenceIndex = leafNode.referenceIndex[w];
+				c.objectIndex = aggregateIndex;
+				if (addInteraction(c)) found = true;
+			}
+		}
+	}
+
+	return found;
+}
+
+template<size_t WIDTH, size_t DIM, typename PrimitiveType>
+inline MaskP<WIDTH> overlapLeafNodeBoxes(const MbvhLeafNode<WIDTH, DIM, PrimitiveType>& leafNode,
+										 const enokiVector<DIM>& sc, float sr2, FloatP<WIDTH>& d2Min)
+{
+	std::cerr << "overlapLeafNodeBoxes(): WIDTH: " << WIDTH << ", DIM: " << DIM << " not supported" << std::endl;
+	exit(EXIT_FAILURE);
+
+	return MaskP<WIDTH>(false);
+}
+
+template<size_t WIDTH, size_t DIM>
+inline MaskP<WIDTH> overlapLeafNodeBoxes(const MbvhLeafNode<WIDTH, DIM, Aggregate<DIM>>& leafNode,
+										 const enokiVector<DIM>& sc, float sr2, FloatP<WIDTH>& d2Min)
+{
+	FloatP<WIDTH> d2Max;
+	return overlapWideBox<WIDTH, DIM>(leafNode.boxMin, leafNode.boxMax, sc, sr2, d2Min, d2Max);
+}
+
+template<size_t WIDTH, size_t DIM, typename PrimitiveType>
+inline bool Mbvh<WIDTH, DIM, PrimitiveType>::findClosestPointInLeaf(const MbvhNode<DIM>& node, int nodeIndex,
+																	BoundingSphere<DIM>& s, const enokiVector<DIM>& sc,
+																	Interaction<DIM>& i, int nodeStartIndex,
+																	int aggregateIndex, const Vector<DIM>& boundaryHint,
+																	int& nodesVisited) const
+{
+	if (vectorizedLeaves) {
+		// perform vectorized closest point query
+		nodesVisited++;
+		return findClosestPointPrimitives(node, leaves, nodeIndex, this->index, sc, s.r2, i);
+	}
+
+	// primitive type does not support vectorized closest point query,
+	// perform query to each primitive one by one
+	int leafOffset = -node.child[0] - 1;
+	int referenceOffset = node.child[2];
+	int nReferences = node.child[3];
+	MaskP<WIDTH> mask;
+	FloatP<WIDTH> d2Min;
+	bool found = false;
+
+	for (int p = 0; p < nReferences; p++) {
+		int w = p%WIDTH;
+		if (aggregateLeaves) {
+			// overlap sphere with the bounding boxes of the next WIDTH aggregates,
+			// and skip the aggregates that are outside the shrinking sphere
+			if (w == 0) {
+				mask = overlapLeafNodeBoxes(leaves[leafOffset + p/WIDTH], sc, s.r2, d2Min);
+				nodesVisited++;
+			}
+
+			if (!mask[w] || d2Min[w] > s.r2) continue;
+		}
+
+		int referenceIndex = referenceOffset + p;
+		const PrimitiveType *prim = primitives[referenceIndex];
+		nodesVisited++;
+
+		bool foundPrimitive = false;
+		Interaction<DIM> c;
+		if (primitiveTypeIsAggregate) {
+			const Aggregate<DIM> *aggregate = reinterpret_cast<const Aggregate<DIM> *>(prim);
+			foundPrimitive = aggregate->findClosestPointFromNode(s, c, nodeStartIndex, aggregateIndex,
+																 boundaryHint, nodesVisited);
+
+		} else {
+			foundPrimitive = prim->findClosestPoint(s, c);
+			c.nodeIndex = nodeIndex;
+			c.referenceIndex = referenceIndex;
+			c.objectIndex = this->index;
+		}
+
+		// keep the closest point only
+		if (foundPrimitive) {
+			found = true;
+			s.r2 = std::min(s.r2, c.d*c.d);
+			i = c;
+		}
+	}
+
+	return found;
+}
+
 template<size_t WIDTH, size_t DIM, typename PrimitiveType>
 inline bool Mbvh<WIDTH, DIM, PrimitiveType>::findClosestPointFromNode(BoundingSphere<DIM>& s, Interaction<DIM>& i,
 																	  int nodeStartIndex, int aggregateIndex,
 																	  const Vector<DIM>& boundaryHint, int& nodesVisited) const
 {
-	// TODO: use direction to boundary guess
 	bool notFound = true;
-	BvhTraversal subtree[FCPW_MBVH_MAX_DEPTH];
-	FloatP<FCPW_MBVH_BRANCHING_FACTOR> d2Min, d2Max;
 	enokiVector<DIM> sc = enoki::gather<enokiVector<DIM>>(s.c.data(), range);
 
-	// push root node
-	int rootIndex = aggregateIndex == this->index ? nodeStartIndex : 0;
-	subtree[0].node = rootIndex;
-	subtree[0].distance = minFloat;
-	int stackPtr = 0;
+	// the boundary hint is only passed on to the aggregates in the leaves, since ordering the
+	// children of wide nodes by it does not reduce the number of nodes visited
+
+	auto overlapChildren = [&](const MbvhNode<DIM>& node, FloatP<FCPW_MBVH_BRANCHING_FACTOR>& d2Min) {
+		// overlap sphere with boxes
+		FloatP<FCPW_MBVH_BRANCHING_FACTOR> d2Max;
+		MaskP<FCPW_MBVH_BRANCHING_FACTOR> mask = overlapWideBox<FCPW_MBVH_BRANCHING_FACTOR, DIM>(
+#ifdef FCPW_USE_QUANTIZED_MBVH_NODES
+													node.boxOrigin, node.boxScale, node.qBoxMin, node.qBoxMax,
+#else
+													node.boxMin, node.boxMax,
+#endif
+													sc, s.r2, d2Min, d2Max);
+		nodesVisited++;
+		mask &= enoki::neq(node.child, maxInt);
+
+		// shrink the sphere to the furthest distance to the closest overlapping box; boxes clipped
+		// by spatial splits need not contain any point of their primitives, so they don't bound it
+		if (isDuplicateReference.size() == 0) {
+			for (int w = 0; w < FCPW_MBVH_BRANCHING_FACTOR; w++) {
+				if (mask[w]) s.r2 = std::min(s.r2, (float)d2Max[w]);
+			}
+		}
 
-	while (stackPtr >= 0) {
-		// pop off the next node to work on
-		int nodeIndex = subtree[stackPtr].node;
-		float near = subtree[stackPtr].distance;
-		stackPtr--;
+		return mask;
+	};
 
-		// if this node is further than the closest found primitive, continue
-		if (near > s.r2) continue;
-		const MbvhNode<DIM>& node(flatTree[nodeIndex]);
+	auto processLeaf = [&](const MbvhNode<DIM>& node, int nodeIndex) -> bool {
+		if (findClosestPointInLeaf(node, nodeIndex, s, sc, i, nodeStartIndex,
+								   aggregateIndex, boundaryHint, nodesVisited)) {
+			notFound = false;
+		}
 
-		if (isLeafNode(node)) {
-			if (vectorizedLeafType == ObjectType::LineSegments ||
-				vectorizedLeafType == ObjectType::Triangles) {
-				// perform vectorized closest point query to triangle
-				bool found = findClosestPointPrimitives(node, leafNodes, nodeIndex, this->index, sc, s.r2, i);
-				if (found) notFound = false;
-				nodesVisited++;
+		return false;
+	};
 
-			} else {
-				// primitive type does not support vectorized closest point query,
-				// perform query to each primitive one by one
-				int referenceOffset = node.child[2];
-				int nReferences = node.child[3];
+	// if a node is further than the closest found primitive, it is skipped
+	int rootIndex = aggregateIndex == this->index ? nodeStartIndex : 0;
+	traverse(rootIndex, overlapChildren, processLeaf, [&]() { return s.r2; });
 
-				for (int p = 0; p < nReferences; p++) {
-					int referenceIndex = referenceOffset + p;
-					const PrimitiveType *prim = primitives[referenceIndex];
-					nodesVisited++;
+	if (!notFound) {
+		// compute normal
+		if (this->computeNormals && !primitiveTypeIsAggregate) {
+			computePrimitiveNormal(i);
+		}
 
-					bool found = false;
-					Interaction<DIM> c;
-					if (primitiveTypeIsAggregate) {
-						const Aggregate<DIM> *aggregate = reinterpret_cast<const Aggregate<DIM> *>(prim);
-						found = aggregate->findClosestPointFromNode(s, c, nodeStartIndex, aggregateIndex,
-																	boundaryHint, nodesVisited);
+		return true;
+	}
 
-					} else {
-						found = prim->findClosestPoint(s, c);
-						c.nodeIndex = nodeIndex;
-						c.referenceIndex = referenceIndex;
-						c.objectIndex = this->index;
-					}
+	return false;
+}
 
-					// keep the closest point only
-					if (found) {
-						notFound = false;
-						s.r2 = std::min(s.r2, c.d*c.d);
-						i = c;
-					}
-				}
+template<size_t WIDTH, size_t DIM, typename PrimitiveType>
+inline bool Mbvh<WIDTH, DIM, PrimitiveType>::findClosestPointBottomUp(BoundingSphere<DIM>& s, Interaction<DIM>& i,
+																	  int nodeStartIndex, int aggregateIndex,
+																	  int& nodesVisited) const
+{
+	// the start node only refers to a node of this aggregate if its index matches
+	if (aggregateIndex != this->index || nodeStartIndex < 0 || nodeStartIndex >= nNodes) {
+		return findClosestPointFromNode(s, i, 0, this->index, Vector<DIM>::Zero(), nodesVisited);
+	}
+
+	bool notFound = true;
+	enokiVector<DIM> sc = enoki::gather<enokiVector<DIM>>(s.c.data(), range);
+
+	auto overlapChildren = [&](const MbvhNode<DIM>& node, FloatP<FCPW_MBVH_BRANCHING_FACTOR>& d2Min) {
+		// overlap sphere with boxes
+		FloatP<FCPW_MBVH_BRANCHING_FACTOR> d2Max;
+		MaskP<FCPW_MBVH_BRANCHING_FACTOR> mask = overlapWideBox<FCPW_MBVH_BRANCHING_FACTOR, DIM>(
+#ifdef FCPW_USE_QUANTIZED_MBVH_NODES
+													node.boxOrigin, node.boxScale, node.qBoxMin, node.qBoxMax,
+#else
+													node.boxMin, node.boxMax,
+#endif
+													sc, s.r2, d2Min, d2Max);
+		nodesVisited++;
+		mask &= enoki::neq(node.child, maxInt);
+
+		// shrink the sphere to the furthest distance to the closest overlapping box; boxes clipped
+		// by spatial splits need not contain any point of their primitives, so they don't bound it
+		if (isDuplicateReference.size() == 0) {
+			for (int w = 0; w < FCPW_MBVH_BRANCHING_FACTOR; w++) {
+				if (mask[w]) s.r2 = std::min(s.r2, (float)d2Max[w]);
 			}
+		}
 
-		} else {
-			// overlap sphere with boxes
-			MaskP<FCPW_MBVH_BRANCHING_FACTOR> mask = overlapWideBox<FCPW_MBVH_BRANCHING_FACTOR, DIM>(
-																node.boxMin, node.boxMax, sc, s.r2, d2Min, d2Max);
+		return mask;
+	};
 
-			// enqueue overlapping boxes in sorted order
-			nodesVisited++;
-			mask &= enoki::neq(node.child, maxInt);
-			if (enoki::any(mask)) {
-				enqueueNodes(node, d2Min, d2Max, mask, s.r2, s.r2, stackPtr, subtree);
+	auto processLeaf = [&](const MbvhNode<DIM>& node, int nodeIndex) -> bool {
+		if (findClosestPointInLeaf(node, nodeIndex, s, sc, i, nodeStartIndex,
+								   aggregateIndex, Vector<DIM>::Zero(), nodesVisited)) {
+			notFound = false;
+		}
+
+		return false;
+	};
+
+	// the subtree of the start node likely contains the closest point, so searching it first
+	// shrinks the sphere enough to cull most of the sibling subtrees visited on the way up
+	traverse(nodeStartIndex, overlapChildren, processLeaf, [&]() { return s.r2; });
+
+	for (int nodeIndex = nodeStartIndex; parents[nodeIndex] != -1; nodeIndex = parents[nodeIndex]) {
+		// climb to the parent, and search the subtrees of the siblings that overlap the sphere
+		// in order of their distance
+		const MbvhNode<DIM>& parent = nodes[parents[nodeIndex]];
+		FloatP<FCPW_MBVH_BRANCHING_FACTOR> d2Min;
+		MaskP<FCPW_MBVH_BRANCHING_FACTOR> mask = overlapChildren(parent, d2Min);
+		mask &= enoki::neq(parent.child, nodeIndex);
+
+		int order[FCPW_MBVH_BRANCHING_FACTOR];
+		int nSiblings = 0;
+		for (int w = 0; w < FCPW_MBVH_BRANCHING_FACTOR; w++) {
+			if (!mask[w]) continue;
+
+			int k = nSiblings++;
+			while (k > 0 && d2Min[order[k - 1]] > d2Min[w]) {
+				order[k] = order[k - 1];
+				k--;
 			}
+
+			order[k] = w;
+		}
+
+		for (int k = 0; k < nSiblings; k++) {
+			if (d2Min[order[k]] > s.r2) break;
+			traverse(parent.child[order[k]], overlapChildren, processLeaf, [&]() { return s.r2; });
 		}
 	}
 
 	if (!notFound) {
 		// compute normal
 		if (this->computeNormals && !primitiveTypeIsAggregate) {
-			i.computeNormal(primitives[i.referenceIndex]);
+			computePrimitiveNormal(i);
 		}
 
 		return true;
@@ -864,4 +2174,315 @@ inline bool Mbvh<WIDTH, DIM, PrimitiveType>::findClosestPointFromNode(BoundingSp
 	return false;
 }
 
+template<size_t WIDTH, size_t DIM, typename PrimitiveType>
+inline bool Mbvh<WIDTH, DIM, PrimitiveType>::findKClosestPointsFromNode(BoundingSphere<DIM>& s,
+																		std::vector<Interaction<DIM>>& is,
+																		int k, int nodeStartIndex, int aggregateIndex,
+																		int& nodesVisited) const
+{
+	bool found = false;
+	enokiVector<DIM> sc = enoki::gather<enokiVector<DIM>>(s.c.data(), range);
+
+	auto overlapChildren = [&](const MbvhNode<DIM>& node, FloatP<FCPW_MBVH_BRANCHING_FACTOR>& d2Min) {
+		// overlap sphere with boxes; unlike the closest point query, the sphere can't be shrunk
+		// to the furthest distance to a box, since that only bounds the distance to the closest
+		// primitive. It shrinks to the kth closest distance instead once k primitives have been found
+		FloatP<FCPW_MBVH_BRANCHING_FACTOR> d2Max;
+		MaskP<FCPW_MBVH_BRANCHING_FACTOR> mask = overlapWideBox<FCPW_MBVH_BRANCHING_FACTOR, DIM>(
+#ifdef FCPW_USE_QUANTIZED_MBVH_NODES
+													node.boxOrigin, node.boxScale, node.qBoxMin, node.qBoxMax,
+#else
+													node.boxMin, node.boxMax,
+#endif
+													sc, s.r2, d2Min, d2Max);
+		nodesVisited++;
+
+		return mask & enoki::neq(node.child, maxInt);
+	};
+
+	auto addInteraction = [&](Interaction<DIM>& c) -> bool {
+		if (this->computeNormals && !primitiveTypeIsAggregate) {
+			computePrimitiveNormal(c);
+		}
+
+		return addKClosestInteraction<DIM>(s, is, c, k);
+	};
+
+	auto processLeaf = [&](const MbvhNode<DIM>& node, int nodeIndex) -> bool {
+		if (vectorizedLeaves) {
+			// perform vectorized closest point query
+			if (findKClosestPointsPrimitives(node, leaves, nodeIndex, this->index,
+											 sc, s.r2, addInteraction)) {
+				found = true;
+			}
+
+			nodesVisited++;
+
+		} else {
+			// primitive type does not support vectorized closest point query,
+			// perform query to each primitive one by one
+			int leafOffset = -node.child[0] - 1;
+			int referenceOffset = node.child[2];
+			int nReferences = node.child[3];
+			MaskP<WIDTH> mask;
+			FloatP<WIDTH> d2Min;
+
+			for (int p = 0; p < nReferences; p++) {
+				int w = p%WIDTH;
+				if (aggregateLeaves) {
+					// overlap sphere with the bounding boxes of the next WIDTH aggregates,
+					// and skip the aggregates that are outside the sphere
+					if (w == 0) {
+						mask = overlapLeafNodeBoxes(leaves[leafOffset + p/WIDTH], sc, s.r2, d2Min);
+						nodesVisited++;
+					}
+
+					if (!mask[w] || d2Min[w] > s.r2) continue;
+				}
+
+				int referenceIndex = referenceOffset + p;
+				const PrimitiveType *prim = primitives[referenceIndex];
+				nodesVisited++;
+
+				if (primitiveTypeIsAggregate) {
+					const Aggregate<DIM> *aggregate = reinterpret_cast<const Aggregate<DIM> *>(prim);
+					if (aggregate->findKClosestPointsFromNode(s, is, k, nodeStartIndex,
+															  aggregateIndex, nodesVisited)) {
+						found = true;
+					}
+
+				} else {
+					Interaction<DIM> c;
+					if (prim->findClosestPoint(s, c)) {
+						c.nodeIndex = nodeIndex;
+						c.referenceIndex = referenceIndex;
+						c.objectIndex = this->index;
+						if (addInteraction(c)) found = true;
+					}
+				}
+			}
+		}
+
+		return false;
+	};
+
+	// if a node is further than the kth closest found primitive, it is skipped
+	int rootIndex = aggregateIndex == this->index ? nodeStartIndex : 0;
+	traverse(rootIndex, overlapChildren, processLeaf, [&]() { return s.r2; });
+
+	return found;
+}
+
+template<size_t WIDTH, size_t DIM, typename PrimitiveType>
+inline void Mbvh<WIDTH, DIM, PrimitiveType>::findClosestPoints(const float *xyz, const float *squaredRadii,
+															   size_t nQueries, size_t begin, size_t end,
+															   float *distances, float *points,
+															   int *primitiveIndices, float *uvs) const
+{
+	// call the traversal directly to avoid a virtual call per query
+	auto findClosestPoint = [this](BoundingSphere<DIM>& s, Interaction<DIM>& i) -> bool {
+		int nodesVisited = 0;
+		return this->Mbvh<WIDTH, DIM, PrimitiveType>::findClosestPointFromNode(s, i, 0, this->index,
+																			   Vector<DIM>::Zero(), nodesVisited);
+	};
+
+	findClosestPointsInRange<DIM>(findClosestPoint, xyz, squaredRadii, nQueries, begin, end,
+								  distances, points, primitiveIndices, uvs);
+}
+
+template<size_t WIDTH, size_t DIM, typename PrimitiveType>
+inline void Mbvh<WIDTH, DIM, PrimitiveType>::findClosestPointsInClusters(const float *xyz, const float *squaredRadii,
+																		 size_t nQueries, size_t begin, size_t end,
+																		 size_t clusterSize, float *distances,
+																		 float *points, int *primitiveIndices,
+																		 float *uvs) const
+{
+	// the stack entries record the parent and lane of each node, from which the box of a leaf is read
+	struct ClusterTraversal {
+		int node;
+		float distance;
+		int parent, lane;
+	};
+
+	// the leaves that can contain the closest point to a query point in the cluster
+	struct ClusterLeaf {
+		int node;
+		float distance;
+		BoundingBox<DIM> box;
+	};
+
+	std::vector<ClusterLeaf> candidates;
+	clusterSize = std::max(clusterSize, (size_t)1);
+	int nodesVisited = 0;
+
+	for (size_t clusterBegin = begin; clusterBegin < end; clusterBegin += clusterSize) {
+		size_t clusterEnd = std::min(clusterBegin + clusterSize, end);
+
+		// compute the box enclosing the query points in the cluster and their largest radius
+		BoundingBox<DIM> cluster;
+		float r2 = 0.0f;
+		for (size_t q = clusterBegin; q < clusterEnd; q++) {
+			Vector<DIM> x;
+			for (size_t k = 0; k < DIM; k++) x[k] = xyz[k*nQueries + q];
+
+			cluster.expandToInclude(x);
+			r2 = std::max(r2, squaredRadii ? squaredRadii[q] : maxFloat);
+		}
+
+		// the distance from any point in the cluster to its closest point is at most its distance
+		// to the closest point to the center of the cluster, which bounds the radius of the cluster
+		Interaction<DIM> ci;
+		BoundingSphere<DIM> cs(cluster.centroid(), maxFloat);
+		bool foundCenter = findClosestPointFromNode(cs, ci, 0, this->index, Vector<DIM>::Zero(), nodesVisited);
+		if (foundCenter) {
+			Vector<DIM> u = (cluster.pMin - ci.p).cwiseAbs().cwiseMax((cluster.pMax - ci.p).cwiseAbs());
+			r2 = std::min(r2, u.squaredNorm());
+		}
+
+		enokiVector<DIM> boxMin = enoki::gather<enokiVector<DIM>>(cluster.pMin.data(), range);
+		enokiVector<DIM> boxMax = enoki::gather<enokiVector<DIM>>(cluster.pMax.data(), range);
+
+		// traverse the tree once for the cluster; a node is skipped if it is further from every
+		// point in the cluster than the furthest distance from any point in the cluster to the
+		// closest overlapping box, since it can't contain the closest point to any of them. Boxes
+		// clipped by spatial splits need not contain any point of their primitives, so they don't
+		// shrink the radius
+		bool shrinkToFurthestBox = isDuplicateReference.size() == 0;
+		ClusterTraversal subtree[FCPW_MBVH_MAX_DEPTH];
+		subtree[0].node = 0;
+		subtree[0].distance = minFloat;
+		subtree[0].parent = -1;
+		subtree[0].lane = -1;
+		int stackPtr = 0;
+		candidates.clear();
+
+		while (stackPtr >= 0) {
+			// pop off the next node to work on
+			ClusterTraversal entry = subtree[stackPtr];
+			stackPtr--;
+
+			if (entry.distance > r2) continue;
+			const MbvhNode<DIM>& node(nodes[entry.node]);
+
+			if (isLeafNode(node)) {
+				ClusterLeaf leaf;
+				leaf.node = entry.node;
+				leaf.distance = entry.distance;
+				leaf.box = entry.parent == -1 ? computeNodeBox(entry.node) :
+												getChildBox(nodes[entry.parent], entry.lane);
+				candidates.emplace_back(leaf);
+				continue;
+			}
+
+			// overlap cluster box with child boxes
+			FloatP<FCPW_MBVH_BRANCHING_FACTOR> d2Min, d2Max;
+			MaskP<FCPW_MBVH_BRANCHING_FACTOR> mask = overlapWideBox<FCPW_MBVH_BRANCHING_FACTOR, DIM>(
+#ifdef FCPW_USE_QUANTIZED_MBVH_NODES
+														node.boxOrigin, node.boxScale, node.qBoxMin, node.qBoxMax,
+#else
+														node.boxMin, node.boxMax,
+#endif
+														boxMin, boxMax, r2, d2Min, d2Max);
+			mask &= enoki::neq(node.child, maxInt);
+			nodesVisited++;
+
+			// shrink the radius, then sort the overlapping children by distance and push the furthest first
+			int order[FCPW_MBVH_BRANCHING_FACTOR];
+			int nChildren = 0;
+			for (int w = 0; w < FCPW_MBVH_BRANCHING_FACTOR; w++) {
+				if (!mask[w]) continue;
+				if (shrinkToFurthestBox) r2 = std::min(r2, (float)d2Max[w]);
+
+				int k = nChildren++;
+				while (k > 0 && d2Min[order[k - 1]] < d2Min[w]) {
+					order[k] = order[k - 1];
+					k--;
+				}
+
+				order[k] = w;
+			}
+
+			for (int k = 0; k < nChildren; k++) {
+				stackPtr++;
+				subtree[stackPtr].node = node.child[order[k]];
+				subtree[stackPtr].distance = d2Min[order[k]];
+				subtree[stackPtr].parent = entry.node;
+				subtree[stackPtr].lane = order[k];
+			}
+		}
+
+		// finish each query point against the candidate leaves in order of their distance to the
+		// cluster; since this distance bounds the distance to every point in the cluster, a query
+		// point is done once it reaches a leaf further than its closest found primitive
+		std::sort(candidates.begin(), candidates.end(), [](const ClusterLeaf& a, const ClusterLeaf& b) {
+			return a.distance < b.distance;
+		});
+		int nCandidates = (int)candidates.size();
+
+		for (size_t q = clusterBegin; q < clusterEnd; q++) {
+			Vector<DIM> x;
+			for (size_t k = 0; k < DIM; k++) x[k] = xyz[k*nQueries + q];
+
+			Interaction<DIM> i;
+			bool found = false;
+			BoundingSphere<DIM> s(x, squaredRadii ? squaredRadii[q] : maxFloat);
+			enokiVector<DIM> sc = enoki::gather<enokiVector<DIM>>(s.c.data(), range);
+
+			for (int c = 0; c < nCandidates; c++) {
+				if (candidates[c].distance > s.r2) break;
+
+				float d2Min, d2Max;
+				candidates[c].box.computeSquaredDistance(x, d2Min, d2Max);
+				if (d2Min > s.r2) continue;
+
+				int nodeIndex = candidates[c].node;
+				if (findClosestPointInLeaf(nodes[nodeIndex], nodeIndex, s, sc, i, 0, this->index,
+										   Vector<DIM>::Zero(), nodesVisited)) {
+					found = true;
+				}
+			}
+
+			// compute normal
+			if (found && this->computeNormals && !primitiveTypeIsAggregate) {
+				computePrimitiveNormal(i);
+			}
+
+			writeClosestPointInteraction<DIM>(found, i, q, nQueries, distances, points,
+											  primitiveIndices, uvs);
+		}
+	}
+}
+
+template<size_t WIDTH, size_t DIM, typename PrimitiveType>
+inline int Mbvh<WIDTH, DIM, PrimitiveType>::intersectRays(const float *origins, const float *directions,
+														  const float *tMax, size_t nRays, size_t begin,
+														  size_t end, float *distances, float *points,
+														  int *primitiveIndices, float *uvs,
+														  bool checkForOcclusion) const
+{
+#ifdef FCPW_USE_RAY_PACKET_TRAVERSAL
+	// intersect consecutive rays as packets, which pays off when they are coherent
+	auto intersectPacket = [this](Ray<DIM> *rays, Interaction<DIM> *is, int nPacketRays,
+								  bool checkForOcclusion) -> uint32_t {
+		int nodesVisited = 0;
+		return this->intersectPacket(rays, is, nPacketRays, nodesVisited, checkForOcclusion);
+	};
+
+	return intersectRayPacketsInRange<DIM, FCPW_MBVH_PACKET_SIZE>(intersectPacket, origins, directions,
+																  tMax, nRays, begin, end, distances,
+																  points, primitiveIndices, uvs,
+																  checkForOcclusion);
+#else
+	// call the traversal directly to avoid a virtual call per ray
+	auto intersect = [this](Ray<DIM>& r, Interaction<DIM>& i, bool checkForOcclusion) -> bool {
+		int nodesVisited = 0;
+		return this->Mbvh<WIDTH, DIM, PrimitiveType>::intersectFromNode(r, i, 0, this->index,
+																		nodesVisited, checkForOcclusion);
+	};
+
+	return intersectRaysInRange<DIM>(intersect, origins, directions, tMax, nRays, begin, end,
+									 distances, points, primitiveIndices, uvs, checkForOcclusion);
+#endif
+}
+
 } // namespace fcpw
@@ -2,7 +2,15 @@
 
 #include <fcpw/core/primitive.h>
 #include <tuple>
+#include <future>
+#include <unordered_set>
 #define FCPW_SBVH_MAX_DEPTH 64
+#define FCPW_SBVH_MIN_TASK_SIZE 4096 // min references in a node to build its subtrees as parallel tasks
+#define FCPW_SBVH_MIN_PARALLEL_LOOP_SIZE 65536 // min references in a node to process it with parallel loops
+#define FCPW_SBVH_PARALLEL_LOOP_GRAIN_SIZE 16384
+#define FCPW_SBVH_SPATIAL_SPLIT_BUDGET 1.0f // max number of duplicated references, relative to the number of primitives
+#define FCPW_SBVH_BUCKETS 32 // default number of buckets the references in a node are binned into
+#define FCPW_SBVH_OVERLAP_THRESHOLD 1e-5f // default overlap of child nodes above which spatial splits are considered
 
 namespace fcpw {
 // modified version of https://github.com/brandonpelfrey/Fast-BVH and
@@ -37,17 +45,91 @@ struct BvhTraversal {
 	float distance; // minimum distance (parametric, squared, ...) to this node
 };
 
+template<size_t DIM, typename PrimitiveType>
+struct SbvhBins {
+	// bin bounds are padded to a multiple of 4 floats, so that expanding them
+	// compiles to packed simd min/max instructions
+	using PaddedVector = Vector<((DIM + 3)/4)*4>;
+
+	// constructor
+	SbvhBins(int nBins_=0) { reset(nBins_); }
+
+	// resizes the bins and empties them along all dimensions
+	void reset(int nBins_);
+
+	// members
+	int nBins;
+	std::vector<PaddedVector> boxMin, boxMax; // bin bounds, indexed by dim*nBins + bin
+	std::vector<int> counts;
+	std::vector<PaddedVector> rightBoxMin, rightBoxMax; // bounds of the bins to the right of a split
+	std::vector<int> rightCounts;
+	std::vector<BoundingBox<DIM>> spatialBoxes, spatialRightBoxes; // bounds of the chopped references in spatial bins
+	std::vector<int> entries, exits; // number of references starting and ending in each spatial bin
+	std::vector<PrimitiveType *> leftPrimitives, rightPrimitives; // references on each side of a spatial split
+	std::vector<BoundingBox<DIM>> leftBoxes, rightBoxes;
+	std::vector<Vector<DIM>> leftCentroids, rightCentroids;
+};
+
+// vertex positions of a referenced primitive, stored contiguously in tree order so that the
+// scalar traversal can query line segments and triangles without virtual calls or indirections
+template<size_t DIM, typename PrimitiveType>
+struct SbvhLeafPrimitive {
+	// members
+	Vector<DIM> positions[1];
+	int primitiveIndex;
+};
+
+template<size_t DIM>
+struct SbvhLeafPrimitive<DIM, LineSegment> {
+	// members
+	Vector<DIM> positions[2];
+	int primitiveIndex;
+};
+
+template<size_t DIM>
+struct SbvhLeafPrimitive<DIM, Triangle> {
+	// members
+	Vector<DIM> positions[3];
+	int primitiveIndex;
+};
+
+// calls func once for each primitive in a list of references, skipping the references
+// flagged in isDuplicateReference (an empty list of flags marks no duplicates)
+template<typename PrimitiveType, typename Func>
+void forEachUniquePrimitive(const std::vector<PrimitiveType *>& primitives,
+							const std::vector<bool>& isDuplicateReference, const Func& func);
+
 template<size_t DIM, typename PrimitiveType>
 using SortPositionsFunc = std::function<void(const std::vector<SbvhNode<DIM>>&, std::vector<PrimitiveType *>&)>;
 
 template<size_t DIM, typename PrimitiveType=Primitive<DIM>>
 class Sbvh: public Aggregate<DIM> {
 public:
-	// constructor
+	// constructor; primitives_ is reordered to match the order of the references in the tree. When
+	// useSpatialSplits is enabled, spatial splits are considered for nodes whose children overlap by
+	// more than overlapThreshold times the surface area of the root. Such splits duplicate the references
+	// to primitives straddling the split plane, so the tree then keeps its own list of references (see
+	// getReferences) that can contain the same primitive more than once, and leaves primitives_ unchanged.
+	// Set copyLeafPrimitives_ to false if the tree is not queried itself, e.g., when it is collapsed into
+	// an mbvh, so that the vertex positions of its line segments and triangles are not copied into its leaves
 	Sbvh(const CostHeuristic& costHeuristic_,
 		 std::vector<PrimitiveType *>& primitives_,
 		 SortPositionsFunc<DIM, PrimitiveType> sortPositions_={},
-		 bool printStats_=false, bool packLeaves_=false, int leafSize_=4, int nBuckets_=8);
+		 bool printStats_=false, bool packLeaves_=false, int leafSize_=4, int nBuckets_=FCPW_SBVH_BUCKETS,
+		 bool useSpatialSplits_=false, float overlapThreshold_=FCPW_SBVH_OVERLAP_THRESHOLD,
+		 bool copyLeafPrimitives_=true);
+
+	// constructor; views a tree serialized with write (e.g., in a memory mapped file) in place
+	// instead of building one; primitives_ must be in the reference order of the serialized tree.
+	// Set copyReferences_ to keep a copy of primitives_ in the tree, e.g., when it contains the
+	// references of a tree built with spatial splits
+	Sbvh(std::vector<PrimitiveType *>& primitives_, BinaryReader& reader, bool copyReferences_=false);
+
+	// serializes the tree without its primitives
+	void write(BinaryWriter& writer) const;
+
+	// returns the primitives in the reference order of the tree
+	const std::vector<PrimitiveType *>& getReferences() const;
 
 	// returns bounding box
 	BoundingBox<DIM> boundingBox() const;
@@ -61,17 +143,68 @@ public:
 	// returns signed volume
 	float signedVolume() const;
 
+	// recomputes the node bounding boxes bottom-up after the primitives have moved; the tree
+	// topology is left unchanged, so the tree quality degrades with large deformations
+	void refit();
+
+	// frees the copies of the vertex positions in the leaves to reduce the memory footprint of the
+	// tree, which then queries its primitives directly; returns false, since it still needs them
+	bool releasePrimitives();
+
 	// intersects with ray, starting the traversal at the specified node in an aggregate
 	// NOTE: interactions are invalid when checkForOcclusion is enabled
 	int intersectFromNode(Ray<DIM>& r, std::vector<Interaction<DIM>>& is,
 						  int nodeStartIndex, int aggregateIndex, int& nodesVisited,
 						  bool checkForOcclusion=false, bool recordAllHits=false) const;
 
+	// intersects with ray, starting the traversal at the specified node in an aggregate;
+	// returns the closest interaction in i without allocating
+	// NOTE: interaction is invalid when checkForOcclusion is enabled
+	bool intersectFromNode(Ray<DIM>& r, Interaction<DIM>& i, int nodeStartIndex,
+						   int aggregateIndex, int& nodesVisited,
+						   bool checkForOcclusion=false) const;
+
+	// intersects with ray, starting the traversal at the specified node in an aggregate;
+	// returns the closest interaction accepted by filter in i
+	// NOTE: interaction is invalid when checkForOcclusion is enabled
+	bool intersectFromNode(Ray<DIM>& r, Interaction<DIM>& i, const HitFilter<DIM>& filter,
+						   int nodeStartIndex, int aggregateIndex, int& nodesVisited,
+						   bool checkForOcclusion=false) const;
+
+	// intersects with ray like the overload above, with a filter(c) that is inlined into the
+	// traversal and returns a HitFilterResult for each candidate hit c
+	template<typename FilterFunc>
+	bool intersectFromNodeWithFilter(Ray<DIM>& r, Interaction<DIM>& i, FilterFunc&& filter,
+									 int nodeStartIndex, int aggregateIndex, int& nodesVisited,
+									 bool checkForOcclusion=false) const;
+
 	// finds closest point to sphere center, starting the traversal at the specified node in an aggregate
 	bool findClosestPointFromNode(BoundingSphere<DIM>& s, Interaction<DIM>& i,
 								  int nodeStartIndex, int aggregateIndex,
 								  const Vector<DIM>& boundaryHint, int& nodesVisited) const;
 
+	// finds closest point to sphere center, searching the subtree of the specified node first and
+	// then the sibling subtrees that overlap the sphere on the way up to the root
+	bool findClosestPointBottomUp(BoundingSphere<DIM>& s, Interaction<DIM>& i, int nodeStartIndex,
+								  int aggregateIndex, int& nodesVisited) const;
+
+	// finds the k closest primitives to sphere center, starting the traversal at the specified node in an aggregate
+	bool findKClosestPointsFromNode(BoundingSphere<DIM>& s, std::vector<Interaction<DIM>>& is,
+									int k, int nodeStartIndex, int aggregateIndex,
+									int& nodesVisited) const;
+
+	// finds closest points to the query points in the range [begin, end) of a batch;
+	// see findClosestPointsInRange for the layout of the input and output buffers
+	void findClosestPoints(const float *xyz, const float *squaredRadii, size_t nQueries,
+						   size_t begin, size_t end, float *distances, float *points,
+						   int *primitiveIndices, float *uvs) const;
+
+	// intersects the rays in the range [begin, end) of a batch, returns the number of rays with a hit;
+	// see intersectRaysInRange for the layout of the input and output buffers
+	int intersectRays(const float *origins, const float *directions, const float *tMax,
+					  size_t nRays, size_t begin, size_t end, float *distances, float *points,
+					  int *primitiveIndices, float *uvs, bool checkForOcclusion=false) const;
+
 protected:
 	// computes split cost based on heuristic
 	float computeSplitCost(const BoundingBox<DIM>& boxLeft,
@@ -80,32 +213,83 @@ protected:
 						   int nReferencesLeft, int nReferencesRight,
 						   int depth) const;
 
+	// computes the bounding box and centroid box of the references in a node
+	void computeNodeBounds(const std::vector<BoundingBox<DIM>>& referenceBoxes,
+						   const std::vector<Vector<DIM>>& referenceCentroids,
+						   int nodeStart, int nodeEnd, bool parallelize,
+						   BoundingBox<DIM>& nodeBoundingBox,
+						   BoundingBox<DIM>& nodeCentroidBox) const;
+
+	// bins the references in a node along all dimensions in a single pass,
+	// using bins that evenly subdivide the centroid box of the node
+	void binReferences(const BoundingBox<DIM>& nodeCentroidBox,
+					   const std::vector<BoundingBox<DIM>>& referenceBoxes,
+					   const std::vector<Vector<DIM>>& referenceCentroids,
+					   int nodeStart, int nodeEnd, bool parallelize,
+					   SbvhBins<DIM, PrimitiveType>& bins) const;
+
 	// computes object split
 	float computeObjectSplit(const BoundingBox<DIM>& nodeBoundingBox,
 							 const BoundingBox<DIM>& nodeCentroidBox,
 							 const std::vector<BoundingBox<DIM>>& referenceBoxes,
 							 const std::vector<Vector<DIM>>& referenceCentroids,
-							 int depth, int nodeStart, int nodeEnd, int& splitDim,
-							 float& splitCoord, BoundingBox<DIM>& boxIntersected);
+							 SbvhBins<DIM, PrimitiveType>& bins, int depth, int nodeStart, int nodeEnd,
+							 bool parallelize, int& splitDim, float& splitCoord,
+							 BoundingBox<DIM>& boxIntersected) const;
 
-	// performs object split
-	int performObjectSplit(int nodeStart, int nodeEnd, int splitDim, float splitCoord,
+	// performs object split; large nodes are partitioned stably in chunks that can be processed in parallel
+	int performObjectSplit(int nodeStart, int nodeEnd, int splitDim, float splitCoord, bool parallelize,
 						   std::vector<BoundingBox<DIM>>& referenceBoxes,
 						   std::vector<Vector<DIM>>& referenceCentroids);
 
-	// helper function to build binary tree
-	void buildRecursive(std::vector<BoundingBox<DIM>>& referenceBoxes,
-						std::vector<Vector<DIM>>& referenceCentroids,
-						std::vector<SbvhNode<DIM>>& buildNodes,
-						int parent, int start, int end, int depth);
+	// computes spatial split by chopping the references in a node into bins along each dimension;
+	// ignores splits that duplicate more than maxDuplicates references
+	float computeSpatialSplit(const BoundingBox<DIM>& nodeBoundingBox,
+							  const std::vector<BoundingBox<DIM>>& referenceBoxes,
+							  SbvhBins<DIM, PrimitiveType>& bins, int depth, int nodeStart, int nodeEnd,
+							  int maxDuplicates, int& splitDim, float& splitCoord, BoundingBox<DIM>& boxLeft,
+							  BoundingBox<DIM>& boxRight, int& nReferencesLeft,
+							  int& nReferencesRight) const;
+
+	// performs spatial split, duplicating references that straddle the split plane unless it is
+	// cheaper under the cost heuristic to move them to one side; the references are written to
+	// [nodeStart, nodeEnd), with nodeEnd updated to account for the duplicates. Returns the end of
+	// the left references, or -1 if the split does not fit within extendedEnd or leaves a side empty
+	int performSpatialSplit(const BoundingBox<DIM>& nodeBoundingBox, int depth,
+							int nodeStart, int& nodeEnd, int extendedEnd, int splitDim, float splitCoord,
+							BoundingBox<DIM> boxLeft, BoundingBox<DIM> boxRight,
+							int nReferencesLeft, int nReferencesRight,
+							std::vector<BoundingBox<DIM>>& referenceBoxes,
+							std::vector<Vector<DIM>>& referenceCentroids,
+							SbvhBins<DIM, PrimitiveType>& bins);
+
+	// helper function to build binary tree; subtrees of large nodes are built as parallel
+	// tasks and spliced into buildNodes in depth first order; [end, extendedEnd) is free space
+	// for references duplicated by spatial splits; returns the max depth of the subtree
+	int buildRecursive(std::vector<BoundingBox<DIM>>& referenceBoxes,
+					   std::vector<Vector<DIM>>& referenceCentroids,
+					   std::vector<SbvhNode<DIM>>& buildNodes, SbvhBins<DIM, PrimitiveType>& bins,
+					   int parent, int start, int end, int extendedEnd, int depth);
 
 	// builds binary tree
 	void build();
 
-	// processes subtree for intersection
-	bool processSubtreeForIntersection(Ray<DIM>& r, std::vector<Interaction<DIM>>& is,
-									   int nodeStartIndex, int aggregateIndex, bool checkForOcclusion,
-									   bool recordAllHits, BvhTraversal *subtree,
+	// copies the vertex positions of the referenced line segments or triangles into leafPrimitives,
+	// unless copyLeafPrimitives is false
+	void populateLeafPrimitives();
+
+	// records the parent of each node in parents
+	void computeParents();
+
+	// checks that the child offsets and reference ranges of a serialized tree lie within it
+	bool hasValidNodes() const;
+
+	// processes subtree for intersection; records the closest hit accepted by filter in i or all
+	// hits in is, and returns true if the query was terminated by an occluding or terminating hit
+	template<typename FilterFunc>
+	bool processSubtreeForIntersection(Ray<DIM>& r, Interaction<DIM>& i, std::vector<Interaction<DIM>>& is,
+									   FilterFunc&& filter, int nodeStartIndex, int aggregateIndex,
+									   bool checkForOcclusion, bool recordAllHits, BvhTraversal *subtree,
 									   float *boxHits, int& hits, int& nodesVisited) const;
 
 	// processes subtree for closest point
@@ -118,10 +302,19 @@ protected:
 	// members
 	CostHeuristic costHeuristic;
 	int nNodes, nLeafs, leafSize, nBuckets, maxDepth, depthGuess;
-	std::vector<std::pair<BoundingBox<DIM>, int>> buckets, rightBucketBoxes;
-	std::vector<PrimitiveType *>& primitives;
+	int nThreads, maxTaskDepth, nPrimitives;
+	bool useSpatialSplits;
+	float overlapThreshold, minSpatialSplitOverlap;
+	std::vector<PrimitiveType *> ownedReferences; // references owned by the tree, e.g., when built with spatial splits
+	std::vector<PrimitiveType *>& primitives; // refers to ownedReferences or to the primitives passed to the tree
+	std::vector<bool> isDuplicateReference; // flags references duplicated by spatial splits
 	std::vector<SbvhNode<DIM>> flatTree;
+	SbvhNode<DIM> *nodes; // points to flatTree, or to a serialized tree viewed in place
+	std::vector<int> parents; // indexed by node, -1 for the root
+	std::vector<SbvhLeafPrimitive<DIM, PrimitiveType>> leafPrimitives; // indexed by reference, empty if unsupported
+	ObjectType leafPrimitiveType;
 	bool packLeaves, primitiveTypeIsAggregate;
+	bool copyLeafPrimitives; // set if leafPrimitives are populated, see populateLeafPrimitives
 
 	template<size_t U, size_t V, typename W>
 	friend class Mbvh;
@@ -4,7 +4,8 @@ template<size_t DIM, typename PrimitiveType>
 inline Sbvh<DIM, PrimitiveType>::Sbvh(const CostHeuristic& costHeuristic_,
 									  std::vector<PrimitiveType *>& primitives_,
 									  SortPositionsFunc<DIM, PrimitiveType> sortPositions_,
-									  bool printStats_, bool packLeaves_, int leafSize_, int nBuckets_):
+									  bool printStats_, bool packLeaves_, int leafSize_, int nBuckets_,
+									  bool useSpatialSplits_, float overlapThreshold_, bool copyLeafPrimitives_):
 costHeuristic(costHeuristic_),
 nNodes(0),
 nLeafs(0),
@@ -12,11 +13,21 @@ leafSize(leafSize_),
 nBuckets(nBuckets_),
 maxDepth(0),
 depthGuess(std::log2(primitives_.size())),
-buckets(nBuckets, std::make_pair(BoundingBox<DIM>(), 0)),
-rightBucketBoxes(nBuckets, std::make_pair(BoundingBox<DIM>(), 0)),
-primitives(primitives_),
+nThreads(std::max((int)std::thread::hardware_concurrency(), 1)),
+maxTaskDepth(nThreads > 1 ? (int)std::ceil(std::log2(nThreads)) + 2 : 0),
+nPrimitives((int)primitives_.size()),
+useSpatialSplits(useSpatialSplits_ && costHeuristic_ != CostHeuristic::LongestAxisCenter),
+overlapThreshold(overlapThreshold_),
+minSpatialSplitOverlap(maxFloat),
+ownedReferences(useSpatialSplits ? primitives_ : std::vector<PrimitiveType *>()),
+primitives(useSpatialSplits ? ownedReferences : primitives_),
+nodes(nullptr),
+leafPrimitiveType(std::is_same<PrimitiveType, LineSegment>::value ? ObjectType::LineSegments :
+				  std::is_same<PrimitiveType, Triangle>::value ? ObjectType::Triangles :
+				  ObjectType::Mixed),
 packLeaves(packLeaves_),
-primitiveTypeIsAggregate(std::is_base_of<Aggregate<DIM>, PrimitiveType>::value)
+primitiveTypeIsAggregate(std::is_base_of<Aggregate<DIM>, PrimitiveType>::value),
+copyLeafPrimitives(copyLeafPrimitives_)
 {
 	using namespace std::chrono;
 	high_resolution_clock::time_point t1 = high_resolution_clock::now();
@@ -29,6 +40,10 @@ primitiveTypeIsAggregate(std::is_base_of<Aggregate<DIM>, PrimitiveType>::value)
 		sortPositions_(flatTree, primitives);
 	}
 
+	// populate leaf primitives if primitive type is supported
+	populateLeafPrimitives();
+	computeParents();
+
 	// don't compute normals by default
 	this->computeNormals = false;
 
@@ -40,11 +55,89 @@ primitiveTypeIsAggregate(std::is_base_of<Aggregate<DIM>, PrimitiveType>::value)
 				  << nNodes << " nodes, "
 				  << nLeafs << " leaves, "
 				  << maxDepth << " max depth, "
-				  << primitives.size() << " primitives in "
-				  << timeSpan.count() << " seconds" << std::endl;
+				  << nPrimitives << " primitives";
+		if (useSpatialSplits) std::cout << ", " << primitives.size() << " references";
+		std::cout << " in " << timeSpan.count() << " seconds" << std::endl;
 	}
 }
 
+template<size_t DIM, typename PrimitiveType>
+inline Sbvh<DIM, PrimitiveType>::Sbvh(std::vector<PrimitiveType *>& primitives_, BinaryReader& reader,
+									  bool copyReferences_):
+costHeuristic(CostHeuristic::SurfaceArea),
+nNodes(0),
+nLeafs(0),
+leafSize(0),
+nBuckets(0),
+maxDepth(0),
+depthGuess(0),
+nThreads(std::max((int)std::thread::hardware_concurrency(), 1)),
+maxTaskDepth(nThreads > 1 ? (int)std::ceil(std::log2(nThreads)) + 2 : 0),
+nPrimitives(0),
+useSpatialSplits(false),
+overlapThreshold(0.0f),
+minSpatialSplitOverlap(maxFloat),
+ownedReferences(copyReferences_ ? primitives_ : std::vector<PrimitiveType *>()),
+primitives(copyReferences_ ? ownedReferences : primitives_),
+nodes(nullptr),
+leafPrimitiveType(std::is_same<PrimitiveType, LineSegment>::value ? ObjectType::LineSegments :
+				  std::is_same<PrimitiveType, Triangle>::value ? ObjectType::Triangles :
+				  ObjectType::Mixed),
+packLeaves(false),
+primitiveTypeIsAggregate(std::is_base_of<Aggregate<DIM>, PrimitiveType>::value),
+copyLeafPrimitives(true)
+{
+	// read the build settings and the tree, which is viewed in place
+	costHeuristic = static_cast<CostHeuristic>(reader.read<int>());
+	nLeafs = reader.read<int>();
+	leafSize = reader.read<int>();
+	nBuckets = reader.read<int>();
+	maxDepth = reader.read<int>();
+	depthGuess = reader.read<int>();
+	nPrimitives = reader.read<int>();
+	useSpatialSplits = reader.read<int>() == 1;
+	overlapThreshold = reader.read<float>();
+	packLeaves = reader.read<int>() == 1;
+
+	size_t nFlatTreeNodes = 0;
+	nodes = reader.readArray<SbvhNode<DIM>>(nFlatTreeNodes);
+	nNodes = (int)nFlatTreeNodes;
+	reader.readArray(isDuplicateReference);
+
+	// reject trees whose nodes index outside of them, e.g., in a corrupted file
+	if (!reader.good() || !hasValidNodes()) {
+		reader.fail();
+		nodes = nullptr;
+		nNodes = 0;
+		isDuplicateReference.clear();
+		return;
+	}
+
+	// the leaf primitives and parents are not serialized, since they can be recovered
+	populateLeafPrimitives();
+	computeParents();
+
+	// don't compute normals by default
+	this->computeNormals = false;
+}
+
+template<size_t DIM, typename PrimitiveType>
+inline void Sbvh<DIM, PrimitiveType>::write(BinaryWriter& writer) const
+{
+	writer.write<int>(static_cast<int>(costHeuristic));
+	writer.write<int>(nLeafs);
+	writer.write<int>(leafSize);
+	writer.write<int>(nBuckets);
+	writer.write<int>(maxDepth);
+	writer.write<int>(depthGuess);
+	writer.write<int>(nPrimitives);
+	writer.write<int>(useSpatialSplits ? 1 : 0);
+	writer.write<float>(overlapThreshold);
+	writer.write<int>(packLeaves ? 1 : 0);
+	writer.writeArray(nodes, nNodes);
+	writer.writeArray(isDuplicateReference);
+}
+
 template<size_t DIM, typename PrimitiveType>
 inline float Sbvh<DIM, PrimitiveType>::computeSplitCost(const BoundingBox<DIM>& boxLeft,
 														const BoundingBox<DIM>& boxRight,
@@ -84,21 +177,158 @@ inline float Sbvh<DIM, PrimitiveType>::computeSplitCost(const BoundingBox<DIM>&
 	return cost;
 }
 
+template<typename Func>
+inline void forEachBuildChunk(size_t n, bool parallelize, const Func& func)
+{
+	// processes fixed size chunks of [0, n), so that results do not depend on the thread count
+	if (parallelize) {
+		parallelFor(n, FCPW_SBVH_PARALLEL_LOOP_GRAIN_SIZE, func);
+
+	} else {
+		for (size_t begin = 0; begin < n; begin += FCPW_SBVH_PARALLEL_LOOP_GRAIN_SIZE) {
+			func(begin, std::min(begin + FCPW_SBVH_PARALLEL_LOOP_GRAIN_SIZE, n));
+		}
+	}
+}
+
+template<size_t DIM, typename PrimitiveType>
+inline void Sbvh<DIM, PrimitiveType>::computeNodeBounds(const std::vector<BoundingBox<DIM>>& referenceBoxes,
+														const std::vector<Vector<DIM>>& referenceCentroids,
+														int nodeStart, int nodeEnd, bool parallelize,
+														BoundingBox<DIM>& nodeBoundingBox,
+														BoundingBox<DIM>& nodeCentroidBox) const
+{
+	nodeBoundingBox = BoundingBox<DIM>();
+	nodeCentroidBox = BoundingBox<DIM>();
+
+	if (parallelize) {
+		// compute the bounds of fixed size chunks in parallel and merge them
+		int nReferences = nodeEnd - nodeStart;
+		int nChunks = (nReferences + FCPW_SBVH_PARALLEL_LOOP_GRAIN_SIZE - 1)/FCPW_SBVH_PARALLEL_LOOP_GRAIN_SIZE;
+		std::vector<BoundingBox<DIM>> chunkBoundingBoxes(nChunks), chunkCentroidBoxes(nChunks);
+
+		auto computeChunkBounds = [&](size_t begin, size_t end) {
+			int chunk = (int)begin/FCPW_SBVH_PARALLEL_LOOP_GRAIN_SIZE;
+			for (int p = nodeStart + (int)begin; p < nodeStart + (int)end; p++) {
+				chunkBoundingBoxes[chunk].expandToInclude(referenceBoxes[p]);
+				chunkCentroidBoxes[chunk].expandToInclude(referenceCentroids[p]);
+			}
+		};
+
+		parallelFor(nReferences, FCPW_SBVH_PARALLEL_LOOP_GRAIN_SIZE, computeChunkBounds);
+		for (int c = 0; c < nChunks; c++) {
+			nodeBoundingBox.expandToInclude(chunkBoundingBoxes[c]);
+			nodeCentroidBox.expandToInclude(chunkCentroidBoxes[c]);
+		}
+
+	} else {
+		for (int p = nodeStart; p < nodeEnd; p++) {
+			nodeBoundingBox.expandToInclude(referenceBoxes[p]);
+			nodeCentroidBox.expandToInclude(referenceCentroids[p]);
+		}
+	}
+}
+
+template<size_t DIM, typename PrimitiveType>
+inline void SbvhBins<DIM, PrimitiveType>::reset(int nBins_)
+{
+	nBins = nBins_;
+	boxMin.assign(DIM*nBins, PaddedVector::Constant(maxFloat));
+	boxMax.assign(DIM*nBins, PaddedVector::Constant(-maxFloat));
+	counts.assign(DIM*nBins, 0);
+	rightBoxMin.resize(nBins);
+	rightBoxMax.resize(nBins);
+	rightCounts.resize(nBins);
+}
+
+template<size_t DIM, typename PrimitiveType>
+inline void Sbvh<DIM, PrimitiveType>::binReferences(const BoundingBox<DIM>& nodeCentroidBox,
+													const std::vector<BoundingBox<DIM>>& referenceBoxes,
+													const std::vector<Vector<DIM>>& referenceCentroids,
+													int nodeStart, int nodeEnd, bool parallelize,
+													SbvhBins<DIM, PrimitiveType>& bins) const
+{
+	using PaddedVector = typename SbvhBins<DIM, PrimitiveType>::PaddedVector;
+	int nBins = bins.nBins;
+
+	// flat dimensions map all references to the first bin
+	Vector<DIM> extent = nodeCentroidBox.extent();
+	Vector<DIM> scale = Vector<DIM>::Zero();
+	for (size_t dim = 0; dim < DIM; dim++) {
+		if (extent[dim] >= 1e-6) scale[dim] = nBins/extent[dim];
+	}
+
+	auto binRange = [&](int rangeStart, int rangeEnd, SbvhBins<DIM, PrimitiveType>& rangeBins) {
+		PaddedVector *boxMin = rangeBins.boxMin.data();
+		PaddedVector *boxMax = rangeBins.boxMax.data();
+		int *counts = rangeBins.counts.data();
+		PaddedVector pMin = PaddedVector::Zero();
+		PaddedVector pMax = PaddedVector::Zero();
+
+		for (int p = rangeStart; p < rangeEnd; p++) {
+			// load the reference box once and expand its bin along each dimension
+			pMin.template head<DIM>() = referenceBoxes[p].pMin;
+			pMax.template head<DIM>() = referenceBoxes[p].pMax;
+			Vector<DIM> binCoords = (referenceCentroids[p] - nodeCentroidBox.pMin).cwiseProduct(scale);
+
+			for (size_t dim = 0; dim < DIM; dim++) {
+				int b = dim*nBins + clamp((int)binCoords[dim], 0, nBins - 1);
+				boxMin[b] = boxMin[b].cwiseMin(pMin);
+				boxMax[b] = boxMax[b].cwiseMax(pMax);
+				counts[b] += 1;
+			}
+		}
+	};
+
+	if (parallelize) {
+		// bin fixed size chunks in parallel and merge their bins
+		int nReferences = nodeEnd - nodeStart;
+		int nChunks = (nReferences + FCPW_SBVH_PARALLEL_LOOP_GRAIN_SIZE - 1)/FCPW_SBVH_PARALLEL_LOOP_GRAIN_SIZE;
+		std::vector<SbvhBins<DIM, PrimitiveType>> chunkBins(nChunks, SbvhBins<DIM, PrimitiveType>(nBins));
+
+		auto binChunk = [&](size_t begin, size_t end) {
+			int chunk = (int)begin/FCPW_SBVH_PARALLEL_LOOP_GRAIN_SIZE;
+			binRange(nodeStart + (int)begin, nodeStart + (int)end, chunkBins[chunk]);
+		};
+
+		parallelFor(nReferences, FCPW_SBVH_PARALLEL_LOOP_GRAIN_SIZE, binChunk);
+		for (int c = 0; c < nChunks; c++) {
+			for (int b = 0; b < (int)DIM*nBins; b++) {
+				bins.boxMin[b] = bins.boxMin[b].cwiseMin(chunkBins[c].boxMin[b]);
+				bins.boxMax[b] = bins.boxMax[b].cwiseMax(chunkBins[c].boxMax[b]);
+				bins.counts[b] += chunkBins[c].counts[b];
+			}
+		}
+
+	} else {
+		binRange(nodeStart, nodeEnd, bins);
+	}
+}
+
 template<size_t DIM, typename PrimitiveType>
 inline float Sbvh<DIM, PrimitiveType>::computeObjectSplit(const BoundingBox<DIM>& nodeBoundingBox,
 														  const BoundingBox<DIM>& nodeCentroidBox,
 														  const std::vector<BoundingBox<DIM>>& referenceBoxes,
 														  const std::vector<Vector<DIM>>& referenceCentroids,
-														  int depth, int nodeStart, int nodeEnd, int& splitDim,
-														  float& splitCoord, BoundingBox<DIM>& boxIntersected)
+														  SbvhBins<DIM, PrimitiveType>& bins, int depth, int nodeStart, int nodeEnd,
+														  bool parallelize, int& splitDim, float& splitCoord,
+														  BoundingBox<DIM>& boxIntersected) const
 {
+	using PaddedVector = typename SbvhBins<DIM, PrimitiveType>::PaddedVector;
 	float splitCost = maxFloat;
 	splitDim = -1;
 	splitCoord = 0.0f;
 	boxIntersected = BoundingBox<DIM>();
 
 	if (costHeuristic != CostHeuristic::LongestAxisCenter) {
-		Vector<DIM> extent = nodeBoundingBox.extent();
+		// bin references into buckets along all dimensions; nodes with few
+		// references use fewer buckets since most would otherwise be empty
+		int nBins = std::min(nBuckets, nodeEnd - nodeStart);
+		bins.reset(nBins);
+		binReferences(nodeCentroidBox, referenceBoxes, referenceCentroids,
+					  nodeStart, nodeEnd, parallelize, bins);
+
+		Vector<DIM> extent = nodeCentroidBox.extent();
 		float surfaceArea = nodeBoundingBox.surfaceArea();
 		float volume = nodeBoundingBox.volume();
 
@@ -107,46 +337,46 @@ inline float Sbvh<DIM, PrimitiveType>::computeObjectSplit(const BoundingBox<DIM>
 			// ignore flat dimension
 			if (extent[dim] < 1e-6) continue;
 
-			// bin references into buckets
-			float bucketWidth = extent[dim]/nBuckets;
-			for (int b = 0; b < nBuckets; b++) {
-				buckets[b].first = BoundingBox<DIM>();
-				buckets[b].second = 0;
-			}
-
-			for (int p = nodeStart; p < nodeEnd; p++) {
-				int bucketIndex = (int)((referenceCentroids[p][dim] - nodeBoundingBox.pMin[dim])/bucketWidth);
-				bucketIndex = clamp(bucketIndex, 0, nBuckets - 1);
-				buckets[bucketIndex].first.expandToInclude(referenceBoxes[p]);
-				buckets[bucketIndex].second += 1;
-			}
-
 			// sweep right to left to build right bucket bounding boxes
-			BoundingBox<DIM> boxRefRight;
-			for (int b = nBuckets - 1; b > 0; b--) {
-				boxRefRight.expandToInclude(buckets[b].first);
-				rightBucketBoxes[b].first = boxRefRight;
-				rightBucketBoxes[b].second = buckets[b].second;
-				if (b != nBuckets - 1) rightBucketBoxes[b].second += rightBucketBoxes[b + 1].second;
+			int offset = dim*nBins;
+			PaddedVector rightMin = PaddedVector::Constant(maxFloat);
+			PaddedVector rightMax = PaddedVector::Constant(-maxFloat);
+			int nReferencesRight = 0;
+			for (int b = nBins - 1; b > 0; b--) {
+				rightMin = rightMin.cwiseMin(bins.boxMin[offset + b]);
+				rightMax = rightMax.cwiseMax(bins.boxMax[offset + b]);
+				nReferencesRight += bins.counts[offset + b];
+				bins.rightBoxMin[b] = rightMin;
+				bins.rightBoxMax[b] = rightMax;
+				bins.rightCounts[b] = nReferencesRight;
 			}
 
 			// evaluate bucket split costs
-			BoundingBox<DIM> boxRefLeft;
+			PaddedVector leftMin = PaddedVector::Constant(maxFloat);
+			PaddedVector leftMax = PaddedVector::Constant(-maxFloat);
 			int nReferencesLeft = 0;
-			for (int b = 1; b < nBuckets; b++) {
-				boxRefLeft.expandToInclude(buckets[b - 1].first);
-				nReferencesLeft += buckets[b - 1].second;
-
-				if (nReferencesLeft > 0 && rightBucketBoxes[b].second > 0) {
-					float cost = computeSplitCost(boxRefLeft, rightBucketBoxes[b].first,
-												  surfaceArea, volume, nReferencesLeft,
-												  rightBucketBoxes[b].second, depth);
+			float bucketWidth = extent[dim]/nBins;
+			for (int b = 1; b < nBins; b++) {
+				leftMin = leftMin.cwiseMin(bins.boxMin[offset + b - 1]);
+				leftMax = leftMax.cwiseMax(bins.boxMax[offset + b - 1]);
+				nReferencesLeft += bins.counts[offset + b - 1];
+
+				// splitting after an empty bucket gives the same boxes as the previous split
+				if (bins.counts[offset + b - 1] > 0 && bins.rightCounts[b] > 0) {
+					BoundingBox<DIM> boxRefLeft, boxRefRight;
+					boxRefLeft.pMin = leftMin.template head<DIM>();
+					boxRefLeft.pMax = leftMax.template head<DIM>();
+					boxRefRight.pMin = bins.rightBoxMin[b].template head<DIM>();
+					boxRefRight.pMax = bins.rightBoxMax[b].template head<DIM>();
+
+					float cost = computeSplitCost(boxRefLeft, boxRefRight, surfaceArea, volume,
+												  nReferencesLeft, bins.rightCounts[b], depth);
 
 					if (cost < splitCost) {
 						splitCost = cost;
 						splitDim = dim;
-						splitCoord = nodeBoundingBox.pMin[dim] + b*bucketWidth;
-						boxIntersected = boxRefLeft.intersect(rightBucketBoxes[b].first);
+						splitCoord = nodeCentroidBox.pMin[dim] + b*bucketWidth;
+						boxIntersected = boxRefLeft.intersect(boxRefRight);
 					}
 				}
 			}
@@ -167,16 +397,76 @@ inline float Sbvh<DIM, PrimitiveType>::computeObjectSplit(const BoundingBox<DIM>
 
 template<size_t DIM, typename PrimitiveType>
 inline int Sbvh<DIM, PrimitiveType>::performObjectSplit(int nodeStart, int nodeEnd, int splitDim, float splitCoord,
-														std::vector<BoundingBox<DIM>>& referenceBoxes,
+														bool parallelize, std::vector<BoundingBox<DIM>>& referenceBoxes,
 														std::vector<Vector<DIM>>& referenceCentroids)
 {
 	int mid = nodeStart;
-	for (int i = nodeStart; i < nodeEnd; i++) {
-		if (referenceCentroids[i][splitDim] < splitCoord) {
-			std::swap(primitives[i], primitives[mid]);
-			std::swap(referenceBoxes[i], referenceBoxes[mid]);
-			std::swap(referenceCentroids[i], referenceCentroids[mid]);
-			mid++;
+	int nReferences = nodeEnd - nodeStart;
+	if (nReferences >= FCPW_SBVH_MIN_PARALLEL_LOOP_SIZE) {
+		// count the references on the left of the split in fixed size chunks
+		int nChunks = (nReferences + FCPW_SBVH_PARALLEL_LOOP_GRAIN_SIZE - 1)/FCPW_SBVH_PARALLEL_LOOP_GRAIN_SIZE;
+		std::vector<int> leftOffsets(nChunks, 0), rightOffsets(nChunks, 0);
+
+		auto countLeft = [&](size_t begin, size_t end) {
+			int chunk = (int)begin/FCPW_SBVH_PARALLEL_LOOP_GRAIN_SIZE;
+			for (int p = nodeStart + (int)begin; p < nodeStart + (int)end; p++) {
+				if (referenceCentroids[p][splitDim] < splitCoord) leftOffsets[chunk]++;
+			}
+		};
+
+		forEachBuildChunk(nReferences, parallelize, countLeft);
+
+		// compute the output offsets of each chunk
+		int nLeft = 0;
+		for (int c = 0; c < nChunks; c++) {
+			int nChunkLeft = leftOffsets[c];
+			leftOffsets[c] = nLeft;
+			rightOffsets[c] = c*FCPW_SBVH_PARALLEL_LOOP_GRAIN_SIZE - nLeft;
+			nLeft += nChunkLeft;
+		}
+
+		for (int c = 0; c < nChunks; c++) rightOffsets[c] += nLeft;
+		mid = nodeStart + nLeft;
+
+		if (mid != nodeStart && mid != nodeEnd) {
+			// scatter the references into their partitions and copy them back
+			std::vector<PrimitiveType *> partitionedPrimitives(nReferences);
+			std::vector<BoundingBox<DIM>> partitionedBoxes(nReferences);
+			std::vector<Vector<DIM>> partitionedCentroids(nReferences);
+
+			auto scatter = [&](size_t begin, size_t end) {
+				int chunk = (int)begin/FCPW_SBVH_PARALLEL_LOOP_GRAIN_SIZE;
+				int left = leftOffsets[chunk];
+				int right = rightOffsets[chunk];
+
+				for (int p = nodeStart + (int)begin; p < nodeStart + (int)end; p++) {
+					int q = referenceCentroids[p][splitDim] < splitCoord ? left++ : right++;
+					partitionedPrimitives[q] = primitives[p];
+					partitionedBoxes[q] = referenceBoxes[p];
+					partitionedCentroids[q] = referenceCentroids[p];
+				}
+			};
+
+			auto copyBack = [&](size_t begin, size_t end) {
+				for (int q = (int)begin; q < (int)end; q++) {
+					primitives[nodeStart + q] = partitionedPrimitives[q];
+					referenceBoxes[nodeStart + q] = partitionedBoxes[q];
+					referenceCentroids[nodeStart + q] = partitionedCentroids[q];
+				}
+			};
+
+			forEachBuildChunk(nReferences, parallelize, scatter);
+			forEachBuildChunk(nReferences, parallelize, copyBack);
+		}
+
+	} else {
+		for (int i = nodeStart; i < nodeEnd; i++) {
+			if (referenceCentroids[i][splitDim] < splitCoord) {
+				std::swap(primitives[i], primitives[mid]);
+				std::swap(referenceBoxes[i], referenceBoxes[mid]);
+				std::swap(referenceCentroids[i], referenceCentroids[mid]);
+				mid++;
+			}
 		}
 	}
 
@@ -195,28 +485,238 @@ inline int Sbvh<DIM, PrimitiveType>::performObjectSplit(int nodeStart, int nodeE
 }
 
 template<size_t DIM, typename PrimitiveType>
-inline void Sbvh<DIM, PrimitiveType>::buildRecursive(std::vector<BoundingBox<DIM>>& referenceBoxes,
-													 std::vector<Vector<DIM>>& referenceCentroids,
-													 std::vector<SbvhNode<DIM>>& buildNodes,
-													 int parent, int start, int end, int depth)
+inline float Sbvh<DIM, PrimitiveType>::computeSpatialSplit(const BoundingBox<DIM>& nodeBoundingBox,
+														   const std::vector<BoundingBox<DIM>>& referenceBoxes,
+														   SbvhBins<DIM, PrimitiveType>& bins, int depth, int nodeStart, int nodeEnd,
+														   int maxDuplicates, int& splitDim, float& splitCoord, BoundingBox<DIM>& boxLeft,
+														   BoundingBox<DIM>& boxRight, int& nReferencesLeft,
+														   int& nReferencesRight) const
+{
+	float splitCost = maxFloat;
+	splitDim = -1;
+	splitCoord = 0.0f;
+
+	// use at most one bin per reference, as for object splits
+	int nBins = std::min(nBuckets, nodeEnd - nodeStart);
+	bins.spatialBoxes.resize(nBins);
+	bins.spatialRightBoxes.resize(nBins);
+	bins.entries.resize(nBins);
+	bins.exits.resize(nBins);
+
+	Vector<DIM> extent = nodeBoundingBox.extent();
+	float surfaceArea = nodeBoundingBox.surfaceArea();
+	float volume = nodeBoundingBox.volume();
+
+	for (size_t dim = 0; dim < DIM; dim++) {
+		// ignore flat dimension
+		if (extent[dim] < 1e-6) continue;
+
+		for (int b = 0; b < nBins; b++) {
+			bins.spatialBoxes[b] = BoundingBox<DIM>();
+			bins.entries[b] = 0;
+			bins.exits[b] = 0;
+		}
+
+		// chop references into the bins they overlap
+		float binWidth = extent[dim]/nBins;
+		float binScale = nBins/extent[dim];
+		for (int p = nodeStart; p < nodeEnd; p++) {
+			const BoundingBox<DIM>& box = referenceBoxes[p];
+			int firstBin = clamp((int)((box.pMin[dim] - nodeBoundingBox.pMin[dim])*binScale), 0, nBins - 1);
+			int lastBin = clamp((int)((box.pMax[dim] - nodeBoundingBox.pMin[dim])*binScale), 0, nBins - 1);
+			BoundingBox<DIM> remainingBox = box;
+
+			for (int b = firstBin; b < lastBin; b++) {
+				BoundingBox<DIM> primitiveBoxLeft, primitiveBoxRight;
+				float binCoord = nodeBoundingBox.pMin[dim] + (b + 1)*binWidth;
+				primitives[p]->split(dim, binCoord, primitiveBoxLeft, primitiveBoxRight);
+
+				BoundingBox<DIM> chopLeft = primitiveBoxLeft.intersect(remainingBox);
+				if (chopLeft.isValid()) bins.spatialBoxes[b].expandToInclude(chopLeft);
+				remainingBox = primitiveBoxRight.intersect(remainingBox);
+			}
+
+			if (remainingBox.isValid()) bins.spatialBoxes[lastBin].expandToInclude(remainingBox);
+			bins.entries[firstBin] += 1;
+			bins.exits[lastBin] += 1;
+		}
+
+		// sweep right to left to build right bin bounding boxes
+		BoundingBox<DIM> boxRefRight;
+		for (int b = nBins - 1; b > 0; b--) {
+			boxRefRight.expandToInclude(bins.spatialBoxes[b]);
+			bins.spatialRightBoxes[b] = boxRefRight;
+		}
+
+		// evaluate bin split costs; references that straddle a split count on both sides
+		BoundingBox<DIM> boxRefLeft;
+		int nLeft = 0;
+		int nRight = nodeEnd - nodeStart;
+		for (int b = 1; b < nBins; b++) {
+			boxRefLeft.expandToInclude(bins.spatialBoxes[b - 1]);
+			nLeft += bins.entries[b - 1];
+			nRight -= bins.exits[b - 1];
+
+			// ignore splits that duplicate more references than there is space for
+			if (nLeft > 0 && nRight > 0 && nLeft + nRight - (nodeEnd - nodeStart) <= maxDuplicates &&
+				boxRefLeft.isValid() && bins.spatialRightBoxes[b].isValid()) {
+				float cost = computeSplitCost(boxRefLeft, bins.spatialRightBoxes[b], surfaceArea,
+											  volume, nLeft, nRight, depth);
+
+				if (cost < splitCost) {
+					splitCost = cost;
+					splitDim = dim;
+					splitCoord = nodeBoundingBox.pMin[dim] + b*binWidth;
+					boxLeft = boxRefLeft;
+					boxRight = bins.spatialRightBoxes[b];
+					nReferencesLeft = nLeft;
+					nReferencesRight = nRight;
+				}
+			}
+		}
+	}
+
+	return splitCost;
+}
+
+template<size_t DIM, typename PrimitiveType>
+inline int Sbvh<DIM, PrimitiveType>::performSpatialSplit(const BoundingBox<DIM>& nodeBoundingBox, int depth,
+														 int nodeStart, int& nodeEnd, int extendedEnd,
+														 int splitDim, float splitCoord,
+														 BoundingBox<DIM> boxLeft, BoundingBox<DIM> boxRight,
+														 int nReferencesLeft, int nReferencesRight,
+														 std::vector<BoundingBox<DIM>>& referenceBoxes,
+														 std::vector<Vector<DIM>>& referenceCentroids,
+														 SbvhBins<DIM, PrimitiveType>& bins)
+{
+	// the split lists live in the bins, so that their memory is reused across nodes
+	std::vector<PrimitiveType *>& leftPrimitives = bins.leftPrimitives;
+	std::vector<PrimitiveType *>& rightPrimitives = bins.rightPrimitives;
+	std::vector<BoundingBox<DIM>>& leftBoxes = bins.leftBoxes;
+	std::vector<BoundingBox<DIM>>& rightBoxes = bins.rightBoxes;
+	std::vector<Vector<DIM>>& leftCentroids = bins.leftCentroids;
+	std::vector<Vector<DIM>>& rightCentroids = bins.rightCentroids;
+	leftPrimitives.clear();
+	rightPrimitives.clear();
+	leftBoxes.clear();
+	rightBoxes.clear();
+	leftCentroids.clear();
+	rightCentroids.clear();
+
+	float surfaceArea = nodeBoundingBox.surfaceArea();
+	float volume = nodeBoundingBox.volume();
+
+	for (int p = nodeStart; p < nodeEnd; p++) {
+		const BoundingBox<DIM>& box = referenceBoxes[p];
+		bool addLeft = box.pMax[splitDim] <= splitCoord;
+		bool addRight = box.pMin[splitDim] >= splitCoord;
+		BoundingBox<DIM> splitBoxLeft = box, splitBoxRight = box;
+
+		if (!addLeft && !addRight) {
+			// clip the reference to both sides of the split plane
+			BoundingBox<DIM> primitiveBoxLeft, primitiveBoxRight;
+			primitives[p]->split(splitDim, splitCoord, primitiveBoxLeft, primitiveBoxRight);
+			splitBoxLeft = primitiveBoxLeft.intersect(box);
+			splitBoxRight = primitiveBoxRight.intersect(box);
+
+			if (!splitBoxLeft.isValid()) {
+				addRight = true;
+				splitBoxRight = box;
+
+			} else if (!splitBoxRight.isValid()) {
+				addLeft = true;
+				splitBoxLeft = box;
+
+			} else {
+				// unsplit the reference if moving it entirely to one side is cheaper than duplicating it
+				BoundingBox<DIM> boxLeftUnsplit = boxLeft;
+				BoundingBox<DIM> boxRightUnsplit = boxRight;
+				boxLeftUnsplit.expandToInclude(box);
+				boxRightUnsplit.expandToInclude(box);
+
+				float costSplit = computeSplitCost(boxLeft, boxRight, surfaceArea, volume,
+												   nReferencesLeft, nReferencesRight, depth);
+				float costLeft = computeSplitCost(boxLeftUnsplit, boxRight, surfaceArea, volume,
+												  nReferencesLeft, nReferencesRight - 1, depth);
+				float costRight = computeSplitCost(boxLeft, boxRightUnsplit, surfaceArea, volume,
+												   nReferencesLeft - 1, nReferencesRight, depth);
+
+				if (costLeft < costSplit && costLeft <= costRight) {
+					addLeft = true;
+					splitBoxLeft = box;
+					boxLeft = boxLeftUnsplit;
+					nReferencesRight--;
+
+				} else if (costRight < costSplit) {
+					addRight = true;
+					splitBoxRight = box;
+					boxRight = boxRightUnsplit;
+					nReferencesLeft--;
+
+				} else {
+					addLeft = true;
+					addRight = true;
+				}
+			}
+		}
+
+		if (addLeft) {
+			// clipped references are binned by the centroid of their box
+			leftPrimitives.emplace_back(primitives[p]);
+			leftBoxes.emplace_back(splitBoxLeft);
+			leftCentroids.emplace_back(addRight ? splitBoxLeft.centroid() : referenceCentroids[p]);
+		}
+
+		if (addRight) {
+			rightPrimitives.emplace_back(primitives[p]);
+			rightBoxes.emplace_back(splitBoxRight);
+			rightCentroids.emplace_back(addLeft ? splitBoxRight.centroid() : referenceCentroids[p]);
+		}
+	}
+
+	int nLeft = (int)leftPrimitives.size();
+	int nRight = (int)rightPrimitives.size();
+	if (nLeft == 0 || nRight == 0 || nodeStart + nLeft + nRight > extendedEnd) return -1;
+
+	// write the left references followed by the right references
+	for (int p = 0; p < nLeft; p++) {
+		primitives[nodeStart + p] = leftPrimitives[p];
+		referenceBoxes[nodeStart + p] = leftBoxes[p];
+		referenceCentroids[nodeStart + p] = leftCentroids[p];
+	}
+
+	int mid = nodeStart + nLeft;
+	for (int p = 0; p < nRight; p++) {
+		primitives[mid + p] = rightPrimitives[p];
+		referenceBoxes[mid + p] = rightBoxes[p];
+		referenceCentroids[mid + p] = rightCentroids[p];
+	}
+
+	nodeEnd = mid + nRight;
+	return mid;
+}
+
+template<size_t DIM, typename PrimitiveType>
+inline int Sbvh<DIM, PrimitiveType>::buildRecursive(std::vector<BoundingBox<DIM>>& referenceBoxes,
+													std::vector<Vector<DIM>>& referenceCentroids,
+													std::vector<SbvhNode<DIM>>& buildNodes,
+													SbvhBins<DIM, PrimitiveType>& bins, int parent, int start, int end,
+													int extendedEnd, int depth)
 {
 	const int Untouched    = 0xffffffff;
 	const int TouchedTwice = 0xfffffffd;
-	maxDepth = std::max(depth, maxDepth);
 
 	// add node to tree
 	SbvhNode<DIM> node;
-	int currentNodeIndex = nNodes;
+	int currentNodeIndex = (int)buildNodes.size();
 	int nReferences = end - start;
 
-	nNodes++;
+	// process nodes near the root with parallel loops, while there are fewer tasks than threads
+	bool parallelize = nReferences >= FCPW_SBVH_MIN_PARALLEL_LOOP_SIZE && (1 << depth) < nThreads;
 
 	// calculate the bounding box for this node
 	BoundingBox<DIM> bb, bc;
-	for (int p = start; p < end; p++) {
-		bb.expandToInclude(referenceBoxes[p]);
-		bc.expandToInclude(referenceCentroids[p]);
-	}
+	computeNodeBounds(referenceBoxes, referenceCentroids, start, end, parallelize, bb, bc);
 
 	node.box = bb;
 
@@ -225,7 +725,6 @@ inline void Sbvh<DIM, PrimitiveType>::buildRecursive(std::vector<BoundingBox<DIM
 	if (nReferences <= leafSize || depth == FCPW_SBVH_MAX_DEPTH - 2) {
 		node.referenceOffset = start;
 		node.nReferences = nReferences;
-		nLeafs++;
 
 	} else {
 		node.secondChildOffset = Untouched;
@@ -242,71 +741,288 @@ inline void Sbvh<DIM, PrimitiveType>::buildRecursive(std::vector<BoundingBox<DIM
 		// when this is the second touch, this is the right child;
 		// the right child sets up the offset for the flat tree
 		if (buildNodes[parent].secondChildOffset == TouchedTwice) {
-			buildNodes[parent].secondChildOffset = nNodes - 1 - parent;
+			buildNodes[parent].secondChildOffset = currentNodeIndex - parent;
 		}
 	}
 
 	// if this is a leaf, no need to subdivide
-	if (node.nReferences > 0) return;
+	if (node.nReferences > 0) return depth;
 
 	// compute object split
 	int splitDim;
 	float splitCoord;
 	BoundingBox<DIM> boxIntersected;
-	float splitCost = computeObjectSplit(bb, bc, referenceBoxes, referenceCentroids, depth,
-										 start, end, splitDim, splitCoord, boxIntersected);
+	float splitCost = computeObjectSplit(bb, bc, referenceBoxes, referenceCentroids, bins, depth,
+										 start, end, parallelize, splitDim, splitCoord, boxIntersected);
+
+	// try a spatial split if the children of the object split overlap significantly
+	int mid = -1;
+	if (useSpatialSplits && extendedEnd > end && boxIntersected.isValid() &&
+		boxIntersected.surfaceArea() > minSpatialSplitOverlap) {
+		int spatialSplitDim, nReferencesLeft, nReferencesRight;
+		float spatialSplitCoord;
+		BoundingBox<DIM> boxLeft, boxRight;
+		float spatialSplitCost = computeSpatialSplit(bb, referenceBoxes, bins, depth, start, end,
+													 extendedEnd - end, spatialSplitDim, spatialSplitCoord,
+													 boxLeft, boxRight, nReferencesLeft, nReferencesRight);
+
+		if (spatialSplitCost < splitCost) {
+			mid = performSpatialSplit(bb, depth, start, end, extendedEnd, spatialSplitDim, spatialSplitCoord,
+									  boxLeft, boxRight, nReferencesLeft, nReferencesRight,
+									  referenceBoxes, referenceCentroids, bins);
+		}
+	}
 
 	// partition the list of references on split
-	int nReferencesAdded = 0;
-	int mid = performObjectSplit(start, end, splitDim, splitCoord, referenceBoxes, referenceCentroids);
+	if (mid == -1) {
+		mid = performObjectSplit(start, end, splitDim, splitCoord, parallelize, referenceBoxes, referenceCentroids);
+	}
+
+	// share the free space for duplicated references among the children, in proportion to their sizes
+	int leftExtendedEnd = mid;
+	int rightStart = mid;
+	int rightEnd = end;
+	if (extendedEnd > end) {
+		int leftSpace = (int)((int64_t)(extendedEnd - end)*(mid - start)/(end - start));
+		std::move_backward(primitives.begin() + mid, primitives.begin() + end, primitives.begin() + end + leftSpace);
+		std::move_backward(referenceBoxes.begin() + mid, referenceBoxes.begin() + end,
+						   referenceBoxes.begin() + end + leftSpace);
+		std::move_backward(referenceCentroids.begin() + mid, referenceCentroids.begin() + end,
+						   referenceCentroids.begin() + end + leftSpace);
+
+		leftExtendedEnd = mid + leftSpace;
+		rightStart = mid + leftSpace;
+		rightEnd = end + leftSpace;
+	}
+
+	if (nReferences >= FCPW_SBVH_MIN_TASK_SIZE && depth < maxTaskDepth) {
+		// build the left subtree in a separate task and the right subtree on this thread;
+		// since the children reference disjoint ranges and child offsets are relative,
+		// the subtrees can be spliced into the depth first layout once both are built
+		std::vector<SbvhNode<DIM>> leftNodes, rightNodes;
+		std::future<int> leftTask = std::async(std::launch::async, [&]() {
+			SbvhBins<DIM, PrimitiveType> leftBins(nBuckets);
+			return buildRecursive(referenceBoxes, referenceCentroids, leftNodes, leftBins,
+								  0xfffffffc, start, mid, leftExtendedEnd, depth + 1);
+		});
+
+		int rightDepth = buildRecursive(referenceBoxes, referenceCentroids, rightNodes, bins,
+										0xfffffffc, rightStart, rightEnd, extendedEnd, depth + 1);
+		int leftDepth = leftTask.get();
+
+		buildNodes[currentNodeIndex].secondChildOffset = 1 + (int)leftNodes.size();
+		buildNodes.insert(buildNodes.end(), leftNodes.begin(), leftNodes.end());
+		buildNodes.insert(buildNodes.end(), rightNodes.begin(), rightNodes.end());
+
+		return std::max(leftDepth, rightDepth);
+	}
 
 	// push left and right children
-	buildRecursive(referenceBoxes, referenceCentroids, buildNodes, currentNodeIndex, start, mid, depth + 1);
-	buildRecursive(referenceBoxes, referenceCentroids, buildNodes, currentNodeIndex, mid, end, depth + 1);
+	int leftDepth = buildRecursive(referenceBoxes, referenceCentroids, buildNodes, bins,
+								   currentNodeIndex, start, mid, leftExtendedEnd, depth + 1);
+	int rightDepth = buildRecursive(referenceBoxes, referenceCentroids, buildNodes, bins,
+									currentNodeIndex, rightStart, rightEnd, extendedEnd, depth + 1);
+
+	return std::max(leftDepth, rightDepth);
 }
 
 template<size_t DIM, typename PrimitiveType>
 inline void Sbvh<DIM, PrimitiveType>::build()
 {
-	// precompute bounding boxes and centroids
-	int nReferences = (int)primitives.size();
+	// precompute bounding boxes and centroids, reserving space for
+	// references duplicated by spatial splits
+	int nReferences = nPrimitives;
+	if (useSpatialSplits) nReferences += (int)(nPrimitives*FCPW_SBVH_SPATIAL_SPLIT_BUDGET);
 	std::vector<BoundingBox<DIM>> referenceBoxes;
 	std::vector<Vector<DIM>> referenceCentroids;
 
+	primitives.resize(nReferences, nullptr);
 	referenceBoxes.resize(nReferences);
 	referenceCentroids.resize(nReferences);
 	flatTree.reserve(nReferences*2);
-	BoundingBox<DIM> boxRoot;
 
-	for (int i = 0; i < nReferences; i++) {
-		referenceBoxes[i] = primitives[i]->boundingBox();
-		referenceCentroids[i] = primitives[i]->centroid();
-		boxRoot.expandToInclude(referenceBoxes[i]);
+	auto computeReferenceBounds = [&](size_t begin, size_t end) {
+		for (int i = (int)begin; i < (int)end; i++) {
+			referenceBoxes[i] = primitives[i]->boundingBox();
+			referenceCentroids[i] = primitives[i]->centroid();
+		}
+	};
+
+	if (nPrimitives >= FCPW_SBVH_MIN_PARALLEL_LOOP_SIZE) {
+		parallelFor(nPrimitives, FCPW_SBVH_PARALLEL_LOOP_GRAIN_SIZE, computeReferenceBounds);
+
+	} else {
+		computeReferenceBounds(0, nPrimitives);
+	}
+
+	if (useSpatialSplits) {
+		// spatial splits are only considered for nodes with significant overlap relative to the root
+		BoundingBox<DIM> rootBoundingBox, rootCentroidBox;
+		computeNodeBounds(referenceBoxes, referenceCentroids, 0, nPrimitives,
+						  nPrimitives >= FCPW_SBVH_MIN_PARALLEL_LOOP_SIZE,
+						  rootBoundingBox, rootCentroidBox);
+		minSpatialSplitOverlap = overlapThreshold*rootBoundingBox.surfaceArea();
 	}
 
 	// build tree recursively
-	buildRecursive(referenceBoxes, referenceCentroids, flatTree, 0xfffffffc, 0, nReferences, 0);
+	SbvhBins<DIM, PrimitiveType> bins(nBuckets);
+	maxDepth = buildRecursive(referenceBoxes, referenceCentroids, flatTree, bins,
+							  0xfffffffc, 0, nPrimitives, nReferences, 0);
+
+	if (useSpatialSplits) {
+		// remove the free space left between leaves
+		std::vector<PrimitiveType *> compactedReferences;
+		compactedReferences.reserve(nReferences);
+
+		for (int i = 0; i < (int)flatTree.size(); i++) {
+			SbvhNode<DIM>& node = flatTree[i];
+
+			if (node.nReferences > 0) {
+				int referenceOffset = (int)compactedReferences.size();
+				compactedReferences.insert(compactedReferences.end(), primitives.begin() + node.referenceOffset,
+										   primitives.begin() + node.referenceOffset + node.nReferences);
+				node.referenceOffset = referenceOffset;
+			}
+		}
+
+		primitives = std::move(compactedReferences);
+
+		// flag duplicated references, so that each primitive is visited once
+		std::unordered_set<const PrimitiveType *> visited;
+		isDuplicateReference.resize(primitives.size());
+
+		for (int i = 0; i < (int)primitives.size(); i++) {
+			isDuplicateReference[i] = !visited.insert(primitives[i]).second;
+		}
+	}
+
+	// count nodes and leaves
+	nodes = flatTree.data();
+	nNodes = (int)flatTree.size();
+	nLeafs = 0;
+	for (int i = 0; i < nNodes; i++) {
+		if (flatTree[i].nReferences > 0) nLeafs++;
+	}
+}
+
+template<size_t DIM, typename PrimitiveType>
+inline void populateLeafPrimitive(const PrimitiveType *primitive,
+								  SbvhLeafPrimitive<DIM, PrimitiveType>& leafPrimitive)
+{
+	std::cerr << "populateLeafPrimitive(): DIM: " << DIM << " not supported" << std::endl;
+	exit(EXIT_FAILURE);
+}
+
+inline void populateLeafPrimitive(const LineSegment *lineSegment,
+								  SbvhLeafPrimitive<3, LineSegment>& leafPrimitive)
+{
+	leafPrimitive.positions[0] = lineSegment->soup->positions[lineSegment->indices[0]];
+	leafPrimitive.positions[1] = lineSegment->soup->positions[lineSegment->indices[1]];
+	leafPrimitive.primitiveIndex = lineSegment->pIndex;
+}
+
+inline void populateLeafPrimitive(const Triangle *triangle,
+								  SbvhLeafPrimitive<3, Triangle>& leafPrimitive)
+{
+	leafPrimitive.positions[0] = triangle->soup->positions[triangle->indices[0]];
+	leafPrimitive.positions[1] = triangle->soup->positions[triangle->indices[1]];
+	leafPrimitive.positions[2] = triangle->soup->positions[triangle->indices[2]];
+	leafPrimitive.primitiveIndex = triangle->pIndex;
+}
+
+template<size_t DIM, typename PrimitiveType>
+inline void Sbvh<DIM, PrimitiveType>::populateLeafPrimitives()
+{
+	if (copyLeafPrimitives && (leafPrimitiveType == ObjectType::LineSegments ||
+							   leafPrimitiveType == ObjectType::Triangles)) {
+		int nReferences = (int)primitives.size();
+		leafPrimitives.resize(nReferences);
+
+		auto populate = [this](size_t begin, size_t end) {
+			for (int i = (int)begin; i < (int)end; i++) {
+				populateLeafPrimitive(primitives[i], leafPrimitives[i]);
+			}
+		};
 
-	// clear working set
-	buckets.clear();
-	rightBucketBoxes.clear();
+		if (nReferences >= FCPW_SBVH_MIN_PARALLEL_LOOP_SIZE) {
+			parallelFor(nReferences, FCPW_SBVH_PARALLEL_LOOP_GRAIN_SIZE, populate);
+
+		} else {
+			populate(0, nReferences);
+		}
+	}
+}
+
+template<size_t DIM, typename PrimitiveType>
+inline void Sbvh<DIM, PrimitiveType>::computeParents()
+{
+	// the first child of an inner node is stored right after it
+	parents.resize(nNodes);
+	if (nNodes > 0) parents[0] = -1;
+
+	for (int i = 0; i < nNodes; i++) {
+		const SbvhNode<DIM>& node = nodes[i];
+		if (node.nReferences == 0) {
+			parents[i + 1] = i;
+			parents[i + node.secondChildOffset] = i;
+		}
+	}
+}
+
+template<size_t DIM, typename PrimitiveType>
+inline bool Sbvh<DIM, PrimitiveType>::hasValidNodes() const
+{
+	int nReferences = (int)primitives.size();
+	if (nNodes <= 0) return false;
+	if (isDuplicateReference.size() > 0 && (int)isDuplicateReference.size() != nReferences) return false;
+
+	for (int i = 0; i < nNodes; i++) {
+		const SbvhNode<DIM>& node = nodes[i];
+		if (node.nReferences > 0) {
+			// leaf node
+			if (node.referenceOffset < 0 || node.nReferences > nReferences - node.referenceOffset) return false;
+
+		} else if (node.nReferences == 0) {
+			// inner node; children are stored after their parent, so that traversals terminate
+			if (i + 1 >= nNodes || node.secondChildOffset < 2 || node.secondChildOffset >= nNodes - i) return false;
+
+		} else {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+template<typename PrimitiveType, typename Func>
+inline void forEachUniquePrimitive(const std::vector<PrimitiveType *>& primitives,
+								   const std::vector<bool>& isDuplicateReference, const Func& func)
+{
+	bool hasDuplicates = isDuplicateReference.size() > 0;
+	for (int p = 0; p < (int)primitives.size(); p++) {
+		if (!hasDuplicates || !isDuplicateReference[p]) func(primitives[p]);
+	}
+}
+
+template<size_t DIM, typename PrimitiveType>
+inline const std::vector<PrimitiveType *>& Sbvh<DIM, PrimitiveType>::getReferences() const
+{
+	return primitives;
 }
 
 template<size_t DIM, typename PrimitiveType>
 inline BoundingBox<DIM> Sbvh<DIM, PrimitiveType>::boundingBox() const
 {
-	return flatTree.size() > 0 ? flatTree[0].box : BoundingBox<DIM>();
+	return nNodes > 0 ? nodes[0].box : BoundingBox<DIM>();
 }
 
 template<size_t DIM, typename PrimitiveType>
 inline Vector<DIM> Sbvh<DIM, PrimitiveType>::centroid() const
 {
 	Vector<DIM> c = Vector<DIM>::Zero();
-	int nPrimitives = (int)primitives.size();
-
-	for (int p = 0; p < nPrimitives; p++) {
-		c += primitives[p]->centroid();
-	}
+	forEachUniquePrimitive(primitives, isDuplicateReference, [&c](const PrimitiveType *primitive) {
+		c += primitive->centroid();
+	});
 
 	return c/nPrimitives;
 }
@@ -315,9 +1031,9 @@ template<size_t DIM, typename PrimitiveType>
 inline float Sbvh<DIM, PrimitiveType>::surfaceArea() const
 {
 	float area = 0.0f;
-	for (int p = 0; p < (int)primitives.size(); p++) {
-		area += primitives[p]->surfaceArea();
-	}
+	forEachUniquePrimitive(primitives, isDuplicateReference, [&area](const PrimitiveType *primitive) {
+		area += primitive->surfaceArea();
+	});
 
 	return area;
 }
@@ -326,19 +1042,163 @@ template<size_t DIM, typename PrimitiveType>
 inline float Sbvh<DIM, PrimitiveType>::signedVolume() const
 {
 	float volume = 0.0f;
-	for (int p = 0; p < (int)primitives.size(); p++) {
-		volume += primitives[p]->signedVolume();
-	}
+	forEachUniquePrimitive(primitives, isDuplicateReference, [&volume](const PrimitiveType *primitive) {
+		volume += primitive->signedVolume();
+	});
 
 	return volume;
 }
 
 template<size_t DIM, typename PrimitiveType>
-inline bool Sbvh<DIM, PrimitiveType>::processSubtreeForIntersection(Ray<DIM>& r, std::vector<Interaction<DIM>>& is,
-																	int nodeStartIndex, int aggregateIndex, bool checkForOcclusion,
+inline void Sbvh<DIM, PrimitiveType>::refit()
+{
+	// refit child aggregates before their bounding boxes are read
+	if (primitiveTypeIsAggregate) {
+		forEachUniquePrimitive(primitives, isDuplicateReference, [](PrimitiveType *primitive) {
+			reinterpret_cast<Aggregate<DIM> *>(primitive)->refit();
+		});
+	}
+
+	// rewrite the leaf primitive positions in place
+	populateLeafPrimitives();
+
+	// children are stored after their parent, so a reverse sweep visits them first;
+	// leaves with references clipped by spatial splits are refit conservatively
+	for (int i = nNodes - 1; i >= 0; i--) {
+		SbvhNode<DIM>& node = nodes[i];
+		BoundingBox<DIM> box;
+
+		if (node.nReferences > 0) {
+			for (int j = 0; j < node.nReferences; j++) {
+				box.expandToInclude(primitives[node.referenceOffset + j]->boundingBox());
+			}
+
+		} else {
+			box.expandToInclude(nodes[i + 1].box);
+			box.expandToInclude(nodes[i + node.secondChildOffset].box);
+		}
+
+		node.box = box;
+	}
+}
+
+template<size_t DIM, typename PrimitiveType>
+inline bool Sbvh<DIM, PrimitiveType>::releasePrimitives()
+{
+	copyLeafPrimitives = false;
+	std::vector<SbvhLeafPrimitive<DIM, PrimitiveType>>().swap(leafPrimitives);
+	return false;
+}
+
+template<size_t DIM, typename PrimitiveType>
+inline bool intersectLeafPrimitive(const SbvhLeafPrimitive<DIM, PrimitiveType>& leafPrimitive,
+								   Ray<DIM>& r, Interaction<DIM>& i)
+{
+	std::cerr << "intersectLeafPrimitive(): DIM: " << DIM << " not supported" << std::endl;
+	exit(EXIT_FAILURE);
+
+	return false;
+}
+
+inline bool intersectLeafPrimitive(const SbvhLeafPrimitive<3, LineSegment>& leafPrimitive,
+								   Ray<3>& r, Interaction<3>& i)
+{
+	float d, t;
+	if (intersectLineSegment(leafPrimitive.positions[0], leafPrimitive.positions[1], r, d, t)) {
+		i.d = d;
+		i.p = r(d);
+		i.uv[0] = t;
+		i.uv[1] = -1;
+		i.primitiveIndex = leafPrimitive.primitiveIndex;
+
+		return true;
+	}
+
+	return false;
+}
+
+inline bool intersectLeafPrimitive(const SbvhLeafPrimitive<3, Triangle>& leafPrimitive,
+								   Ray<3>& r, Interaction<3>& i)
+{
+	float d;
+	Vector2 t;
+	if (intersectTriangle(leafPrimitive.positions[0], leafPrimitive.positions[1],
+						  leafPrimitive.positions[2], r, d, t)) {
+		i.d = d;
+		i.p = r(d);
+		i.uv = t;
+		i.primitiveIndex = leafPrimitive.primitiveIndex;
+
+		return true;
+	}
+
+	return false;
+}
+
+template<size_t DIM, typename PrimitiveType>
+inline bool findClosestPointLeafPrimitive(const SbvhLeafPrimitive<DIM, PrimitiveType>& leafPrimitive,
+										  BoundingSphere<DIM>& s, Interaction<DIM>& i)
+{
+	std::cerr << "findClosestPointLeafPrimitive(): DIM: " << DIM << " not supported" << std::endl;
+	exit(EXIT_FAILURE);
+
+	return false;
+}
+
+inline bool findClosestPointLeafPrimitive(const SbvhLeafPrimitive<3, LineSegment>& leafPrimitive,
+										  BoundingSphere<3>& s, Interaction<3>& i)
+{
+	float d = findClosestPointLineSegment(leafPrimitive.positions[0], leafPrimitive.positions[1],
+										  s.c, i.p, i.uv[0]);
+
+	if (d*d <= s.r2) {
+		i.d = d;
+		i.primitiveIndex = leafPrimitive.primitiveIndex;
+		i.uv[1] = -1;
+
+		return true;
+	}
+
+	return false;
+}
+
+inline bool findClosestPointLeafPrimitive(const SbvhLeafPrimitive<3, Triangle>& leafPrimitive,
+										  BoundingSphere<3>& s, Interaction<3>& i)
+{
+	float d = findClosestPointTriangle(leafPrimitive.positions[0], leafPrimitive.positions[1],
+									   leafPrimitive.positions[2], s.c, i.p, i.uv);
+
+	if (d*d <= s.r2) {
+		i.d = d;
+		i.primitiveIndex = leafPrimitive.primitiveIndex;
+
+		return true;
+	}
+
+	return false;
+}
+
+template<size_t DIM, typename PrimitiveType>
+template<typename FilterFunc>
+inline bool Sbvh<DIM, PrimitiveType>::processSubtreeForIntersection(Ray<DIM>& r, Interaction<DIM>& i,
+																	std::vector<Interaction<DIM>>& is,
+																	FilterFunc&& filter, int nodeStartIndex,
+																	int aggregateIndex, bool checkForOcclusion,
 																	bool recordAllHits, BvhTraversal *subtree,
 																	float *boxHits, int& hits, int& nodesVisited) const
 {
+	// nested aggregates filter their own hits, and report whether the filter terminated the query
+	constexpr bool filterHits = !std::is_same<typename std::decay<FilterFunc>::type, AcceptAllHits>::value;
+	bool terminated = false;
+	auto filterNested = [&](const Interaction<DIM>& c) -> HitFilterResult {
+		HitFilterResult result = filter(c);
+		if (result == HitFilterResult::Terminate) terminated = true;
+
+		return result;
+	};
+
+	// line segments and triangles are queried through their leaf primitives without virtual calls
+	bool hasLeafPrimitives = leafPrimitives.size() > 0;
 	int stackPtr = 0;
 	while (stackPtr >= 0) {
 		// pop off the next node to work on
@@ -348,7 +1208,7 @@ inline bool Sbvh<DIM, PrimitiveType>::processSubtreeForIntersection(Ray<DIM>& r,
 
 		// if this node is further than the closest found intersection, continue
 		if (!recordAllHits && near > r.tMax) continue;
-		const SbvhNode<DIM>& node(flatTree[nodeIndex]);
+		const SbvhNode<DIM>& node(nodes[nodeIndex]);
 
 		// is leaf -> intersect
 		if (node.nReferences > 0) {
@@ -357,43 +1217,89 @@ inline bool Sbvh<DIM, PrimitiveType>::processSubtreeForIntersection(Ray<DIM>& r,
 				const PrimitiveType *prim = primitives[referenceIndex];
 				nodesVisited++;
 
-				int hit = 0;
-				std::vector<Interaction<DIM>> cs;
-				if (primitiveTypeIsAggregate) {
-					const Aggregate<DIM> *aggregate = reinterpret_cast<const Aggregate<DIM> *>(prim);
-					hit = aggregate->intersectFromNode(r, cs, nodeStartIndex, aggregateIndex,
-													   nodesVisited, checkForOcclusion, recordAllHits);
+				if (recordAllHits) {
+					int hit = 0;
+					QueryBuffer<DIM> buffer;
+					std::vector<Interaction<DIM>>& cs = buffer.interactions;
+					if (primitiveTypeIsAggregate) {
+						const Aggregate<DIM> *aggregate = reinterpret_cast<const Aggregate<DIM> *>(prim);
+						hit = aggregate->intersectFromNode(r, cs, nodeStartIndex, aggregateIndex,
+														   nodesVisited, checkForOcclusion, recordAllHits);
 
-				} else {
-					hit = prim->intersect(r, cs, checkForOcclusion, recordAllHits);
-					for (int i = 0; i < (int)cs.size(); i++) {
-						cs[i].nodeIndex = nodeIndex;
-						cs[i].referenceIndex = referenceIndex;
-						cs[i].objectIndex = this->index;
+					} else {
+						if (hasLeafPrimitives) {
+							cs.resize(1);
+							hit = intersectLeafPrimitive(leafPrimitives[referenceIndex], r, cs[0]) ? 1 : 0;
+							cs.resize(hit);
+
+						} else {
+							hit = prim->intersect(r, cs, checkForOcclusion, recordAllHits);
+						}
+
+						for (int j = 0; j < (int)cs.size(); j++) {
+							cs[j].nodeIndex = nodeIndex;
+							cs[j].referenceIndex = referenceIndex;
+							cs[j].objectIndex = this->index;
+						}
 					}
-				}
 
-				// keep the closest intersection only
-				if (hit > 0) {
-					if (checkForOcclusion) {
-						is.clear();
-						return true;
-					}
+					// record all intersections
+					if (hit > 0) {
+						if (checkForOcclusion) {
+							is.clear();
+							return true;
+						}
 
-					hits += hit;
-					if (recordAllHits) {
+						hits += hit;
 						is.insert(is.end(), cs.begin(), cs.end());
+					}
+
+				} else {
+					bool hit = false;
+					Interaction<DIM> c;
+					HitFilterResult result = HitFilterResult::Accept;
+					if (primitiveTypeIsAggregate) {
+						const Aggregate<DIM> *aggregate = reinterpret_cast<const Aggregate<DIM> *>(prim);
+						if (filterHits) {
+							// the type erased filter wraps a reference to the lambda, which avoids allocating
+							hit = aggregate->intersectFromNode(r, c, HitFilter<DIM>(std::ref(filterNested)),
+															   nodeStartIndex, aggregateIndex,
+															   nodesVisited, checkForOcclusion);
+							if (terminated) result = HitFilterResult::Terminate;
+
+						} else {
+							hit = aggregate->intersectFromNode(r, c, nodeStartIndex, aggregateIndex,
+															   nodesVisited, checkForOcclusion);
+						}
 
 					} else {
-						r.tMax = std::min(r.tMax, cs[0].d);
-						is[0] = cs[0];
+						// the filter requires a complete interaction, even for occlusion queries; call through
+						// the base class, since primitives that only override the vector version of intersect
+						// hide this overload
+						const Primitive<DIM> *primitive = prim;
+						hit = hasLeafPrimitives ? intersectLeafPrimitive(leafPrimitives[referenceIndex], r, c) :
+												  primitive->intersect(r, c, checkForOcclusion && !filterHits);
+						c.nodeIndex = nodeIndex;
+						c.referenceIndex = referenceIndex;
+						c.objectIndex = this->index;
+						if (filterHits && hit) result = filter(c);
+					}
+
+					// keep the closest intersection only
+					if (hit && result != HitFilterResult::Reject) {
+						if (checkForOcclusion) return true;
+
+						hits++;
+						r.tMax = std::min(r.tMax, c.d);
+						i = c;
+						if (result == HitFilterResult::Terminate) return true;
 					}
 				}
 			}
 
 		} else { // not a leaf
-			bool hit0 = flatTree[nodeIndex + 1].box.intersect(r, boxHits[0], boxHits[1]);
-			bool hit1 = flatTree[nodeIndex + node.secondChildOffset].box.intersect(r, boxHits[2], boxHits[3]);
+			bool hit0 = nodes[nodeIndex + 1].box.intersect(r, boxHits[0], boxHits[1]);
+			bool hit1 = nodes[nodeIndex + node.secondChildOffset].box.intersect(r, boxHits[2], boxHits[3]);
 
 			// did we hit both nodes?
 			if (hit0 && hit1) {
@@ -443,30 +1349,36 @@ inline int Sbvh<DIM, PrimitiveType>::intersectFromNode(Ray<DIM>& r, std::vector<
 													   int nodeStartIndex, int aggregateIndex, int& nodesVisited,
 													   bool checkForOcclusion, bool recordAllHits) const
 {
+	if (!recordAllHits) {
+		// find the closest intersection without allocating
+		is.resize(1);
+		bool hit = intersectFromNode(r, is[0], nodeStartIndex, aggregateIndex,
+									 nodesVisited, checkForOcclusion);
+		if (hit && checkForOcclusion) is.clear();
+
+		return hit ? 1 : 0;
+	}
+
 	int hits = 0;
-	if (!recordAllHits) is.resize(1);
+	Interaction<DIM> c; // unused since all hits are recorded
 	BvhTraversal subtree[FCPW_SBVH_MAX_DEPTH];
 	float boxHits[4];
 
 	int rootIndex = aggregateIndex == this->index ? nodeStartIndex : 0;
-	if (flatTree[rootIndex].box.intersect(r, boxHits[0], boxHits[1])) {
+	if (nodes[rootIndex].box.intersect(r, boxHits[0], boxHits[1])) {
 		subtree[0].node = rootIndex;
 		subtree[0].distance = boxHits[0];
-		bool occluded = processSubtreeForIntersection(r, is, nodeStartIndex, aggregateIndex, checkForOcclusion,
-													  recordAllHits, subtree, boxHits, hits, nodesVisited);
+		bool occluded = processSubtreeForIntersection(r, c, is, AcceptAllHits(), nodeStartIndex, aggregateIndex,
+													  checkForOcclusion, recordAllHits, subtree, boxHits,
+													  hits, nodesVisited);
 		if (occluded) return 1;
 	}
 
 	if (hits > 0) {
 		// sort by distance and remove duplicates
-		if (recordAllHits) {
-			std::sort(is.begin(), is.end(), compareInteractions<DIM>);
-			is = removeDuplicates<DIM>(is);
-			hits = (int)is.size();
-
-		} else {
-			hits = 1;
-		}
+		std::sort(is.begin(), is.end(), compareInteractions<DIM>);
+		removeDuplicates<DIM>(is);
+		hits = (int)is.size();
 
 		// compute normals
 		if (this->computeNormals && !primitiveTypeIsAggregate) {
@@ -481,6 +1393,59 @@ inline int Sbvh<DIM, PrimitiveType>::intersectFromNode(Ray<DIM>& r, std::vector<
 	return 0;
 }
 
+template<size_t DIM, typename PrimitiveType>
+inline bool Sbvh<DIM, PrimitiveType>::intersectFromNode(Ray<DIM>& r, Interaction<DIM>& i,
+														int nodeStartIndex, int aggregateIndex,
+														int& nodesVisited, bool checkForOcclusion) const
+{
+	return intersectFromNodeWithFilter(r, i, AcceptAllHits(), nodeStartIndex, aggregateIndex,
+									   nodesVisited, checkForOcclusion);
+}
+
+template<size_t DIM, typename PrimitiveType>
+inline bool Sbvh<DIM, PrimitiveType>::intersectFromNode(Ray<DIM>& r, Interaction<DIM>& i,
+														const HitFilter<DIM>& filter,
+														int nodeStartIndex, int aggregateIndex,
+														int& nodesVisited, bool checkForOcclusion) const
+{
+	return intersectFromNodeWithFilter(r, i, filter, nodeStartIndex, aggregateIndex,
+									   nodesVisited, checkForOcclusion);
+}
+
+template<size_t DIM, typename PrimitiveType>
+template<typename FilterFunc>
+inline bool Sbvh<DIM, PrimitiveType>::intersectFromNodeWithFilter(Ray<DIM>& r, Interaction<DIM>& i,
+																  FilterFunc&& filter, int nodeStartIndex,
+																  int aggregateIndex, int& nodesVisited,
+																  bool checkForOcclusion) const
+{
+	int hits = 0;
+	std::vector<Interaction<DIM>> is; // remains empty since all hits are not recorded
+	BvhTraversal subtree[FCPW_SBVH_MAX_DEPTH];
+	float boxHits[4];
+
+	int rootIndex = aggregateIndex == this->index ? nodeStartIndex : 0;
+	if (nodes[rootIndex].box.intersect(r, boxHits[0], boxHits[1])) {
+		subtree[0].node = rootIndex;
+		subtree[0].distance = boxHits[0];
+		bool terminated = processSubtreeForIntersection(r, i, is, filter, nodeStartIndex, aggregateIndex,
+														checkForOcclusion, false, subtree, boxHits,
+														hits, nodesVisited);
+		if (terminated && checkForOcclusion) return true;
+	}
+
+	if (hits > 0) {
+		// compute normal
+		if (this->computeNormals && !primitiveTypeIsAggregate) {
+			i.computeNormal(primitives[i.referenceIndex]);
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
 template<size_t DIM, typename PrimitiveType>
 inline void Sbvh<DIM, PrimitiveType>::processSubtreeForClosestPoint(BoundingSphere<DIM>& s, Interaction<DIM>& i,
 																	int nodeStartIndex, int aggregateIndex,
@@ -488,8 +1453,16 @@ inline void Sbvh<DIM, PrimitiveType>::processSubtreeForClosestPoint(BoundingSphe
 																	BvhTraversal *subtree, float *boxHits,
 																	bool& notFound, int& nodesVisited) const
 {
-	// TODO: use direction to boundary guess
+	// the ray in the direction to the boundary guess orders children that both contain the sphere center
+	bool useHint = boundaryHint.squaredNorm() > 0.0f;
+	Ray<DIM> hintRay(s.c, useHint ? boundaryHint : Vector<DIM>::Ones());
+	bool hasLeafPrimitives = leafPrimitives.size() > 0;
+
+	// boxes clipped by spatial splits need not contain any point of their primitives, so the
+	// furthest distance to them does not bound the distance to the closest primitive
+	bool shrinkToFurthestBox = isDuplicateReference.size() == 0;
 	int stackPtr = 0;
+
 	while (stackPtr >= 0) {
 		// pop off the next node to work on
 		int nodeIndex = subtree[stackPtr].node;
@@ -498,7 +1471,7 @@ inline void Sbvh<DIM, PrimitiveType>::processSubtreeForClosestPoint(BoundingSphe
 
 		// if this node is further than the closest found primitive, continue
 		if (near > s.r2) continue;
-		const SbvhNode<DIM>& node(flatTree[nodeIndex]);
+		const SbvhNode<DIM>& node(nodes[nodeIndex]);
 
 		// is leaf -> compute squared distance
 		if (node.nReferences > 0) {
@@ -515,7 +1488,8 @@ inline void Sbvh<DIM, PrimitiveType>::processSubtreeForClosestPoint(BoundingSphe
 																boundaryHint, nodesVisited);
 
 				} else {
-					found = prim->findClosestPoint(s, c);
+					found = hasLeafPrimitives ? findClosestPointLeafPrimitive(leafPrimitives[referenceIndex], s, c) :
+												prim->findClosestPoint(s, c);
 					c.nodeIndex = nodeIndex;
 					c.referenceIndex = referenceIndex;
 					c.objectIndex = this->index;
@@ -530,11 +1504,11 @@ inline void Sbvh<DIM, PrimitiveType>::processSubtreeForClosestPoint(BoundingSphe
 			}
 
 		} else { // not a leaf
-			bool hit0 = flatTree[nodeIndex + 1].box.overlap(s, boxHits[0], boxHits[1]);
-			s.r2 = std::min(s.r2, boxHits[1]);
+			bool hit0 = nodes[nodeIndex + 1].box.overlap(s, boxHits[0], boxHits[1]);
+			if (shrinkToFurthestBox) s.r2 = std::min(s.r2, boxHits[1]);
 
-			bool hit1 = flatTree[nodeIndex + node.secondChildOffset].box.overlap(s, boxHits[2], boxHits[3]);
-			s.r2 = std::min(s.r2, boxHits[3]);
+			bool hit1 = nodes[nodeIndex + node.secondChildOffset].box.overlap(s, boxHits[2], boxHits[3]);
+			if (shrinkToFurthestBox) s.r2 = std::min(s.r2, boxHits[3]);
 
 			// is there overlap with both nodes?
 			if (hit0 && hit1) {
@@ -544,7 +1518,16 @@ inline void Sbvh<DIM, PrimitiveType>::processSubtreeForClosestPoint(BoundingSphe
 
 				// ... if the right child was actually closer, swap the relavent values
 				if (boxHits[0] == 0.0f && boxHits[2] == 0.0f) {
-					if (boxHits[3] < boxHits[1]) {
+					// the sphere center is inside both boxes; the boundary is more likely to be in
+					// the box that the ray in the direction of the boundary guess leaves last
+					float tEnter0, tExit0, tEnter1, tExit1;
+					if (useHint && nodes[closer].box.intersect(hintRay, tEnter0, tExit0) &&
+						nodes[other].box.intersect(hintRay, tEnter1, tExit1) && tExit0 != tExit1) {
+						if (tExit1 > tExit0) {
+							std::swap(closer, other);
+						}
+
+					} else if (boxHits[3] < boxHits[1]) {
 						std::swap(closer, other);
 					}
 
@@ -591,8 +1574,9 @@ inline bool Sbvh<DIM, PrimitiveType>::findClosestPointFromNode(BoundingSphere<DI
 	float boxHits[4];
 
 	int rootIndex = aggregateIndex == this->index ? nodeStartIndex : 0;
-	if (flatTree[rootIndex].box.overlap(s, boxHits[0], boxHits[1])) {
-		s.r2 = std::min(s.r2, boxHits[1]);
+	if (nodes[rootIndex].box.overlap(s, boxHits[0], boxHits[1])) {
+		// see processSubtreeForClosestPoint for boxes clipped by spatial splits
+		if (isDuplicateReference.size() == 0) s.r2 = std::min(s.r2, boxHits[1]);
 		subtree[0].node = rootIndex;
 		subtree[0].distance = boxHits[0];
 		processSubtreeForClosestPoint(s, i, nodeStartIndex, aggregateIndex, boundaryHint,
@@ -611,4 +1595,189 @@ inline bool Sbvh<DIM, PrimitiveType>::findClosestPointFromNode(BoundingSphere<DI
 	return false;
 }
 
+template<size_t DIM, typename PrimitiveType>
+inline bool Sbvh<DIM, PrimitiveType>::findClosestPointBottomUp(BoundingSphere<DIM>& s, Interaction<DIM>& i,
+															   int nodeStartIndex, int aggregateIndex,
+															   int& nodesVisited) const
+{
+	// the start node only refers to a node of this aggregate if its index matches
+	if (aggregateIndex != this->index || nodeStartIndex < 0 || nodeStartIndex >= nNodes) {
+		return findClosestPointFromNode(s, i, 0, this->index, Vector<DIM>::Zero(), nodesVisited);
+	}
+
+	bool notFound = true;
+	BvhTraversal subtree[FCPW_SBVH_MAX_DEPTH];
+	float boxHits[4];
+
+	// the subtree of the start node likely contains the closest point, so searching it first
+	// shrinks the sphere enough to cull most of the sibling subtrees visited on the way up
+	int nodeIndex = nodeStartIndex;
+	int subtreeIndex = nodeStartIndex;
+
+	while (true) {
+		if (nodes[subtreeIndex].box.overlap(s, boxHits[0], boxHits[1])) {
+			// see processSubtreeForClosestPoint for boxes clipped by spatial splits
+			if (isDuplicateReference.size() == 0) s.r2 = std::min(s.r2, boxHits[1]);
+			subtree[0].node = subtreeIndex;
+			subtree[0].distance = boxHits[0];
+			processSubtreeForClosestPoint(s, i, nodeStartIndex, aggregateIndex, Vector<DIM>::Zero(),
+										  subtree, boxHits, notFound, nodesVisited);
+		}
+
+		// climb to the parent, and search the subtree of the sibling next
+		int parent = parents[nodeIndex];
+		if (parent == -1) break;
+
+		subtreeIndex = parent + 1 == nodeIndex ? parent + nodes[parent].secondChildOffset : parent + 1;
+		nodeIndex = parent;
+		nodesVisited++;
+	}
+
+	if (!notFound) {
+		// compute normal
+		if (this->computeNormals && !primitiveTypeIsAggregate) {
+			i.computeNormal(primitives[i.referenceIndex]);
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
+template<size_t DIM, typename PrimitiveType>
+inline bool Sbvh<DIM, PrimitiveType>::findKClosestPointsFromNode(BoundingSphere<DIM>& s,
+																 std::vector<Interaction<DIM>>& is,
+																 int k, int nodeStartIndex, int aggregateIndex,
+																 int& nodesVisited) const
+{
+	bool found = false;
+	bool hasLeafPrimitives = leafPrimitives.size() > 0;
+	BvhTraversal subtree[FCPW_SBVH_MAX_DEPTH];
+	float boxHits[4];
+	int stackPtr = -1;
+
+	// unlike the closest point query, the sphere can't be shrunk to the furthest distance to a box,
+	// since it only bounds the distance to the closest primitive; it shrinks to the kth closest
+	// distance instead once k primitives have been found
+	int rootIndex = aggregateIndex == this->index ? nodeStartIndex : 0;
+	if (nodes[rootIndex].box.overlap(s, boxHits[0], boxHits[1])) {
+		stackPtr++;
+		subtree[stackPtr].node = rootIndex;
+		subtree[stackPtr].distance = boxHits[0];
+	}
+
+	while (stackPtr >= 0) {
+		// pop off the next node to work on
+		int nodeIndex = subtree[stackPtr].node;
+		float near = subtree[stackPtr].distance;
+		stackPtr--;
+
+		// if this node is further than the kth closest found primitive, continue
+		if (near > s.r2) continue;
+		const SbvhNode<DIM>& node(nodes[nodeIndex]);
+
+		// is leaf -> add primitives inside the sphere to the heap
+		if (node.nReferences > 0) {
+			for (int p = 0; p < node.nReferences; p++) {
+				int referenceIndex = node.referenceOffset + p;
+				const PrimitiveType *prim = primitives[referenceIndex];
+				nodesVisited++;
+
+				if (primitiveTypeIsAggregate) {
+					const Aggregate<DIM> *aggregate = reinterpret_cast<const Aggregate<DIM> *>(prim);
+					if (aggregate->findKClosestPointsFromNode(s, is, k, nodeStartIndex,
+															  aggregateIndex, nodesVisited)) {
+						found = true;
+					}
+
+				} else {
+					Interaction<DIM> c;
+					bool inside = hasLeafPrimitives ? findClosestPointLeafPrimitive(leafPrimitives[referenceIndex], s, c) :
+													  prim->findClosestPoint(s, c);
+					if (inside) {
+						c.nodeIndex = nodeIndex;
+						c.referenceIndex = referenceIndex;
+						c.objectIndex = this->index;
+						if (this->computeNormals) c.computeNormal(prim);
+						if (addKClosestInteraction<DIM>(s, is, c, k)) found = true;
+					}
+				}
+			}
+
+		} else { // not a leaf
+			bool hit0 = nodes[nodeIndex + 1].box.overlap(s, boxHits[0], boxHits[1]);
+			bool hit1 = nodes[nodeIndex + node.secondChildOffset].box.overlap(s, boxHits[2], boxHits[3]);
+
+			// push the farther child first, then the closer
+			if (hit0 && hit1) {
+				int closer = nodeIndex + 1;
+				int other = nodeIndex + node.secondChildOffset;
+
+				if (boxHits[2] < boxHits[0]) {
+					std::swap(boxHits[0], boxHits[2]);
+					std::swap(closer, other);
+				}
+
+				stackPtr++;
+				subtree[stackPtr].node = other;
+				subtree[stackPtr].distance = boxHits[2];
+
+				stackPtr++;
+				subtree[stackPtr].node = closer;
+				subtree[stackPtr].distance = boxHits[0];
+
+			} else if (hit0) {
+				stackPtr++;
+				subtree[stackPtr].node = nodeIndex + 1;
+				subtree[stackPtr].distance = boxHits[0];
+
+			} else if (hit1) {
+				stackPtr++;
+				subtree[stackPtr].node = nodeIndex + node.secondChildOffset;
+				subtree[stackPtr].distance = boxHits[2];
+			}
+
+			nodesVisited++;
+		}
+	}
+
+	return found;
+}
+
+template<size_t DIM, typename PrimitiveType>
+inline void Sbvh<DIM, PrimitiveType>::findClosestPoints(const float *xyz, const float *squaredRadii,
+														 size_t nQueries, size_t begin, size_t end,
+														 float *distances, float *points,
+														 int *primitiveIndices, float *uvs) const
+{
+	// call the traversal directly to avoid a virtual call per query
+	auto findClosestPoint = [this](BoundingSphere<DIM>& s, Interaction<DIM>& i) -> bool {
+		int nodesVisited = 0;
+		return this->Sbvh<DIM, PrimitiveType>::findClosestPointFromNode(s, i, 0, this->index,
+																		Vector<DIM>::Zero(), nodesVisited);
+	};
+
+	findClosestPointsInRange<DIM>(findClosestPoint, xyz, squaredRadii, nQueries, begin, end,
+								  distances, points, primitiveIndices, uvs);
+}
+
+template<size_t DIM, typename PrimitiveType>
+inline int Sbvh<DIM, PrimitiveType>::intersectRays(const float *origins, const float *directions,
+												   const float *tMax, size_t nRays, size_t begin,
+												   size_t end, float *distances, float *points,
+												   int *primitiveIndices, float *uvs,
+												   bool checkForOcclusion) const
+{
+	// call the traversal directly to avoid a virtual call per ray
+	auto intersect = [this](Ray<DIM>& r, Interaction<DIM>& i, bool checkForOcclusion) -> bool {
+		int nodesVisited = 0;
+		return this->Sbvh<DIM, PrimitiveType>::intersectFromNode(r, i, 0, this->index,
+																 nodesVisited, checkForOcclusion);
+	};
+
+	return intersectRaysInRange<DIM>(intersect, origins, directions, tMax, nRays, begin, end,
+									 distances, points, primitiveIndices, uvs, checkForOcclusion);
+}
+
 } // namespace fcpw
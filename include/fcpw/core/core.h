@@ -3,6 +3,7 @@
 // global includes
 #include <algorithm>
 #include <cmath>
+#include <cstdint>
 #include <iostream>
 #include <limits>
 #include <memory>
@@ -12,6 +13,8 @@
 #include <chrono>
 #include <random>
 #include <type_traits>
+#include <thread>
+#include <atomic>
 #ifdef FCPW_USE_ENOKI
 	#include <enoki/array.h>
 #endif
@@ -96,4 +99,41 @@ inline Vector<DIM> uniformRealRandomVector(float a=0.0f, float b=1.0f)
 	return v;
 }
 
+// splits the range [0, n) into chunks of size grainSize and calls func(begin, end) on each
+// chunk; chunks are distributed dynamically across all available hardware threads, with the
+// calling thread participating in the work. NOTE: the threads are started and joined on every
+// call, which costs tens of microseconds; ranges with fewer than minParallelSize elements are
+// therefore processed on the calling thread
+template<typename Func>
+inline void parallelFor(size_t n, size_t grainSize, const Func& func, size_t minParallelSize=0)
+{
+	if (n == 0) return;
+	grainSize = std::max(grainSize, (size_t)1);
+	size_t nChunks = (n + grainSize - 1)/grainSize;
+	size_t nThreads = std::min((size_t)std::max(std::thread::hardware_concurrency(), 1u), nChunks);
+
+	if (nThreads == 1 || n < minParallelSize) {
+		func((size_t)0, n);
+		return;
+	}
+
+	std::atomic<size_t> nextChunk(0);
+	auto work = [&]() {
+		while (true) {
+			size_t chunk = nextChunk.fetch_add(1);
+			if (chunk >= nChunks) break;
+
+			size_t begin = chunk*grainSize;
+			size_t end = std::min(begin + grainSize, n);
+			func(begin, end);
+		}
+	};
+
+	std::vector<std::thread> threads;
+	threads.reserve(nThreads - 1);
+	for (size_t i = 0; i < nThreads - 1; i++) threads.emplace_back(work);
+	work();
+	for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+}
+
 } // namespace fcpw
@@ -65,21 +65,29 @@ inline bool compareInteractions(const Interaction<DIM>& i, const Interaction<DIM
 	return i.d < j.d;
 }
 
+// removes consecutive duplicate interactions from a list sorted by distance, in place
 template<size_t DIM>
-inline std::vector<Interaction<DIM>> removeDuplicates(const std::vector<Interaction<DIM>>& is) {
-	int N = (int)is.size();
-	std::vector<bool> isDuplicate(N, false);
-	std::vector<Interaction<DIM>> cs;
-
-	for (int i = 0; i < N - 1; i++) {
-		if (is[i] == is[i + 1]) isDuplicate[i + 1] = true;
-	}
-
-	for (int i = 0; i < N; i++) {
-		if (!isDuplicate[i]) cs.emplace_back(is[i]);
-	}
+inline void removeDuplicates(std::vector<Interaction<DIM>>& is) {
+	is.erase(std::unique(is.begin(), is.end()), is.end());
+}
 
-	return cs;
+// sorts interactions by distance and removes interactions with the same primitive, e.g., from a
+// primitive referenced twice by a bvh with spatial splits; unlike removeDuplicates, interactions
+// with distinct primitives that share a closest point are kept
+template<size_t DIM>
+inline void removeDuplicatePrimitives(std::vector<Interaction<DIM>>& is) {
+	std::sort(is.begin(), is.end(), [](const Interaction<DIM>& i, const Interaction<DIM>& j) {
+		if (i.d != j.d) return i.d < j.d;
+		if (i.objectIndex != j.objectIndex) return i.objectIndex < j.objectIndex;
+		if (i.primitiveIndex != j.primitiveIndex) return i.primitiveIndex < j.primitiveIndex;
+
+		return std::lexicographical_compare(i.p.data(), i.p.data() + DIM, j.p.data(), j.p.data() + DIM);
+	});
+
+	auto last = std::unique(is.begin(), is.end(), [](const Interaction<DIM>& i, const Interaction<DIM>& j) {
+		return i.objectIndex == j.objectIndex && i.primitiveIndex == j.primitiveIndex && i == j;
+	});
+	is.erase(last, is.end());
 }
 
 } // namespace fcpw
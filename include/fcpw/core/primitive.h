@@ -2,7 +2,8 @@
 
 #include <fcpw/core/ray.h>
 #include <fcpw/core/bounding_volumes.h>
-#include <fcpw/core/interaction.h>
+#include <fcpw/core/query_context.h>
+#include <fcpw/core/serialization.h>
 
 namespace fcpw {
 
@@ -35,6 +36,21 @@ public:
 	virtual int intersect(Ray<DIM>& r, std::vector<Interaction<DIM>>& is,
 						  bool checkForOcclusion=false, bool recordAllHits=false) const = 0;
 
+	// intersects with ray without allocating, returns the closest interaction in i; primitives
+	// that do not override this method fall back to the version above with a buffer from the
+	// query context of the thread
+	virtual bool intersect(Ray<DIM>& r, Interaction<DIM>& i, bool checkForOcclusion=false) const {
+		QueryBuffer<DIM> buffer;
+		std::vector<Interaction<DIM>>& is = buffer.interactions;
+		int hits = this->intersect(r, is, checkForOcclusion, false);
+		if (hits > 0) {
+			if (!checkForOcclusion) i = is[0];
+			return true;
+		}
+
+		return false;
+	}
+
 	// finds closest point to sphere center
 	virtual bool findClosestPoint(BoundingSphere<DIM>& s, Interaction<DIM>& i) const = 0;
 };
@@ -52,6 +68,199 @@ public:
 	virtual Vector<DIM - 1> barycentricCoordinates(const Vector<DIM>& p) const = 0;
 };
 
+// writes the result of the closest point query of query point q of a batch; see
+// findClosestPointsInRange for the layout of the output buffers
+template<size_t DIM>
+inline void writeClosestPointInteraction(bool found, const Interaction<DIM>& i, size_t q, size_t nQueries,
+										 float *distances, float *points, int *primitiveIndices, float *uvs)
+{
+	if (found) {
+		distances[q] = i.d;
+		if (points) for (size_t k = 0; k < DIM; k++) points[k*nQueries + q] = i.p[k];
+		if (primitiveIndices) primitiveIndices[q] = i.primitiveIndex;
+		if (uvs) for (size_t k = 0; k < DIM - 1; k++) uvs[k*nQueries + q] = i.uv[k];
+
+	} else {
+		distances[q] = maxFloat;
+		if (primitiveIndices) primitiveIndices[q] = -1;
+	}
+}
+
+// performs closest point queries for the query points in the range [begin, end) using the
+// provided query function; query points, closest points and uvs are stored in structure-of-arrays
+// layout, i.e., xyz[k*nQueries + q] is the kth coordinate of query q; squaredRadii, points,
+// primitiveIndices and uvs are optional. For queries without a closest point, the distance is
+// set to maxFloat and the primitive index to -1, while the points and uvs are left untouched
+template<size_t DIM, typename QueryFunc>
+inline void findClosestPointsInRange(const QueryFunc& findClosestPoint, const float *xyz,
+									 const float *squaredRadii, size_t nQueries, size_t begin,
+									 size_t end, float *distances, float *points,
+									 int *primitiveIndices, float *uvs)
+{
+	for (size_t q = begin; q < end; q++) {
+		Vector<DIM> x;
+		for (size_t k = 0; k < DIM; k++) x[k] = xyz[k*nQueries + q];
+
+		Interaction<DIM> i;
+		BoundingSphere<DIM> s(x, squaredRadii ? squaredRadii[q] : maxFloat);
+		bool found = findClosestPoint(s, i);
+
+		writeClosestPointInteraction<DIM>(found, i, q, nQueries, distances, points,
+										  primitiveIndices, uvs);
+	}
+}
+
+// writes the result of the intersection query of ray q of a batch; see intersectRaysInRange
+// for the layout of the output buffers
+template<size_t DIM>
+inline void writeRayInteraction(bool hit, const Interaction<DIM>& i, size_t q, size_t nRays,
+								float *distances, float *points, int *primitiveIndices,
+								float *uvs, bool checkForOcclusion)
+{
+	if (hit) {
+		if (checkForOcclusion) {
+			distances[q] = 0.0f;
+			return;
+		}
+
+		distances[q] = i.d;
+		if (points) for (size_t k = 0; k < DIM; k++) points[k*nRays + q] = i.p[k];
+		if (primitiveIndices) primitiveIndices[q] = i.primitiveIndex;
+		if (uvs) for (size_t k = 0; k < DIM - 1; k++) uvs[k*nRays + q] = i.uv[k];
+
+	} else {
+		distances[q] = maxFloat;
+		if (primitiveIndices && !checkForOcclusion) primitiveIndices[q] = -1;
+	}
+}
+
+// intersects the rays in the range [begin, end) of a batch using the provided query function;
+// ray origins, directions, hit points and uvs are stored in structure-of-arrays layout, i.e.,
+// origins[k*nRays + q] is the kth coordinate of ray q; tMax, points, primitiveIndices and uvs
+// are optional. For rays without a hit, the distance is set to maxFloat and the primitive index
+// to -1. If checkForOcclusion is enabled, only the distances are written, with occluded rays
+// assigned a distance of 0. Returns the number of rays with a hit
+template<size_t DIM, typename QueryFunc>
+inline int intersectRaysInRange(const QueryFunc& intersect, const float *origins,
+								const float *directions, const float *tMax, size_t nRays,
+								size_t begin, size_t end, float *distances, float *points,
+								int *primitiveIndices, float *uvs, bool checkForOcclusion)
+{
+	int hits = 0;
+	for (size_t q = begin; q < end; q++) {
+		Vector<DIM> o, d;
+		for (size_t k = 0; k < DIM; k++) {
+			o[k] = origins[k*nRays + q];
+			d[k] = directions[k*nRays + q];
+		}
+
+		Interaction<DIM> i;
+		Ray<DIM> r(o, d, tMax ? tMax[q] : maxFloat);
+		bool hit = intersect(r, i, checkForOcclusion);
+
+		hits += hit ? 1 : 0;
+		writeRayInteraction<DIM>(hit, i, q, nRays, distances, points,
+								 primitiveIndices, uvs, checkForOcclusion);
+	}
+
+	return hits;
+}
+
+// intersects the rays in the range [begin, end) of a batch in packets of up to PACKET_SIZE
+// consecutive rays using the provided packet query function intersect(rays, is, nRays,
+// checkForOcclusion), which returns a bit mask of the rays with a hit; see intersectRaysInRange
+// for the layout of the input and output buffers. Returns the number of rays with a hit
+template<size_t DIM, size_t PACKET_SIZE, typename PacketQueryFunc>
+inline int intersectRayPacketsInRange(const PacketQueryFunc& intersect, const float *origins,
+									  const float *directions, const float *tMax, size_t nRays,
+									  size_t begin, size_t end, float *distances, float *points,
+									  int *primitiveIndices, float *uvs, bool checkForOcclusion)
+{
+	int hits = 0;
+	Ray<DIM> rays[PACKET_SIZE];
+	Interaction<DIM> is[PACKET_SIZE];
+
+	for (size_t packetBegin = begin; packetBegin < end; packetBegin += PACKET_SIZE) {
+		int nPacketRays = (int)std::min(PACKET_SIZE, end - packetBegin);
+		for (int j = 0; j < nPacketRays; j++) {
+			size_t q = packetBegin + j;
+			Vector<DIM> o, d;
+			for (size_t k = 0; k < DIM; k++) {
+				o[k] = origins[k*nRays + q];
+				d[k] = directions[k*nRays + q];
+			}
+
+			rays[j] = Ray<DIM>(o, d, tMax ? tMax[q] : maxFloat);
+			is[j] = Interaction<DIM>();
+		}
+
+		uint32_t hitMask = intersect(rays, is, nPacketRays, checkForOcclusion);
+		for (int j = 0; j < nPacketRays; j++) {
+			bool hit = (hitMask >> j) & 1u;
+
+			hits += hit ? 1 : 0;
+			writeRayInteraction<DIM>(hit, is[j], packetBegin + j, nRays, distances, points,
+									 primitiveIndices, uvs, checkForOcclusion);
+		}
+	}
+
+	return hits;
+}
+
+// adds c to the k closest interactions found so far, which are stored in a max heap ordered by
+// distance; c is skipped if it duplicates an interaction in the heap (e.g., a primitive referenced
+// twice by a bvh with spatial splits). Once the heap holds k interactions, the sphere is shrunk to
+// the kth closest distance so that further primitives are culled. For k = maxInt, every interaction
+// inside the sphere is appended, and duplicates are removed with removeDuplicatePrimitives once the
+// query completes, since checking for them here is quadratic in the number of results.
+// Returns whether c was added
+template<size_t DIM>
+inline bool addKClosestInteraction(BoundingSphere<DIM>& s, std::vector<Interaction<DIM>>& is,
+								   const Interaction<DIM>& c, int k)
+{
+	if (k <= 0 || c.d*c.d > s.r2) return false;
+	if (k == maxInt) {
+		is.emplace_back(c);
+		return true;
+	}
+
+	for (int j = 0; j < (int)is.size(); j++) {
+		if (is[j].primitiveIndex == c.primitiveIndex &&
+			is[j].objectIndex == c.objectIndex && is[j] == c) return false;
+	}
+
+	if ((int)is.size() == k) {
+		std::pop_heap(is.begin(), is.end(), compareInteractions<DIM>);
+		is.pop_back();
+	}
+
+	is.emplace_back(c);
+	std::push_heap(is.begin(), is.end(), compareInteractions<DIM>);
+	if ((int)is.size() == k) s.r2 = std::min(s.r2, is.front().d*is.front().d);
+
+	return true;
+}
+
+// result of an intersection filter, which is invoked on each candidate hit before it is accepted
+enum class HitFilterResult {
+	Accept, // accepts the hit, and continues the search for a closer hit
+	Reject, // ignores the hit, e.g., a self hit or a hit with a transparent face
+	Terminate // accepts the hit and ends the query, e.g., for occlusion queries
+};
+
+// type erased intersection filter, used to pass a filter through the virtual aggregate interface;
+// the candidate hit has its distance, point, uvs, primitive index and object index set
+template<size_t DIM>
+using HitFilter = std::function<HitFilterResult(const Interaction<DIM>&)>;
+
+// intersection filter that accepts every hit; traversals instantiated with it do not filter hits
+struct AcceptAllHits {
+	template<size_t DIM>
+	HitFilterResult operator()(const Interaction<DIM>& c) const {
+		return HitFilterResult::Accept;
+	}
+};
+
 template<size_t DIM>
 class Aggregate: public Primitive<DIM> {
 public:
@@ -75,15 +284,104 @@ public:
 	int intersect(Ray<DIM>& r, std::vector<Interaction<DIM>>& is,
 				  bool checkForOcclusion=false, bool recordAllHits=false) const {
 		int nodesVisited = 0;
+		is.clear();
 		return this->intersectFromNode(r, is, 0, this->index, nodesVisited, checkForOcclusion, recordAllHits);
 	}
 
+	// intersects with ray without allocating, returns the closest interaction in i
+	// NOTE: interaction is invalid when checkForOcclusion is enabled
+	bool intersect(Ray<DIM>& r, Interaction<DIM>& i, bool checkForOcclusion=false) const {
+		int nodesVisited = 0;
+		return this->intersectFromNode(r, i, 0, this->index, nodesVisited, checkForOcclusion);
+	}
+
+	// intersects with ray, returns the closest interaction accepted by filter in i
+	// NOTE: interaction is invalid when checkForOcclusion is enabled
+	bool intersect(Ray<DIM>& r, Interaction<DIM>& i, const HitFilter<DIM>& filter,
+				   bool checkForOcclusion=false) const {
+		int nodesVisited = 0;
+		return this->intersectFromNode(r, i, filter, 0, this->index, nodesVisited, checkForOcclusion);
+	}
+
 	// finds closest point to sphere center
 	bool findClosestPoint(BoundingSphere<DIM>& s, Interaction<DIM>& i) const {
 		int nodesVisited = 0;
 		return this->findClosestPointFromNode(s, i, 0, this->index, Vector<DIM>::Zero(), nodesVisited);
 	}
 
+	// finds the k closest primitives to sphere center, and returns their closest points in is
+	// sorted by distance; returns the number of primitives found inside the sphere
+	int findKClosestPoints(BoundingSphere<DIM>& s, std::vector<Interaction<DIM>>& is, int k) const {
+		int nodesVisited = 0;
+		is.clear();
+		this->findKClosestPointsFromNode(s, is, k, 0, this->index, nodesVisited);
+		if (k == maxInt) removeDuplicatePrimitives<DIM>(is);
+		else std::sort_heap(is.begin(), is.end(), compareInteractions<DIM>);
+
+		return (int)is.size();
+	}
+
+	// finds all primitives inside the sphere, and returns their closest points in is sorted
+	// by distance; returns the number of primitives found
+	int findAllWithinRadius(BoundingSphere<DIM>& s, std::vector<Interaction<DIM>>& is) const {
+		return this->findKClosestPoints(s, is, maxInt);
+	}
+
+	// intersects the rays in the range [begin, end) of a batch, returns the number of rays with a hit;
+	// see intersectRaysInRange for the layout of the input and output buffers
+	virtual int intersectRays(const float *origins, const float *directions, const float *tMax,
+							  size_t nRays, size_t begin, size_t end, float *distances, float *points,
+							  int *primitiveIndices, float *uvs, bool checkForOcclusion=false) const {
+		auto intersect = [this](Ray<DIM>& r, Interaction<DIM>& i, bool checkForOcclusion) -> bool {
+			int nodesVisited = 0;
+			return this->intersectFromNode(r, i, 0, this->index, nodesVisited, checkForOcclusion);
+		};
+
+		return intersectRaysInRange<DIM>(intersect, origins, directions, tMax, nRays, begin, end,
+										 distances, points, primitiveIndices, uvs, checkForOcclusion);
+	}
+
+	// finds closest points to the query points in the range [begin, end) of a batch;
+	// see findClosestPointsInRange for the layout of the input and output buffers
+	virtual void findClosestPoints(const float *xyz, const float *squaredRadii, size_t nQueries,
+								   size_t begin, size_t end, float *distances, float *points,
+								   int *primitiveIndices, float *uvs) const {
+		auto findClosestPoint = [this](BoundingSphere<DIM>& s, Interaction<DIM>& i) -> bool {
+			int nodesVisited = 0;
+			return this->findClosestPointFromNode(s, i, 0, this->index, Vector<DIM>::Zero(), nodesVisited);
+		};
+
+		findClosestPointsInRange<DIM>(findClosestPoint, xyz, squaredRadii, nQueries, begin, end,
+									  distances, points, primitiveIndices, uvs);
+	}
+
+	// finds closest points to the query points in the range [begin, end) of a batch, which is split
+	// into clusters of clusterSize consecutive query points that are expected to be spatially close;
+	// see findClosestPointsInRange for the layout of the input and output buffers. By default, the
+	// query points are processed one by one
+	virtual void findClosestPointsInClusters(const float *xyz, const float *squaredRadii, size_t nQueries,
+											 size_t begin, size_t end, size_t clusterSize, float *distances,
+											 float *points, int *primitiveIndices, float *uvs) const {
+		this->findClosestPoints(xyz, squaredRadii, nQueries, begin, end, distances,
+								points, primitiveIndices, uvs);
+	}
+
+	// recomputes the bounding volumes of the aggregate after the positions of its primitives
+	// have changed, without modifying its structure
+	virtual void refit() {}
+
+	// stops referencing the primitives if the aggregate can answer queries without them, so that
+	// they can be freed; returns false if the aggregate still needs its primitives
+	virtual bool releasePrimitives() {
+		return false;
+	}
+
+	// serializes the aggregate without its primitives, see Scene::save
+	virtual void write(BinaryWriter& writer) const {
+		std::cerr << "Aggregate::write(): Not supported" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
 	// performs inside outside test for x
 	// NOTE: assumes aggregate bounds watertight shape
 	bool contains(const Vector<DIM>& x, bool useRayIntersection=true) const {
@@ -94,13 +392,12 @@ public:
 			direction1[0] = 1;
 			direction2[1] = 1;
 
-			std::vector<Interaction<DIM>> is1;
+			QueryBuffer<DIM> buffer;
 			Ray<DIM> r1(x, direction1);
-			int hits1 = this->intersect(r1, is1, false, true);
+			int hits1 = this->intersect(r1, buffer.interactions, false, true);
 
-			std::vector<Interaction<DIM>> is2;
 			Ray<DIM> r2(x, direction2);
-			int hits2 = this->intersect(r2, is2, false, true);
+			int hits2 = this->intersect(r2, buffer.interactions, false, true);
 
 			return hits1%2 == 1 && hits2%2 == 1;
 		}
@@ -118,11 +415,11 @@ public:
 		float dNorm = direction.norm();
 		direction /= dNorm;
 
-		std::vector<Interaction<DIM>> is;
+		Interaction<DIM> i;
 		Ray<DIM> r(xi, direction, dNorm);
-		int hits = this->intersect(r, is, true);
+		bool hit = this->intersect(r, i, true);
 
-		return hits == 0;
+		return !hit;
 	}
 
 	// clamps x to the closest primitive this aggregate bounds
@@ -151,11 +448,80 @@ public:
 								  int nodeStartIndex, int aggregateIndex, int& nodesVisited,
 								  bool checkForOcclusion=false, bool recordAllHits=false) const = 0;
 
+	// intersects with ray, starting the traversal at the specified node in an aggregate;
+	// returns the closest interaction in i; aggregates that do not override this method
+	// fall back to the version above with a buffer from the query context of the thread
+	// NOTE: interaction is invalid when checkForOcclusion is enabled
+	virtual bool intersectFromNode(Ray<DIM>& r, Interaction<DIM>& i, int nodeStartIndex,
+								   int aggregateIndex, int& nodesVisited,
+								   bool checkForOcclusion=false) const {
+		QueryBuffer<DIM> buffer;
+		std::vector<Interaction<DIM>>& is = buffer.interactions;
+		int hits = this->intersectFromNode(r, is, nodeStartIndex, aggregateIndex,
+										   nodesVisited, checkForOcclusion, false);
+		if (hits > 0) {
+			if (!checkForOcclusion) i = is[0];
+			return true;
+		}
+
+		return false;
+	}
+
+	// intersects with ray, starting the traversal at the specified node in an aggregate; invokes
+	// filter on each candidate hit before it is accepted, and returns the closest accepted interaction
+	// in i. Aggregates that do not override this method record all hits and filter them in order of
+	// distance. NOTE: interaction is invalid when checkForOcclusion is enabled
+	virtual bool intersectFromNode(Ray<DIM>& r, Interaction<DIM>& i, const HitFilter<DIM>& filter,
+								   int nodeStartIndex, int aggregateIndex, int& nodesVisited,
+								   bool checkForOcclusion=false) const {
+		QueryBuffer<DIM> buffer;
+		std::vector<Interaction<DIM>>& is = buffer.interactions;
+		Ray<DIM> rAll = r;
+		int hits = this->intersectFromNode(rAll, is, nodeStartIndex, aggregateIndex,
+										   nodesVisited, false, true);
+
+		for (int j = 0; j < hits; j++) {
+			if (filter(is[j]) != HitFilterResult::Reject) {
+				r.tMax = std::min(r.tMax, is[j].d);
+				if (!checkForOcclusion) i = is[j];
+				return true;
+			}
+		}
+
+		return false;
+	}
+
 	// finds closest point to sphere center, starting the traversal at the specified node in an aggregate
 	virtual bool findClosestPointFromNode(BoundingSphere<DIM>& s, Interaction<DIM>& i,
 										  int nodeStartIndex, int aggregateIndex,
 										  const Vector<DIM>& boundaryHint, int& nodesVisited) const = 0;
 
+	// finds closest point to sphere center, searching the subtree of the specified node in an aggregate
+	// first (e.g., the nodeIndex and objectIndex of the closest point to a nearby query point) and then
+	// climbing back up to the root through the subtrees that overlap the sphere; unlike
+	// findClosestPointFromNode, the closest point in the entire aggregate is found. Aggregates
+	// that do not store the parents of their nodes start the traversal at the root
+	virtual bool findClosestPointBottomUp(BoundingSphere<DIM>& s, Interaction<DIM>& i, int nodeStartIndex,
+										  int aggregateIndex, int& nodesVisited) const {
+		return this->findClosestPointFromNode(s, i, 0, this->index, Vector<DIM>::Zero(), nodesVisited);
+	}
+
+	// finds the k closest primitives to sphere center, starting the traversal at the specified node
+	// in an aggregate; is is a max heap of the k closest interactions found so far that is updated
+	// with addKClosestInteraction, which also shrinks the sphere. Aggregates that do not override
+	// this method fall back to adding their closest point only. Returns whether an interaction was added
+	virtual bool findKClosestPointsFromNode(BoundingSphere<DIM>& s, std::vector<Interaction<DIM>>& is,
+											int k, int nodeStartIndex, int aggregateIndex,
+											int& nodesVisited) const {
+		// query a copy of the sphere, since the closest point does not bound the kth closest distance
+		Interaction<DIM> c;
+		BoundingSphere<DIM> sClosest = s;
+		bool found = this->findClosestPointFromNode(sClosest, c, nodeStartIndex, aggregateIndex,
+													Vector<DIM>::Zero(), nodesVisited);
+
+		return found && addKClosestInteraction<DIM>(s, is, c, k);
+	}
+
 	// members
 	int index;
 	bool computeNormals;
@@ -168,13 +534,20 @@ public:
 	TransformedAggregate(const std::shared_ptr<Aggregate<DIM>>& aggregate_,
 						 const Transform<DIM>& transform_):
 						 aggregate(aggregate_), t(transform_), tInv(t.inverse()),
-						 det(t.matrix().determinant()), sqrtDet(std::sqrt(det)) {
+						 det(t.matrix().determinant()), sqrtDet(std::sqrt(det)),
+						 box(aggregate->boundingBox().transform(t)) {
 		this->computeNormals = false;
 	}
 
+	// recomputes the transformed bounding box; the aggregate is shared by all instances of an
+	// object, so it must be refit beforehand, once for all of them (see Scene::refit)
+	void refit() {
+		box = aggregate->boundingBox().transform(t);
+	}
+
 	// returns bounding box
 	BoundingBox<DIM> boundingBox() const {
-		return aggregate->boundingBox().transform(t);
+		return box;
 	}
 
 	// returns centroid
@@ -217,6 +590,52 @@ public:
 		return hits;
 	}
 
+	// intersects with ray, starting the traversal at the specified node in an aggregate
+	bool intersectFromNode(Ray<DIM>& r, Interaction<DIM>& i, int nodeStartIndex,
+						   int aggregateIndex, int& nodesVisited,
+						   bool checkForOcclusion=false) const {
+		// apply inverse transform to ray
+		Ray<DIM> rInv = r.transform(tInv);
+
+		// intersect
+		bool hit = aggregate->intersectFromNode(rInv, i, nodeStartIndex, aggregateIndex,
+												nodesVisited, checkForOcclusion);
+
+		// apply transform to ray and interaction
+		r.tMax = rInv.transform(t).tMax;
+		if (hit && !checkForOcclusion) i.applyTransform(t, tInv, r.o);
+
+		nodesVisited++;
+		return hit;
+	}
+
+	// intersects with ray, starting the traversal at the specified node in an aggregate
+	bool intersectFromNode(Ray<DIM>& r, Interaction<DIM>& i, const HitFilter<DIM>& filter,
+						   int nodeStartIndex, int aggregateIndex, int& nodesVisited,
+						   bool checkForOcclusion=false) const {
+		// apply inverse transform to ray
+		Ray<DIM> rInv = r.transform(tInv);
+
+		// intersect, invoking the filter with the candidate hits in world space; the type
+		// erased filter wraps a reference to the lambda, which avoids allocating
+		auto filterInv = [&](const Interaction<DIM>& c) -> HitFilterResult {
+			Interaction<DIM> cw = c;
+			cw.applyTransform(t, tInv, r.o);
+
+			return filter(cw);
+		};
+
+		bool hit = aggregate->intersectFromNode(rInv, i, HitFilter<DIM>(std::ref(filterInv)), nodeStartIndex,
+												aggregateIndex, nodesVisited, checkForOcclusion);
+
+		// apply transform to ray and interaction
+		r.tMax = rInv.transform(t).tMax;
+		if (hit && !checkForOcclusion) i.applyTransform(t, tInv, r.o);
+
+		nodesVisited++;
+		return hit;
+	}
+
 	// finds closest point to sphere center, starting the traversal at the specified node in an aggregate
 	bool findClosestPointFromNode(BoundingSphere<DIM>& s, Interaction<DIM>& i,
 								  int nodeStartIndex, int aggregateIndex,
@@ -244,6 +663,49 @@ public:
 		return found;
 	}
 
+	// finds closest point to sphere center, searching the subtree of the specified node in an aggregate
+	// first and then climbing back up to the root through the subtrees that overlap the sphere
+	bool findClosestPointBottomUp(BoundingSphere<DIM>& s, Interaction<DIM>& i, int nodeStartIndex,
+								  int aggregateIndex, int& nodesVisited) const {
+		// apply inverse transform to sphere
+		BoundingSphere<DIM> sInv = s.transform(tInv);
+
+		// find closest point
+		bool found = aggregate->findClosestPointBottomUp(sInv, i, nodeStartIndex, aggregateIndex,
+														 nodesVisited);
+
+		// apply transform to sphere and interaction
+		s.r2 = sInv.transform(t).r2;
+		if (found) i.applyTransform(t, tInv, s.c);
+
+		nodesVisited++;
+		return found;
+	}
+
+	// finds the k closest primitives to sphere center, starting the traversal at the specified node in an aggregate
+	bool findKClosestPointsFromNode(BoundingSphere<DIM>& s, std::vector<Interaction<DIM>>& is,
+									int k, int nodeStartIndex, int aggregateIndex,
+									int& nodesVisited) const {
+		// apply inverse transform to sphere
+		BoundingSphere<DIM> sInv = s.transform(tInv);
+
+		// find the k closest points in object space, since their distances are not comparable
+		// with the distances of the interactions already in the heap
+		QueryBuffer<DIM> buffer;
+		std::vector<Interaction<DIM>>& cs = buffer.interactions;
+		aggregate->findKClosestPointsFromNode(sInv, cs, k, nodeStartIndex, aggregateIndex, nodesVisited);
+
+		// apply transform to interactions and add them to the heap
+		bool found = false;
+		for (int j = 0; j < (int)cs.size(); j++) {
+			cs[j].applyTransform(t, tInv, s.c);
+			if (addKClosestInteraction<DIM>(s, is, cs[j], k)) found = true;
+		}
+
+		nodesVisited++;
+		return found;
+	}
+
 	// performs inside outside test for x
 	bool contains(const Vector<DIM>& x, bool useRayIntersection=true) const {
 		return aggregate->contains(tInv*x, useRayIntersection);
@@ -274,6 +736,7 @@ private:
 	std::shared_ptr<Aggregate<DIM>> aggregate;
 	Transform<DIM> t, tInv;
 	float det, sqrtDet;
+	BoundingBox<DIM> box;
 };
 
 } // namespace fcpw
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <fcpw/core/interaction.h>
+#include <deque>
+
+namespace fcpw {
+
+// scratch interaction buffers that are reused across queries, so that the queries which need
+// temporary interaction lists (e.g., to record all hits of nested aggregates, for inside outside
+// tests and for csg intersections) do not allocate once the buffers have grown to their steady
+// state size; each thread owns a context, so contexts are never shared between threads
+template<size_t DIM>
+class QueryContext {
+public:
+	// returns the context of the calling thread
+	static QueryContext<DIM>& threadContext() {
+		thread_local QueryContext<DIM> context;
+		return context;
+	}
+
+	// returns an empty buffer that is reserved until it is released; buffers are
+	// released in the reverse order in which they are acquired
+	std::vector<Interaction<DIM>>& acquire() {
+		if (nAcquired == buffers.size()) buffers.emplace_back();
+		std::vector<Interaction<DIM>>& buffer = buffers[nAcquired++];
+		buffer.clear();
+
+		return buffer;
+	}
+
+	// releases the most recently acquired buffer
+	void release() {
+		nAcquired--;
+	}
+
+	// frees the memory held by the buffers that are not acquired
+	void shrink() {
+		buffers.resize(nAcquired);
+		buffers.shrink_to_fit();
+	}
+
+private:
+	// members
+	std::deque<std::vector<Interaction<DIM>>> buffers; // references stay valid as the deque grows
+	size_t nAcquired = 0;
+};
+
+// reserves a buffer of the query context of the calling thread for the lifetime of this object
+template<size_t DIM>
+class QueryBuffer {
+public:
+	// constructor
+	QueryBuffer(): context(QueryContext<DIM>::threadContext()), interactions(context.acquire()) {}
+
+	// destructor
+	~QueryBuffer() {
+		context.release();
+	}
+
+	QueryBuffer(const QueryBuffer<DIM>&) = delete;
+	QueryBuffer<DIM>& operator=(const QueryBuffer<DIM>&) = delete;
+
+	// members
+	QueryContext<DIM>& context;
+	std::vector<Interaction<DIM>>& interactions;
+};
+
+} // namespace fcpw
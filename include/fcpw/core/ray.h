@@ -6,7 +6,8 @@ namespace fcpw {
 
 template<size_t DIM>
 struct Ray {
-	// constructor
+	// constructors
+	Ray(): o(Vector<DIM>::Zero()), d(Vector<DIM>::Zero()), invD(Vector<DIM>::Zero()), tMax(maxFloat) {}
 	Ray(const Vector<DIM>& o_, const Vector<DIM>& d_, float tMax_=maxFloat):
 		o(o_), d(d_), invD(d.cwiseInverse()), tMax(tMax_) {}
 
@@ -0,0 +1,236 @@
+#pragma once
+
+#include <fcpw/core/core.h>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#ifndef _WIN32
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+#define FCPW_SERIALIZATION_VERSION 2
+#define FCPW_SERIALIZATION_MAGIC 0x57504346 // "FCPW" in little endian byte order
+#define FCPW_SERIALIZATION_ENDIAN_TAG 0x01020304 // reads back byte swapped on machines with a different endianness
+#define FCPW_SERIALIZATION_ALIGNMENT 64 // arrays are aligned so that they can be viewed in place
+#define FCPW_MESH_SERIALIZATION_VERSION 1
+#define FCPW_MESH_SERIALIZATION_MAGIC 0x4d504346 // "FCPM" in little endian byte order
+
+namespace fcpw {
+
+class BinaryWriter {
+public:
+	// constructor
+	BinaryWriter(std::ofstream& out_): out(out_), offset(0) {}
+
+	// writes a value
+	template<typename T>
+	void write(const T& value) {
+		out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+		offset += sizeof(T);
+	}
+
+	// writes the size of an array followed by its elements, which are aligned
+	// to FCPW_SERIALIZATION_ALIGNMENT bytes relative to the start of the file
+	template<typename T>
+	void writeArray(const T *values, size_t nValues) {
+		write<uint64_t>(nValues);
+		while (offset%FCPW_SERIALIZATION_ALIGNMENT != 0) {
+			out.put(0);
+			offset++;
+		}
+
+		out.write(reinterpret_cast<const char *>(values), nValues*sizeof(T));
+		offset += nValues*sizeof(T);
+	}
+
+	// writes an array
+	template<typename T>
+	void writeArray(const std::vector<T>& values) {
+		writeArray(values.data(), values.size());
+	}
+
+	// writes an array of flags
+	void writeArray(const std::vector<bool>& values) {
+		std::vector<uint8_t> flags(values.begin(), values.end());
+		writeArray(flags);
+	}
+
+	// returns whether all writes succeeded
+	bool good() const {
+		return out.good();
+	}
+
+private:
+	// members
+	std::ofstream& out;
+	size_t offset;
+};
+
+class BinaryReader {
+public:
+	// constructor
+	BinaryReader(char *data_, size_t size_): data(data_), size(size_), offset(0), failed(false) {}
+
+	// reads a value; returns a value initialized T if the end of the data is reached
+	template<typename T>
+	T read() {
+		T value{};
+		if (failed || offset + sizeof(T) > size) {
+			failed = true;
+			return value;
+		}
+
+		std::memcpy(static_cast<void *>(&value), data + offset, sizeof(T));
+		offset += sizeof(T);
+		return value;
+	}
+
+	// returns a pointer to an array written by BinaryWriter::writeArray without copying
+	// its elements; returns nullptr if the array extends beyond the end of the data
+	template<typename T>
+	T *readArray(size_t& nValues) {
+		nValues = (size_t)read<uint64_t>();
+		offset += (FCPW_SERIALIZATION_ALIGNMENT - offset%FCPW_SERIALIZATION_ALIGNMENT)%FCPW_SERIALIZATION_ALIGNMENT;
+		if (failed || offset > size || nValues > (size - offset)/sizeof(T)) {
+			failed = true;
+			nValues = 0;
+			return nullptr;
+		}
+
+		T *values = reinterpret_cast<T *>(data + offset);
+		offset += nValues*sizeof(T);
+		return values;
+	}
+
+	// copies an array into values
+	template<typename T>
+	void readArray(std::vector<T>& values) {
+		size_t nValues = 0;
+		const T *array = readArray<T>(nValues);
+		values.assign(array, array + nValues);
+	}
+
+	// copies an array of flags into values
+	void readArray(std::vector<bool>& values) {
+		size_t nValues = 0;
+		const uint8_t *flags = readArray<uint8_t>(nValues);
+		values.assign(flags, flags + nValues);
+	}
+
+	// marks the data as invalid, e.g., when the values read from it fail validation
+	void fail() {
+		failed = true;
+	}
+
+	// returns whether all reads succeeded
+	bool good() const {
+		return !failed;
+	}
+
+private:
+	// members
+	char *data;
+	size_t size, offset;
+	bool failed;
+};
+
+class MappedFile {
+public:
+	// constructor
+	MappedFile(): data(nullptr), size(0) {}
+
+	// destructor
+	~MappedFile() {
+		unmap();
+	}
+
+	// the mapping is owned by a single file, so it can be moved but not copied
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	// move constructor
+	MappedFile(MappedFile&& other) noexcept: data(nullptr), size(0) {
+		*this = std::move(other);
+	}
+
+	// move assignment
+	MappedFile& operator=(MappedFile&& other) noexcept {
+		if (this != &other) {
+			unmap();
+			data = other.data;
+			size = other.size;
+#ifdef _WIN32
+			buffer = std::move(other.buffer);
+#endif
+			other.data = nullptr;
+			other.size = 0;
+		}
+
+		return *this;
+	}
+
+	// maps a file into memory; the mapping is private and copy-on-write, so that views into
+	// it can be modified (e.g., when refitting) without changing the file. On platforms
+	// without mmap, the file is read into an aligned buffer instead
+	bool map(const std::string& filename) {
+		unmap();
+
+#ifndef _WIN32
+		int fd = open(filename.c_str(), O_RDONLY);
+		if (fd == -1) return false;
+
+		struct stat st;
+		if (fstat(fd, &st) == -1 || st.st_size == 0) {
+			close(fd);
+			return false;
+		}
+
+		void *mapping = mmap(nullptr, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (mapping == MAP_FAILED) return false;
+
+		data = static_cast<char *>(mapping);
+		size = (size_t)st.st_size;
+#else
+		std::ifstream in(filename, std::ios::binary | std::ios::ate);
+		if (!in.is_open()) return false;
+
+		size = (size_t)in.tellg();
+		buffer = std::unique_ptr<char[]>(new char[size + FCPW_SERIALIZATION_ALIGNMENT]);
+		size_t misalignment = reinterpret_cast<uintptr_t>(buffer.get())%FCPW_SERIALIZATION_ALIGNMENT;
+		data = buffer.get() + (FCPW_SERIALIZATION_ALIGNMENT - misalignment)%FCPW_SERIALIZATION_ALIGNMENT;
+
+		in.seekg(0);
+		if (!in.read(data, size)) {
+			unmap();
+			return false;
+		}
+#endif
+
+		return true;
+	}
+
+	// unmaps the file
+	void unmap() {
+#ifndef _WIN32
+		if (data) munmap(data, size);
+#else
+		buffer = nullptr;
+#endif
+		data = nullptr;
+		size = 0;
+	}
+
+	// members
+	char *data;
+	size_t size;
+
+private:
+#ifdef _WIN32
+	std::unique_ptr<char[]> buffer;
+#endif
+};
+
+} // namespace fcpw
@@ -22,6 +22,37 @@ inline MaskP<WIDTH> intersectWideBox(const VectorP<WIDTH, DIM>& bMin, const Vect
 	return tMin <= tMax;
 }
 
+// dequantizes wide boxes stored with 8 bits per coordinate relative to the frame (origin, scale)
+template<size_t WIDTH, size_t DIM>
+inline void dequantizeWideBox(const float (&origin)[DIM], const float (&scale)[DIM],
+							  const uint8_t (&qMin)[DIM][WIDTH], const uint8_t (&qMax)[DIM][WIDTH],
+							  VectorP<WIDTH, DIM>& bMin, VectorP<WIDTH, DIM>& bMax)
+{
+	for (size_t j = 0; j < DIM; j++) {
+		FloatP<WIDTH> qMinj, qMaxj;
+		for (size_t w = 0; w < WIDTH; w++) {
+			qMinj[w] = qMin[j][w];
+			qMaxj[w] = qMax[j][w];
+		}
+
+		bMin[j] = origin[j] + qMinj*scale[j];
+		bMax[j] = origin[j] + qMaxj*scale[j];
+	}
+}
+
+// performs wide version of ray box intersection test against quantized boxes
+template<size_t WIDTH, size_t DIM>
+inline MaskP<WIDTH> intersectWideBox(const float (&origin)[DIM], const float (&scale)[DIM],
+									 const uint8_t (&qMin)[DIM][WIDTH], const uint8_t (&qMax)[DIM][WIDTH],
+									 const enokiVector<DIM>& ro, const enokiVector<DIM>& rinvD, float rtMax,
+									 FloatP<WIDTH>& tMin, FloatP<WIDTH>& tMax)
+{
+	VectorP<WIDTH, DIM> bMin, bMax;
+	dequantizeWideBox<WIDTH, DIM>(origin, scale, qMin, qMax, bMin, bMax);
+
+	return intersectWideBox<WIDTH, DIM>(bMin, bMax, ro, rinvD, rtMax, tMin, tMax);
+}
+
 // performs wide version of ray line segment intersection test
 template<size_t WIDTH>
 inline MaskP<WIDTH> intersectWideLineSegment(const Vector3P<WIDTH>& pa, const Vector3P<WIDTH>& pb,
@@ -97,6 +128,47 @@ inline MaskP<WIDTH> overlapWideBox(const VectorP<WIDTH, DIM>& bMin, const Vector
 	return d2Min <= sr2;
 }
 
+// performs wide version of sphere box overlap test against quantized boxes
+template<size_t WIDTH, size_t DIM>
+inline MaskP<WIDTH> overlapWideBox(const float (&origin)[DIM], const float (&scale)[DIM],
+								   const uint8_t (&qMin)[DIM][WIDTH], const uint8_t (&qMax)[DIM][WIDTH],
+								   const enokiVector<DIM>& sc, float sr2,
+								   FloatP<WIDTH>& d2Min, FloatP<WIDTH>& d2Max)
+{
+	VectorP<WIDTH, DIM> bMin, bMax;
+	dequantizeWideBox<WIDTH, DIM>(origin, scale, qMin, qMax, bMin, bMax);
+
+	return overlapWideBox<WIDTH, DIM>(bMin, bMax, sc, sr2, d2Min, d2Max);
+}
+
+// performs wide version of box box overlap test; d2Min and d2Max bound the squared distance from
+// every point inside the query box [boxMin, boxMax] to the nearest and furthest point of each box
+template<size_t WIDTH, size_t DIM>
+inline MaskP<WIDTH> overlapWideBox(const VectorP<WIDTH, DIM>& bMin, const VectorP<WIDTH, DIM>& bMax,
+								   const enokiVector<DIM>& boxMin, const enokiVector<DIM>& boxMax, float r2,
+								   FloatP<WIDTH>& d2Min, FloatP<WIDTH>& d2Max)
+{
+	VectorP<WIDTH, DIM> u = bMin - boxMax;
+	VectorP<WIDTH, DIM> v = boxMin - bMax;
+	d2Min = enoki::squared_norm(enoki::max(enoki::max(u, v), 0.0f));
+	d2Max = enoki::squared_norm(enoki::max(enoki::abs(bMax - boxMin), enoki::abs(boxMax - bMin)));
+
+	return d2Min <= r2;
+}
+
+// performs wide version of box box overlap test against quantized boxes
+template<size_t WIDTH, size_t DIM>
+inline MaskP<WIDTH> overlapWideBox(const float (&origin)[DIM], const float (&scale)[DIM],
+								   const uint8_t (&qMin)[DIM][WIDTH], const uint8_t (&qMax)[DIM][WIDTH],
+								   const enokiVector<DIM>& boxMin, const enokiVector<DIM>& boxMax, float r2,
+								   FloatP<WIDTH>& d2Min, FloatP<WIDTH>& d2Max)
+{
+	VectorP<WIDTH, DIM> bMin, bMax;
+	dequantizeWideBox<WIDTH, DIM>(origin, scale, qMin, qMax, bMin, bMax);
+
+	return overlapWideBox<WIDTH, DIM>(bMin, bMax, boxMin, boxMax, r2, d2Min, d2Max);
+}
+
 // finds closest point on wide line segment to point
 template<size_t WIDTH>
 inline FloatP<WIDTH> findClosestPointWideLineSegment(const Vector3P<WIDTH>& pa, const Vector3P<WIDTH>& pb,
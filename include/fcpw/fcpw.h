@@ -2,6 +2,8 @@
 
 #include <fcpw/utilities/scene_data.h>
 
+#define FCPW_MIN_PARALLEL_QUERIES 1024 // batches with fewer query points are processed on the calling thread
+
 namespace fcpw {
 
 enum class PrimitiveType {
@@ -37,12 +39,35 @@ public:
 	// sets the position of a vertex in an object
 	void setObjectVertex(const Vector<DIM>& position, int vertexIndex, int objectIndex);
 
+	// updates the positions of all vertices in an object, e.g., to deform it after the scene
+	// aggregate has been built; positions are specified in the same order as setObjectVertex,
+	// and the object topology (including its number of vertices) must stay unchanged. Call
+	// refit() after updating all deformed objects; NOTE: vertex normals are not updated
+	void updateObjectVertices(const std::vector<Vector<DIM>>& positions, int objectIndex);
+
 	// sets the vertex indices of a line segment in an object
 	void setObjectLineSegment(const int *indices, int lineSegmentIndex, int objectIndex);
 
 	// sets the vertex indices of a triangle in an object
 	void setObjectTriangle(const int *indices, int triangleIndex, int objectIndex);
 
+	// sets the positions of all vertices in an object in bulk, replacing setObjectVertexCount and
+	// setObjectVertex; the DIM coordinates of vertex i are read from the address positions + i*stride
+	// in bytes, so that positions can be interleaved with other vertex attributes. A stride of 0
+	// means the positions are tightly packed. NOTE: the positions are copied, since building the
+	// scene aggregate reorders them to improve memory locality
+	void setObjectVertices(const float *positions, int nVertices, int objectIndex, size_t stride=0);
+
+	// sets the vertex indices of all line segments in an object in bulk, replacing
+	// setObjectLineSegmentCount and setObjectLineSegment; indices holds 2*nLineSegments values.
+	// NOTE: use this function only if an object contains only line segments
+	void setObjectLineSegments(const int *indices, int nLineSegments, int objectIndex);
+
+	// sets the vertex indices of all triangles in an object in bulk, replacing
+	// setObjectTriangleCount and setObjectTriangle; indices holds 3*nTriangles values.
+	// NOTE: use this function only if an object contains only triangles
+	void setObjectTriangles(const int *indices, int nTriangles, int objectIndex);
+
 	// sets the vertex indices of a primitive in an object; primitiveIndex must lie in the range
 	// [0, nLineSegments) or [0, nTriangles) based on the primitive type; internally, the line
 	// segments are stored before the triangles; NOTE: use this function only if an object contains
@@ -59,7 +84,8 @@ public:
 	// enables normal computation for an object with a single primitive type; if normals are
 	// required for an object with mixed primitive types, they can be computed after performing
 	// a query using the "primitiveIndex" member in the "Interaction" class. NOTE: enabling normal
-	// computation for non-planar line segments produces gargabe results since they are not well defined
+	// computation for non-planar line segments produces gargabe results since they are not well defined;
+	// normals already in the soup of the object are replaced
 	void computeObjectNormals(int objectIndex);
 
 	///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -69,12 +95,40 @@ public:
 	// function rebuilds the aggregate/accelerator for the scene from the specified geometry
 	// (except when reduceMemoryFootprint is set to true which results in undefined behavior);
 	// it is recommended to set vectorize to false for primitives that do not implement
-	// vectorized intersection and closest point queries; set reduceMemoryFootprint to true
+	// vectorized intersection and closest point queries; when the scene has multiple objects or
+	// instances, vectorize also builds the aggregate over them as a wide bvh whose leaves cull
+	// the objects and instances with their bounding boxes; set reduceMemoryFootprint to true
 	// to reduce the memory footprint of fcpw when constructing an aggregate, however if you
-	// plan to access the scene data let it remain false
+	// plan to access the scene data let it remain false. With vectorize also set to true, the
+	// LineSegment and Triangle objects of objects with a single primitive type are freed as well,
+	// since the vectorized bvh leaves store copies of them; only their indices in the polygon
+	// soup are kept, and only if the object normals were computed. With vectorize set to false, the
+	// bvh frees the copies of the vertex positions in its leaves instead, at the cost of slower queries
 	void build(const AggregateType& aggregateType, bool vectorize,
 			   bool printStats=false, bool reduceMemoryFootprint=false);
 
+	// recomputes the bounding volumes of the scene aggregate after its vertices have been updated,
+	// without rebuilding it or reallocating any memory; refitting is much cheaper than rebuilding,
+	// but the query performance degrades when the geometry deforms significantly. The aggregate of
+	// an instanced object is refit once for all its instances. NOTE: the aggregate must not have
+	// been built with reduceMemoryFootprint set to true
+	void refit();
+
+	///////////////////////////////////////////////////////////////////////////////////////////////////
+	// API to save and load the scene aggregate/accelerator
+
+	// saves the scene geometry and its aggregate/accelerator to a versioned binary file, so that
+	// the scene can be loaded later without rebuilding it; only scenes built with a bvh, whose
+	// objects contain a single primitive type and that do not have a csg tree are supported.
+	// NOTE: the scene must not have been built with reduceMemoryFootprint set to true
+	void save(const std::string& filename) const;
+
+	// loads a scene saved with save(), replacing the current scene data; the file is memory mapped
+	// and the nodes of the aggregate/accelerator are queried in place, while the geometry is copied
+	// into the scene data. Returns false if the file cannot be read or was written by a different
+	// version or build configuration of fcpw (e.g., with a different simd width or endianness)
+	bool load(const std::string& filename);
+
 	///////////////////////////////////////////////////////////////////////////////////////////////////
 	// API to find closest points and intersect rays with the scene, among others
 
@@ -85,6 +139,27 @@ public:
 	int intersect(Ray<DIM>& r, std::vector<Interaction<DIM>>& is,
 				  bool checkForOcclusion=false, bool recordAllHits=false) const;
 
+	// intersects the scene with the given ray and returns whether a hit is accepted by filter;
+	// the filter is invoked on each candidate hit before it is accepted, and can accept it, reject it
+	// (e.g., to skip self hits or transparent faces) or accept it and terminate the query. The
+	// closest accepted interaction is returned in i, which is not populated if checkForOcclusion is enabled
+	bool intersect(Ray<DIM>& r, Interaction<DIM>& i, const HitFilter<DIM>& filter,
+				   bool checkForOcclusion=false) const;
+
+	// intersects the scene with a batch of nRays rays and returns the number of rays with a hit;
+	// the ray origins and directions are specified in structure-of-arrays layout, i.e.,
+	// origins[k*nRays + q] is the kth coordinate of ray q, and the hit points and uvs are written
+	// in the same layout to the caller-owned points and uvs arrays; tMax (the maximum distance
+	// along each ray), points, primitiveIndices and uvs are optional. Rays without a hit have
+	// their distance set to maxFloat and primitive index set to -1. If checkForOcclusion is
+	// enabled, only the distances are written, with occluded rays assigned a distance of 0.
+	// The batch is processed on the calling thread without any heap allocation, except for csg
+	// scenes; NOTE: the ray directions are expected to be normalized
+	int intersectRays(const float *origins, const float *directions, const float *tMax,
+					  size_t nRays, float *distances, float *points=nullptr,
+					  int *primitiveIndices=nullptr, float *uvs=nullptr,
+					  bool checkForOcclusion=false) const;
+
 	// checks whether a point is contained inside a scene; NOTE: the scene must be watertight
 	bool contains(const Vector<DIM>& x) const;
 
@@ -92,9 +167,54 @@ public:
 	bool hasLineOfSight(const Vector<DIM>& xi, const Vector<DIM>& xj) const;
 
 	// finds the closest point in the scene to a point; optionally specify a conservative
-	// radius guess around the point within which the closest point can be found
+	// radius guess around the point within which the closest point can be found, and a guess
+	// for the direction from the point to the boundary (e.g., from a previous query) that is
+	// used to order the traversal of bvhs built with vectorize set to false; a poor direction guess
+	// does not affect the result
 	bool findClosestPoint(const Vector<DIM>& x, Interaction<DIM>& i,
-						  float squaredRadius=maxFloat) const;
+						  float squaredRadius=maxFloat,
+						  const Vector<DIM>& boundaryHint=Vector<DIM>::Zero()) const;
+
+	// finds the closest point in the scene to a point like findClosestPoint, but starts the traversal
+	// at the bvh node of the closest point iPrev found for a nearby point (e.g., at the previous step
+	// of a random walk) and climbs back up the bvh only into the subtrees that overlap the closest
+	// point found so far; iPrev may also be a default constructed interaction
+	bool findClosestPointFromPrevious(const Vector<DIM>& x, const Interaction<DIM>& iPrev,
+									  Interaction<DIM>& i, float squaredRadius=maxFloat) const;
+
+	// finds the k closest primitives in the scene to a point, and returns their closest points
+	// in is sorted by distance; optionally specify a radius around the point beyond which
+	// primitives are ignored. Returns the number of primitives found, which is less than k
+	// if fewer primitives lie inside the radius. NOTE: csg scenes only return the closest point
+	int findKClosestPoints(const Vector<DIM>& x, int k, std::vector<Interaction<DIM>>& is,
+						   float squaredRadius=maxFloat) const;
+
+	// finds all primitives in the scene whose distance to a point is at most radius, and
+	// returns their closest points in is sorted by distance; returns the number of primitives
+	// found. NOTE: csg scenes only return the closest point
+	int findAllWithinRadius(const Vector<DIM>& x, float radius, std::vector<Interaction<DIM>>& is) const;
+
+	// finds the closest points in the scene to a batch of nQueries points; the query points are
+	// specified in structure-of-arrays layout, i.e., xyz[k*nQueries + q] is the kth coordinate of
+	// query q, and the closest points and uvs are written in the same layout to the caller-owned
+	// points and uvs arrays; points, primitiveIndices, uvs and squaredRadii (a conservative
+	// squared radius guess per query) are optional. Queries without a closest point have their
+	// distance set to maxFloat and primitive index set to -1. The queries are distributed across
+	// all available hardware threads, unless the batch is smaller than FCPW_MIN_PARALLEL_QUERIES
+	void findClosestPoints(const float *xyz, size_t nQueries, float *distances,
+						   float *points=nullptr, int *primitiveIndices=nullptr,
+						   float *uvs=nullptr, const float *squaredRadii=nullptr) const;
+
+	// finds the closest points in the scene to a batch of nQueries points like findClosestPoints,
+	// but splits the batch into clusters of clusterSize consecutive query points that share a single
+	// traversal of the scene aggregate; each query point then only visits the leaves that can contain
+	// the closest point to some point in its cluster. This pays off when consecutive query points are
+	// spatially close, e.g., points on a grid in tiled order or particles sorted along a space filling
+	// curve. NOTE: only bvh aggregates built with vectorize set to true share the traversal
+	void findClosestPointsInClusters(const float *xyz, size_t nQueries, float *distances,
+									 float *points=nullptr, int *primitiveIndices=nullptr,
+									 float *uvs=nullptr, const float *squaredRadii=nullptr,
+									 size_t clusterSize=64) const;
 
 	// returns a pointer to the underlying scene data; use at your own risk...
 	SceneData<DIM>* getSceneData();
@@ -99,6 +99,31 @@ inline void Scene<DIM>::setObjectVertex(const Vector<DIM>& position, int vertexI
 	sceneData->soups[objectIndex].positions[vertexIndex] = position;
 }
 
+template<size_t DIM>
+inline void Scene<DIM>::updateObjectVertices(const std::vector<Vector<DIM>>& positions, int objectIndex)
+{
+	PolygonSoup<DIM>& soup = sceneData->soups[objectIndex];
+	const std::vector<int>& vertexIndexMap = soup.vertexIndexMap;
+
+	// the object topology must stay unchanged, so one position is expected for each input vertex
+	size_t nVertices = vertexIndexMap.size() > 0 ? vertexIndexMap.size() : soup.positions.size();
+	if (positions.size() != nVertices) {
+		std::cerr << "Scene::updateObjectVertices(): Expected " << nVertices << " vertices for object "
+				  << objectIndex << ", got " << positions.size() << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	if (vertexIndexMap.size() == 0) {
+		std::copy(positions.begin(), positions.end(), soup.positions.begin());
+
+	} else {
+		for (int i = 0; i < (int)positions.size(); i++) {
+			int vIndex = vertexIndexMap[i];
+			if (vIndex != -1) soup.positions[vIndex] = positions[i]; // skip unreferenced vertices
+		}
+	}
+}
+
 template<size_t DIM>
 inline void Scene<DIM>::setObjectLineSegment(const int *indices, int lineSegmentIndex, int objectIndex)
 {
@@ -135,6 +160,62 @@ inline void Scene<DIM>::setObjectTriangle(const int *indices, int triangleIndex,
 	triangle.pIndex = triangleIndex;
 }
 
+template<size_t DIM>
+inline void Scene<DIM>::setObjectVertices(const float *positions, int nVertices, int objectIndex, size_t stride)
+{
+	std::vector<Vector<DIM>>& soupPositions = sceneData->soups[objectIndex].positions;
+	soupPositions.resize(nVertices);
+	if (stride == 0) stride = DIM*sizeof(float);
+
+	if (stride == DIM*sizeof(float) && sizeof(Vector<DIM>) == DIM*sizeof(float)) {
+		// tightly packed positions are copied with a single memcpy
+		std::memcpy(static_cast<void *>(soupPositions.data()), positions, nVertices*stride);
+
+	} else {
+		const char *bytes = reinterpret_cast<const char *>(positions);
+		parallelFor(nVertices, 1 << 16, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++) {
+				std::memcpy(soupPositions[i].data(), bytes + i*stride, DIM*sizeof(float));
+			}
+		});
+	}
+}
+
+template<size_t DIM, typename PrimitiveType, size_t N>
+inline void setObjectPrimitives(const int *indices, int nPrimitives, PolygonSoup<DIM>& soup,
+								std::unique_ptr<std::vector<PrimitiveType>>& primitives)
+{
+	// copy soup indices
+	soup.indices.assign(indices, indices + N*nPrimitives);
+
+	// allocate primitives and set their indices in parallel
+	primitives = std::unique_ptr<std::vector<PrimitiveType>>(new std::vector<PrimitiveType>(nPrimitives));
+	parallelFor(nPrimitives, 1 << 14, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			PrimitiveType& primitive = (*primitives)[i];
+			primitive.soup = &soup;
+			for (size_t j = 0; j < N; j++) primitive.indices[j] = indices[N*i + j];
+			primitive.pIndex = (int)i;
+		}
+	});
+}
+
+template<size_t DIM>
+inline void Scene<DIM>::setObjectLineSegments(const int *indices, int nLineSegments, int objectIndex)
+{
+	int lineSegmentObjectIndex = sceneData->soupToObjectsMap[objectIndex][0].second;
+	setObjectPrimitives<DIM, LineSegment, 2>(indices, nLineSegments, sceneData->soups[objectIndex],
+											 sceneData->lineSegmentObjects[lineSegmentObjectIndex]);
+}
+
+template<size_t DIM>
+inline void Scene<DIM>::setObjectTriangles(const int *indices, int nTriangles, int objectIndex)
+{
+	int triangleObjectIndex = sceneData->soupToObjectsMap[objectIndex][0].second;
+	setObjectPrimitives<DIM, Triangle, 3>(indices, nTriangles, sceneData->soups[objectIndex],
+										  sceneData->triangleObjects[triangleObjectIndex]);
+}
+
 template<size_t DIM>
 inline void Scene<DIM>::setObjectPrimitive(const int *indices, const PrimitiveType& primitiveType,
 										   int primitiveIndex, int objectIndex)
@@ -209,7 +290,7 @@ inline void computeWeightedNormals<3, LineSegment>(const std::vector<LineSegment
 {
 	int N = (int)lineSegments.size();
 	int V = (int)soup.positions.size();
-	soup.vNormals.resize(V, Vector<3>::Zero());
+	soup.vNormals.assign(V, Vector<3>::Zero());
 
 	for (int i = 0; i < N; i++) {
 		Vector3 n = lineSegments[i].normal(true);
@@ -228,10 +309,11 @@ template<>
 inline void computeWeightedNormals<3, Triangle>(const std::vector<Triangle>& triangles,
 												PolygonSoup<3>& soup)
 {
-	// set edge indices
+	// set edge indices, replacing those of previously computed normals
 	int E = 0;
 	int N = (int)triangles.size();
 	std::map<std::pair<int, int>, int> indexMap;
+	soup.eIndices.clear();
 
 	for (int i = 0; i < N; i++) {
 		for (int j = 0; j < 3; j++) {
@@ -248,8 +330,8 @@ inline void computeWeightedNormals<3, Triangle>(const std::vector<Triangle>& tri
 
 	// compute normals
 	int V = (int)soup.positions.size();
-	soup.vNormals.resize(V, Vector<3>::Zero());
-	soup.eNormals.resize(E, Vector<3>::Zero());
+	soup.vNormals.assign(V, Vector<3>::Zero());
+	soup.eNormals.assign(E, Vector<3>::Zero());
 
 	for (int i = 0; i < N; i++) {
 		Vector3 n = triangles[i].normal(true);
@@ -290,6 +372,21 @@ inline void sortSoupPositions(const std::vector<SbvhNode<DIM>>& flatTree,
 	// do nothing
 }
 
+template<size_t DIM>
+inline void updateVertexIndexMap(std::vector<int>& indexMap, PolygonSoup<DIM>& soup)
+{
+	// compose with the map from a previous sort, so that input vertex indices remain valid
+	if (soup.vertexIndexMap.size() > 0) {
+		for (int i = 0; i < (int)soup.vertexIndexMap.size(); i++) {
+			int vIndex = soup.vertexIndexMap[i];
+			soup.vertexIndexMap[i] = vIndex == -1 ? -1 : indexMap[vIndex];
+		}
+
+	} else {
+		soup.vertexIndexMap = std::move(indexMap);
+	}
+}
+
 template<>
 inline void sortSoupPositions<3, LineSegment>(const std::vector<SbvhNode<3>>& flatTree,
 											  std::vector<LineSegment *>& lineSegments,
@@ -298,6 +395,7 @@ inline void sortSoupPositions<3, LineSegment>(const std::vector<SbvhNode<3>>& fl
 	int V = (int)soup.positions.size();
 	std::vector<Vector<3>> sortedPositions(V), sortedVertexNormals(V);
 	std::vector<int> indexMap(V, -1);
+	std::vector<bool> isSorted(soup.indices.size()/2, false);
 	int v = 0;
 
 	// collect sorted positions, updating line segment and soup indices
@@ -308,6 +406,10 @@ inline void sortSoupPositions<3, LineSegment>(const std::vector<SbvhNode<3>>& fl
 			int referenceIndex = node.referenceOffset + j;
 			LineSegment *lineSegment = lineSegments[referenceIndex];
 
+			// skip references duplicated by spatial splits
+			if (isSorted[lineSegment->pIndex]) continue;
+			isSorted[lineSegment->pIndex] = true;
+
 			for (int k = 0; k < 2; k++) {
 				int vIndex = lineSegment->indices[k];
 
@@ -326,6 +428,7 @@ inline void sortSoupPositions<3, LineSegment>(const std::vector<SbvhNode<3>>& fl
 	// update to sorted positions
 	soup.positions = std::move(sortedPositions);
 	if (soup.vNormals.size() > 0) soup.vNormals = std::move(sortedVertexNormals);
+	updateVertexIndexMap(indexMap, soup);
 }
 
 template<>
@@ -336,6 +439,7 @@ inline void sortSoupPositions<3, Triangle>(const std::vector<SbvhNode<3>>& flatT
 	int V = (int)soup.positions.size();
 	std::vector<Vector<3>> sortedPositions(V), sortedVertexNormals(V);
 	std::vector<int> indexMap(V, -1);
+	std::vector<bool> isSorted(soup.indices.size()/3, false);
 	int v = 0;
 
 	// collect sorted positions, updating triangle and soup indices
@@ -346,6 +450,10 @@ inline void sortSoupPositions<3, Triangle>(const std::vector<SbvhNode<3>>& flatT
 			int referenceIndex = node.referenceOffset + j;
 			Triangle *triangle = triangles[referenceIndex];
 
+			// skip references duplicated by spatial splits
+			if (isSorted[triangle->pIndex]) continue;
+			isSorted[triangle->pIndex] = true;
+
 			for (int k = 0; k < 3; k++) {
 				int vIndex = triangle->indices[k];
 
@@ -364,6 +472,7 @@ inline void sortSoupPositions<3, Triangle>(const std::vector<SbvhNode<3>>& flatT
 	// update to sorted positions
 	soup.positions = std::move(sortedPositions);
 	if (soup.vNormals.size() > 0) soup.vNormals = std::move(sortedVertexNormals);
+	updateVertexIndexMap(indexMap, soup);
 }
 
 template<size_t DIM, typename PrimitiveType>
@@ -372,41 +481,49 @@ inline std::unique_ptr<Aggregate<DIM>> makeAggregate(const AggregateType& aggreg
 													 bool vectorize, bool printStats,
 													 SortPositionsFunc<DIM, PrimitiveType> sortPositions={})
 {
-	std::unique_ptr<Sbvh<DIM, PrimitiveType>> sbvh = nullptr;
+	CostHeuristic costHeuristic = CostHeuristic::SurfaceArea;
 	bool packLeaves = false;
+	bool useSpatialSplits = false;
+	bool copyLeafPrimitives = true;
 	int leafSize = 4;
 
 #ifdef FCPW_USE_ENOKI
 	if (vectorize) {
+		// the sbvh is only built to be collapsed into an mbvh, which stores its own leaves
 		packLeaves = true;
+		copyLeafPrimitives = false;
 		leafSize = FCPW_SIMD_WIDTH;
 	}
 #endif
 
 	if (aggregateType == AggregateType::Bvh_LongestAxisCenter) {
-		sbvh = std::unique_ptr<Sbvh<DIM, PrimitiveType>>(new Sbvh<DIM, PrimitiveType>(
-				CostHeuristic::LongestAxisCenter, primitives, sortPositions, printStats, false, leafSize));
+		costHeuristic = CostHeuristic::LongestAxisCenter;
+		packLeaves = false;
 
 	} else if (aggregateType == AggregateType::Bvh_SurfaceArea) {
-		sbvh = std::unique_ptr<Sbvh<DIM, PrimitiveType>>(new Sbvh<DIM, PrimitiveType>(
-				CostHeuristic::SurfaceArea, primitives, sortPositions, printStats, packLeaves, leafSize));
+		costHeuristic = CostHeuristic::SurfaceArea;
 
 	} else if (aggregateType == AggregateType::Bvh_OverlapSurfaceArea) {
-		sbvh = std::unique_ptr<Sbvh<DIM, PrimitiveType>>(new Sbvh<DIM, PrimitiveType>(
-				CostHeuristic::OverlapSurfaceArea, primitives, sortPositions, printStats, packLeaves, leafSize));
+		costHeuristic = CostHeuristic::OverlapSurfaceArea;
 
 	} else if (aggregateType == AggregateType::Bvh_Volume) {
-		sbvh = std::unique_ptr<Sbvh<DIM, PrimitiveType>>(new Sbvh<DIM, PrimitiveType>(
-				CostHeuristic::Volume, primitives, sortPositions, printStats, packLeaves, leafSize));
+		costHeuristic = CostHeuristic::Volume;
 
 	} else if (aggregateType == AggregateType::Bvh_OverlapVolume) {
-		sbvh = std::unique_ptr<Sbvh<DIM, PrimitiveType>>(new Sbvh<DIM, PrimitiveType>(
-				CostHeuristic::OverlapVolume, primitives, sortPositions, printStats, packLeaves, leafSize));
+		costHeuristic = CostHeuristic::OverlapVolume;
+
+	} else if (aggregateType == AggregateType::Bvh_SpatialSplitSurfaceArea) {
+		costHeuristic = CostHeuristic::SurfaceArea;
+		useSpatialSplits = true;
 
 	} else {
 		return std::unique_ptr<Baseline<DIM, PrimitiveType>>(new Baseline<DIM, PrimitiveType>(primitives));
 	}
 
+	std::unique_ptr<Sbvh<DIM, PrimitiveType>> sbvh(new Sbvh<DIM, PrimitiveType>(
+			costHeuristic, primitives, sortPositions, printStats, packLeaves, leafSize, FCPW_SBVH_BUCKETS,
+			useSpatialSplits, FCPW_SBVH_OVERLAP_THRESHOLD, copyLeafPrimitives));
+
 #ifdef FCPW_USE_ENOKI
 	if (vectorize) {
 		return std::unique_ptr<Mbvh<FCPW_SIMD_WIDTH, DIM, PrimitiveType>>(
@@ -561,20 +678,13 @@ inline std::unique_ptr<Aggregate<DIM>> buildCsgAggregateRecursive(
 }
 
 template<size_t DIM>
-inline void Scene<DIM>::build(const AggregateType& aggregateType, bool vectorize,
-							  bool printStats, bool reduceMemoryFootprint)
+inline void buildAggregateInstances(std::unique_ptr<SceneData<DIM>>& sceneData,
+									std::vector<std::unique_ptr<Aggregate<DIM>>>& objectAggregates,
+									int& nAggregates)
 {
-	// clear old aggregate data
-	sceneData->clearAggregateData();
-
-	// build geometric aggregates
-	std::vector<std::unique_ptr<Aggregate<DIM>>> objectAggregates;
-	buildGeometricAggregates<DIM>(aggregateType, vectorize, printStats, sceneData, objectAggregates);
-	int nAggregates = (int)objectAggregates.size();
-
-	// build aggregate instances and instance ptrs
 	for (int i = 0; i < (int)sceneData->soups.size(); i++) {
 		int nObjectInstances = (int)sceneData->instanceTransforms[i].size();
+		sceneData->objectAggregatePtrs.emplace_back(objectAggregates[i].get());
 
 		if (nObjectInstances == 0) {
 			sceneData->aggregateInstancePtrs.emplace_back(objectAggregates[i].get());
@@ -592,6 +702,24 @@ inline void Scene<DIM>::build(const AggregateType& aggregateType, bool vectorize
 			}
 		}
 	}
+}
+
+template<size_t DIM>
+inline void Scene<DIM>::build(const AggregateType& aggregateType, bool vectorize,
+							  bool printStats, bool reduceMemoryFootprint)
+{
+	// clear old aggregate data
+	sceneData->clearAggregateData();
+	sceneData->aggregateType = aggregateType;
+	sceneData->vectorized = vectorize;
+
+	// build geometric aggregates
+	std::vector<std::unique_ptr<Aggregate<DIM>>> objectAggregates;
+	buildGeometricAggregates<DIM>(aggregateType, vectorize, printStats, sceneData, objectAggregates);
+	int nAggregates = (int)objectAggregates.size();
+
+	// build aggregate instances and instance ptrs
+	buildAggregateInstances<DIM>(sceneData, objectAggregates, nAggregates);
 
 	// build root aggregate
 	if (sceneData->aggregateInstances.size() == 1) {
@@ -609,21 +737,56 @@ inline void Scene<DIM>::build(const AggregateType& aggregateType, bool vectorize
 		sceneData->aggregateInstances.clear();
 
 	} else {
-		// make aggregate of aggregates
+		// make aggregate of aggregates; when vectorized, its leaves cull the aggregate instances
+		// with their bounding boxes WIDTH at a time
 		sceneData->aggregate = makeAggregate<DIM, Aggregate<DIM>>(aggregateType, sceneData->aggregateInstancePtrs,
-																  false, printStats);
+																  vectorize, printStats);
 		sceneData->aggregate->index = nAggregates++;
 	}
 
 	// reduce memory footprint of aggregate
 	if (reduceMemoryFootprint) {
+		// free the line segments and triangles of objects whose aggregates no longer need them,
+		// i.e., whose vectorized leaves store them; these primitives are then only referenced
+		// by their indices in the soup
+		// the object ptrs are only allocated for objects with a single primitive type, and are
+		// hence indexed differently than the objects themselves (see buildGeometricAggregates)
+		int nObjects = (int)sceneData->soups.size();
+		int nLineSegmentObjectPtrs = 0;
+		int nTriangleObjectPtrs = 0;
+		std::vector<bool> releasedPrimitives(nObjects, false);
+
+		for (int i = 0; i < nObjects; i++) {
+			const std::vector<std::pair<ObjectType, int>>& objectsMap = sceneData->soupToObjectsMap[i];
+			if (objectsMap.size() != 1) continue;
+
+			int objectIndex = objectsMap[0].second;
+			if (objectsMap[0].first == ObjectType::LineSegments) {
+				int objectPtrIndex = nLineSegmentObjectPtrs++;
+				if (!sceneData->objectAggregatePtrs[i]->releasePrimitives()) continue;
+
+				std::vector<LineSegment *>().swap(sceneData->lineSegmentObjectPtrs[objectPtrIndex]);
+				sceneData->lineSegmentObjects[objectIndex] = nullptr;
+
+			} else {
+				int objectPtrIndex = nTriangleObjectPtrs++;
+				if (!sceneData->objectAggregatePtrs[i]->releasePrimitives()) continue;
+
+				std::vector<Triangle *>().swap(sceneData->triangleObjectPtrs[objectPtrIndex]);
+				sceneData->triangleObjects[objectIndex] = nullptr;
+			}
+
+			releasedPrimitives[i] = true;
+		}
+
 		sceneData->soupToObjectsMap.clear();
 		sceneData->instanceTransforms.clear();
 		sceneData->csgTree.clear();
 
-		for (int i = 0; i < (int)sceneData->soups.size(); i++) {
+		for (int i = 0; i < nObjects; i++) {
 			PolygonSoup<DIM>& soup = sceneData->soups[i];
-			soup.indices.clear();
+			// normals of released primitives are computed from their indices in the soup
+			if (!releasedPrimitives[i] || soup.vNormals.size() == 0) soup.indices.clear();
 			if (vectorize && sceneData->mixedObjectPtrs.size() == 0 && soup.vNormals.size() == 0) {
 				soup.positions.clear();
 			}
@@ -631,6 +794,428 @@ inline void Scene<DIM>::build(const AggregateType& aggregateType, bool vectorize
 	}
 }
 
+template<size_t DIM>
+inline void Scene<DIM>::refit()
+{
+	// instances share the aggregate of their object, so it is refit once here rather than once per
+	// instance; the scene aggregate then refits the objects without instances and the instance boxes
+	for (int i = 0; i < (int)sceneData->objectAggregatePtrs.size(); i++) {
+		if (i < (int)sceneData->instanceTransforms.size() && sceneData->instanceTransforms[i].size() > 0) {
+			sceneData->objectAggregatePtrs[i]->refit();
+		}
+	}
+
+	sceneData->aggregate->refit();
+}
+
+template<size_t DIM>
+inline void writeSceneHeader(BinaryWriter& writer)
+{
+	writer.write<uint32_t>(FCPW_SERIALIZATION_MAGIC);
+	writer.write<uint32_t>(FCPW_SERIALIZATION_VERSION);
+	writer.write<uint32_t>(FCPW_SERIALIZATION_ENDIAN_TAG);
+	writer.write<uint32_t>(DIM);
+
+	// record the build configuration the memory layout of the aggregates depends on
+#ifdef FCPW_USE_ENOKI
+	writer.write<uint32_t>(FCPW_SIMD_WIDTH);
+	writer.write<uint32_t>(FCPW_MBVH_BRANCHING_FACTOR);
+	writer.write<uint32_t>(sizeof(MbvhNode<DIM>));
+#else
+	writer.write<uint32_t>(0);
+	writer.write<uint32_t>(0);
+	writer.write<uint32_t>(0);
+#endif
+	writer.write<uint32_t>(sizeof(SbvhNode<DIM>));
+}
+
+template<size_t DIM>
+inline bool readSceneHeader(BinaryReader& reader)
+{
+	if (reader.read<uint32_t>() != FCPW_SERIALIZATION_MAGIC) return false;
+	if (reader.read<uint32_t>() != FCPW_SERIALIZATION_VERSION) return false;
+	if (reader.read<uint32_t>() != FCPW_SERIALIZATION_ENDIAN_TAG) return false;
+	if (reader.read<uint32_t>() != DIM) return false;
+
+#ifdef FCPW_USE_ENOKI
+	if (reader.read<uint32_t>() != FCPW_SIMD_WIDTH) return false;
+	if (reader.read<uint32_t>() != FCPW_MBVH_BRANCHING_FACTOR) return false;
+	if (reader.read<uint32_t>() != sizeof(MbvhNode<DIM>)) return false;
+#else
+	if (reader.read<uint32_t>() != 0) return false;
+	if (reader.read<uint32_t>() != 0) return false;
+	if (reader.read<uint32_t>() != 0) return false;
+#endif
+	if (reader.read<uint32_t>() != sizeof(SbvhNode<DIM>)) return false;
+
+	return reader.good();
+}
+
+template<size_t DIM>
+inline void writeSoup(const PolygonSoup<DIM>& soup, BinaryWriter& writer)
+{
+	writer.writeArray(soup.indices);
+	writer.writeArray(soup.eIndices);
+	writer.writeArray(soup.tIndices);
+	writer.writeArray(soup.positions);
+	writer.writeArray(soup.textureCoordinates);
+	writer.writeArray(soup.vNormals);
+	writer.writeArray(soup.eNormals);
+	writer.writeArray(soup.vertexIndexMap);
+}
+
+template<size_t DIM>
+inline void readSoup(BinaryReader& reader, PolygonSoup<DIM>& soup)
+{
+	reader.readArray(soup.indices);
+	reader.readArray(soup.eIndices);
+	reader.readArray(soup.tIndices);
+	reader.readArray(soup.positions);
+	reader.readArray(soup.textureCoordinates);
+	reader.readArray(soup.vNormals);
+	reader.readArray(soup.eNormals);
+	reader.readArray(soup.vertexIndexMap);
+}
+
+template<typename PrimitiveType>
+inline void writeReferences(const std::vector<PrimitiveType *>& primitives, BinaryWriter& writer)
+{
+	// write the soup index of each primitive in the reference order of the aggregate
+	std::vector<int> references;
+	references.reserve(primitives.size());
+	for (int i = 0; i < (int)primitives.size(); i++) {
+		references.emplace_back(primitives[i]->pIndex);
+	}
+
+	writer.writeArray(references);
+}
+
+template<size_t DIM, typename PrimitiveType, size_t N>
+inline bool readPrimitives(BinaryReader& reader, const PolygonSoup<DIM>& soup,
+						   std::vector<PrimitiveType>& primitives,
+						   std::vector<PrimitiveType *>& primitivePtrs)
+{
+	// set the primitives from the soup indices
+	int V = (int)soup.positions.size();
+	int nPrimitives = (int)soup.indices.size()/N;
+	if (soup.indices.size()%N != 0) return false;
+	primitives.resize(nPrimitives);
+
+	for (int i = 0; i < nPrimitives; i++) {
+		PrimitiveType& primitive = primitives[i];
+		primitive.soup = &soup;
+		primitive.pIndex = i;
+
+		for (size_t k = 0; k < N; k++) {
+			primitive.indices[k] = soup.indices[N*i + k];
+			if (primitive.indices[k] < 0 || primitive.indices[k] >= V) return false;
+		}
+	}
+
+	// set the primitive ptrs in the reference order of the aggregate
+	size_t nReferences = 0;
+	const int *references = reader.readArray<int>(nReferences);
+	primitivePtrs.reserve(nReferences);
+
+	for (size_t i = 0; i < nReferences; i++) {
+		if (references[i] < 0 || references[i] >= nPrimitives) return false;
+		primitivePtrs.emplace_back(&primitives[references[i]]);
+	}
+
+	return reader.good();
+}
+
+template<typename PrimitiveType>
+inline void setPrimitivePtrs(std::vector<PrimitiveType>& primitives, std::vector<PrimitiveType *>& primitivePtrs)
+{
+	primitivePtrs.resize(primitives.size());
+	for (int i = 0; i < (int)primitives.size(); i++) {
+		primitivePtrs[i] = &primitives[i];
+	}
+}
+
+template<size_t DIM, typename PrimitiveType>
+inline const std::vector<PrimitiveType *>& getAggregateReferences(const Aggregate<DIM> *aggregate, bool vectorized)
+{
+#ifdef FCPW_USE_ENOKI
+	if (vectorized) {
+		return static_cast<const Mbvh<FCPW_SIMD_WIDTH, DIM, PrimitiveType> *>(aggregate)->getReferences();
+	}
+#endif
+
+	return static_cast<const Sbvh<DIM, PrimitiveType> *>(aggregate)->getReferences();
+}
+
+template<size_t DIM, typename PrimitiveType>
+inline std::unique_ptr<Aggregate<DIM>> readAggregate(BinaryReader& reader, bool vectorized,
+													 std::vector<PrimitiveType *>& primitives,
+													 bool copyReferences=false)
+{
+#ifdef FCPW_USE_ENOKI
+	if (vectorized) {
+		return std::unique_ptr<Mbvh<FCPW_SIMD_WIDTH, DIM, PrimitiveType>>(
+				new Mbvh<FCPW_SIMD_WIDTH, DIM, PrimitiveType>(primitives, reader, copyReferences));
+	}
+#endif
+
+	return std::unique_ptr<Sbvh<DIM, PrimitiveType>>(
+			new Sbvh<DIM, PrimitiveType>(primitives, reader, copyReferences));
+}
+
+template<size_t DIM>
+inline void writeGeometricAggregates(const std::unique_ptr<SceneData<DIM>>& sceneData, BinaryWriter& writer)
+{
+	std::cerr << "writeGeometricAggregates(): DIM: " << DIM << std::endl;
+	exit(EXIT_FAILURE);
+}
+
+template<>
+inline void writeGeometricAggregates<3>(const std::unique_ptr<SceneData<3>>& sceneData, BinaryWriter& writer)
+{
+	// write the object types up front, so that the object vectors can be allocated before reading
+	int nObjects = (int)sceneData->soups.size();
+	std::vector<int> objectTypes(nObjects);
+
+	for (int i = 0; i < nObjects; i++) {
+		const std::vector<std::pair<ObjectType, int>>& objectsMap = sceneData->soupToObjectsMap.at(i);
+		if (objectsMap.size() > 1) {
+			std::cerr << "writeGeometricAggregates(): Objects with mixed primitive types are not supported" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+
+		objectTypes[i] = static_cast<int>(objectsMap[0].first);
+	}
+
+	writer.writeArray(objectTypes);
+
+	// write the soups, the reference order of their primitives and their aggregates; the references
+	// are taken from the aggregates, since they can contain duplicates created by spatial splits
+	for (int i = 0; i < nObjects; i++) {
+		writeSoup<3>(sceneData->soups[i], writer);
+		const Aggregate<3> *aggregate = sceneData->objectAggregatePtrs[i];
+
+		if (objectTypes[i] == static_cast<int>(ObjectType::LineSegments)) {
+			writeReferences<LineSegment>(getAggregateReferences<3, LineSegment>(aggregate, sceneData->vectorized),
+										 writer);
+
+		} else {
+			writeReferences<Triangle>(getAggregateReferences<3, Triangle>(aggregate, sceneData->vectorized),
+									  writer);
+		}
+
+		aggregate->write(writer);
+	}
+}
+
+template<size_t DIM>
+inline bool readGeometricAggregates(BinaryReader& reader, std::unique_ptr<SceneData<DIM>>& sceneData,
+									std::vector<std::unique_ptr<Aggregate<DIM>>>& objectAggregates)
+{
+	std::cerr << "readGeometricAggregates(): DIM: " << DIM << std::endl;
+	exit(EXIT_FAILURE);
+}
+
+template<>
+inline bool readGeometricAggregates<3>(BinaryReader& reader, std::unique_ptr<SceneData<3>>& sceneData,
+									   std::vector<std::unique_ptr<Aggregate<3>>>& objectAggregates)
+{
+	// allocate the soup and object vectors, which must not be resized once the aggregates reference them
+	std::vector<int> objectTypes;
+	reader.readArray(objectTypes);
+	int nObjects = (int)objectTypes.size();
+	int nLineSegmentObjects = 0;
+	int nTriangleObjects = 0;
+
+	for (int i = 0; i < nObjects; i++) {
+		if (objectTypes[i] == static_cast<int>(ObjectType::LineSegments)) {
+			sceneData->soupToObjectsMap[i].emplace_back(std::make_pair(ObjectType::LineSegments,
+																	   nLineSegmentObjects++));
+
+		} else if (objectTypes[i] == static_cast<int>(ObjectType::Triangles)) {
+			sceneData->soupToObjectsMap[i].emplace_back(std::make_pair(ObjectType::Triangles,
+																	   nTriangleObjects++));
+
+		} else {
+			return false;
+		}
+	}
+
+	sceneData->soups.resize(nObjects);
+	sceneData->instanceTransforms.resize(nObjects);
+	sceneData->lineSegmentObjects.resize(nLineSegmentObjects);
+	sceneData->triangleObjects.resize(nTriangleObjects);
+	sceneData->lineSegmentObjectPtrs.resize(nLineSegmentObjects);
+	sceneData->triangleObjectPtrs.resize(nTriangleObjects);
+	objectAggregates.resize(nObjects);
+
+	// read the soups, primitives and aggregates
+	for (int i = 0; i < nObjects; i++) {
+		PolygonSoup<3>& soup = sceneData->soups[i];
+		readSoup<3>(reader, soup);
+		int objectIndex = sceneData->soupToObjectsMap[i][0].second;
+
+		if (objectTypes[i] == static_cast<int>(ObjectType::LineSegments)) {
+			sceneData->lineSegmentObjects[objectIndex] = std::unique_ptr<std::vector<LineSegment>>(
+				new std::vector<LineSegment>());
+			std::vector<LineSegment>& lineSegmentObject = *sceneData->lineSegmentObjects[objectIndex];
+			std::vector<LineSegment *>& lineSegmentObjectPtr = sceneData->lineSegmentObjectPtrs[objectIndex];
+			if (!readPrimitives<3, LineSegment, 2>(reader, soup, lineSegmentObject, lineSegmentObjectPtr)) return false;
+
+			// references duplicated by spatial splits are kept by the aggregate
+			bool copyReferences = lineSegmentObjectPtr.size() > lineSegmentObject.size();
+			objectAggregates[i] = readAggregate<3, LineSegment>(reader, sceneData->vectorized,
+																lineSegmentObjectPtr, copyReferences);
+			if (copyReferences) setPrimitivePtrs<LineSegment>(lineSegmentObject, lineSegmentObjectPtr);
+
+		} else {
+			sceneData->triangleObjects[objectIndex] = std::unique_ptr<std::vector<Triangle>>(
+				new std::vector<Triangle>());
+			std::vector<Triangle>& triangleObject = *sceneData->triangleObjects[objectIndex];
+			std::vector<Triangle *>& triangleObjectPtr = sceneData->triangleObjectPtrs[objectIndex];
+			if (!readPrimitives<3, Triangle, 3>(reader, soup, triangleObject, triangleObjectPtr)) return false;
+
+			// references duplicated by spatial splits are kept by the aggregate
+			bool copyReferences = triangleObjectPtr.size() > triangleObject.size();
+			objectAggregates[i] = readAggregate<3, Triangle>(reader, sceneData->vectorized,
+															 triangleObjectPtr, copyReferences);
+			if (copyReferences) setPrimitivePtrs<Triangle>(triangleObject, triangleObjectPtr);
+		}
+
+		objectAggregates[i]->index = i;
+		objectAggregates[i]->computeNormals = soup.vNormals.size() > 0;
+		if (!reader.good()) return false;
+	}
+
+	return true;
+}
+
+template<size_t DIM>
+inline void Scene<DIM>::save(const std::string& filename) const
+{
+	if (!sceneData->aggregate || sceneData->aggregateType == AggregateType::Baseline ||
+		sceneData->csgTree.size() > 0 || sceneData->soupToObjectsMap.size() == 0) {
+		std::cerr << "Scene::save(): Only scenes with a bvh aggregate and without a csg tree are supported"
+				  << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	std::ofstream out(filename, std::ios::binary);
+	if (!out.is_open()) {
+		std::cerr << "Unable to open file: " << filename << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// write header and aggregate settings
+	BinaryWriter writer(out);
+	writeSceneHeader<DIM>(writer);
+	writer.write<int>(static_cast<int>(sceneData->aggregateType));
+	writer.write<int>(sceneData->vectorized ? 1 : 0);
+
+	// write objects and instance transforms
+	writeGeometricAggregates<DIM>(sceneData, writer);
+	for (int i = 0; i < (int)sceneData->soups.size(); i++) {
+		writer.writeArray(sceneData->instanceTransforms[i]);
+	}
+
+	// write root aggregate, if the scene has an aggregate of aggregates
+	std::vector<int> references;
+	for (int i = 0; i < (int)sceneData->aggregateInstancePtrs.size(); i++) {
+		references.emplace_back(sceneData->aggregateInstancePtrs[i]->index);
+	}
+
+	writer.writeArray(references);
+	if (references.size() > 0) sceneData->aggregate->write(writer);
+
+	if (!writer.good()) {
+		std::cerr << "Scene::save(): Unable to write file: " << filename << std::endl;
+		exit(EXIT_FAILURE);
+	}
+}
+
+template<size_t DIM>
+inline bool Scene<DIM>::load(const std::string& filename)
+{
+	// clear old data
+	sceneData->clearAggregateData();
+	sceneData->clearObjectData();
+
+	// map file
+	std::unique_ptr<MappedFile> mappedFile(new MappedFile());
+	if (!mappedFile->map(filename)) {
+		std::cerr << "Unable to open file: " << filename << std::endl;
+		return false;
+	}
+
+	BinaryReader reader(mappedFile->data, mappedFile->size);
+	if (!readSceneHeader<DIM>(reader)) {
+		std::cerr << "Scene::load(): " << filename << " was written by an incompatible version "
+				  << "or build configuration of fcpw" << std::endl;
+		return false;
+	}
+
+	// read aggregate settings, objects and instance transforms
+	sceneData->aggregateType = static_cast<AggregateType>(reader.read<int>());
+	sceneData->vectorized = reader.read<int>() == 1;
+
+	std::vector<std::unique_ptr<Aggregate<DIM>>> objectAggregates;
+	bool success = readGeometricAggregates<DIM>(reader, sceneData, objectAggregates);
+	for (int i = 0; success && i < (int)sceneData->soups.size(); i++) {
+		reader.readArray(sceneData->instanceTransforms[i]);
+	}
+
+	if (success && reader.good()) {
+		// build aggregate instances and instance ptrs as in build
+		int nAggregates = (int)objectAggregates.size();
+		buildAggregateInstances<DIM>(sceneData, objectAggregates, nAggregates);
+
+		// order the instance ptrs as referenced by the root aggregate
+		std::vector<int> references;
+		reader.readArray(references);
+		std::vector<Aggregate<DIM> *> aggregateInstancePtrs(nAggregates, nullptr);
+		for (int i = 0; i < (int)sceneData->aggregateInstancePtrs.size(); i++) {
+			Aggregate<DIM> *instance = sceneData->aggregateInstancePtrs[i];
+			aggregateInstancePtrs[instance->index] = instance;
+		}
+
+		int nInstances = (int)sceneData->aggregateInstancePtrs.size();
+		if (nInstances > 1 && (int)references.size() != nInstances) success = false;
+		for (int i = 0; success && i < (int)references.size(); i++) {
+			if (references[i] < 0 || references[i] >= nAggregates || !aggregateInstancePtrs[references[i]]) {
+				success = false;
+
+			} else {
+				sceneData->aggregateInstancePtrs[i] = aggregateInstancePtrs[references[i]];
+			}
+		}
+
+		// set root aggregate
+		if (!success || sceneData->aggregateInstances.size() == 0) {
+			success = false;
+
+		} else if (sceneData->aggregateInstances.size() == 1) {
+			sceneData->aggregate = std::move(sceneData->aggregateInstances[0]);
+			sceneData->aggregateInstancePtrs.clear();
+			sceneData->aggregateInstances.clear();
+
+		} else {
+			sceneData->aggregate = readAggregate<DIM, Aggregate<DIM>>(reader, sceneData->vectorized,
+																	  sceneData->aggregateInstancePtrs);
+			sceneData->aggregate->index = nAggregates++;
+		}
+	}
+
+	if (!success || !reader.good()) {
+		std::cerr << "Scene::load(): " << filename << " is corrupted" << std::endl;
+		sceneData->clearAggregateData();
+		sceneData->clearObjectData();
+		return false;
+	}
+
+	// keep the file mapped while the aggregates view it
+	sceneData->mappedFile = std::move(mappedFile);
+	return true;
+}
+
 template<size_t DIM>
 inline int Scene<DIM>::intersect(Ray<DIM>& r, std::vector<Interaction<DIM>>& is, bool checkForOcclusion,
 								 bool recordAllHits) const
@@ -638,6 +1223,22 @@ inline int Scene<DIM>::intersect(Ray<DIM>& r, std::vector<Interaction<DIM>>& is,
 	return sceneData->aggregate->intersect(r, is, checkForOcclusion, recordAllHits);
 }
 
+template<size_t DIM>
+inline bool Scene<DIM>::intersect(Ray<DIM>& r, Interaction<DIM>& i, const HitFilter<DIM>& filter,
+								  bool checkForOcclusion) const
+{
+	return sceneData->aggregate->intersect(r, i, filter, checkForOcclusion);
+}
+
+template<size_t DIM>
+inline int Scene<DIM>::intersectRays(const float *origins, const float *directions, const float *tMax,
+									 size_t nRays, float *distances, float *points,
+									 int *primitiveIndices, float *uvs, bool checkForOcclusion) const
+{
+	return sceneData->aggregate->intersectRays(origins, directions, tMax, nRays, 0, nRays, distances,
+											   points, primitiveIndices, uvs, checkForOcclusion);
+}
+
 template<size_t DIM>
 inline bool Scene<DIM>::contains(const Vector<DIM>& x) const
 {
@@ -651,10 +1252,70 @@ inline bool Scene<DIM>::hasLineOfSight(const Vector<DIM>& xi, const Vector<DIM>&
 }
 
 template<size_t DIM>
-inline bool Scene<DIM>::findClosestPoint(const Vector<DIM>& x, Interaction<DIM>& i, float squaredRadius) const
+inline bool Scene<DIM>::findClosestPoint(const Vector<DIM>& x, Interaction<DIM>& i, float squaredRadius,
+										 const Vector<DIM>& boundaryHint) const
+{
+	int nodesVisited = 0;
+	BoundingSphere<DIM> s(x, squaredRadius);
+	return sceneData->aggregate->findClosestPointFromNode(s, i, 0, sceneData->aggregate->index,
+														  boundaryHint, nodesVisited);
+}
+
+template<size_t DIM>
+inline bool Scene<DIM>::findClosestPointFromPrevious(const Vector<DIM>& x, const Interaction<DIM>& iPrev,
+													 Interaction<DIM>& i, float squaredRadius) const
+{
+	int nodesVisited = 0;
+	BoundingSphere<DIM> s(x, squaredRadius);
+	return sceneData->aggregate->findClosestPointBottomUp(s, i, iPrev.nodeIndex, iPrev.objectIndex,
+														  nodesVisited);
+}
+
+template<size_t DIM>
+inline int Scene<DIM>::findKClosestPoints(const Vector<DIM>& x, int k, std::vector<Interaction<DIM>>& is,
+										  float squaredRadius) const
 {
 	BoundingSphere<DIM> s(x, squaredRadius);
-	return sceneData->aggregate->findClosestPoint(s, i);
+	return sceneData->aggregate->findKClosestPoints(s, is, k);
+}
+
+template<size_t DIM>
+inline int Scene<DIM>::findAllWithinRadius(const Vector<DIM>& x, float radius,
+										   std::vector<Interaction<DIM>>& is) const
+{
+	BoundingSphere<DIM> s(x, radius*radius);
+	return sceneData->aggregate->findAllWithinRadius(s, is);
+}
+
+template<size_t DIM>
+inline void Scene<DIM>::findClosestPoints(const float *xyz, size_t nQueries, float *distances,
+										  float *points, int *primitiveIndices, float *uvs,
+										  const float *squaredRadii) const
+{
+	const Aggregate<DIM> *aggregate = sceneData->aggregate.get();
+	auto findClosestPoints = [&](size_t begin, size_t end) {
+		aggregate->findClosestPoints(xyz, squaredRadii, nQueries, begin, end,
+									 distances, points, primitiveIndices, uvs);
+	};
+
+	parallelFor(nQueries, 256, findClosestPoints, FCPW_MIN_PARALLEL_QUERIES);
+}
+
+template<size_t DIM>
+inline void Scene<DIM>::findClosestPointsInClusters(const float *xyz, size_t nQueries, float *distances,
+													float *points, int *primitiveIndices, float *uvs,
+													const float *squaredRadii, size_t clusterSize) const
+{
+	// distribute whole clusters across threads
+	const Aggregate<DIM> *aggregate = sceneData->aggregate.get();
+	clusterSize = std::max(clusterSize, (size_t)1);
+	auto findClosestPoints = [&](size_t begin, size_t end) {
+		aggregate->findClosestPointsInClusters(xyz, squaredRadii, nQueries, begin, end, clusterSize,
+											   distances, points, primitiveIndices, uvs);
+	};
+
+	parallelFor(nQueries, clusterSize*std::max((size_t)256/clusterSize, (size_t)1), findClosestPoints,
+				FCPW_MIN_PARALLEL_QUERIES);
 }
 
 template<size_t DIM>
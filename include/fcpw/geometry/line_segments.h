@@ -38,6 +38,9 @@ public:
 	int intersect(Ray<3>& r, std::vector<Interaction<3>>& is,
 				  bool checkForOcclusion=false, bool recordAllHits=false) const;
 
+	// intersects with ray without allocating; NOTE: specialized to flat line segment (z = 0)
+	bool intersect(Ray<3>& r, Interaction<3>& i, bool checkForOcclusion=false) const;
+
 	// finds closest point to sphere center
 	bool findClosestPoint(BoundingSphere<3>& s, Interaction<3>& i) const;
 
@@ -124,39 +124,58 @@ inline int LineSegment::intersect(Ray<3>& r, std::vector<Interaction<3>>& is,
 								  bool checkForOcclusion, bool recordAllHits) const
 {
 	is.clear();
-	const Vector3& pa = soup->positions[indices[0]];
-	const Vector3& pb = soup->positions[indices[1]];
+	Interaction<3> i;
+	if (intersect(r, i, checkForOcclusion)) {
+		is.emplace_back(i);
+		return 1;
+	}
+
+	return 0;
+}
 
+inline bool intersectLineSegment(const Vector3& pa, const Vector3& pb,
+								 const Ray<3>& r, float& d, float& t)
+{
 	Vector3 u = pa - r.o;
 	Vector3 v = pb - pa;
 
 	// return if line segment and ray are parallel
 	float dv = r.d.cross(v)[2];
-	if (std::fabs(dv) < epsilon) return 0;
+	if (std::fabs(dv) < epsilon) return false;
 
-	// solve r.o + t*r.d = pa + s*(pb - pa) for t >= 0 && 0 <= s <= 1
-	// s = (u x r.d)/(r.d x v)
+	// solve r.o + d*r.d = pa + t*(pb - pa) for d >= 0 && 0 <= t <= 1
+	// t = (u x r.d)/(r.d x v)
 	float ud = u.cross(r.d)[2];
-	float s = ud/dv;
+	t = ud/dv;
 
-	if (s >= 0.0f && s <= 1.0f) {
-		// t = (u x v)/(r.d x v)
+	if (t >= 0.0f && t <= 1.0f) {
+		// d = (u x v)/(r.d x v)
 		float uv = u.cross(v)[2];
-		float t = uv/dv;
+		d = uv/dv;
 
-		if (t >= 0.0f && t <= r.tMax) {
-			auto it = is.emplace(is.end(), Interaction<3>());
-			it->d = t;
-			it->p = r(t);
-			it->uv[0] = s;
-			it->uv[1] = -1;
-			it->primitiveIndex = pIndex;
+		return d >= 0.0f && d <= r.tMax;
+	}
 
-			return 1;
-		}
+	return false;
+}
+
+inline bool LineSegment::intersect(Ray<3>& r, Interaction<3>& i, bool checkForOcclusion) const
+{
+	const Vector3& pa = soup->positions[indices[0]];
+	const Vector3& pb = soup->positions[indices[1]];
+
+	float d, t;
+	if (intersectLineSegment(pa, pb, r, d, t)) {
+		i.d = d;
+		i.p = r(d);
+		i.uv[0] = t;
+		i.uv[1] = -1;
+		i.primitiveIndex = pIndex;
+
+		return true;
 	}
 
-	return 0;
+	return false;
 }
 
 inline float findClosestPointLineSegment(const Vector3& pa, const Vector3& pb,
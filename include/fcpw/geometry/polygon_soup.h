@@ -19,6 +19,7 @@ struct PolygonSoup {
 	std::vector<Vector<DIM>> positions;
 	std::vector<Vector<DIM - 1>> textureCoordinates;
 	std::vector<Vector<DIM>> vNormals, eNormals; // normalized values
+	std::vector<int> vertexIndexMap; // maps input vertex indices to sorted positions, empty if unsorted
 };
 
 } // namespace fcpw
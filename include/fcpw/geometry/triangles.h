@@ -44,6 +44,9 @@ public:
 	int intersect(Ray<3>& r, std::vector<Interaction<3>>& is,
 				  bool checkForOcclusion=false, bool recordAllHits=false) const;
 
+	// intersects with ray without allocating
+	bool intersect(Ray<3>& r, Interaction<3>& i, bool checkForOcclusion=false) const;
+
 	// finds closest point to sphere center
 	bool findClosestPoint(BoundingSphere<3>& s, Interaction<3>& i) const;
 
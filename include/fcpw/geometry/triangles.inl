@@ -202,42 +202,66 @@ inline void Triangle::split(int dim, float splitCoord, BoundingBox<3>& boxLeft,
 inline int Triangle::intersect(Ray<3>& r, std::vector<Interaction<3>>& is,
 							   bool checkForOcclusion, bool recordAllHits) const
 {
-	// Möller–Trumbore intersection algorithm
-	const Vector3& pa = soup->positions[indices[0]];
-	const Vector3& pb = soup->positions[indices[1]];
-	const Vector3& pc = soup->positions[indices[2]];
 	is.clear();
+	Interaction<3> i;
+	if (intersect(r, i, checkForOcclusion)) {
+		is.emplace_back(i);
+		return 1;
+	}
 
+	return 0;
+}
+
+inline bool intersectTriangle(const Vector3& pa, const Vector3& pb, const Vector3& pc,
+							  const Ray<3>& r, float& d, Vector2& t)
+{
+	// Möller–Trumbore intersection algorithm
 	Vector3 v1 = pb - pa;
 	Vector3 v2 = pc - pa;
 	Vector3 p = r.d.cross(v2);
 	float det = v1.dot(p);
 
 	// ray and triangle are parallel if det is close to 0
-	if (std::fabs(det) < epsilon) return 0;
+	if (std::fabs(det) < epsilon) return false;
 	float invDet = 1.0f/det;
 
 	Vector3 s = r.o - pa;
 	float u = s.dot(p)*invDet;
-	if (u < 0 || u > 1) return 0;
+	if (u < 0 || u > 1) return false;
 
 	Vector3 q = s.cross(v1);
 	float v = r.d.dot(q)*invDet;
-	if (v < 0 || u + v > 1) return 0;
+	if (v < 0 || u + v > 1) return false;
 
-	float t = v2.dot(q)*invDet;
-	if (t >= 0.0f && t <= r.tMax) {
-		auto it = is.emplace(is.end(), Interaction<3>());
-		it->d = t;
-		it->p = r(t);
-		it->uv[0] = u;
-		it->uv[1] = v;
-		it->primitiveIndex = pIndex;
+	d = v2.dot(q)*invDet;
+	if (d >= 0.0f && d <= r.tMax) {
+		t[0] = u;
+		t[1] = v;
 
-		return 1;
+		return true;
 	}
 
-	return 0;
+	return false;
+}
+
+inline bool Triangle::intersect(Ray<3>& r, Interaction<3>& i, bool checkForOcclusion) const
+{
+	const Vector3& pa = soup->positions[indices[0]];
+	const Vector3& pb = soup->positions[indices[1]];
+	const Vector3& pc = soup->positions[indices[2]];
+
+	float d;
+	Vector2 t;
+	if (intersectTriangle(pa, pb, pc, r, d, t)) {
+		i.d = d;
+		i.p = r(d);
+		i.uv = t;
+		i.primitiveIndex = pIndex;
+
+		return true;
+	}
+
+	return false;
 }
 
 inline float findClosestPointTriangle(const Vector3& pa, const Vector3& pb, const Vector3& pc,
@@ -19,7 +19,10 @@ enum class AggregateType {
 	Bvh_OverlapSurfaceArea = 2,
 	Bvh_SurfaceArea = 3,
 	Bvh_OverlapVolume = 4,
-	Bvh_Volume = 5
+	Bvh_Volume = 5,
+	Bvh_SpatialSplitSurfaceArea = 6 // surface area heuristic with spatial splits; the bvh keeps the duplicated
+									// references to primitives it creates, so the object ptrs of the scene data
+									// still contain each primitive exactly once
 };
 
 struct CsgTreeNode {
@@ -41,6 +44,7 @@ public:
 	void clearAggregateData();
 
 	// members
+	std::unique_ptr<MappedFile> mappedFile; // file viewed in place by a loaded aggregate
 	std::vector<PolygonSoup<DIM>> soups;
 	std::unordered_map<int, std::vector<std::pair<ObjectType, int>>> soupToObjectsMap;
 
@@ -53,9 +57,12 @@ public:
 	std::vector<std::vector<Triangle *>> triangleObjectPtrs;
 	std::vector<std::vector<GeometricPrimitive<DIM> *>> mixedObjectPtrs;
 
+	std::vector<Aggregate<DIM> *> objectAggregatePtrs;
 	std::vector<std::unique_ptr<Aggregate<DIM>>> aggregateInstances;
 	std::vector<Aggregate<DIM> *> aggregateInstancePtrs;
 	std::unique_ptr<Aggregate<DIM>> aggregate;
+	AggregateType aggregateType;
+	bool vectorized;
 
 	template<size_t U>
 	friend class Scene;
@@ -2,7 +2,10 @@ namespace fcpw {
 
 template<size_t DIM>
 inline SceneData<DIM>::SceneData():
-aggregate(nullptr)
+mappedFile(nullptr),
+aggregate(nullptr),
+aggregateType(AggregateType::Baseline),
+vectorized(false)
 {
 
 }
@@ -24,9 +27,11 @@ inline void SceneData<DIM>::clearAggregateData()
 	lineSegmentObjectPtrs.clear();
 	triangleObjectPtrs.clear();
 	mixedObjectPtrs.clear();
+	objectAggregatePtrs.clear();
 	aggregateInstancePtrs.clear();
 	aggregateInstances.clear();
 	aggregate = nullptr;
+	mappedFile = nullptr;
 }
 
 } // namespace fcpw
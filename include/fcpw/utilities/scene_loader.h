@@ -6,7 +6,11 @@ namespace fcpw {
 
 enum class LoadingOption {
 	ObjLineSegments,
-	ObjTriangles
+	ObjTriangles,
+	BinaryLineSegments, // polygon soup written by saveSoupToBinaryFile
+	BinaryTriangles,
+	PlyTriangles, // binary ply file, polygonal faces are triangulated
+	StlTriangles // binary stl file, vertices are welded
 };
 
 std::vector<std::pair<std::string, LoadingOption>> files;
@@ -16,7 +20,8 @@ std::string csgFilename;
 template<size_t DIM>
 class SceneLoader {
 public:
-	// loads files; NOTE: this method does not build the scene aggregate/accelerator,
+	// loads files; if computeNormals is set, normals stored in binary mesh files are kept instead
+	// of being recomputed. NOTE: this method does not build the scene aggregate/accelerator,
 	// it just populates its geometry
 	void loadFiles(Scene<DIM>& scene, bool computeNormals);
 };
@@ -1,152 +1,732 @@
+#include <array>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <sstream>
+#include <unordered_map>
 
 namespace fcpw {
 
-// helper class for loading polygons from obj files
-struct Index {
-	Index() {}
+// helper functions for parsing obj files; a backslash at the end of a line continues
+// the line onto the next one
+inline bool isObjLineContinuation(const char *p, const char *end)
+{
+	// p points at a backslash
+	for (p++; p < end && (*p == ' ' || *p == '\t' || *p == '\r'); p++);
+	return p == end || *p == '\n';
+}
 
-	Index(int v, int vt, int vn) : position(v), uv(vt), normal(vn) {}
+inline bool endsWithObjLineContinuation(const char *begin, const char *newline)
+{
+	const char *p = newline;
+	while (p > begin && (p[-1] == ' ' || p[-1] == '\t' || p[-1] == '\r')) p--;
+	return p > begin && p[-1] == '\\';
+}
 
-	bool operator<(const Index& i) const {
-		if (position < i.position) return true;
-		if (position > i.position) return false;
-		if (uv < i.uv) return true;
-		if (uv > i.uv) return false;
-		if (normal < i.normal) return true;
-		if (normal > i.normal) return false;
+inline void skipObjWhitespace(const char *& p, const char *end)
+{
+	while (p < end) {
+		if (*p == ' ' || *p == '\t' || *p == '\r') {
+			p++;
+
+		} else if (*p == '\\' && isObjLineContinuation(p, end)) {
+			while (p < end && *p != '\n') p++;
+			if (p < end) p++;
 
-		return false;
+		} else {
+			break;
+		}
 	}
+}
 
-	int position;
-	int uv;
-	int normal;
-};
+inline void skipObjLine(const char *& p, const char *end)
+{
+	while (p < end && *p != '\n') {
+		if (*p == '\\' && isObjLineContinuation(p, end)) skipObjWhitespace(p, end);
+		else p++;
+	}
 
-// helper function for loading polygons from obj files
-inline Index parseFaceIndex(const std::string& token) {
-	std::stringstream in(token);
-	std::string indexString;
-	int indices[3] = {1, 1, 1};
+	if (p < end) p++;
+}
+
+inline bool isObjLineEnd(const char *p, const char *end)
+{
+	// a comment also ends the data on a line
+	return p == end || *p == '\n' || *p == '#';
+}
+
+inline void skipObjToken(const char *& p, const char *end)
+{
+	while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+}
+
+inline bool parseObjInt(const char *& p, const char *end, int& value)
+{
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+	if (p == end || *p < '0' || *p > '9') return false;
+
+	int n = 0;
+	for (; p < end && *p >= '0' && *p <= '9'; p++) n = 10*n + (*p - '0');
+	value = negative ? -n : n;
+
+	return true;
+}
 
-	int i = 0;
-	while (std::getline(in, indexString, '/')) {
-		if (indexString != "\\") {
-			std::stringstream ss(indexString);
-			ss >> indices[i++];
+inline float parseObjFloat(const char *& p, const char *end)
+{
+	static const double powersOf10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+
+	// parse sign, mantissa and exponent; digits beyond the precision of the mantissa are dropped
+	const char *start = p;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+
+	uint64_t mantissa = 0;
+	int exponent = 0, nDigits = 0, nSignificantDigits = 0;
+	for (; p < end && *p >= '0' && *p <= '9'; p++, nDigits++) {
+		if (nSignificantDigits < 19) {
+			mantissa = 10*mantissa + (*p - '0');
+			if (mantissa > 0) nSignificantDigits++;
+
+		} else {
+			exponent++;
 		}
 	}
 
-	// decrement since indices in OBJ files are 1-based
-	return Index(indices[0] - 1, indices[1] - 1, indices[2] - 1);
+	if (p < end && *p == '.') {
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++, nDigits++) {
+			if (nSignificantDigits < 19) {
+				mantissa = 10*mantissa + (*p - '0');
+				if (mantissa > 0) nSignificantDigits++;
+				exponent--;
+			}
+		}
+	}
+
+	if (nDigits == 0) {
+		// fall back to strtof for special values such as inf and nan
+		char buffer[64] = {};
+		p = start;
+		skipObjToken(p, end);
+		std::copy(start, start + std::min((size_t)(p - start), sizeof(buffer) - 1), buffer);
+
+		return std::strtof(buffer, nullptr);
+	}
+
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		const char *e = p++;
+		int exponentValue = 0;
+		if (parseObjInt(p, end, exponentValue)) exponent += exponentValue;
+		else p = e;
+	}
+
+	double value = (double)mantissa;
+	if (exponent < -22) value *= std::pow(10.0, exponent);
+	else if (exponent < 0) value /= powersOf10[-exponent];
+	else if (exponent > 22) value *= std::pow(10.0, exponent);
+	else value *= powersOf10[exponent];
+
+	return (float)(negative ? -value : value);
 }
 
-inline void loadLineSegmentSoupFromOBJFile(const std::string& filename, PolygonSoup<3>& soup)
+inline void parseObjFaceIndex(const char *& p, const char *end, int& position, int& uv)
 {
-	// initialize
-	std::ifstream in(filename);
-	if (in.is_open() == false) {
-		std::cerr << "Unable to open file: " << filename << std::endl;
-		exit(EXIT_FAILURE);
+	// parses v, v/vt, v//vn and v/vt/vn; missing and empty indices default to 1
+	int indices[3] = {1, 1, 1};
+	for (int i = 0; i < 3; i++) {
+		parseObjInt(p, end, indices[i]);
+		if (p < end && *p == '/') p++;
+		else break;
 	}
 
-	// parse obj format
-	std::string line;
-	while (getline(in, line)) {
-		std::stringstream ss(line);
-		std::string token;
-		ss >> token;
+	skipObjToken(p, end);
 
-		if (token == "v") {
-			float x, y, z;
-			ss >> x >> y >> z;
+	// decrement since indices in OBJ files are 1-based
+	position = indices[0] - 1;
+	uv = indices[1] - 1;
+}
 
-			soup.positions.emplace_back(Vector3(x, y, z));
+struct ObjChunk {
+	// members
+	std::vector<Vector3> positions;
+	std::vector<Vector2> textureCoordinates;
+	std::vector<int> indices;
+	std::vector<int> tIndices;
+};
 
-		} else if (token == "f" || token == "l") {
-			bool tokenIsF = token == "f";
-			std::vector<int> indices;
+inline void parseObjChunk(const char *p, const char *end, bool loadLineSegments, ObjChunk& chunk)
+{
+	std::vector<int> polygon; // reused across faces and lines
+
+	while (p < end) {
+		// read keyword
+		skipObjWhitespace(p, end);
+		const char *keyword = p;
+		skipObjToken(p, end);
+		size_t keywordLength = p - keyword;
+
+		if (keywordLength == 1 && keyword[0] == 'v') {
+			float coordinates[3] = {0.0f, 0.0f, 0.0f};
+			for (int i = 0; i < 3; i++) {
+				skipObjWhitespace(p, end);
+				if (isObjLineEnd(p, end)) break;
+				coordinates[i] = parseObjFloat(p, end);
+			}
 
-			while (ss >> token) {
-				Index index = parseFaceIndex(token);
+			chunk.positions.emplace_back(Vector3(coordinates[0], coordinates[1], coordinates[2]));
 
-				if (index.position < 0) {
-					getline(in, line);
-					size_t i = line.find_first_not_of("\t\n\v\f\r ");
-					index = parseFaceIndex(line.substr(i));
-				}
+		} else if (keywordLength == 2 && keyword[0] == 'v' && keyword[1] == 't' && !loadLineSegments) {
+			float coordinates[2] = {0.0f, 0.0f};
+			for (int i = 0; i < 2; i++) {
+				skipObjWhitespace(p, end);
+				if (isObjLineEnd(p, end)) break;
+				coordinates[i] = parseObjFloat(p, end);
+			}
+
+			chunk.textureCoordinates.emplace_back(Vector2(coordinates[0], coordinates[1]));
 
-				if (tokenIsF) indices.emplace_back(index.position);
-				else soup.indices.emplace_back(index.position);
+		} else if (keywordLength == 1 && (keyword[0] == 'f' || (keyword[0] == 'l' && loadLineSegments))) {
+			polygon.clear();
+			while (true) {
+				skipObjWhitespace(p, end);
+				if (isObjLineEnd(p, end)) break;
+
+				int position, uv;
+				parseObjFaceIndex(p, end, position, uv);
+
+				if (loadLineSegments) {
+					polygon.emplace_back(position);
+
+				} else {
+					chunk.indices.emplace_back(position);
+					chunk.tIndices.emplace_back(uv);
+				}
 			}
 
-			if (tokenIsF) {
-				int F = (int)indices.size();
+			if (loadLineSegments) {
+				// faces and lines are polylines; closed curves repeat their first index
+				int F = (int)polygon.size();
 				for (int i = 0; i < F - 1; i++) {
-					int j = (i + 1)%F;
-					soup.indices.emplace_back(indices[i]);
-					soup.indices.emplace_back(indices[j]);
+					chunk.indices.emplace_back(polygon[i]);
+					chunk.indices.emplace_back(polygon[i + 1]);
 				}
 			}
 		}
+
+		skipObjLine(p, end);
 	}
+}
 
-	// close
-	in.close();
+inline void loadSoupFromOBJFile(const std::string& filename, bool loadLineSegments, PolygonSoup<3>& soup)
+{
+	// map file into memory
+	MappedFile file;
+	if (!file.map(filename)) {
+		std::ifstream in(filename);
+		if (in.is_open() == false) {
+			std::cerr << "Unable to open file: " << filename << std::endl;
+			exit(EXIT_FAILURE);
+		}
+
+		return; // empty file
+	}
+
+	// split the file into chunks at line boundaries, without separating continued lines
+	const char *begin = file.data;
+	const char *end = file.data + file.size;
+	const size_t chunkSize = 1 << 22;
+	std::vector<const char *> chunkBegins(1, begin);
+
+	while ((size_t)(end - chunkBegins.back()) > chunkSize) {
+		const char *p = chunkBegins.back() + chunkSize;
+		while (p < end) {
+			const char *newline = static_cast<const char *>(std::memchr(p, '\n', end - p));
+			if (newline == nullptr) p = end;
+			else p = newline + 1;
+
+			if (newline == nullptr || !endsWithObjLineContinuation(begin, newline)) break;
+		}
+
+		if (p == end) break;
+		chunkBegins.emplace_back(p);
+	}
+
+	// parse chunks in parallel
+	int nChunks = (int)chunkBegins.size();
+	chunkBegins.emplace_back(end);
+	std::vector<ObjChunk> chunks(nChunks);
+	parallelFor(nChunks, 1, [&](size_t chunkBegin, size_t chunkEnd) {
+		for (size_t i = chunkBegin; i < chunkEnd; i++) {
+			parseObjChunk(chunkBegins[i], chunkBegins[i + 1], loadLineSegments, chunks[i]);
+		}
+	});
+
+	// concatenate chunks in file order; indices in OBJ files are absolute, so they need
+	// not be offset
+	size_t nPositions = soup.positions.size();
+	size_t nTextureCoordinates = soup.textureCoordinates.size();
+	size_t nIndices = soup.indices.size();
+	size_t nTIndices = soup.tIndices.size();
+	std::vector<size_t> offsets(4*nChunks);
+
+	for (int i = 0; i < nChunks; i++) {
+		offsets[4*i + 0] = nPositions;
+		offsets[4*i + 1] = nTextureCoordinates;
+		offsets[4*i + 2] = nIndices;
+		offsets[4*i + 3] = nTIndices;
+		nPositions += chunks[i].positions.size();
+		nTextureCoordinates += chunks[i].textureCoordinates.size();
+		nIndices += chunks[i].indices.size();
+		nTIndices += chunks[i].tIndices.size();
+	}
+
+	soup.positions.resize(nPositions);
+	soup.textureCoordinates.resize(nTextureCoordinates);
+	soup.indices.resize(nIndices);
+	soup.tIndices.resize(nTIndices);
+	parallelFor(nChunks, 1, [&](size_t chunkBegin, size_t chunkEnd) {
+		for (size_t i = chunkBegin; i < chunkEnd; i++) {
+			const ObjChunk& chunk = chunks[i];
+			std::copy(chunk.positions.begin(), chunk.positions.end(), soup.positions.begin() + offsets[4*i + 0]);
+			std::copy(chunk.textureCoordinates.begin(), chunk.textureCoordinates.end(),
+					  soup.textureCoordinates.begin() + offsets[4*i + 1]);
+			std::copy(chunk.indices.begin(), chunk.indices.end(), soup.indices.begin() + offsets[4*i + 2]);
+			std::copy(chunk.tIndices.begin(), chunk.tIndices.end(), soup.tIndices.begin() + offsets[4*i + 3]);
+		}
+	});
+}
+
+inline void loadLineSegmentSoupFromOBJFile(const std::string& filename, PolygonSoup<3>& soup)
+{
+	loadSoupFromOBJFile(filename, true, soup);
 }
 
 inline void loadTriangleSoupFromOBJFile(const std::string& filename, PolygonSoup<3>& soup)
 {
-	// initialize
-	std::ifstream in(filename);
-	if (in.is_open() == false) {
-		std::cerr << "Unable to open file: " << filename << std::endl;
-		exit(EXIT_FAILURE);
+	loadSoupFromOBJFile(filename, false, soup);
+
+	if (soup.textureCoordinates.size() == 0) {
+		soup.tIndices.clear();
 	}
+}
 
-	// parse obj format
+// helper functions for reading binary ply and stl files
+inline bool isBigEndianMachine()
+{
+	uint32_t value = 1;
+	uint8_t firstByte;
+	std::memcpy(&firstByte, &value, 1);
+
+	return firstByte == 0;
+}
+
+template<typename T>
+inline T readBinaryValue(const char *p, bool swapBytes)
+{
+	char bytes[sizeof(T)];
+	std::memcpy(bytes, p, sizeof(T));
+	if (swapBytes) std::reverse(bytes, bytes + sizeof(T));
+
+	T value;
+	std::memcpy(&value, bytes, sizeof(T));
+	return value;
+}
+
+enum class PlyType {
+	Int8,
+	UInt8,
+	Int16,
+	UInt16,
+	Int32,
+	UInt32,
+	Float32,
+	Float64,
+	Invalid
+};
+
+inline PlyType plyTypeFromString(const std::string& type)
+{
+	if (type == "char" || type == "int8") return PlyType::Int8;
+	if (type == "uchar" || type == "uint8") return PlyType::UInt8;
+	if (type == "short" || type == "int16") return PlyType::Int16;
+	if (type == "ushort" || type == "uint16") return PlyType::UInt16;
+	if (type == "int" || type == "int32") return PlyType::Int32;
+	if (type == "uint" || type == "uint32") return PlyType::UInt32;
+	if (type == "float" || type == "float32") return PlyType::Float32;
+	if (type == "double" || type == "float64") return PlyType::Float64;
+
+	return PlyType::Invalid;
+}
+
+inline size_t plyTypeSize(PlyType type)
+{
+	switch (type) {
+		case PlyType::Int8: case PlyType::UInt8: return 1;
+		case PlyType::Int16: case PlyType::UInt16: return 2;
+		case PlyType::Int32: case PlyType::UInt32: case PlyType::Float32: return 4;
+		case PlyType::Float64: return 8;
+		default: return 0;
+	}
+}
+
+inline double readPlyValue(const char *p, PlyType type, bool swapBytes)
+{
+	switch (type) {
+		case PlyType::Int8: return readBinaryValue<int8_t>(p, swapBytes);
+		case PlyType::UInt8: return readBinaryValue<uint8_t>(p, swapBytes);
+		case PlyType::Int16: return readBinaryValue<int16_t>(p, swapBytes);
+		case PlyType::UInt16: return readBinaryValue<uint16_t>(p, swapBytes);
+		case PlyType::Int32: return readBinaryValue<int32_t>(p, swapBytes);
+		case PlyType::UInt32: return readBinaryValue<uint32_t>(p, swapBytes);
+		case PlyType::Float32: return readBinaryValue<float>(p, swapBytes);
+		case PlyType::Float64: return readBinaryValue<double>(p, swapBytes);
+		default: return 0.0;
+	}
+}
+
+struct PlyProperty {
+	// members
+	std::string name;
+	PlyType type; // type of the list items for list properties
+	PlyType countType; // PlyType::Invalid for scalar properties
+};
+
+struct PlyElement {
+	// members
+	std::string name;
+	size_t count;
+	std::vector<PlyProperty> properties;
+};
+
+inline bool readPlyHeader(const char *begin, const char *end, std::vector<PlyElement>& elements,
+						  bool& swapBytes, const char *& body)
+{
+	// find the end of the header
+	const char *p = begin;
+	while (true) {
+		const char *newline = static_cast<const char *>(std::memchr(p, '\n', end - p));
+		if (newline == nullptr) return false;
+
+		std::string line(p, newline);
+		p = newline + 1;
+		if (line.compare(0, 10, "end_header") == 0) break;
+	}
+
+	body = p;
+
+	// parse the header lines
+	std::istringstream in(std::string(begin, body));
 	std::string line;
+	bool isBinary = false;
+	int lineIndex = 0;
+
 	while (getline(in, line)) {
 		std::stringstream ss(line);
 		std::string token;
 		ss >> token;
 
-		if (token == "v") {
-			float x, y, z;
-			ss >> x >> y >> z;
+		if (lineIndex++ == 0) {
+			if (token != "ply") return false;
+
+		} else if (token == "format") {
+			std::string format;
+			ss >> format;
+			if (format == "binary_little_endian") swapBytes = isBigEndianMachine();
+			else if (format == "binary_big_endian") swapBytes = !isBigEndianMachine();
+			else return false;
+			isBinary = true;
+
+		} else if (token == "element") {
+			PlyElement element;
+			ss >> element.name >> element.count;
+			if (ss.fail()) return false;
+			elements.emplace_back(element);
+
+		} else if (token == "property") {
+			if (elements.size() == 0) return false;
+
+			PlyProperty property;
+			std::string type;
+			ss >> type;
+
+			if (type == "list") {
+				std::string countType, itemType;
+				ss >> countType >> itemType;
+				property.countType = plyTypeFromString(countType);
+				property.type = plyTypeFromString(itemType);
+				if (property.countType == PlyType::Invalid) return false;
+
+			} else {
+				property.countType = PlyType::Invalid;
+				property.type = plyTypeFromString(type);
+			}
 
-			soup.positions.emplace_back(Vector3(x, y, z));
+			ss >> property.name;
+			if (property.type == PlyType::Invalid || ss.fail()) return false;
+			elements.back().properties.emplace_back(property);
+		}
+	}
+
+	return isBinary;
+}
+
+inline void loadTriangleSoupFromPLYFile(const std::string& filename, PolygonSoup<3>& soup)
+{
+	// map file
+	MappedFile file;
+	if (!file.map(filename)) {
+		std::cerr << "Unable to open file: " << filename << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// read header
+	const char *end = file.data + file.size;
+	const char *p = nullptr;
+	std::vector<PlyElement> elements;
+	bool swapBytes = false;
+	if (!readPlyHeader(file.data, end, elements, swapBytes, p)) {
+		std::cerr << "loadTriangleSoupFromPLYFile(): " << filename << " is not a binary ply file" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// read elements; polygonal faces are triangulated as fans
+	bool valid = true;
+	std::vector<int> polygon;
+
+	for (int i = 0; valid && i < (int)elements.size(); i++) {
+		const PlyElement& element = elements[i];
+		bool isVertex = element.name == "vertex";
+		bool isFace = element.name == "face";
+
+		// map the properties that are read to coordinates, -1 if skipped
+		int nProperties = (int)element.properties.size();
+		std::vector<int> coordinates(nProperties, -1);
+		bool hasTextureCoordinates = false;
+		size_t minElementSize = 0;
+
+		for (int j = 0; j < nProperties; j++) {
+			const PlyProperty& property = element.properties[j];
+			bool isScalar = property.countType == PlyType::Invalid;
+			minElementSize += plyTypeSize(isScalar ? property.type : property.countType);
+
+			if (isVertex && isScalar) {
+				const std::string& name = property.name;
+				if (name == "x") coordinates[j] = 0;
+				else if (name == "y") coordinates[j] = 1;
+				else if (name == "z") coordinates[j] = 2;
+				else if (name == "u" || name == "s" || name == "texture_u") coordinates[j] = 3;
+				else if (name == "v" || name == "t" || name == "texture_v") coordinates[j] = 4;
+				hasTextureCoordinates |= coordinates[j] >= 3;
+
+			} else if (isFace && !isScalar) {
+				if (property.name == "vertex_indices" || property.name == "vertex_index") coordinates[j] = 0;
+			}
+		}
 
-		} else if (token == "vt") {
-			float u, v;
-			ss >> u >> v;
+		// elements without properties take no space in the body and are skipped; otherwise, the element
+		// count of corrupted or truncated files is bounded by the remaining bytes before reserving memory
+		if (nProperties == 0) continue;
+		if (element.count > (size_t)(end - p)/minElementSize) {
+			valid = false;
+			break;
+		}
 
-			soup.textureCoordinates.emplace_back(Vector2(u, v));
+		if (isVertex) {
+			soup.positions.reserve(soup.positions.size() + element.count);
+			if (hasTextureCoordinates) {
+				soup.textureCoordinates.reserve(soup.textureCoordinates.size() + element.count);
+			}
 
-		} else if (token == "f") {
-			while (ss >> token) {
-				Index index = parseFaceIndex(token);
+		} else if (isFace) {
+			soup.indices.reserve(soup.indices.size() + 3*element.count);
+		}
 
-				if (index.position < 0) {
-					getline(in, line);
-					size_t i = line.find_first_not_of("\t\n\v\f\r ");
-					index = parseFaceIndex(line.substr(i));
+		for (size_t k = 0; valid && k < element.count; k++) {
+			float values[5] = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+
+			for (int j = 0; j < nProperties; j++) {
+				const PlyProperty& property = element.properties[j];
+				size_t size = plyTypeSize(property.type);
+
+				if (property.countType == PlyType::Invalid) {
+					if (p + size > end) {
+						valid = false;
+						break;
+					}
+
+					if (coordinates[j] >= 0) values[coordinates[j]] = (float)readPlyValue(p, property.type, swapBytes);
+					p += size;
+
+				} else {
+					size_t countSize = plyTypeSize(property.countType);
+					if (p + countSize > end) {
+						valid = false;
+						break;
+					}
+
+					double count = readPlyValue(p, property.countType, swapBytes);
+					p += countSize;
+					if (count < 0 || (size_t)count > (size_t)(end - p)/size) {
+						valid = false;
+						break;
+					}
+
+					size_t n = (size_t)count;
+					if (coordinates[j] == 0) {
+						polygon.resize(n);
+						for (size_t l = 0; l < n; l++) {
+							polygon[l] = (int)readPlyValue(p + l*size, property.type, swapBytes);
+						}
+
+						for (size_t l = 1; l + 1 < n; l++) {
+							soup.indices.emplace_back(polygon[0]);
+							soup.indices.emplace_back(polygon[l]);
+							soup.indices.emplace_back(polygon[l + 1]);
+						}
+					}
+
+					p += n*size;
 				}
+			}
 
-				soup.indices.emplace_back(index.position);
-				soup.tIndices.emplace_back(index.uv);
+			if (valid && isVertex) {
+				soup.positions.emplace_back(Vector3(values[0], values[1], values[2]));
+				if (hasTextureCoordinates) soup.textureCoordinates.emplace_back(Vector2(values[3], values[4]));
 			}
 		}
 	}
 
-	if (soup.textureCoordinates.size() == 0) {
-		soup.tIndices.clear();
+	// check that the vertex indices are in range
+	int V = (int)soup.positions.size();
+	for (int i = 0; valid && i < (int)soup.indices.size(); i++) {
+		if (soup.indices[i] < 0 || soup.indices[i] >= V) valid = false;
 	}
 
-	// close
-	in.close();
+	if (!valid) {
+		std::cerr << "loadTriangleSoupFromPLYFile(): " << filename << " is corrupted" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// texture coordinates are per vertex
+	if (soup.textureCoordinates.size() > 0) soup.tIndices = soup.indices;
+}
+
+struct StlVertexHash {
+	size_t operator()(const std::array<uint32_t, 3>& key) const {
+		uint64_t hash = 0xcbf29ce484222325ull;
+		for (int i = 0; i < 3; i++) {
+			hash = (hash ^ key[i])*0x100000001b3ull;
+			hash ^= hash >> 29;
+		}
+
+		return (size_t)hash;
+	}
+};
+
+inline void loadTriangleSoupFromSTLFile(const std::string& filename, PolygonSoup<3>& soup)
+{
+	// map file
+	MappedFile file;
+	if (!file.map(filename)) {
+		std::cerr << "Unable to open file: " << filename << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// binary stl files have an 80 byte header, a triangle count and 50 bytes per triangle
+	bool swapBytes = isBigEndianMachine();
+	size_t nTriangles = file.size >= 84 ? readBinaryValue<uint32_t>(file.data + 80, swapBytes) : 0;
+	if (file.size < 84 || file.size != 84 + 50*nTriangles) {
+		std::cerr << "loadTriangleSoupFromSTLFile(): " << filename << " is not a binary stl file" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// weld the vertices of the triangles, which stl files store separately, by their exact
+	// positions so that adjacent triangles share vertices
+	std::unordered_map<std::array<uint32_t, 3>, int, StlVertexHash> vertexMap;
+	vertexMap.reserve(nTriangles);
+	soup.positions.reserve(soup.positions.size() + nTriangles/2);
+	soup.indices.reserve(soup.indices.size() + 3*nTriangles);
+
+	for (size_t i = 0; i < nTriangles; i++) {
+		// skip the facet normal, which is recomputed from the vertices if requested
+		const char *p = file.data + 84 + 50*i + 12;
+
+		for (int j = 0; j < 3; j++) {
+			Vector3 position;
+			std::array<uint32_t, 3> key;
+
+			for (int k = 0; k < 3; k++) {
+				// add 0 to map -0 to 0, so that both are welded together
+				position[k] = readBinaryValue<float>(p + 12*j + 4*k, swapBytes) + 0.0f;
+				std::memcpy(&key[k], &position[k], sizeof(float));
+			}
+
+			auto it = vertexMap.emplace(key, (int)soup.positions.size());
+			if (it.second) soup.positions.emplace_back(position);
+			soup.indices.emplace_back(it.first->second);
+		}
+	}
+}
+
+template<size_t DIM>
+inline void saveSoupToBinaryFile(const std::string& filename, const PolygonSoup<DIM>& soup)
+{
+	std::ofstream out(filename, std::ios::binary);
+	if (out.is_open() == false) {
+		std::cerr << "Unable to open file: " << filename << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// write header and soup arrays, which are aligned so that they can be copied without parsing
+	BinaryWriter writer(out);
+	writer.write<uint32_t>(FCPW_MESH_SERIALIZATION_MAGIC);
+	writer.write<uint32_t>(FCPW_MESH_SERIALIZATION_VERSION);
+	writer.write<uint32_t>(FCPW_SERIALIZATION_ENDIAN_TAG);
+	writer.write<uint32_t>(DIM);
+	writeSoup<DIM>(soup, writer);
+
+	if (!writer.good()) {
+		std::cerr << "saveSoupToBinaryFile(): Unable to write file: " << filename << std::endl;
+		exit(EXIT_FAILURE);
+	}
+}
+
+template<size_t DIM>
+inline void loadSoupFromBinaryFile(const std::string& filename, PolygonSoup<DIM>& soup)
+{
+	// map file
+	MappedFile file;
+	if (!file.map(filename)) {
+		std::cerr << "Unable to open file: " << filename << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// read header and copy the soup arrays out of the mapping
+	BinaryReader reader(file.data, file.size);
+	bool valid = reader.read<uint32_t>() == FCPW_MESH_SERIALIZATION_MAGIC &&
+				 reader.read<uint32_t>() == FCPW_MESH_SERIALIZATION_VERSION &&
+				 reader.read<uint32_t>() == FCPW_SERIALIZATION_ENDIAN_TAG &&
+				 reader.read<uint32_t>() == DIM;
+	if (valid) {
+		readSoup<DIM>(reader, soup);
+		valid = reader.good();
+	}
+
+	// check that the vertex indices are in range
+	int V = (int)soup.positions.size();
+	for (int i = 0; valid && i < (int)soup.indices.size(); i++) {
+		if (soup.indices[i] < 0 || soup.indices[i] >= V) valid = false;
+	}
+
+	if (!valid) {
+		std::cerr << "loadSoupFromBinaryFile(): " << filename << " is not a valid mesh file "
+				  << "or was written by an incompatible version of fcpw" << std::endl;
+		exit(EXIT_FAILURE);
+	}
 }
 
 template<size_t DIM>
@@ -231,6 +811,9 @@ inline void loadGeometry<3, LineSegment>(const std::string& filename, const Load
 	if (loadingOption == LoadingOption::ObjLineSegments) {
 		loadLineSegmentSoupFromOBJFile(filename, soup);
 
+	} else if (loadingOption == LoadingOption::BinaryLineSegments) {
+		loadSoupFromBinaryFile<3>(filename, soup);
+
 	} else {
 		std::cerr << "loadGeometry<3, LineSegment>(): Invalid loading option" << std::endl;
 		exit(EXIT_FAILURE);
@@ -283,6 +866,15 @@ inline void loadGeometry<3, Triangle>(const std::string& filename, const Loading
 	if (loadingOption == LoadingOption::ObjTriangles) {
 		loadTriangleSoupFromOBJFile(filename, soup);
 
+	} else if (loadingOption == LoadingOption::BinaryTriangles) {
+		loadSoupFromBinaryFile<3>(filename, soup);
+
+	} else if (loadingOption == LoadingOption::PlyTriangles) {
+		loadTriangleSoupFromPLYFile(filename, soup);
+
+	} else if (loadingOption == LoadingOption::StlTriangles) {
+		loadTriangleSoupFromSTLFile(filename, soup);
+
 	} else {
 		std::cerr << "loadGeometry<3, Triangle>(): Invalid loading option" << std::endl;
 		exit(EXIT_FAILURE);
@@ -310,10 +902,14 @@ inline void SceneLoader<DIM>::loadFiles(Scene<DIM>& scene, bool computeNormals)
 	std::vector<std::vector<PrimitiveType>> objectTypes(nFiles);
 
 	for (int i = 0; i < nFiles; i++) {
-		if (files[i].second == LoadingOption::ObjLineSegments) {
+		if (files[i].second == LoadingOption::ObjLineSegments ||
+			files[i].second == LoadingOption::BinaryLineSegments) {
 			objectTypes[i].emplace_back(PrimitiveType::LineSegment);
 
-		} else if (files[i].second == LoadingOption::ObjTriangles) {
+		} else if (files[i].second == LoadingOption::ObjTriangles ||
+				   files[i].second == LoadingOption::BinaryTriangles ||
+				   files[i].second == LoadingOption::PlyTriangles ||
+				   files[i].second == LoadingOption::StlTriangles) {
 			objectTypes[i].emplace_back(PrimitiveType::Triangle);
 		}
 	}
@@ -355,10 +951,10 @@ inline void SceneLoader<DIM>::loadFiles(Scene<DIM>& scene, bool computeNormals)
 		}
 	}
 
-	// compute normals
+	// compute normals, unless they were loaded along with the soup from a binary mesh file
 	if (computeNormals) {
 		for (int i = 0; i < nFiles; i++) {
-			scene.computeObjectNormals(i);
+			if (sceneData->soups[i].vNormals.size() == 0) scene.computeObjectNormals(i);
 		}
 	}
 }
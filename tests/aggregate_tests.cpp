@@ -22,6 +22,46 @@ static bool checkCorrectness = false;
 static bool checkPerformance = false;
 static int nQueries = 10000;
 
+// counts the heap allocations of each thread, to check that steady state queries do not allocate;
+// all forms of new and delete are replaced, so that allocations are always paired with their release
+static thread_local size_t nAllocations = 0;
+
+static void* countedAllocate(size_t size, size_t alignment)
+{
+	nAllocations++;
+	void *ptr = nullptr;
+	alignment = std::max(alignment, sizeof(void *));
+#ifdef _WIN32
+	ptr = _aligned_malloc(size > 0 ? size : 1, alignment);
+#else
+	if (posix_memalign(&ptr, alignment, size > 0 ? size : 1) != 0) ptr = nullptr;
+#endif
+	if (!ptr) throw std::bad_alloc();
+	return ptr;
+}
+
+static void countedFree(void *ptr) noexcept
+{
+#ifdef _WIN32
+	_aligned_free(ptr);
+#else
+	std::free(ptr);
+#endif
+}
+
+void* operator new(size_t size) { return countedAllocate(size, alignof(std::max_align_t)); }
+void* operator new[](size_t size) { return countedAllocate(size, alignof(std::max_align_t)); }
+void* operator new(size_t size, std::align_val_t alignment) { return countedAllocate(size, (size_t)alignment); }
+void* operator new[](size_t size, std::align_val_t alignment) { return countedAllocate(size, (size_t)alignment); }
+void operator delete(void *ptr) noexcept { countedFree(ptr); }
+void operator delete[](void *ptr) noexcept { countedFree(ptr); }
+void operator delete(void *ptr, size_t) noexcept { countedFree(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { countedFree(ptr); }
+void operator delete(void *ptr, std::align_val_t) noexcept { countedFree(ptr); }
+void operator delete[](void *ptr, std::align_val_t) noexcept { countedFree(ptr); }
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept { countedFree(ptr); }
+void operator delete[](void *ptr, size_t, std::align_val_t) noexcept { countedFree(ptr); }
+
 template<size_t DIM>
 void splitBoxRecursive(BoundingBox<DIM> boundingBox,
 					   std::vector<BoundingBox<DIM>>& boxes, int depth)
@@ -202,7 +242,9 @@ void timeClosestPointQueries(const std::unique_ptr<Aggregate<DIM>>& aggregate,
 			int nodesVisited = 0;
 			Interaction<DIM> c;
 			BoundingSphere<DIM> s(queryPoints[I], r2);
-			bool found = aggregate->findClosestPointFromNode(s, c, 0, aggregate->index, Vector<DIM>::Zero(), nodesVisited);
+			bool found = queriesCoherent ?
+						 aggregate->findClosestPointBottomUp(s, c, cPrev.nodeIndex, cPrev.objectIndex, nodesVisited) :
+						 aggregate->findClosestPointFromNode(s, c, 0, aggregate->index, Vector<DIM>::Zero(), nodesVisited);
 			nodesVisitedByThread += nodesVisited;
 			maxNodesVisitedByThread = std::max(maxNodesVisitedByThread, nodesVisited);
 
@@ -235,6 +277,56 @@ void timeClosestPointQueries(const std::unique_ptr<Aggregate<DIM>>& aggregate,
 			  << std::endl;
 }
 
+template<size_t DIM>
+void timeBatchedClosestPointQueries(const Scene<DIM>& scene,
+									const std::vector<Vector<DIM>>& queryPoints,
+									const std::string& aggregateType)
+{
+	// copy query points into structure-of-arrays layout
+	std::vector<float> xyz(DIM*nQueries), distances(nQueries), points(DIM*nQueries);
+	std::vector<int> primitiveIndices(nQueries);
+	for (int i = 0; i < nQueries; i++) {
+		for (size_t k = 0; k < DIM; k++) xyz[k*nQueries + i] = queryPoints[i][k];
+	}
+
+	high_resolution_clock::time_point t1 = high_resolution_clock::now();
+	scene.findClosestPoints(xyz.data(), nQueries, distances.data(), points.data(), primitiveIndices.data());
+	high_resolution_clock::time_point t2 = high_resolution_clock::now();
+	duration<double> timeSpan = duration_cast<duration<double>>(t2 - t1);
+	std::cout << queryPoints.size() << " batched closest point queries"
+			  << " took " << timeSpan.count() << " seconds with "
+			  << aggregateType << std::endl;
+}
+
+template<size_t DIM>
+void timeSbvhBuilds(const SceneData<DIM> *sceneData,
+					const std::vector<Vector<DIM>>& queryPoints,
+					const std::vector<Vector<DIM>>& randomDirections,
+					const std::vector<int>& indices)
+{
+	// collect the primitives of all objects in the scene
+	std::vector<GeometricPrimitive<DIM> *> primitives;
+	for (const std::vector<LineSegment *>& lineSegmentObjectPtr: sceneData->lineSegmentObjectPtrs) {
+		primitives.insert(primitives.end(), lineSegmentObjectPtr.begin(), lineSegmentObjectPtr.end());
+	}
+
+	for (const std::vector<Triangle *>& triangleObjectPtr: sceneData->triangleObjectPtrs) {
+		primitives.insert(primitives.end(), triangleObjectPtr.begin(), triangleObjectPtr.end());
+	}
+
+	// compare build times and query performance of surface area bvhs with different bucket counts
+	for (int nBuckets: {8, 16, 32, 64}) {
+		std::cout << nBuckets << " buckets: ";
+		std::vector<GeometricPrimitive<DIM> *> bvhPrimitives = primitives;
+		std::unique_ptr<Aggregate<DIM>> aggregate(new Sbvh<DIM, GeometricPrimitive<DIM>>(
+			CostHeuristic::SurfaceArea, bvhPrimitives, {}, true, false, 4, nBuckets));
+		std::string aggregateType = "Bvh_SurfaceArea with " + std::to_string(nBuckets) + " buckets";
+
+		timeIntersectionQueries<DIM>(aggregate, queryPoints, randomDirections, indices, aggregateType);
+		timeClosestPointQueries<DIM>(aggregate, queryPoints, indices, aggregateType);
+	}
+}
+
 template<size_t DIM>
 void testIntersectionQueries(const std::unique_ptr<Aggregate<DIM>>& aggregate1,
 							 const std::unique_ptr<Aggregate<DIM>>& aggregate2,
@@ -291,6 +383,49 @@ void testIntersectionQueries(const std::unique_ptr<Aggregate<DIM>>& aggregate1,
 	tbb::parallel_for(range, test);
 }
 
+template<size_t DIM>
+void testFilteredIntersectionQueries(const std::unique_ptr<Aggregate<DIM>>& aggregate1,
+									 const std::unique_ptr<Aggregate<DIM>>& aggregate2,
+									 const std::vector<Vector<DIM>>& rayOrigins,
+									 const std::vector<Vector<DIM>>& rayDirections)
+{
+	// reject hits with odd primitive indices; for occlusion queries, the accepted hits terminate the query
+	HitFilter<DIM> rejectOdd = [](const Interaction<DIM>& c) -> HitFilterResult {
+		return c.primitiveIndex%2 == 1 ? HitFilterResult::Reject : HitFilterResult::Accept;
+	};
+
+	HitFilter<DIM> terminateEven = [](const Interaction<DIM>& c) -> HitFilterResult {
+		return c.primitiveIndex%2 == 1 ? HitFilterResult::Reject : HitFilterResult::Terminate;
+	};
+
+	for (int i = 0; i < nQueries; i++) {
+		Interaction<DIM> c1, c2;
+		Ray<DIM> r1(rayOrigins[i], rayDirections[i]);
+		Ray<DIM> r2(rayOrigins[i], rayDirections[i]);
+		bool hit1 = aggregate1->intersect(r1, c1, rejectOdd);
+		bool hit2 = aggregate2->intersect(r2, c2, rejectOdd);
+
+		if ((hit1 != hit2) || (hit1 && hit2 && std::fabs(c1.d - c2.d) > 1e-6) ||
+			(hit2 && c2.primitiveIndex%2 == 1)) {
+			std::cerr << "d1: " << c1.d << " d2: " << c2.d
+					  << "\nFiltered intersections do not match!" << std::endl;
+			break;
+		}
+
+		Interaction<DIM> c3, c4;
+		Ray<DIM> r3(rayOrigins[i], rayDirections[i]);
+		Ray<DIM> r4(rayOrigins[i], rayDirections[i]);
+		bool hit3 = aggregate1->intersect(r3, c3, terminateEven, true);
+		bool hit4 = aggregate2->intersect(r4, c4, terminateEven, true);
+
+		if (hit1 != hit3 || hit3 != hit4) {
+			std::cerr << "hit1: " << hit1 << " hit3: " << hit3 << " hit4: " << hit4
+					  << "\nFiltered occlusion queries do not match!" << std::endl;
+			break;
+		}
+	}
+}
+
 template<size_t DIM>
 void testClosestPointQueries(const std::unique_ptr<Aggregate<DIM>>& aggregate1,
 							 const std::unique_ptr<Aggregate<DIM>>& aggregate2,
@@ -316,7 +451,7 @@ void testClosestPointQueries(const std::unique_ptr<Aggregate<DIM>>& aggregate1,
 			int nodesVisited = 0;
 			Interaction<DIM> c2;
 			BoundingSphere<DIM> s2(queryPoints[I], r2);
-			bool found2 = aggregate2->findClosestPointFromNode(s2, c2, 0, aggregate2->index, Vector<DIM>::Zero(), nodesVisited);
+			bool found2 = aggregate2->findClosestPointBottomUp(s2, c2, cPrev.nodeIndex, cPrev.objectIndex, nodesVisited);
 
 			if (found1 != found2 || std::fabs(c1.d - c2.d) > 1e-6) {
 				std::cerr << "d1: " << c1.d << " d2: " << c2.d
@@ -339,6 +474,398 @@ void testClosestPointQueries(const std::unique_ptr<Aggregate<DIM>>& aggregate1,
 	tbb::parallel_for(range, test);
 }
 
+template<size_t DIM>
+void testBatchedIntersectionQueries(const std::unique_ptr<Aggregate<DIM>>& aggregate,
+									const Scene<DIM>& scene,
+									const std::vector<Vector<DIM>>& rayOrigins,
+									const std::vector<Vector<DIM>>& rayDirections)
+{
+	// copy rays into structure-of-arrays layout
+	std::vector<float> origins(DIM*nQueries), directions(DIM*nQueries);
+	std::vector<float> distances(nQueries), points(DIM*nQueries), occlusionDistances(nQueries);
+	std::vector<int> primitiveIndices(nQueries);
+	for (int i = 0; i < nQueries; i++) {
+		for (size_t k = 0; k < DIM; k++) {
+			origins[k*nQueries + i] = rayOrigins[i][k];
+			directions[k*nQueries + i] = rayDirections[i][k];
+		}
+	}
+
+	scene.intersectRays(origins.data(), directions.data(), nullptr, nQueries, distances.data(),
+						points.data(), primitiveIndices.data());
+	scene.intersectRays(origins.data(), directions.data(), nullptr, nQueries, occlusionDistances.data(),
+						nullptr, nullptr, nullptr, true);
+
+	for (int i = 0; i < nQueries; i++) {
+		std::vector<Interaction<DIM>> c;
+		Ray<DIM> r(rayOrigins[i], rayDirections[i]);
+		bool hit = (bool)aggregate->intersect(r, c);
+		bool occluded = occlusionDistances[i] < maxFloat;
+
+		if (hit != (primitiveIndices[i] != -1) || hit != occluded ||
+			(hit && std::fabs(c[0].d - distances[i]) > 1e-6)) {
+			std::cerr << "d1: " << (hit ? c[0].d : maxFloat) << " d2: " << distances[i]
+					  << "\nBatched intersections do not match!" << std::endl;
+			break;
+		}
+	}
+}
+
+template<size_t DIM>
+void testBatchedClosestPointQueries(const std::unique_ptr<Aggregate<DIM>>& aggregate,
+									const Scene<DIM>& scene,
+									const std::vector<Vector<DIM>>& queryPoints)
+{
+	// copy query points into structure-of-arrays layout
+	std::vector<float> xyz(DIM*nQueries), distances(nQueries), points(DIM*nQueries);
+	std::vector<int> primitiveIndices(nQueries);
+	for (int i = 0; i < nQueries; i++) {
+		for (size_t k = 0; k < DIM; k++) xyz[k*nQueries + i] = queryPoints[i][k];
+	}
+
+	for (int clustered = 0; clustered < 2; clustered++) {
+		if (clustered == 0) {
+			scene.findClosestPoints(xyz.data(), nQueries, distances.data(),
+									points.data(), primitiveIndices.data());
+
+		} else {
+			scene.findClosestPointsInClusters(xyz.data(), nQueries, distances.data(),
+											  points.data(), primitiveIndices.data());
+		}
+
+		for (int i = 0; i < nQueries; i++) {
+			Interaction<DIM> c;
+			BoundingSphere<DIM> s(queryPoints[i], maxFloat);
+			bool found = aggregate->findClosestPoint(s, c);
+
+			Vector<DIM> p;
+			for (size_t k = 0; k < DIM; k++) p[k] = points[k*nQueries + i];
+
+			if (found != (primitiveIndices[i] != -1) || std::fabs(c.d - distances[i]) > 1e-6) {
+				std::cerr << "d1: " << c.d << " d2: " << distances[i]
+						  << "\np1: " << c.p << " p2: " << p
+						  << "\n" << (clustered == 1 ? "Clustered" : "Batched")
+						  << " closest points do not match!" << std::endl;
+				break;
+			}
+		}
+	}
+}
+
+template<size_t DIM>
+void testKClosestPointQueries(const std::unique_ptr<Aggregate<DIM>>& aggregate1,
+							  const std::unique_ptr<Aggregate<DIM>>& aggregate2,
+							  const std::vector<Vector<DIM>>& queryPoints, int k)
+{
+	for (int i = 0; i < nQueries; i++) {
+		std::vector<Interaction<DIM>> c1, c2;
+		BoundingSphere<DIM> s1(queryPoints[i], maxFloat);
+		BoundingSphere<DIM> s2(queryPoints[i], maxFloat);
+		int found1 = aggregate1->findKClosestPoints(s1, c1, k);
+		int found2 = aggregate2->findKClosestPoints(s2, c2, k);
+
+		bool match = found1 == found2;
+		for (int j = 0; match && j < found1; j++) {
+			if (std::fabs(c1[j].d - c2[j].d) > 1e-6) match = false;
+		}
+
+		if (!match) {
+			std::cerr << "found1: " << found1 << " found2: " << found2
+					  << "\nK closest points do not match!" << std::endl;
+			break;
+		}
+	}
+}
+
+template<size_t DIM>
+void testRadiusQueries(const std::unique_ptr<Aggregate<DIM>>& aggregate1,
+					   const std::unique_ptr<Aggregate<DIM>>& aggregate2,
+					   const std::vector<Vector<DIM>>& queryPoints, float radius)
+{
+	for (int i = 0; i < nQueries; i++) {
+		std::vector<Interaction<DIM>> c1, c2;
+		BoundingSphere<DIM> s1(queryPoints[i], radius*radius);
+		BoundingSphere<DIM> s2(queryPoints[i], radius*radius);
+		int found1 = aggregate1->findAllWithinRadius(s1, c1);
+		int found2 = aggregate2->findAllWithinRadius(s2, c2);
+
+		bool match = found1 == found2;
+		for (int j = 0; match && j < found1; j++) {
+			if (std::fabs(c1[j].d - c2[j].d) > 1e-6) match = false;
+		}
+
+		if (!match) {
+			std::cerr << "found1: " << found1 << " found2: " << found2
+					  << "\nPrimitives within radius do not match!" << std::endl;
+			break;
+		}
+	}
+}
+
+template<size_t DIM>
+void testQueryAllocations(const Scene<DIM>& scene,
+						  const std::vector<Vector<DIM>>& queryPoints,
+						  const std::vector<Vector<DIM>>& randomDirections)
+{
+	// run the queries twice, the first pass grows the interaction list and the
+	// buffers of the query context to their steady state size
+	std::vector<Interaction<DIM>> is;
+	size_t nSteadyStateAllocations = 0;
+
+	for (int pass = 0; pass < 2; pass++) {
+		size_t nAllocationsBefore = nAllocations;
+
+		for (int i = 0; i < nQueries; i++) {
+			Ray<DIM> r(queryPoints[i], randomDirections[i]);
+			scene.intersect(r, is, false, true);
+			scene.contains(queryPoints[i]);
+			scene.hasLineOfSight(queryPoints[i], queryPoints[(i + 1)%nQueries]);
+
+			Interaction<DIM> c;
+			scene.findClosestPoint(queryPoints[i], c);
+		}
+
+		nSteadyStateAllocations = nAllocations - nAllocationsBefore;
+	}
+
+	if (nSteadyStateAllocations > 0) {
+		std::cerr << nSteadyStateAllocations << " allocations"
+				  << "\nSteady state queries allocate memory!" << std::endl;
+	}
+}
+
+template<size_t DIM>
+void testRefittedAggregates(SceneLoader<DIM>& sceneLoader,
+							const std::vector<Vector<DIM>>& queryPoints,
+							const std::vector<Vector<DIM>>& randomDirections,
+							const std::vector<int>& indices)
+{
+	// load the scene and bend its vertices along the first axis
+	Scene<DIM> baselineScene, bvhScene;
+	sceneLoader.loadFiles(baselineScene, false);
+	sceneLoader.loadFiles(bvhScene, false);
+	SceneData<DIM> *baselineSceneData = baselineScene.getSceneData();
+	int nObjects = (int)baselineSceneData->soups.size();
+	std::vector<std::vector<Vector<DIM>>> positions(nObjects), deformedPositions(nObjects);
+
+	BoundingBox<DIM> boundingBox;
+	for (int i = 0; i < nObjects; i++) {
+		positions[i] = baselineSceneData->soups[i].positions;
+		for (const Vector<DIM>& p: positions[i]) boundingBox.expandToInclude(p);
+	}
+
+	Vector<DIM> extent = boundingBox.extent();
+	for (int i = 0; i < nObjects; i++) {
+		for (const Vector<DIM>& p: positions[i]) {
+			Vector<DIM> q = p;
+			q[0] += 0.25f*extent[0]*std::sin(3.0f*(p[1] - boundingBox.pMin[1])/extent[1]);
+			deformedPositions[i].emplace_back(q);
+		}
+
+		baselineScene.updateObjectVertices(deformedPositions[i], i);
+	}
+
+	baselineScene.build(AggregateType::Baseline, false);
+
+	for (int vec = 0; vec < 2; vec++) {
+		// build the bvh on the undeformed scene, then deform and refit it
+		for (int i = 0; i < nObjects; i++) bvhScene.updateObjectVertices(positions[i], i);
+		bvhScene.build(AggregateType::Bvh_SurfaceArea, vec == 1);
+		for (int i = 0; i < nObjects; i++) bvhScene.updateObjectVertices(deformedPositions[i], i);
+		bvhScene.refit();
+
+		testIntersectionQueries<DIM>(baselineSceneData->aggregate, bvhScene.getSceneData()->aggregate,
+									 queryPoints, randomDirections, indices);
+		testClosestPointQueries<DIM>(baselineSceneData->aggregate, bvhScene.getSceneData()->aggregate,
+									 queryPoints, indices);
+
+#ifndef FCPW_USE_ENOKI
+		break;
+#endif
+	}
+}
+
+template<size_t DIM>
+void testLoadedAggregates(const std::unique_ptr<Aggregate<DIM>>& aggregate,
+						  SceneLoader<DIM>& sceneLoader,
+						  const std::vector<Vector<DIM>>& queryPoints,
+						  const std::vector<Vector<DIM>>& randomDirections,
+						  const std::vector<int>& indices)
+{
+	// save bvh scenes and compare the results of the loaded scenes with baseline
+	Scene<DIM> bvhScene, loadedScene;
+	sceneLoader.loadFiles(bvhScene, false);
+	std::string filename = "fcpw_aggregate_tests_scene.bin";
+
+	for (int vec = 0; vec < 2; vec++) {
+		bvhScene.build(AggregateType::Bvh_SurfaceArea, vec == 1);
+		bvhScene.save(filename);
+
+		if (!loadedScene.load(filename)) {
+			std::cerr << "Unable to load saved scene!" << std::endl;
+			break;
+		}
+
+		testIntersectionQueries<DIM>(aggregate, loadedScene.getSceneData()->aggregate,
+									 queryPoints, randomDirections, indices);
+		testClosestPointQueries<DIM>(aggregate, loadedScene.getSceneData()->aggregate,
+									 queryPoints, indices);
+
+#ifndef FCPW_USE_ENOKI
+		break;
+#endif
+	}
+
+	std::remove(filename.c_str());
+}
+
+template<size_t DIM>
+void testLoadedMeshes(SceneLoader<DIM>& sceneLoader)
+{
+	// convert the soups to binary mesh files with and without normals, load them with normal
+	// computation enabled and compare the loaded soups with those loaded from the original files
+	Scene<DIM> scene;
+	sceneLoader.loadFiles(scene, true);
+	const std::vector<PolygonSoup<DIM>>& soups = scene.getSceneData()->soups;
+	std::vector<std::pair<std::string, LoadingOption>> originalFiles = files;
+
+	auto vectorsMatch = [](const std::vector<Vector<DIM>>& v1, const std::vector<Vector<DIM>>& v2) {
+		if (v1.size() != v2.size()) return false;
+		for (size_t i = 0; i < v1.size(); i++) {
+			if ((v1[i] - v2[i]).norm() > 1e-6f) return false;
+		}
+
+		return true;
+	};
+
+	for (int storeNormals = 0; storeNormals < 2; storeNormals++) {
+		for (int i = 0; i < (int)files.size(); i++) {
+			PolygonSoup<DIM> soup = soups[i];
+			if (storeNormals == 0) {
+				soup.eIndices.clear();
+				soup.vNormals.clear();
+				soup.eNormals.clear();
+			}
+
+			bool isLineSegmentSoup = files[i].second == LoadingOption::ObjLineSegments ||
+									 files[i].second == LoadingOption::BinaryLineSegments;
+			files[i].first = "fcpw_aggregate_tests_mesh_" + std::to_string(i) + ".fcpm";
+			files[i].second = isLineSegmentSoup ? LoadingOption::BinaryLineSegments : LoadingOption::BinaryTriangles;
+			saveSoupToBinaryFile<DIM>(files[i].first, soup);
+		}
+
+		Scene<DIM> loadedScene;
+		sceneLoader.loadFiles(loadedScene, true);
+		const std::vector<PolygonSoup<DIM>>& loadedSoups = loadedScene.getSceneData()->soups;
+
+		for (int i = 0; i < (int)files.size(); i++) {
+			if (soups[i].indices != loadedSoups[i].indices || soups[i].eIndices != loadedSoups[i].eIndices ||
+				!vectorsMatch(soups[i].positions, loadedSoups[i].positions) ||
+				!vectorsMatch(soups[i].vNormals, loadedSoups[i].vNormals) ||
+				!vectorsMatch(soups[i].eNormals, loadedSoups[i].eNormals)) {
+				std::cerr << "eIndices: " << soups[i].eIndices.size() << " " << loadedSoups[i].eIndices.size()
+						  << "\nSoups loaded from binary mesh files " << (storeNormals == 1 ? "with" : "without")
+						  << " normals do not match!" << std::endl;
+			}
+
+			std::remove(files[i].first.c_str());
+		}
+
+		files = originalFiles;
+	}
+}
+
+template<size_t DIM>
+void testCompactAggregates(const std::unique_ptr<Aggregate<DIM>>& aggregate,
+						   SceneLoader<DIM>& sceneLoader,
+						   const std::vector<Vector<DIM>>& queryPoints,
+						   const std::vector<Vector<DIM>>& randomDirections,
+						   const std::vector<int>& indices)
+{
+	// build a vectorized bvh that frees its primitives and compare its results with baseline
+	Scene<DIM> bvhScene;
+	sceneLoader.loadFiles(bvhScene, false);
+	bvhScene.build(AggregateType::Bvh_SurfaceArea, true, false, true);
+
+	testIntersectionQueries<DIM>(aggregate, bvhScene.getSceneData()->aggregate,
+								 queryPoints, randomDirections, indices);
+	testClosestPointQueries<DIM>(aggregate, bvhScene.getSceneData()->aggregate,
+								 queryPoints, indices);
+}
+
+template<size_t DIM>
+void testCompactMixedAggregates(SceneLoader<DIM>& sceneLoader,
+								const std::vector<Vector<DIM>>& queryPoints,
+								const std::vector<Vector<DIM>>& randomDirections,
+								const std::vector<int>& indices)
+{
+	// mixed primitive types are only supported in 3D
+}
+
+template<>
+void testCompactMixedAggregates<3>(SceneLoader<3>& sceneLoader,
+								   const std::vector<Vector<3>>& queryPoints,
+								   const std::vector<Vector<3>>& randomDirections,
+								   const std::vector<int>& indices)
+{
+	// split the triangles of the first loaded object into a mixed object, whose line segments are
+	// the first edges of half of the triangles, followed by an object containing only triangles
+	Scene<3> loadedScene;
+	sceneLoader.loadFiles(loadedScene, false);
+	SceneData<3> *loadedSceneData = loadedScene.getSceneData();
+	if (loadedSceneData->triangleObjects.size() == 0 ||
+		loadedSceneData->soupToObjectsMap[0].size() != 1 ||
+		loadedSceneData->soupToObjectsMap[0][0].first != ObjectType::Triangles) return;
+
+	const PolygonSoup<3>& soup = loadedSceneData->soups[0];
+	int nVertices = (int)soup.positions.size();
+	int nTriangles = (int)soup.indices.size()/3;
+	int nLineSegments = nTriangles/2;
+	BoundingBox<3> boundingBox;
+	for (int i = 0; i < nVertices; i++) boundingBox.expandToInclude(soup.positions[i]);
+	Vector<3> offset = Vector<3>::Zero();
+	offset[0] = 0.5f*boundingBox.extent()[0];
+
+	Scene<3> baselineScene, bvhScene, compactBvhScene;
+	Scene<3> *scenes[3] = {&baselineScene, &bvhScene, &compactBvhScene};
+	for (int s = 0; s < 3; s++) {
+		Scene<3>& scene = *scenes[s];
+		scene.setObjectTypes({{PrimitiveType::LineSegment, PrimitiveType::Triangle},
+							  {PrimitiveType::Triangle}});
+
+		for (int o = 0; o < 2; o++) {
+			scene.setObjectVertexCount(nVertices, o);
+			for (int i = 0; i < nVertices; i++) {
+				scene.setObjectVertex(o == 0 ? soup.positions[i] : Vector<3>(soup.positions[i] + offset), i, o);
+			}
+		}
+
+		scene.setObjectLineSegmentCount(nLineSegments, 0);
+		scene.setObjectTriangleCount(nTriangles - nLineSegments, 0);
+		for (int i = 0; i < nLineSegments; i++) {
+			scene.setObjectPrimitive(&soup.indices[3*i], PrimitiveType::LineSegment, i, 0);
+		}
+
+		for (int i = nLineSegments; i < nTriangles; i++) {
+			scene.setObjectPrimitive(&soup.indices[3*i], PrimitiveType::Triangle, i - nLineSegments, 0);
+		}
+
+		scene.setObjectTriangles(soup.indices.data(), nTriangles, 1);
+	}
+
+	// build a vectorized bvh that frees the primitives of the triangle object and compare its
+	// results with baseline; since line segments are intersected in the xy-plane, which bvhs cull
+	// with 3D bounding boxes, its intersections are compared with a bvh that keeps its primitives
+	baselineScene.build(AggregateType::Baseline, false);
+	bvhScene.build(AggregateType::Bvh_SurfaceArea, true);
+	compactBvhScene.build(AggregateType::Bvh_SurfaceArea, true, false, true);
+
+	testIntersectionQueries<3>(bvhScene.getSceneData()->aggregate, compactBvhScene.getSceneData()->aggregate,
+							   queryPoints, randomDirections, indices);
+	testClosestPointQueries<3>(baselineScene.getSceneData()->aggregate, compactBvhScene.getSceneData()->aggregate,
+							   queryPoints, indices);
+}
+
 template<size_t DIM>
 void isolateInteriorPoints(const std::unique_ptr<Aggregate<DIM>>& aggregate,
 						   const std::vector<Vector<DIM>>& queryPoints,
@@ -424,7 +951,10 @@ void run()
 	// build baseline scene
 	Scene<DIM> scene;
 	SceneLoader<DIM> sceneLoader;
+	high_resolution_clock::time_point t1 = high_resolution_clock::now();
 	sceneLoader.loadFiles(scene, false);
+	high_resolution_clock::time_point t2 = high_resolution_clock::now();
+	duration<double> loadingTimeSpan = duration_cast<duration<double>>(t2 - t1);
 	scene.build(AggregateType::Baseline, false, true);
 	SceneData<DIM> *sceneData = scene.getSceneData();
 
@@ -444,11 +974,16 @@ void run()
 	std::shuffle(shuffledIndices.begin(), shuffledIndices.end(), std::default_random_engine(seed));
 
 	std::vector<std::string> bvhTypes({"Bvh_LongestAxisCenter", "Bvh_OverlapSurfaceArea",
-									   "Bvh_SurfaceArea", "Bvh_OverlapVolume", "Bvh_Volume"});
+									   "Bvh_SurfaceArea", "Bvh_OverlapVolume", "Bvh_Volume",
+									   "Bvh_SpatialSplitSurfaceArea"});
 
 	if (checkPerformance) {
 		std::cout << "Running performance tests..." << std::endl;
 
+		// benchmark file loading
+		std::cout << "Loading " << files.size() << " files took " << loadingTimeSpan.count()
+				  << " seconds" << std::endl;
+
 		// benchmark baseline queries
 		//timeIntersectionQueries<DIM>(sceneData->aggregate, queryPoints, randomDirections,
 		//							   shuffledIndices, "Baseline");
@@ -456,7 +991,7 @@ void run()
 		//							   shuffledIndices, "Baseline");
 
 		// build bvh aggregates and benchmark queries
-		for (int bvh = 1; bvh < 6; bvh++) {
+		for (int bvh = 1; bvh < 7; bvh++) {
 			for (int vec = 0; vec < 2; vec++) {
 				scene.build(static_cast<AggregateType>(bvh), vec == 1, true);
 				sceneData = scene.getSceneData();
@@ -469,6 +1004,7 @@ void run()
 											 shuffledIndices, bvhTypes[bvh - 1]);
 				timeClosestPointQueries<DIM>(sceneData->aggregate, queryPoints,
 											 indices, bvhTypes[bvh - 1], true);
+				timeBatchedClosestPointQueries<DIM>(scene, queryPoints, bvhTypes[bvh - 1]);
 
 #ifndef FCPW_USE_ENOKI
 				break;
@@ -478,6 +1014,10 @@ void run()
 			std::cout << std::endl;
 		}
 
+		// benchmark bvh builds with different bucket counts
+		timeSbvhBuilds<DIM>(sceneData, queryPoints, randomDirections, shuffledIndices);
+		std::cout << std::endl;
+
 #ifdef FCPW_TESTS_BENCHMARK_EMBREE
 		// build embree bvh aggregate & benchmark queries
 		if (buildEmbreeAggregate<DIM>(sceneData, true)) {
@@ -500,7 +1040,7 @@ void run()
 		Scene<DIM> bvhScene;
 		sceneLoader.loadFiles(bvhScene, false);
 
-		for (int bvh = 1; bvh < 6; bvh++) {
+		for (int bvh = 1; bvh < 7; bvh++) {
 			std::cout << "Testing " << bvhTypes[bvh - 1] << " results against Baseline" << std::endl;
 
 			for (int vec = 0; vec < 2; vec++) {
@@ -511,10 +1051,20 @@ void run()
 											 queryPoints, randomDirections, shuffledIndices);
 				testIntersectionQueries<DIM>(sceneData->aggregate, bvhSceneData->aggregate,
 											 queryPoints, randomDirections, indices);
+				testFilteredIntersectionQueries<DIM>(sceneData->aggregate, bvhSceneData->aggregate,
+													 queryPoints, randomDirections);
 				testClosestPointQueries<DIM>(sceneData->aggregate, bvhSceneData->aggregate,
 											 queryPoints, shuffledIndices);
 				testClosestPointQueries<DIM>(sceneData->aggregate, bvhSceneData->aggregate,
 											 queryPoints, indices);
+				testBatchedIntersectionQueries<DIM>(sceneData->aggregate, bvhScene,
+													queryPoints, randomDirections);
+				testBatchedClosestPointQueries<DIM>(sceneData->aggregate, bvhScene, queryPoints);
+				testKClosestPointQueries<DIM>(sceneData->aggregate, bvhSceneData->aggregate,
+											  queryPoints, 8);
+				testRadiusQueries<DIM>(sceneData->aggregate, bvhSceneData->aggregate,
+									   queryPoints, 0.05f*boundingBox.extent().norm());
+				testQueryAllocations<DIM>(bvhScene, queryPoints, randomDirections);
 
 #ifndef FCPW_USE_ENOKI
 				break;
@@ -524,6 +1074,29 @@ void run()
 			std::cout << std::endl;
 		}
 
+		// refit bvh aggregates of a deformed scene and compare results with baseline
+		std::cout << "Testing refitted Bvh_SurfaceArea results against Baseline" << std::endl;
+		testRefittedAggregates<DIM>(sceneLoader, queryPoints, randomDirections, indices);
+		std::cout << std::endl;
+
+		// save and load bvh aggregates and compare results with baseline
+		std::cout << "Testing loaded Bvh_SurfaceArea results against Baseline" << std::endl;
+		testLoadedAggregates<DIM>(sceneData->aggregate, sceneLoader, queryPoints, randomDirections, indices);
+		std::cout << std::endl;
+
+		// convert soups to binary mesh files and compare them with the soups of the original files
+		std::cout << "Testing soups loaded from binary mesh files" << std::endl;
+		testLoadedMeshes<DIM>(sceneLoader);
+		std::cout << std::endl;
+
+#ifdef FCPW_USE_ENOKI
+		// build vectorized bvh aggregates without primitives and compare results with baseline
+		std::cout << "Testing compact vectorized Bvh_SurfaceArea results against Baseline" << std::endl;
+		testCompactAggregates<DIM>(sceneData->aggregate, sceneLoader, queryPoints, randomDirections, indices);
+		testCompactMixedAggregates<DIM>(sceneLoader, queryPoints, randomDirections, indices);
+		std::cout << std::endl;
+#endif
+
 #ifdef FCPW_TESTS_BENCHMARK_EMBREE
 		// build embree bvh aggregate and compare results with baseline
 		std::cout << "Testing Embree Bvh results against Baseline" << std::endl;
@@ -604,14 +1177,23 @@ int main(int argc, const char *argv[]) {
 	if (checkCorrectness) ::checkCorrectness = args::get(checkCorrectness);
 	if (checkPerformance) ::checkPerformance = args::get(checkPerformance);
 	if (nQueries) ::nQueries = args::get(nQueries);
+	auto hasExtension = [](const std::string& filename, const std::string& extension) {
+		return filename.size() >= extension.size() &&
+			   filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0;
+	};
 	if (lineSegmentFilenames) {
-		for (const auto lsf: args::get(lineSegmentFilenames)) {
-			files.emplace_back(std::make_pair(lsf, LoadingOption::ObjLineSegments));
+		for (const auto& lsf: args::get(lineSegmentFilenames)) {
+			files.emplace_back(std::make_pair(lsf, hasExtension(lsf, ".fcpm") ? LoadingOption::BinaryLineSegments :
+																				LoadingOption::ObjLineSegments));
 		}
 	}
 	if (triangleFilenames) {
-		for (const auto tsf: args::get(triangleFilenames)) {
-			files.emplace_back(std::make_pair(tsf, LoadingOption::ObjTriangles));
+		for (const auto& tsf: args::get(triangleFilenames)) {
+			LoadingOption loadingOption = hasExtension(tsf, ".fcpm") ? LoadingOption::BinaryTriangles :
+										  hasExtension(tsf, ".ply") ? LoadingOption::PlyTriangles :
+										  hasExtension(tsf, ".stl") ? LoadingOption::StlTriangles :
+																	  LoadingOption::ObjTriangles;
+			files.emplace_back(std::make_pair(tsf, loadingOption));
 		}
 	}
 
@@ -283,7 +283,7 @@ inline int EmbreeBvh::intersectFromNode(Ray<3>& r, std::vector<Interaction<3>>&
 	if (is.size() > 0) {
 		// sort interactions
 		std::sort(is.begin(), is.end(), compareInteractions<3>);
-		is = removeDuplicates<3>(is);
+		removeDuplicates<3>(is);
 		hits = (int)is.size();
 
 	} else {
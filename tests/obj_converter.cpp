@@ -0,0 +1,53 @@
+#include <fcpw/utilities/scene_loader.h>
+
+#include "args/args.hxx"
+
+using namespace fcpw;
+
+int main(int argc, const char *argv[]) {
+	// configure the argument parser
+	args::ArgumentParser parser("converts obj files to binary mesh files, which load without parsing");
+	args::ValueFlag<std::string> lineSegmentFilename(parser, "string", "line segment soup filename", {"lFile"});
+	args::ValueFlag<std::string> triangleFilename(parser, "string", "triangle soup filename", {"tFile"});
+	args::ValueFlag<std::string> outputFilename(parser, "string", "binary mesh filename", {"outFile"});
+	args::Flag computeNormals(parser, "bool", "store vertex and edge normals", {"computeNormals"});
+
+	// parse args
+	try {
+		parser.ParseCLI(argc, argv);
+
+	} catch (const args::Help&) {
+		std::cout << parser;
+		return 0;
+
+	} catch (const args::ParseError& e) {
+		std::cerr << e.what() << std::endl;
+		std::cerr << parser;
+		return 1;
+	}
+
+	if ((bool)lineSegmentFilename == (bool)triangleFilename) {
+		std::cerr << "Please specify either a line segment or a triangle soup filename" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	if (!outputFilename) {
+		std::cerr << "Please specify an output filename" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	if (lineSegmentFilename) {
+		files.emplace_back(std::make_pair(args::get(lineSegmentFilename), LoadingOption::ObjLineSegments));
+
+	} else {
+		files.emplace_back(std::make_pair(args::get(triangleFilename), LoadingOption::ObjTriangles));
+	}
+
+	// load obj file and write its soup
+	Scene<3> scene;
+	SceneLoader<3> sceneLoader;
+	sceneLoader.loadFiles(scene, args::get(computeNormals));
+	saveSoupToBinaryFile<3>(args::get(outputFilename), scene.getSceneData()->soups[0]);
+
+	return 0;
+}